@@ -0,0 +1,258 @@
+//
+//  Copyright (c) 2019   Finnbarr P. Murphy.   All rights reserved.
+//
+//  One enumeration of the PCI hierarchy into an array of device records,
+//  shared by ShowPCI, ShowPCIx and any other tool that lists PCI devices
+//
+//  License: BSD 2 clause license applies.
+//
+
+#ifndef _PCI_SNAPSHOT_LIB_H_
+#define _PCI_SNAPSHOT_LIB_H_
+
+#include <Protocol/PciRootBridgeIo.h>
+#include <IndustryStandard/Pci.h>
+
+//
+// How config space is read
+//
+typedef enum {
+    PciAccessAuto,              // ECAM if the MCFG table covers the bus
+    PciAccessProtocol,          // EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL.Pci.Read
+    PciAccessEcam,
+    PciAccessPciIo              // firmware's EFI_PCI_IO_PROTOCOL handles, no scan
+} PCI_ACCESS_METHOD;
+
+//
+// PciSnapshotCreate() flags
+//
+#define PCI_SNAPSHOT_ALL_BUSES  0x0001      // probe every bus in the range, not just bridged ones
+#define PCI_SNAPSHOT_PARALLEL   0x0002      // scan on the application processors if possible
+
+#define PCI_SNAPSHOT_EXTENDED_SIZE  4096
+
+//
+// Config space accesses issued by the enumeration
+//
+typedef struct {
+    UINTN   Buses;              // buses scanned
+    UINTN   BusRange;           // buses decoded by the root bridges
+    UINTN   Functions;          // functions probed
+    UINTN   Present;            // functions found
+    UINTN   Accesses;           // config cycles issued
+    UINTN   EcamAccesses;       // of which read from the ECAM window
+    UINTN   Processors;         // that took part in the scan, 1 if serial
+    UINT64  Ticks;              // TSC ticks spent enumerating
+} PCI_SNAPSHOT_STATS;
+
+//
+// One root bridge bus range
+//
+typedef struct {
+    EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *IoDev;
+    CONST VOID                      *Ecam;          // ECAM region, NULL if none
+    UINT32                          Segment;
+    UINT16                          MinBus;
+    UINT16                          MaxBus;
+} PCI_SNAPSHOT_ROOT;
+
+//
+// One function. Header holds the first 64 bytes of config space, the
+// type 0 or type 1 header; Extended is filled in by
+// PciSnapshotReadExtended() only when a caller needs it.
+//
+typedef struct {
+    UINT32      Root;               // index into PCI_SNAPSHOT.Roots
+    UINT16      Segment;
+    UINT16      Bus;
+    UINT8       Device;
+    UINT8       Function;
+    UINT8       Depth;              // bridges between the root bus and this function
+    PCI_TYPE00  Header;
+    UINT8       *Extended;          // PCI_SNAPSHOT_EXTENDED_SIZE bytes or NULL
+} PCI_SNAPSHOT_DEVICE;
+
+//
+// Devices are in bridge walk order: each bridge is followed by the
+// functions below it, so a listing in array order matches a depth-first
+// scan. With PCI_SNAPSHOT_ALL_BUSES they are in bus order instead.
+//
+typedef struct {
+    PCI_SNAPSHOT_ROOT   *Roots;
+    UINTN               RootCount;
+    PCI_SNAPSHOT_DEVICE *Devices;
+    UINTN               DeviceCount;
+    UINTN               DeviceMax;
+    PCI_ACCESS_METHOD   Method;
+    UINTN               EcamRegions;    // MCFG allocations found
+    VOID                *EcamTable;     // private
+    VOID                *Image;         // loaded snapshot, owns every Extended
+    EFI_TIME            Time;           // when the snapshot was taken
+    PCI_SNAPSHOT_STATS  Stats;
+} PCI_SNAPSHOT;
+
+//
+// Snapshot file. Each record is followed by its ConfigSize bytes of
+// config space; the rest of the 4 KB is Fill, so trailing all-ones or
+// all-zero space is not stored.
+//
+#define PCI_SNAPSHOT_FILE_SIGNATURE  SIGNATURE_32('P', 'C', 'I', 'S')
+#define PCI_SNAPSHOT_FILE_REVISION   1
+
+#pragma pack(1)
+typedef struct {
+    UINT32      Signature;
+    UINT32      Revision;
+    UINT32      HeaderSize;
+    UINT32      ImageSize;          // header and records
+    UINT32      ImageCrc;           // CRC32 of everything after the header
+    UINT32      DeviceCount;
+    EFI_TIME    Time;
+} PCI_SNAPSHOT_FILE_HEADER;
+
+typedef struct {
+    UINT16      Segment;
+    UINT8       Bus;
+    UINT8       Device;
+    UINT8       Function;
+    UINT8       Depth;
+    UINT8       Fill;
+    UINT8       Reserved;
+    UINT16      ConfigSize;
+} PCI_SNAPSHOT_FILE_RECORD;
+#pragma pack()
+
+//
+// PCI Express capability register fields, decoded by
+// PciSnapshotReadExpress(). Link speeds are the Link Capabilities
+// encoding: 1 is 2.5 GT/s, 2 is 5 GT/s, 3 is 8 GT/s and so on.
+//
+#define PCI_EXPRESS_PORT_ENDPOINT           0x0
+#define PCI_EXPRESS_PORT_LEGACY_ENDPOINT    0x1
+#define PCI_EXPRESS_PORT_ROOT               0x4
+#define PCI_EXPRESS_PORT_UPSTREAM           0x5
+#define PCI_EXPRESS_PORT_DOWNSTREAM         0x6
+#define PCI_EXPRESS_PORT_PCIE_TO_PCI        0x7
+#define PCI_EXPRESS_PORT_PCI_TO_PCIE        0x8
+#define PCI_EXPRESS_PORT_RC_ENDPOINT        0x9
+#define PCI_EXPRESS_PORT_RC_EVENT_COLLECTOR 0xa
+
+#define PCI_EXPRESS_ASPM_L0S                0x01
+#define PCI_EXPRESS_ASPM_L1                 0x02
+#define PCI_EXPRESS_ASPM_L1_1               0x04    // L1 PM Substates
+#define PCI_EXPRESS_ASPM_L1_2               0x08
+
+//
+// PciSnapshotReadExpress() fields; only the groups asked for are read
+//
+#define PCI_EXPRESS_LINK                    0x0001  // link speed and width
+#define PCI_EXPRESS_PAYLOAD                 0x0002  // MPS, MRRS, relaxed ordering
+#define PCI_EXPRESS_ASPM                    0x0004  // ASPM and L1 PM Substates
+#define PCI_EXPRESS_ALL                     0x0007
+
+typedef struct {
+    UINT32      Offset;             // of the PCI Express capability
+    UINT8       PortType;
+    BOOLEAN     HasLink;            // root complex integrated functions have none
+    UINT8       MaxLinkSpeed;
+    UINT8       MaxLinkWidth;
+    UINT8       LinkSpeed;
+    UINT8       LinkWidth;
+    UINT16      MaxPayloadSupported;    // bytes
+    UINT16      MaxPayload;
+    UINT16      MaxReadRequest;
+    BOOLEAN     RelaxedOrdering;
+    UINT8       AspmSupported;      // PCI_EXPRESS_ASPM_xxx
+    UINT8       AspmEnabled;
+} PCI_SNAPSHOT_EXPRESS;
+
+//
+// Streaming export of one record per function, as a JSON array or as
+// CSV with a header line. Records are batched into large writes.
+//
+typedef enum {
+    PciExportJson,
+    PciExportCsv
+} PCI_EXPORT_FORMAT;
+
+typedef struct {
+    VOID                *FileHandle;    // SHELL_FILE_HANDLE, NULL for the console
+    PCI_EXPORT_FORMAT   Format;
+    CHAR8               *Buffer;
+    UINTN               Used;
+    UINTN               Size;
+    UINTN               Records;
+    UINTN               Writes;         // file or console writes issued
+    EFI_STATUS          Status;         // first write error
+} PCI_SNAPSHOT_EXPORT;
+
+
+EFI_STATUS
+PciSnapshotCreate( PCI_ACCESS_METHOD Method,
+                   UINTN Flags,
+                   PCI_SNAPSHOT *Snapshot );
+
+EFI_STATUS
+PciSnapshotReadConfig( PCI_SNAPSHOT *Snapshot,
+                       CONST PCI_SNAPSHOT_DEVICE *Device,
+                       EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_WIDTH Width,
+                       UINT32 Offset,
+                       UINTN Count,
+                       VOID *Buffer );
+
+EFI_STATUS
+PciSnapshotReadExtended( PCI_SNAPSHOT *Snapshot,
+                         PCI_SNAPSHOT_DEVICE *Device );
+
+EFI_STATUS
+PciSnapshotSave( PCI_SNAPSHOT *Snapshot,
+                 CONST CHAR16 *FileName );
+
+EFI_STATUS
+PciSnapshotLoad( CONST CHAR16 *FileName,
+                 PCI_SNAPSHOT *Snapshot );
+
+EFI_STATUS
+PciSnapshotFindCapability( PCI_SNAPSHOT *Snapshot,
+                           CONST PCI_SNAPSHOT_DEVICE *Device,
+                           UINT8 CapabilityId,
+                           UINT32 *Offset );
+
+EFI_STATUS
+PciSnapshotFindExtendedCapability( PCI_SNAPSHOT *Snapshot,
+                                   CONST PCI_SNAPSHOT_DEVICE *Device,
+                                   UINT16 CapabilityId,
+                                   UINT32 *Offset );
+
+EFI_STATUS
+PciSnapshotReadExpress( PCI_SNAPSHOT *Snapshot,
+                        CONST PCI_SNAPSHOT_DEVICE *Device,
+                        UINTN Fields,
+                        PCI_SNAPSHOT_EXPRESS *Express );
+
+PCI_SNAPSHOT_DEVICE *
+PciSnapshotFindUpstreamBridge( PCI_SNAPSHOT *Snapshot,
+                               CONST PCI_SNAPSHOT_DEVICE *Device );
+
+EFI_STATUS
+PciSnapshotExportOpen( CONST CHAR16 *FileName,
+                       PCI_EXPORT_FORMAT Format,
+                       PCI_SNAPSHOT_EXPORT *Export );
+
+EFI_STATUS
+PciSnapshotExportDevice( PCI_SNAPSHOT_EXPORT *Export,
+                         CONST PCI_SNAPSHOT_DEVICE *Device,
+                         CONST CHAR8 *VendorName,
+                         CONST CHAR8 *DeviceName,
+                         CONST CHAR8 *ClassName );
+
+EFI_STATUS
+PciSnapshotExportClose( PCI_SNAPSHOT_EXPORT *Export );
+
+UINT64
+PciSnapshotTicksToMicroseconds( UINT64 Ticks );
+
+VOID
+PciSnapshotFree( PCI_SNAPSHOT *Snapshot );
+
+#endif // _PCI_SNAPSHOT_LIB_H_
@@ -0,0 +1,271 @@
+//
+//  Copyright (c) 2019   Finnbarr P. Murphy.   All rights reserved.
+//
+//  Walk the PCI capability and PCI Express extended capability lists
+//  of snapshot functions, and decode the PCI Express link, payload and
+//  power management settings that govern device throughput
+//
+//  License: BSD 2 clause license applies.
+//
+
+#include <Uefi.h>
+#include <Library/UefiLib.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/PciSnapshotLib.h>
+
+#include <IndustryStandard/Pci.h>
+
+#define CARDBUS_CAPABILITY_POINTER_OFFSET   0x14
+
+//
+// Offsets into the PCI Express capability
+//
+#define PCIE_CAPABILITIES_OFFSET            0x02
+#define PCIE_DEVICE_CAPABILITIES_OFFSET     0x04
+#define PCIE_DEVICE_CONTROL_OFFSET          0x08
+#define PCIE_LINK_CAPABILITIES_OFFSET       0x0c
+#define PCIE_LINK_CONTROL_OFFSET            0x10
+#define PCIE_LINK_STATUS_OFFSET             0x12
+
+#define PCIE_DEVICE_CONTROL_RELAXED_ORDERING    BIT4
+
+//
+// L1 PM Substates extended capability
+//
+#define PCIE_EXT_CAP_ID_L1_PM_SUBSTATES     0x001e
+#define PCIE_L1SS_CAPABILITIES_OFFSET       0x04
+#define PCIE_L1SS_CONTROL1_OFFSET           0x08
+
+// the same bits in the Capabilities and Control 1 registers
+#define PCIE_L1SS_ASPM_L1_2                 BIT2
+#define PCIE_L1SS_ASPM_L1_1                 BIT3
+
+// a capability header is at least a dword, so a list cannot be longer
+#define MAX_CAPABILITIES        ((PCI_MAX_CONFIG_OFFSET - 0x40) / sizeof(UINT32))
+#define MAX_EXT_CAPABILITIES    ((PCI_SNAPSHOT_EXTENDED_SIZE - PCI_MAX_CONFIG_OFFSET) / sizeof(UINT32))
+
+
+//
+// Find a capability in the list starting at the header capability
+// pointer. Returns EFI_NOT_FOUND if the function does not have it.
+//
+EFI_STATUS
+PciSnapshotFindCapability( PCI_SNAPSHOT *Snapshot,
+                           CONST PCI_SNAPSHOT_DEVICE *Device,
+                           UINT8 CapabilityId,
+                           UINT32 *Offset )
+{
+    EFI_STATUS Status;
+    UINT8  Pointer;
+    UINT8  Header[2];
+
+    if ((Device->Header.Hdr.Status & EFI_PCI_STATUS_CAPABILITY) == 0) {
+        return EFI_NOT_FOUND;
+    }
+
+    if ((Device->Header.Hdr.HeaderType & HEADER_LAYOUT_CODE) == HEADER_TYPE_CARDBUS_BRIDGE) {
+        Status = PciSnapshotReadConfig( Snapshot, Device, EfiPciWidthUint8,
+                                        CARDBUS_CAPABILITY_POINTER_OFFSET, 1, &Pointer );
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+    } else {
+        // same offset in type 0 and type 1 headers
+        Pointer = Device->Header.Device.CapabilityPtr;
+    }
+
+    for (UINTN i = 0; i < MAX_CAPABILITIES; i++) {
+        Pointer &= ~0x03;
+        if (Pointer < sizeof(PCI_TYPE00)) {
+            break;
+        }
+        Status = PciSnapshotReadConfig( Snapshot, Device, EfiPciWidthUint8, Pointer, 2, Header );
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+        if (Header[0] == CapabilityId) {
+            *Offset = Pointer;
+            return EFI_SUCCESS;
+        }
+        Pointer = Header[1];
+    }
+
+    return EFI_NOT_FOUND;
+}
+
+
+//
+// Find a PCI Express extended capability, in the list at offset 256.
+// Functions without extended config space read all ones or fail there.
+//
+EFI_STATUS
+PciSnapshotFindExtendedCapability( PCI_SNAPSHOT *Snapshot,
+                                   CONST PCI_SNAPSHOT_DEVICE *Device,
+                                   UINT16 CapabilityId,
+                                   UINT32 *Offset )
+{
+    EFI_STATUS Status;
+    UINT32 Pointer = PCI_MAX_CONFIG_OFFSET;
+    UINT32 Header;
+
+    for (UINTN i = 0; i < MAX_EXT_CAPABILITIES; i++) {
+        Status = PciSnapshotReadConfig( Snapshot, Device, EfiPciWidthUint32, Pointer, 1, &Header );
+        if (EFI_ERROR(Status) || Header == 0 || Header == MAX_UINT32) {
+            break;
+        }
+        if ((Header & 0xffff) == CapabilityId) {
+            *Offset = Pointer;
+            return EFI_SUCCESS;
+        }
+        // bits 31:20 are the next offset, 0 at the end of the list
+        Pointer = (Header >> 20) & ~0x03;
+        if (Pointer < PCI_MAX_CONFIG_OFFSET) {
+            break;
+        }
+    }
+
+    return EFI_NOT_FOUND;
+}
+
+
+//
+// Decode the PCI Express capability of a function. Only the register
+// groups in Fields are read. Returns EFI_NOT_FOUND for conventional PCI.
+//
+EFI_STATUS
+PciSnapshotReadExpress( PCI_SNAPSHOT *Snapshot,
+                        CONST PCI_SNAPSHOT_DEVICE *Device,
+                        UINTN Fields,
+                        PCI_SNAPSHOT_EXPRESS *Express )
+{
+    EFI_STATUS Status;
+    UINT32 Cap;
+    UINT32 L1ss;
+    UINT32 DeviceCapabilities;
+    UINT32 LinkCapabilities = 0;
+    UINT16 Capabilities;
+    UINT16 DeviceControl;
+    UINT16 LinkControl;
+    UINT16 LinkStatus;
+    UINT32 L1ssCapabilities;
+    UINT32 Control1;
+
+    ZeroMem( Express, sizeof(*Express) );
+
+    Status = PciSnapshotFindCapability( Snapshot, Device, EFI_PCI_CAPABILITY_ID_PCIEXP, &Cap );
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    Status = PciSnapshotReadConfig( Snapshot, Device, EfiPciWidthUint16,
+                                    Cap + PCIE_CAPABILITIES_OFFSET, 1, &Capabilities );
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+    Express->Offset = Cap;
+    Express->PortType = (Capabilities >> 4) & 0x0f;
+    Express->HasLink = (Express->PortType != PCI_EXPRESS_PORT_RC_ENDPOINT &&
+                        Express->PortType != PCI_EXPRESS_PORT_RC_EVENT_COLLECTOR);
+
+    if (Express->HasLink && (Fields & (PCI_EXPRESS_LINK | PCI_EXPRESS_ASPM)) != 0) {
+        Status = PciSnapshotReadConfig( Snapshot, Device, EfiPciWidthUint32,
+                                        Cap + PCIE_LINK_CAPABILITIES_OFFSET, 1, &LinkCapabilities );
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+    }
+
+    if (Express->HasLink && (Fields & PCI_EXPRESS_LINK) != 0) {
+        Status = PciSnapshotReadConfig( Snapshot, Device, EfiPciWidthUint16,
+                                        Cap + PCIE_LINK_STATUS_OFFSET, 1, &LinkStatus );
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+        Express->MaxLinkSpeed = (UINT8)(LinkCapabilities & 0x0f);
+        Express->MaxLinkWidth = (UINT8)((LinkCapabilities >> 4) & 0x3f);
+        Express->LinkSpeed = (UINT8)(LinkStatus & 0x0f);
+        Express->LinkWidth = (UINT8)((LinkStatus >> 4) & 0x3f);
+    }
+
+    if ((Fields & PCI_EXPRESS_PAYLOAD) != 0) {
+        Status = PciSnapshotReadConfig( Snapshot, Device, EfiPciWidthUint32,
+                                        Cap + PCIE_DEVICE_CAPABILITIES_OFFSET, 1, &DeviceCapabilities );
+        if (!EFI_ERROR(Status)) {
+            Status = PciSnapshotReadConfig( Snapshot, Device, EfiPciWidthUint16,
+                                            Cap + PCIE_DEVICE_CONTROL_OFFSET, 1, &DeviceControl );
+        }
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+        // all three are encoded as 128 << n bytes
+        Express->MaxPayloadSupported = (UINT16)(128 << (DeviceCapabilities & 0x07));
+        Express->MaxPayload = (UINT16)(128 << ((DeviceControl >> 5) & 0x07));
+        Express->MaxReadRequest = (UINT16)(128 << ((DeviceControl >> 12) & 0x07));
+        Express->RelaxedOrdering = (DeviceControl & PCIE_DEVICE_CONTROL_RELAXED_ORDERING) != 0;
+    }
+
+    if (Express->HasLink && (Fields & PCI_EXPRESS_ASPM) != 0) {
+        Status = PciSnapshotReadConfig( Snapshot, Device, EfiPciWidthUint16,
+                                        Cap + PCIE_LINK_CONTROL_OFFSET, 1, &LinkControl );
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+        Express->AspmSupported = (UINT8)((LinkCapabilities >> 10) & 0x03);
+        Express->AspmEnabled = (UINT8)(LinkControl & 0x03);
+
+        // L1 substates only matter when L1 itself can be entered
+        if ((Express->AspmSupported & PCI_EXPRESS_ASPM_L1) != 0 &&
+            !EFI_ERROR(PciSnapshotFindExtendedCapability( Snapshot, Device,
+                                                          PCIE_EXT_CAP_ID_L1_PM_SUBSTATES, &L1ss ))) {
+            Status = PciSnapshotReadConfig( Snapshot, Device, EfiPciWidthUint32,
+                                            L1ss + PCIE_L1SS_CAPABILITIES_OFFSET, 1, &L1ssCapabilities );
+            if (!EFI_ERROR(Status)) {
+                if ((L1ssCapabilities & PCIE_L1SS_ASPM_L1_1) != 0) {
+                    Express->AspmSupported |= PCI_EXPRESS_ASPM_L1_1;
+                }
+                if ((L1ssCapabilities & PCIE_L1SS_ASPM_L1_2) != 0) {
+                    Express->AspmSupported |= PCI_EXPRESS_ASPM_L1_2;
+                }
+                Status = PciSnapshotReadConfig( Snapshot, Device, EfiPciWidthUint32,
+                                                L1ss + PCIE_L1SS_CONTROL1_OFFSET, 1, &Control1 );
+            }
+            if (!EFI_ERROR(Status)) {
+                if ((Control1 & PCIE_L1SS_ASPM_L1_1) != 0) {
+                    Express->AspmEnabled |= PCI_EXPRESS_ASPM_L1_1;
+                }
+                if ((Control1 & PCIE_L1SS_ASPM_L1_2) != 0) {
+                    Express->AspmEnabled |= PCI_EXPRESS_ASPM_L1_2;
+                }
+            }
+        }
+    }
+
+    return EFI_SUCCESS;
+}
+
+
+//
+// The bridge whose secondary bus is the bus of the function, or NULL
+// for functions on a root bus
+//
+PCI_SNAPSHOT_DEVICE *
+PciSnapshotFindUpstreamBridge( PCI_SNAPSHOT *Snapshot,
+                               CONST PCI_SNAPSHOT_DEVICE *Device )
+{
+    CONST PCI_TYPE01 *Bridge;
+
+    for (UINTN i = 0; i < Snapshot->DeviceCount; i++) {
+        if (Snapshot->Devices[i].Segment != Device->Segment) {
+            continue;
+        }
+        Bridge = (CONST PCI_TYPE01 *)&Snapshot->Devices[i].Header;
+        if (IS_PCI_BRIDGE( Bridge ) &&
+            Bridge->Bridge.SecondaryBus == Device->Bus &&
+            Bridge->Bridge.SecondaryBus > Snapshot->Devices[i].Bus) {
+            return &Snapshot->Devices[i];
+        }
+    }
+
+    return NULL;
+}
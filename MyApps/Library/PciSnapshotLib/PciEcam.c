@@ -0,0 +1,176 @@
+//
+//  Copyright (c) 2019   Finnbarr P. Murphy.   All rights reserved.
+//
+//  PCI Express memory-mapped (ECAM) config space access using the
+//  ACPI MCFG table
+//
+//  License: BSD 2 clause license applies.
+//
+
+#include <Uefi.h>
+#include <Library/UefiLib.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/IoLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+
+#include <Protocol/PciRootBridgeIo.h>
+
+#include <IndustryStandard/Acpi.h>
+#include <IndustryStandard/MemoryMappedConfigurationSpaceAccessTable.h>
+
+#include <Guid/Acpi.h>
+
+#include "PciEcam.h"
+
+#define ECAM_FUNCTION_SIZE  4096
+
+
+//
+// Find the MCFG table by walking the XSDT, as the ACPI tools do
+//
+STATIC EFI_ACPI_SDT_HEADER *
+FindMcfg( EFI_ACPI_2_0_ROOT_SYSTEM_DESCRIPTION_POINTER *Rsdp )
+{
+    EFI_ACPI_SDT_HEADER *Xsdt, *Entry;
+    UINT64 *EntryPtr;
+    UINTN EntryCount;
+
+    if (Rsdp->Revision < EFI_ACPI_2_0_ROOT_SYSTEM_DESCRIPTION_POINTER_REVISION ||
+        Rsdp->XsdtAddress == 0) {
+        return NULL;
+    }
+
+    Xsdt = (EFI_ACPI_SDT_HEADER *)(UINTN)(Rsdp->XsdtAddress);
+    if (Xsdt->Signature != SIGNATURE_32('X', 'S', 'D', 'T')) {
+        return NULL;
+    }
+
+    EntryCount = (Xsdt->Length - sizeof(EFI_ACPI_SDT_HEADER)) / sizeof(UINT64);
+    EntryPtr = (UINT64 *)(Xsdt + 1);
+    for (UINTN Index = 0; Index < EntryCount; Index++, EntryPtr++) {
+        Entry = (EFI_ACPI_SDT_HEADER *)((UINTN)(*EntryPtr));
+        if (Entry != NULL && Entry->Signature == SIGNATURE_32('M', 'C', 'F', 'G')) {
+            return Entry;
+        }
+    }
+
+    return NULL;
+}
+
+
+//
+// Copy the MCFG allocations into Ecam. EFI_NOT_FOUND if the firmware
+// publishes no MCFG table.
+//
+EFI_STATUS
+PciEcamLocate( PCI_ECAM *Ecam )
+{
+    EFI_ACPI_MEMORY_MAPPED_ENHANCED_CONFIGURATION_SPACE_BASE_ADDRESS_ALLOCATION_STRUCTURE *Alloc;
+    EFI_ACPI_2_0_ROOT_SYSTEM_DESCRIPTION_POINTER *Rsdp = NULL;
+    EFI_ACPI_SDT_HEADER *Mcfg = NULL;
+    EFI_GUID gAcpi20TableGuid = EFI_ACPI_20_TABLE_GUID;
+    UINTN Count;
+
+    ZeroMem( Ecam, sizeof(*Ecam) );
+
+    for (UINTN i = 0; i < gST->NumberOfTableEntries; i++) {
+        if (CompareGuid( &(gST->ConfigurationTable[i].VendorGuid), &gAcpi20TableGuid )) {
+            Rsdp = (EFI_ACPI_2_0_ROOT_SYSTEM_DESCRIPTION_POINTER *)gST->ConfigurationTable[i].VendorTable;
+            Mcfg = FindMcfg( Rsdp );
+            break;
+        }
+    }
+    if (Mcfg == NULL) {
+        return EFI_NOT_FOUND;
+    }
+
+    Count = (Mcfg->Length - sizeof(EFI_ACPI_MEMORY_MAPPED_CONFIGURATION_BASE_ADDRESS_TABLE_HEADER)) /
+            sizeof(*Alloc);
+    Alloc = (VOID *)((UINT8 *)Mcfg + sizeof(EFI_ACPI_MEMORY_MAPPED_CONFIGURATION_BASE_ADDRESS_TABLE_HEADER));
+
+    for (UINTN i = 0; i < Count && Ecam->RegionCount < PCI_ECAM_MAX_REGIONS; i++, Alloc++) {
+        if (Alloc->BaseAddress == 0 || Alloc->EndBusNumber < Alloc->StartBusNumber) {
+            continue;
+        }
+        Ecam->Regions[Ecam->RegionCount].BaseAddress = Alloc->BaseAddress;
+        Ecam->Regions[Ecam->RegionCount].Segment = Alloc->PciSegmentGroupNumber;
+        Ecam->Regions[Ecam->RegionCount].StartBus = Alloc->StartBusNumber;
+        Ecam->Regions[Ecam->RegionCount].EndBus = Alloc->EndBusNumber;
+        Ecam->RegionCount++;
+    }
+
+    return (Ecam->RegionCount > 0) ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
+
+
+//
+// Region of the given segment that decodes Bus, or NULL
+//
+CONST PCI_ECAM_REGION *
+PciEcamFindRegion( CONST PCI_ECAM *Ecam,
+                   UINT32 Segment,
+                   UINT16 Bus )
+{
+    for (UINTN i = 0; i < Ecam->RegionCount; i++) {
+        if (Ecam->Regions[i].Segment == Segment &&
+            Bus >= Ecam->Regions[i].StartBus && Bus <= Ecam->Regions[i].EndBus) {
+            return &Ecam->Regions[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+//
+// Same arguments as EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL.Pci.Read, but loads
+// straight from the ECAM window. Accesses are never wider than a dword
+// since that is all ECAM is required to support. Returns EFI_UNSUPPORTED
+// if the bus is outside the region so the caller can use the protocol.
+//
+EFI_STATUS
+PciEcamRead( CONST PCI_ECAM_REGION *Region,
+             EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_WIDTH Width,
+             UINT64 Address,
+             UINTN Count,
+             VOID *Buffer )
+{
+    EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_PCI_ADDRESS *PciAddress;
+    UINTN Function;
+    UINTN Register;
+    UINTN Size;
+
+    PciAddress = (EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_PCI_ADDRESS *)&Address;
+    if (PciAddress->Bus < Region->StartBus || PciAddress->Bus > Region->EndBus) {
+        return EFI_UNSUPPORTED;
+    }
+
+    switch (Width) {
+        case EfiPciWidthUint8:  Size = 1; break;
+        case EfiPciWidthUint16: Size = 2; break;
+        case EfiPciWidthUint32: Size = 4; break;
+        default:
+            return EFI_UNSUPPORTED;
+    }
+
+    Register = (PciAddress->ExtendedRegister != 0) ? PciAddress->ExtendedRegister : PciAddress->Register;
+    if ((Register & (Size - 1)) != 0 || Register + Count * Size > ECAM_FUNCTION_SIZE) {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    Function = (UINTN)Region->BaseAddress +
+               ((UINTN)PciAddress->Bus << 20) +
+               ((UINTN)PciAddress->Device << 15) +
+               ((UINTN)PciAddress->Function << 12);
+
+    for (UINTN i = 0; i < Count; i++, Register += Size) {
+        switch (Size) {
+            case 1: ((UINT8 *)Buffer)[i] = MmioRead8( Function + Register ); break;
+            case 2: ((UINT16 *)Buffer)[i] = MmioRead16( Function + Register ); break;
+            default: ((UINT32 *)Buffer)[i] = MmioRead32( Function + Register ); break;
+        }
+    }
+
+    return EFI_SUCCESS;
+}
@@ -0,0 +1,47 @@
+//
+//  Copyright (c) 2019   Finnbarr P. Murphy.   All rights reserved.
+//
+//  PCI Express memory-mapped (ECAM) config space access using the
+//  ACPI MCFG table
+//
+//  License: BSD 2 clause license applies.
+//
+
+#ifndef _PCIECAM_H_
+#define _PCIECAM_H_
+
+#define PCI_ECAM_MAX_REGIONS  16
+
+//
+// One MCFG allocation. BaseAddress is the address of bus 0 of the
+// segment even when StartBus is not 0.
+//
+typedef struct {
+    UINT64  BaseAddress;
+    UINT16  Segment;
+    UINT8   StartBus;
+    UINT8   EndBus;
+} PCI_ECAM_REGION;
+
+typedef struct {
+    UINTN            RegionCount;
+    PCI_ECAM_REGION  Regions[PCI_ECAM_MAX_REGIONS];
+} PCI_ECAM;
+
+
+EFI_STATUS
+PciEcamLocate( PCI_ECAM *Ecam );
+
+CONST PCI_ECAM_REGION *
+PciEcamFindRegion( CONST PCI_ECAM *Ecam,
+                   UINT32 Segment,
+                   UINT16 Bus );
+
+EFI_STATUS
+PciEcamRead( CONST PCI_ECAM_REGION *Region,
+             EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_WIDTH Width,
+             UINT64 Address,
+             UINTN Count,
+             VOID *Buffer );
+
+#endif // _PCIECAM_H_
@@ -0,0 +1,318 @@
+//
+//  Copyright (c) 2019   Finnbarr P. Murphy.   All rights reserved.
+//
+//  Machine-readable JSON or CSV export of snapshot functions, for
+//  inventory collectors
+//
+//  License: BSD 2 clause license applies.
+//
+//  Records are formatted into one large buffer and written out only
+//  when it fills, to a file with ShellWriteFile() or to the console,
+//  so a full listing costs a handful of writes rather than one per line.
+//  Lines end in LF. AsciiVSPrint() would make a LF in its format CR LF,
+//  so line ends are never formatted. ExportFlush() adds the CR that the
+//  console needs.
+//
+
+#include <Uefi.h>
+#include <Library/UefiLib.h>
+#include <Library/ShellLib.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/PrintLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/PciSnapshotLib.h>
+
+#include <IndustryStandard/Pci.h>
+
+#define EXPORT_BUFFER_SIZE      SIZE_64KB
+#define CONSOLE_CHUNK_SIZE      1024
+
+#define CSV_HEADER  "segment,bus,device,function,location,vendor_id,device_id," \
+                    "subsystem_vendor_id,subsystem_id,class,revision,header_type,depth," \
+                    "vendor_name,device_name,class_name\n"
+
+
+STATIC
+VOID
+ExportFlush( PCI_SNAPSHOT_EXPORT *Export )
+{
+    CHAR16 Chunk[CONSOLE_CHUNK_SIZE + 1];
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINTN Size;
+    UINTN Done;
+    UINTN i;
+
+    if (Export->Used == 0) {
+        return;
+    }
+
+    if (Export->FileHandle != NULL) {
+        Size = Export->Used;
+        Status = ShellWriteFile( (SHELL_FILE_HANDLE)Export->FileHandle, &Size, Export->Buffer );
+        if (!EFI_ERROR(Status) && Size != Export->Used) {
+            Status = EFI_VOLUME_FULL;
+        }
+        Export->Writes++;
+    } else {
+        // the console takes UCS-2 with CR LF, converted a chunk at a time
+        for (Done = 0; Done < Export->Used && !EFI_ERROR(Status); ) {
+            for (i = 0; i < CONSOLE_CHUNK_SIZE - 1 && Done < Export->Used; Done++) {
+                if (Export->Buffer[Done] == '\n') {
+                    Chunk[i++] = L'\r';
+                }
+                Chunk[i++] = (CHAR16)(UINT8)Export->Buffer[Done];
+            }
+            Chunk[i] = L'\0';
+            Status = gST->ConOut->OutputString( gST->ConOut, Chunk );
+            Export->Writes++;
+        }
+    }
+
+    if (EFI_ERROR(Status) && !EFI_ERROR(Export->Status)) {
+        Export->Status = Status;
+    }
+    Export->Used = 0;
+}
+
+
+STATIC
+VOID
+ExportAppend( PCI_SNAPSHOT_EXPORT *Export,
+              CONST CHAR8 *Str,
+              UINTN Length )
+{
+    UINTN Copy;
+
+    while (Length > 0) {
+        if (Export->Used == Export->Size) {
+            ExportFlush( Export );
+        }
+        Copy = MIN( Length, Export->Size - Export->Used );
+        CopyMem( Export->Buffer + Export->Used, Str, Copy );
+        Export->Used += Copy;
+        Str += Copy;
+        Length -= Copy;
+    }
+}
+
+
+STATIC
+VOID
+ExportPrint( PCI_SNAPSHOT_EXPORT *Export,
+             CONST CHAR8 *Format,
+             ... )
+{
+    CHAR8   Line[160];
+    VA_LIST Marker;
+    UINTN   Length;
+
+    VA_START( Marker, Format );
+    Length = AsciiVSPrint( Line, sizeof(Line), Format, Marker );
+    VA_END( Marker );
+
+    ExportAppend( Export, Line, Length );
+}
+
+
+//
+// Append a name as a quoted JSON string or CSV field, or as null or an
+// empty field if it is not known
+//
+STATIC
+VOID
+ExportName( PCI_SNAPSHOT_EXPORT *Export,
+            CONST CHAR8 *Name )
+{
+    CONST CHAR8 *Run;
+
+    if (Name == NULL) {
+        if (Export->Format == PciExportJson) {
+            ExportAppend( Export, "null", 4 );
+        }
+        return;
+    }
+
+    ExportAppend( Export, "\"", 1 );
+    for (Run = Name; ; Name++) {
+        // copy runs of plain characters in one go
+        if (*Name != '\0' && *Name != '"' &&
+            (Export->Format == PciExportCsv || (*Name != '\\' && (UINT8)*Name >= 0x20))) {
+            continue;
+        }
+        ExportAppend( Export, Run, Name - Run );
+        Run = Name + 1;
+        if (*Name == '\0') {
+            break;
+        }
+        if (Export->Format == PciExportCsv) {
+            ExportAppend( Export, "\"\"", 2 );
+        } else if (*Name == '"' || *Name == '\\') {
+            ExportPrint( Export, "\\%c", *Name );
+        } else {
+            ExportPrint( Export, "\\u%04x", (UINT8)*Name );
+        }
+    }
+    ExportAppend( Export, "\"", 1 );
+}
+
+
+//
+// Start an export to FileName, replacing any existing file, or to the
+// console if FileName is NULL
+//
+EFI_STATUS
+PciSnapshotExportOpen( CONST CHAR16 *FileName,
+                       PCI_EXPORT_FORMAT Format,
+                       PCI_SNAPSHOT_EXPORT *Export )
+{
+    SHELL_FILE_HANDLE FileHandle = (SHELL_FILE_HANDLE)NULL;
+    EFI_STATUS Status;
+
+    ZeroMem( Export, sizeof(*Export) );
+
+    if (FileName != NULL) {
+        // EFI_FILE_MODE_CREATE does not truncate, so remove any old file first
+        Status = ShellOpenFileByName( FileName,
+                                      &FileHandle,
+                                      EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE,
+                                      0 );
+        if (!EFI_ERROR(Status)) {
+            ShellDeleteFile( &FileHandle );
+        }
+
+        Status = ShellOpenFileByName( FileName,
+                                      &FileHandle,
+                                      EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE,
+                                      0 );
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+    }
+
+    Export->Buffer = AllocatePool( EXPORT_BUFFER_SIZE );
+    if (Export->Buffer == NULL) {
+        if (FileHandle != NULL) {
+            ShellCloseFile( &FileHandle );
+        }
+        return EFI_OUT_OF_RESOURCES;
+    }
+    Export->Size = EXPORT_BUFFER_SIZE;
+    Export->FileHandle = FileHandle;
+    Export->Format = Format;
+
+    if (Format == PciExportJson) {
+        ExportAppend( Export, "[", 1 );
+    } else {
+        ExportAppend( Export, CSV_HEADER, sizeof(CSV_HEADER) - 1 );
+    }
+
+    return EFI_SUCCESS;
+}
+
+
+//
+// Add one function. Names not known are passed as NULL.
+//
+EFI_STATUS
+PciSnapshotExportDevice( PCI_SNAPSHOT_EXPORT *Export,
+                         CONST PCI_SNAPSHOT_DEVICE *Device,
+                         CONST CHAR8 *VendorName,
+                         CONST CHAR8 *DeviceName,
+                         CONST CHAR8 *ClassName )
+{
+    CONST PCI_TYPE00 *Header = &Device->Header;
+    BOOLEAN HasSubsystem;
+
+    // subsystem IDs are only in type 0 headers
+    HasSubsystem = (Header->Hdr.HeaderType & HEADER_LAYOUT_CODE) == HEADER_TYPE_DEVICE;
+
+    if (Export->Format == PciExportJson) {
+        if (Export->Records == 0) {
+            ExportAppend( Export, "\n  {", 4 );
+        } else {
+            ExportAppend( Export, ",\n  {", 5 );
+        }
+        ExportPrint( Export,
+                     "\"segment\": %d, \"bus\": %d, \"device\": %d, \"function\": %d, "
+                     "\"location\": \"%04x:%02x:%02x.%x\", ",
+                     Device->Segment, Device->Bus, Device->Device, Device->Function,
+                     Device->Segment, Device->Bus, Device->Device, Device->Function );
+        ExportPrint( Export, "\"vendor_id\": \"%04x\", \"device_id\": \"%04x\", ",
+                     Header->Hdr.VendorId, Header->Hdr.DeviceId );
+        if (HasSubsystem) {
+            ExportPrint( Export, "\"subsystem_vendor_id\": \"%04x\", \"subsystem_id\": \"%04x\", ",
+                         Header->Device.SubsystemVendorID, Header->Device.SubsystemID );
+        } else {
+            ExportPrint( Export, "\"subsystem_vendor_id\": null, \"subsystem_id\": null, " );
+        }
+        ExportPrint( Export, "\"class\": \"%02x%02x%02x\", \"revision\": \"%02x\", "
+                     "\"header_type\": %d, \"depth\": %d, ",
+                     Header->Hdr.ClassCode[2], Header->Hdr.ClassCode[1], Header->Hdr.ClassCode[0],
+                     Header->Hdr.RevisionID, Header->Hdr.HeaderType & HEADER_LAYOUT_CODE,
+                     Device->Depth );
+        ExportAppend( Export, "\"vendor_name\": ", 15 );
+        ExportName( Export, VendorName );
+        ExportAppend( Export, ", \"device_name\": ", 17 );
+        ExportName( Export, DeviceName );
+        ExportAppend( Export, ", \"class_name\": ", 16 );
+        ExportName( Export, ClassName );
+        ExportAppend( Export, "}", 1 );
+    } else {
+        ExportPrint( Export, "%d,%d,%d,%d,%04x:%02x:%02x.%x,%04x,%04x,",
+                     Device->Segment, Device->Bus, Device->Device, Device->Function,
+                     Device->Segment, Device->Bus, Device->Device, Device->Function,
+                     Header->Hdr.VendorId, Header->Hdr.DeviceId );
+        if (HasSubsystem) {
+            ExportPrint( Export, "%04x,%04x,", Header->Device.SubsystemVendorID, Header->Device.SubsystemID );
+        } else {
+            ExportAppend( Export, ",,", 2 );
+        }
+        ExportPrint( Export, "%02x%02x%02x,%02x,%d,%d,",
+                     Header->Hdr.ClassCode[2], Header->Hdr.ClassCode[1], Header->Hdr.ClassCode[0],
+                     Header->Hdr.RevisionID, Header->Hdr.HeaderType & HEADER_LAYOUT_CODE,
+                     Device->Depth );
+        ExportName( Export, VendorName );
+        ExportAppend( Export, ",", 1 );
+        ExportName( Export, DeviceName );
+        ExportAppend( Export, ",", 1 );
+        ExportName( Export, ClassName );
+        ExportAppend( Export, "\n", 1 );
+    }
+
+    Export->Records++;
+
+    return Export->Status;
+}
+
+
+//
+// Write out what is buffered and close the file. Returns the first
+// write error of the whole export.
+//
+EFI_STATUS
+PciSnapshotExportClose( PCI_SNAPSHOT_EXPORT *Export )
+{
+    SHELL_FILE_HANDLE FileHandle = (SHELL_FILE_HANDLE)Export->FileHandle;
+    EFI_STATUS Status;
+
+    if (Export->Buffer == NULL) {
+        return EFI_NOT_STARTED;
+    }
+
+    if (Export->Format == PciExportJson) {
+        ExportAppend( Export, "\n]\n", 3 );
+    }
+    ExportFlush( Export );
+
+    if (FileHandle != NULL) {
+        ShellCloseFile( &FileHandle );
+    }
+    FreePool( Export->Buffer );
+
+    Status = Export->Status;
+    ZeroMem( Export, sizeof(*Export) );
+
+    return Status;
+}
@@ -0,0 +1,254 @@
+//
+//  Copyright (c) 2019   Finnbarr P. Murphy.   All rights reserved.
+//
+//  Save and load PCI snapshots, with the full config space of every
+//  function, so that register settings can be compared across boots
+//
+//  License: BSD 2 clause license applies.
+//
+
+#include <Uefi.h>
+#include <Library/UefiLib.h>
+#include <Library/ShellLib.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/PciSnapshotLib.h>
+
+#include <IndustryStandard/Pci.h>
+
+
+//
+// Bytes of config space worth storing. Trailing dwords that all match
+// the last one, when that is all ones or all zeros, are left to Fill.
+//
+STATIC UINT16
+ConfigSizeToStore( CONST UINT8 *Config,
+                   UINT8 *Fill )
+{
+    CONST UINT32 *Dwords = (CONST UINT32 *)Config;
+    UINTN Count = PCI_SNAPSHOT_EXTENDED_SIZE / sizeof(UINT32);
+    UINT32 Last = Dwords[Count - 1];
+
+    *Fill = (UINT8)Last;
+    if (Last != 0 && Last != MAX_UINT32) {
+        return PCI_SNAPSHOT_EXTENDED_SIZE;
+    }
+
+    // the 64-byte header is always kept
+    while (Count > sizeof(PCI_TYPE00) / sizeof(UINT32) && Dwords[Count - 1] == Last) {
+        Count--;
+    }
+
+    return (UINT16)(Count * sizeof(UINT32));
+}
+
+
+//
+// Write the snapshot, reading the full config space of any function not
+// yet read, as one image in a single sequential write
+//
+EFI_STATUS
+PciSnapshotSave( PCI_SNAPSHOT *Snapshot,
+                 CONST CHAR16 *FileName )
+{
+    SHELL_FILE_HANDLE FileHandle = (SHELL_FILE_HANDLE)NULL;
+    PCI_SNAPSHOT_FILE_HEADER *Header;
+    PCI_SNAPSHOT_FILE_RECORD *Record;
+    PCI_SNAPSHOT_DEVICE *Device;
+    EFI_STATUS Status;
+    UINT8  *Image;
+    UINT8  *Ptr;
+    UINT8  Fill;
+    UINTN  ImageSize;
+    UINTN  Size;
+
+    ImageSize = sizeof(PCI_SNAPSHOT_FILE_HEADER);
+    for (UINTN i = 0; i < Snapshot->DeviceCount; i++) {
+        Device = &Snapshot->Devices[i];
+        Status = PciSnapshotReadExtended( Snapshot, Device );
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
+        ImageSize += sizeof(PCI_SNAPSHOT_FILE_RECORD) + ConfigSizeToStore( Device->Extended, &Fill );
+    }
+
+    Image = AllocateZeroPool( ImageSize );
+    if (Image == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    Header = (PCI_SNAPSHOT_FILE_HEADER *)Image;
+    Header->Signature = PCI_SNAPSHOT_FILE_SIGNATURE;
+    Header->Revision = PCI_SNAPSHOT_FILE_REVISION;
+    Header->HeaderSize = sizeof(PCI_SNAPSHOT_FILE_HEADER);
+    Header->ImageSize = (UINT32)ImageSize;
+    Header->DeviceCount = (UINT32)Snapshot->DeviceCount;
+    CopyMem( &Header->Time, &Snapshot->Time, sizeof(EFI_TIME) );
+
+    Ptr = Image + sizeof(PCI_SNAPSHOT_FILE_HEADER);
+    for (UINTN i = 0; i < Snapshot->DeviceCount; i++) {
+        Device = &Snapshot->Devices[i];
+        Record = (PCI_SNAPSHOT_FILE_RECORD *)Ptr;
+        Record->Segment = Device->Segment;
+        Record->Bus = (UINT8)Device->Bus;
+        Record->Device = Device->Device;
+        Record->Function = Device->Function;
+        Record->Depth = Device->Depth;
+        Record->ConfigSize = ConfigSizeToStore( Device->Extended, &Record->Fill );
+        Ptr += sizeof(PCI_SNAPSHOT_FILE_RECORD);
+        CopyMem( Ptr, Device->Extended, Record->ConfigSize );
+        Ptr += Record->ConfigSize;
+    }
+
+    gBS->CalculateCrc32( Image + sizeof(PCI_SNAPSHOT_FILE_HEADER),
+                         ImageSize - sizeof(PCI_SNAPSHOT_FILE_HEADER),
+                         &Header->ImageCrc );
+
+    // EFI_FILE_MODE_CREATE does not truncate, so remove any old snapshot first
+    Status = ShellOpenFileByName( FileName,
+                                  &FileHandle,
+                                  EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE,
+                                  0 );
+    if (!EFI_ERROR(Status)) {
+        ShellDeleteFile( &FileHandle );
+    }
+
+    Status = ShellOpenFileByName( FileName,
+                                  &FileHandle,
+                                  EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE,
+                                  0 );
+    if (!EFI_ERROR(Status)) {
+        Size = ImageSize;
+        Status = ShellWriteFile( FileHandle, &Size, Image );
+        ShellCloseFile( &FileHandle );
+    }
+
+    FreePool( Image );
+
+    return Status;
+}
+
+
+//
+// Load a saved snapshot. The devices have no root bridge; their config
+// space is served from the saved copy by PciSnapshotReadConfig().
+//
+EFI_STATUS
+PciSnapshotLoad( CONST CHAR16 *FileName,
+                 PCI_SNAPSHOT *Snapshot )
+{
+    SHELL_FILE_HANDLE FileHandle = (SHELL_FILE_HANDLE)NULL;
+    PCI_SNAPSHOT_FILE_HEADER *Header;
+    PCI_SNAPSHOT_FILE_RECORD *Record;
+    PCI_SNAPSHOT_DEVICE *Device;
+    EFI_STATUS Status;
+    UINT8      *Image = NULL;
+    UINT8      *Ptr;
+    UINT8      *End;
+    UINT64     FileSize;
+    UINT32     Crc;
+    UINTN      Size = 0;
+
+    ZeroMem( Snapshot, sizeof(*Snapshot) );
+
+    Status = ShellOpenFileByName( FileName,
+                                  &FileHandle,
+                                  EFI_FILE_MODE_READ,
+                                  0 );
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    Status = ShellGetFileSize( FileHandle, &FileSize );
+    if (!EFI_ERROR(Status)) {
+        if (FileSize < sizeof(PCI_SNAPSHOT_FILE_HEADER) || FileSize > MAX_UINT32) {
+            Status = EFI_VOLUME_CORRUPTED;
+        } else {
+            Size = (UINTN)FileSize;
+            Image = AllocatePool( Size );
+            if (Image == NULL) {
+                Status = EFI_OUT_OF_RESOURCES;
+            } else {
+                Status = ShellReadFile( FileHandle, &Size, Image );
+            }
+        }
+    }
+    ShellCloseFile( &FileHandle );
+    if (EFI_ERROR(Status)) {
+        goto Error;
+    }
+
+    Header = (PCI_SNAPSHOT_FILE_HEADER *)Image;
+    if (Size != FileSize ||
+        Header->Signature != PCI_SNAPSHOT_FILE_SIGNATURE ||
+        Header->Revision != PCI_SNAPSHOT_FILE_REVISION ||
+        Header->HeaderSize != sizeof(PCI_SNAPSHOT_FILE_HEADER) ||
+        Header->ImageSize != Size) {
+        Status = EFI_VOLUME_CORRUPTED;
+        goto Error;
+    }
+
+    gBS->CalculateCrc32( Image + sizeof(PCI_SNAPSHOT_FILE_HEADER),
+                         Size - sizeof(PCI_SNAPSHOT_FILE_HEADER),
+                         &Crc );
+    if (Crc != Header->ImageCrc ||
+        Header->DeviceCount > (Size - sizeof(PCI_SNAPSHOT_FILE_HEADER)) / sizeof(PCI_SNAPSHOT_FILE_RECORD)) {
+        Status = EFI_VOLUME_CORRUPTED;
+        goto Error;
+    }
+
+    // one block holds the expanded config space of every device
+    Snapshot->Devices = AllocateZeroPool( Header->DeviceCount * sizeof(PCI_SNAPSHOT_DEVICE) );
+    Snapshot->Image = AllocatePool( Header->DeviceCount * PCI_SNAPSHOT_EXTENDED_SIZE );
+    if (Snapshot->Devices == NULL || (Snapshot->Image == NULL && Header->DeviceCount > 0)) {
+        Status = EFI_OUT_OF_RESOURCES;
+        goto Error;
+    }
+    Snapshot->DeviceMax = Header->DeviceCount;
+    CopyMem( &Snapshot->Time, &Header->Time, sizeof(EFI_TIME) );
+
+    Ptr = Image + sizeof(PCI_SNAPSHOT_FILE_HEADER);
+    End = Image + Size;
+    for (UINTN i = 0; i < Header->DeviceCount; i++) {
+        Record = (PCI_SNAPSHOT_FILE_RECORD *)Ptr;
+        if (Ptr + sizeof(PCI_SNAPSHOT_FILE_RECORD) > End ||
+            Record->ConfigSize < sizeof(PCI_TYPE00) ||
+            Record->ConfigSize > PCI_SNAPSHOT_EXTENDED_SIZE ||
+            Ptr + sizeof(PCI_SNAPSHOT_FILE_RECORD) + Record->ConfigSize > End) {
+            Status = EFI_VOLUME_CORRUPTED;
+            goto Error;
+        }
+        Ptr += sizeof(PCI_SNAPSHOT_FILE_RECORD);
+
+        Device = &Snapshot->Devices[i];
+        Device->Segment = Record->Segment;
+        Device->Bus = Record->Bus;
+        Device->Device = Record->Device;
+        Device->Function = Record->Function;
+        Device->Depth = Record->Depth;
+        Device->Extended = (UINT8 *)Snapshot->Image + i * PCI_SNAPSHOT_EXTENDED_SIZE;
+        CopyMem( Device->Extended, Ptr, Record->ConfigSize );
+        SetMem( Device->Extended + Record->ConfigSize,
+                PCI_SNAPSHOT_EXTENDED_SIZE - Record->ConfigSize,
+                Record->Fill );
+        CopyMem( &Device->Header, Device->Extended, sizeof(PCI_TYPE00) );
+        Ptr += Record->ConfigSize;
+
+        Snapshot->DeviceCount++;
+    }
+    Snapshot->Stats.Present = Snapshot->DeviceCount;
+
+    FreePool( Image );
+
+    return EFI_SUCCESS;
+
+Error:
+    if (Image != NULL) {
+        FreePool( Image );
+    }
+    PciSnapshotFree( Snapshot );
+
+    return Status;
+}
@@ -0,0 +1,945 @@
+//
+//  Copyright (c) 2017 - 2019   Finnbarr P. Murphy.   All rights reserved.
+//
+//  One enumeration of the PCI hierarchy into an array of device records,
+//  shared by ShowPCI, ShowPCIx and any other tool that lists PCI devices
+//
+//  License: UDK2015 license applies to code from UDK2015 source,
+//           BSD 2 clause license applies to all other code.
+//
+
+#include <Uefi.h>
+#include <Library/UefiLib.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/UefiRuntimeServicesTableLib.h>
+#include <Library/SortLib.h>
+#include <Library/SynchronizationLib.h>
+#include <Library/PciSnapshotLib.h>
+
+#include <Protocol/PciEnumerationComplete.h>
+#include <Protocol/MpService.h>
+#include <Protocol/PciRootBridgeIo.h>
+#include <Protocol/PciIo.h>
+
+#include <IndustryStandard/Pci.h>
+
+#include "PciEcam.h"
+
+#define SNAPSHOT_INITIAL_DEVICES  64
+
+//
+// Parallel scan: with PCI_SNAPSHOT_ALL_BUSES each root bus range is
+// split into chunks of this many buses, otherwise every root bridge is
+// one task. An AP cannot allocate memory, so each task gets a fixed
+// slice and one that overflows it is scanned again on the BSP.
+//
+#define PARALLEL_BUS_CHUNK        8
+#define PARALLEL_SLICE_DEVICES    512
+
+//
+// A function the firmware enumerated, from its EFI_PCI_IO_PROTOCOL
+//
+typedef struct {
+    UINTN       Segment;
+    UINTN       Bus;
+    UINTN       Device;
+    UINTN       Function;
+    PCI_TYPE00  Header;
+} PCI_IO_FUNCTION;
+
+//
+// State for one walk below a root bridge
+//
+typedef struct {
+    PCI_SNAPSHOT           *Snapshot;
+    UINT32                 Root;
+    CONST PCI_IO_FUNCTION  *Functions;      // sorted, NULL to probe the bus
+    UINTN                  FunctionCount;
+    BOOLEAN                Descend;         // follow bridges to their secondary bus
+    PCI_SNAPSHOT_STATS     *Stats;          // the snapshot's, or the task's on an AP
+    PCI_SNAPSHOT_DEVICE    *Slice;          // fixed array on an AP, NULL to grow Snapshot->Devices
+    UINTN                  SliceCount;
+    UINT8                  Visited[(PCI_MAX_BUS + 1) / 8];
+} PCI_SNAPSHOT_WALK;
+
+//
+// One part of a parallel scan, run by whichever processor claims it
+//
+typedef struct {
+    PCI_SNAPSHOT_WALK      Walk;
+    UINT16                 MinBus;
+    UINT16                 MaxBus;
+    PCI_SNAPSHOT_STATS     Stats;
+    EFI_STATUS             Status;
+} PCI_SNAPSHOT_TASK;
+
+typedef struct {
+    PCI_SNAPSHOT_TASK      *Tasks;
+    UINT32                 TaskCount;
+    volatile UINT32        NextTask;
+    volatile UINT32        Workers;         // processors that took part
+} PCI_SNAPSHOT_WORK;
+
+
+//
+// Copyed from UDK2015 Source.
+//
+STATIC EFI_STATUS
+PciGetNextBusRange( EFI_ACPI_ADDRESS_SPACE_DESCRIPTOR **Descriptors,
+                    UINT16 *MinBus,
+                    UINT16 *MaxBus,
+                    BOOLEAN *IsEnd )
+{
+    *IsEnd = FALSE;
+
+    if ((*Descriptors) == NULL) {
+        *MinBus = 0;
+        *MaxBus = PCI_MAX_BUS;
+        return EFI_SUCCESS;
+    }
+
+    while ((*Descriptors)->Desc != ACPI_END_TAG_DESCRIPTOR) {
+        if ((*Descriptors)->ResType == ACPI_ADDRESS_SPACE_TYPE_BUS) {
+            *MinBus = (UINT16) (*Descriptors)->AddrRangeMin;
+            *MaxBus = (UINT16) (*Descriptors)->AddrRangeMax;
+            (*Descriptors)++;
+            return (EFI_SUCCESS);
+        }
+
+        (*Descriptors)++;
+    }
+
+    if ((*Descriptors)->Desc == ACPI_END_TAG_DESCRIPTOR) {
+        *IsEnd = TRUE;
+    }
+
+    return EFI_SUCCESS;
+}
+
+
+//
+// Copyed from UDK2015 Source.
+//
+STATIC EFI_STATUS
+PciGetProtocolAndResource( EFI_HANDLE Handle,
+                           EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL **IoDev,
+                           EFI_ACPI_ADDRESS_SPACE_DESCRIPTOR **Descriptors )
+{
+    EFI_STATUS Status;
+
+    Status = gBS->HandleProtocol( Handle,
+                                  &gEfiPciRootBridgeIoProtocolGuid,
+                                  (VOID**)IoDev );
+    if (EFI_ERROR (Status)) {
+        return Status;
+    }
+
+    Status = (*IoDev)->Configuration ( *IoDev,
+                                       (VOID**)Descriptors );
+    if (Status == EFI_UNSUPPORTED) {
+        *Descriptors = NULL;
+        return EFI_SUCCESS;
+    }
+
+    return Status;
+}
+
+
+//
+// Every config space read goes through here so it can be counted.
+// Reads come from the ECAM window when the bus is mapped there, and
+// from the root bridge protocol otherwise.
+//
+STATIC EFI_STATUS
+PciConfigRead( PCI_SNAPSHOT_STATS *Stats,
+               CONST PCI_SNAPSHOT_ROOT *Root,
+               EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_WIDTH Width,
+               UINT64 Address,
+               UINTN Count,
+               VOID *Buffer )
+{
+    EFI_STATUS Status;
+
+    Stats->Accesses += Count;
+
+    if (Root->Ecam != NULL) {
+        Status = PciEcamRead( Root->Ecam, Width, Address, Count, Buffer );
+        if (Status != EFI_UNSUPPORTED) {
+            Stats->EcamAccesses += Count;
+            return Status;
+        }
+    }
+
+    return Root->IoDev->Pci.Read( Root->IoDev, Width, Address, Count, Buffer );
+}
+
+
+STATIC
+INTN
+EFIAPI
+ComparePciIoFunction( CONST VOID *Left,
+                      CONST VOID *Right )
+{
+    CONST PCI_IO_FUNCTION *L = (CONST PCI_IO_FUNCTION *)Left;
+    CONST PCI_IO_FUNCTION *R = (CONST PCI_IO_FUNCTION *)Right;
+
+    if (L->Segment != R->Segment) {
+        return (L->Segment < R->Segment) ? -1 : 1;
+    }
+    if (L->Bus != R->Bus) {
+        return (L->Bus < R->Bus) ? -1 : 1;
+    }
+    if (L->Device != R->Device) {
+        return (L->Device < R->Device) ? -1 : 1;
+    }
+    return (INTN)L->Function - (INTN)R->Function;
+}
+
+
+//
+// List the functions the firmware enumerated, from the EFI_PCI_IO_PROTOCOL
+// instance it installed on each, sorted by segment, bus, device and
+// function. Nothing is probed, so absent functions cost nothing.
+//
+STATIC EFI_STATUS
+PciIoCollect( PCI_IO_FUNCTION **Functions,
+              UINTN *FunctionCount,
+              PCI_SNAPSHOT_STATS *Stats )
+{
+    EFI_PCI_IO_PROTOCOL *PciIo;
+    PCI_IO_FUNCTION *Function;
+    EFI_HANDLE *Handles = NULL;
+    EFI_STATUS Status;
+    UINTN HandleCount = 0;
+
+    *Functions = NULL;
+    *FunctionCount = 0;
+
+    Status = gBS->LocateHandleBuffer( ByProtocol,
+                                      &gEfiPciIoProtocolGuid,
+                                      NULL,
+                                      &HandleCount,
+                                      &Handles );
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    *Functions = AllocateZeroPool( HandleCount * sizeof(PCI_IO_FUNCTION) );
+    if (*Functions == NULL) {
+        Status = EFI_OUT_OF_RESOURCES;
+        goto Done;
+    }
+
+    for (UINTN i = 0; i < HandleCount; i++) {
+        Status = gBS->HandleProtocol( Handles[i],
+                                      &gEfiPciIoProtocolGuid,
+                                      (VOID **)&PciIo );
+        if (EFI_ERROR(Status)) {
+            continue;
+        }
+
+        Function = &(*Functions)[*FunctionCount];
+        Status = PciIo->GetLocation( PciIo,
+                                     &Function->Segment,
+                                     &Function->Bus,
+                                     &Function->Device,
+                                     &Function->Function );
+        if (EFI_ERROR(Status)) {
+            continue;
+        }
+
+        Status = PciIo->Pci.Read( PciIo,
+                                  EfiPciIoWidthUint32,
+                                  0,
+                                  sizeof(Function->Header)/sizeof(UINT32),
+                                  &Function->Header );
+        Stats->Accesses += sizeof(Function->Header)/sizeof(UINT32);
+        if (EFI_ERROR(Status)) {
+            continue;
+        }
+
+        (*FunctionCount)++;
+    }
+    Status = EFI_SUCCESS;
+
+    PerformQuickSort( *Functions, *FunctionCount, sizeof(PCI_IO_FUNCTION), ComparePciIoFunction );
+
+Done:
+    FreePool( Handles );
+
+    return Status;
+}
+
+
+//
+// Append a function to the snapshot, growing the array as needed, or
+// to the fixed slice of an AP task
+//
+STATIC EFI_STATUS
+PciSnapshotAdd( PCI_SNAPSHOT_WALK *Walk,
+                UINT16 Bus,
+                UINT16 Device,
+                UINT16 Func,
+                UINTN Depth,
+                CONST PCI_TYPE00 *PciHeader )
+{
+    PCI_SNAPSHOT *Snapshot = Walk->Snapshot;
+    PCI_SNAPSHOT_DEVICE *Record;
+    UINTN NewMax;
+
+    if (Walk->Slice != NULL) {
+        if (Walk->SliceCount == PARALLEL_SLICE_DEVICES) {
+            return EFI_BUFFER_TOO_SMALL;
+        }
+        Record = &Walk->Slice[Walk->SliceCount++];
+    } else if (Snapshot->DeviceCount == Snapshot->DeviceMax) {
+        NewMax = (Snapshot->DeviceMax == 0) ? SNAPSHOT_INITIAL_DEVICES : Snapshot->DeviceMax * 2;
+        Snapshot->Devices = ReallocatePool( Snapshot->DeviceMax * sizeof(PCI_SNAPSHOT_DEVICE),
+                                            NewMax * sizeof(PCI_SNAPSHOT_DEVICE),
+                                            Snapshot->Devices );
+        if (Snapshot->Devices == NULL) {
+            Snapshot->DeviceCount = Snapshot->DeviceMax = 0;
+            return EFI_OUT_OF_RESOURCES;
+        }
+        Snapshot->DeviceMax = NewMax;
+        Record = &Snapshot->Devices[Snapshot->DeviceCount++];
+    } else {
+        Record = &Snapshot->Devices[Snapshot->DeviceCount++];
+    }
+
+    ZeroMem( Record, sizeof(*Record) );
+    Record->Root = Walk->Root;
+    Record->Segment = (UINT16)Snapshot->Roots[Walk->Root].Segment;
+    Record->Bus = Bus;
+    Record->Device = (UINT8)Device;
+    Record->Function = (UINT8)Func;
+    Record->Depth = (UINT8)Depth;
+    CopyMem( &Record->Header, PciHeader, sizeof(Record->Header) );
+
+    Walk->Stats->Present++;
+
+    return EFI_SUCCESS;
+}
+
+
+STATIC EFI_STATUS
+PciSnapshotWalkBus( PCI_SNAPSHOT_WALK *Walk,
+                    UINT16 Bus,
+                    UINTN Depth );
+
+
+//
+// Record a function found on Bus and descend into the secondary bus if
+// it is a bridge
+//
+STATIC EFI_STATUS
+PciSnapshotVisit( PCI_SNAPSHOT_WALK *Walk,
+                  UINT16 Bus,
+                  UINT16 Device,
+                  UINT16 Func,
+                  UINTN Depth,
+                  CONST PCI_TYPE00 *PciHeader )
+{
+    CONST PCI_SNAPSHOT_ROOT *Root = &Walk->Snapshot->Roots[Walk->Root];
+    CONST PCI_TYPE01 *Bridge = (CONST PCI_TYPE01 *)PciHeader;
+    EFI_STATUS Status;
+    UINT16 Secondary;
+    UINT8  Layout;
+
+    Status = PciSnapshotAdd( Walk, Bus, Device, Func, Depth, PciHeader );
+    if (EFI_ERROR(Status) || !Walk->Descend) {
+        return Status;
+    }
+
+    // bus numbers only ever increase going down, which also stops loops
+    Layout = PciHeader->Hdr.HeaderType & HEADER_LAYOUT_CODE;
+    if (Layout == HEADER_TYPE_PCI_TO_PCI_BRIDGE || Layout == HEADER_TYPE_CARDBUS_BRIDGE) {
+        Secondary = Bridge->Bridge.SecondaryBus;
+        if (Secondary > Bus && Secondary >= Root->MinBus && Secondary <= Root->MaxBus &&
+            (Walk->Visited[Secondary / 8] & (1 << (Secondary % 8))) == 0) {
+            Status = PciSnapshotWalkBus( Walk, Secondary, Depth + 1 );
+        }
+    }
+
+    return Status;
+}
+
+
+//
+// Scan one bus. When descending, the secondary bus of each bridge is
+// walked as soon as the bridge is seen, so only buses named by a bridge
+// are visited. With the firmware's function list nothing is probed at
+// all; the list is walked in the same order so the result is identical.
+//
+STATIC EFI_STATUS
+PciSnapshotWalkBus( PCI_SNAPSHOT_WALK *Walk,
+                    UINT16 Bus,
+                    UINTN Depth )
+{
+    PCI_SNAPSHOT *Snapshot = Walk->Snapshot;
+    CONST PCI_SNAPSHOT_ROOT *Root = &Snapshot->Roots[Walk->Root];
+    CONST PCI_IO_FUNCTION *Function;
+    PCI_TYPE00 PciHeader;
+    EFI_STATUS Status;
+    UINT64 Address;
+
+    Walk->Visited[Bus / 8] |= (UINT8)(1 << (Bus % 8));
+    Walk->Stats->Buses++;
+
+    if (Walk->Functions != NULL) {
+        for (UINTN i = 0; i < Walk->FunctionCount; i++) {
+            Function = &Walk->Functions[i];
+            if (Function->Segment == Root->Segment && Function->Bus == Bus) {
+                Status = PciSnapshotVisit( Walk, Bus, (UINT16)Function->Device, (UINT16)Function->Function,
+                                           Depth, &Function->Header );
+                if (EFI_ERROR(Status)) {
+                    return Status;
+                }
+            }
+        }
+        return EFI_SUCCESS;
+    }
+
+    for (UINT16 Device = 0; Device <= PCI_MAX_DEVICE; Device++) {
+        for (UINT16 Func = 0; Func <= PCI_MAX_FUNC; Func++) {
+            Address = EFI_PCI_ADDRESS( Bus, Device, Func, 0 );
+            Walk->Stats->Functions++;
+
+            // probe the vendor ID before reading anything else
+            Status = PciConfigRead( Walk->Stats,
+                                    Root,
+                                    EfiPciWidthUint16,
+                                    Address,
+                                    1,
+                                    &PciHeader.Hdr.VendorId );
+            if (EFI_ERROR(Status) || PciHeader.Hdr.VendorId == 0xffff) {
+                if (Func == 0) {
+                    break;          // no device, skip functions 1-7
+                }
+                continue;
+            }
+
+            // type 0 or type 1 header, 64 bytes as 16 dword reads
+            Status = PciConfigRead( Walk->Stats,
+                                    Root,
+                                    EfiPciWidthUint32,
+                                    Address,
+                                    sizeof(PciHeader)/sizeof(UINT32),
+                                    &PciHeader );
+            if (EFI_ERROR(Status)) {
+                continue;
+            }
+
+            Status = PciSnapshotVisit( Walk, Bus, Device, Func, Depth, &PciHeader );
+            if (EFI_ERROR(Status)) {
+                return Status;
+            }
+
+            if (Func == 0 &&
+                ((PciHeader.Hdr.HeaderType & HEADER_TYPE_MULTI_FUNCTION) == 0x00)) {
+                break;
+            }
+        }
+    }
+
+    return EFI_SUCCESS;
+}
+
+
+//
+// Add a root bridge bus range. It is enumerated once every root is known.
+//
+STATIC EFI_STATUS
+PciSnapshotAddRoot( PCI_SNAPSHOT *Snapshot,
+                    EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *IoDev,
+                    UINT16 MinBus,
+                    UINT16 MaxBus )
+{
+    PCI_SNAPSHOT_ROOT *Root;
+
+    Snapshot->Roots = ReallocatePool( Snapshot->RootCount * sizeof(PCI_SNAPSHOT_ROOT),
+                                      (Snapshot->RootCount + 1) * sizeof(PCI_SNAPSHOT_ROOT),
+                                      Snapshot->Roots );
+    if (Snapshot->Roots == NULL) {
+        Snapshot->RootCount = 0;
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    Root = &Snapshot->Roots[Snapshot->RootCount];
+    Root->IoDev = IoDev;
+    Root->Segment = IoDev->SegmentNumber;
+    Root->MinBus = MinBus;
+    Root->MaxBus = MaxBus;
+    Root->Ecam = PciEcamFindRegion( Snapshot->EcamTable, Root->Segment, MinBus );
+    if (Root->Ecam == NULL && Snapshot->Method == PciAccessEcam) {
+        return EFI_UNSUPPORTED;
+    }
+
+    Snapshot->RootCount++;
+    Snapshot->Stats.BusRange += MaxBus - MinBus + 1;
+
+    return EFI_SUCCESS;
+}
+
+
+STATIC VOID
+PciSnapshotInitWalk( PCI_SNAPSHOT_WALK *Walk,
+                     PCI_SNAPSHOT *Snapshot,
+                     UINTN Root,
+                     CONST PCI_IO_FUNCTION *Functions,
+                     UINTN FunctionCount,
+                     UINTN Flags )
+{
+    ZeroMem( Walk, sizeof(*Walk) );
+    Walk->Snapshot = Snapshot;
+    Walk->Root = (UINT32)Root;
+    Walk->Functions = Functions;
+    Walk->FunctionCount = FunctionCount;
+    Walk->Descend = (Flags & PCI_SNAPSHOT_ALL_BUSES) == 0;
+    Walk->Stats = &Snapshot->Stats;
+}
+
+
+//
+// Enumerate buses MinBus to MaxBus of a root, or when descending walk
+// down from MinBus, the root bus, through the bridges
+//
+STATIC EFI_STATUS
+PciSnapshotWalkRoot( PCI_SNAPSHOT_WALK *Walk,
+                     UINT16 MinBus,
+                     UINT16 MaxBus )
+{
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    if (Walk->Descend) {
+        return PciSnapshotWalkBus( Walk, MinBus, 0 );
+    }
+
+    for (UINT16 Bus = MinBus; Bus <= MaxBus && !EFI_ERROR(Status); Bus++) {
+        Status = PciSnapshotWalkBus( Walk, Bus, 0 );
+    }
+
+    return Status;
+}
+
+
+//
+// Runs on the BSP and on every AP. Each processor claims tasks until
+// none are left, so the BSP finishes the scan alone if no AP starts.
+// Nothing here may call a boot service or protocol.
+//
+STATIC VOID
+EFIAPI
+PciSnapshotWorker( VOID *Buffer )
+{
+    PCI_SNAPSHOT_WORK *Work = (PCI_SNAPSHOT_WORK *)Buffer;
+    PCI_SNAPSHOT_TASK *Task;
+    BOOLEAN Counted = FALSE;
+    UINT32 Index;
+
+    while ((Index = InterlockedIncrement( &Work->NextTask ) - 1) < Work->TaskCount) {
+        if (!Counted) {
+            InterlockedIncrement( &Work->Workers );
+            Counted = TRUE;
+        }
+        Task = &Work->Tasks[Index];
+        Task->Status = PciSnapshotWalkRoot( &Task->Walk, Task->MinBus, Task->MaxBus );
+    }
+}
+
+
+STATIC VOID
+PciSnapshotAddStats( PCI_SNAPSHOT_STATS *Total,
+                     CONST PCI_SNAPSHOT_STATS *Stats )
+{
+    Total->Buses += Stats->Buses;
+    Total->Functions += Stats->Functions;
+    Total->Present += Stats->Present;
+    Total->Accesses += Stats->Accesses;
+    Total->EcamAccesses += Stats->EcamAccesses;
+}
+
+
+//
+// Scan the roots on the application processors. Every root must be
+// covered by ECAM, as the root bridge protocol may only be used on the
+// BSP. Returns EFI_UNSUPPORTED, before touching the snapshot, when the
+// scan has to be serial instead.
+//
+STATIC EFI_STATUS
+PciSnapshotWalkParallel( PCI_SNAPSHOT *Snapshot,
+                         UINTN Flags )
+{
+    EFI_GUID gEfiMpServiceProtocolGuid = EFI_MP_SERVICES_PROTOCOL_GUID;
+    EFI_MP_SERVICES_PROTOCOL *MpServices;
+    CONST PCI_ECAM_REGION *Region;
+    CONST PCI_SNAPSHOT_ROOT *Root;
+    PCI_SNAPSHOT_DEVICE *Slices = NULL;
+    PCI_SNAPSHOT_WORK Work;
+    PCI_SNAPSHOT_TASK *Task;
+    EFI_STATUS Status;
+    EFI_EVENT Event = NULL;
+    UINTN ProcessorCount;
+    UINTN EnabledCount;
+    UINTN DeviceCount = 0;
+    UINTN Chunk;
+    UINTN Index;
+
+    if (Snapshot->Method == PciAccessProtocol || Snapshot->Method == PciAccessPciIo) {
+        return EFI_UNSUPPORTED;
+    }
+    for (UINTN i = 0; i < Snapshot->RootCount; i++) {
+        Region = Snapshot->Roots[i].Ecam;
+        if (Region == NULL || Region->EndBus < Snapshot->Roots[i].MaxBus) {
+            return EFI_UNSUPPORTED;
+        }
+    }
+
+    Status = gBS->LocateProtocol( &gEfiMpServiceProtocolGuid,
+                                  NULL,
+                                  (VOID **)&MpServices );
+    if (EFI_ERROR(Status)) {
+        return EFI_UNSUPPORTED;
+    }
+    Status = MpServices->GetNumberOfProcessors( MpServices, &ProcessorCount, &EnabledCount );
+    if (EFI_ERROR(Status) || EnabledCount < 2) {
+        return EFI_UNSUPPORTED;
+    }
+
+    ZeroMem( &Work, sizeof(Work) );
+    Chunk = ((Flags & PCI_SNAPSHOT_ALL_BUSES) != 0) ? PARALLEL_BUS_CHUNK : PCI_MAX_BUS + 1;
+    for (UINTN i = 0; i < Snapshot->RootCount; i++) {
+        Root = &Snapshot->Roots[i];
+        Work.TaskCount += (UINT32)((Root->MaxBus - Root->MinBus + Chunk) / Chunk);
+    }
+    if (Work.TaskCount < 2) {
+        return EFI_UNSUPPORTED;
+    }
+
+    Work.Tasks = AllocateZeroPool( Work.TaskCount * sizeof(PCI_SNAPSHOT_TASK) );
+    Slices = AllocatePool( Work.TaskCount * PARALLEL_SLICE_DEVICES * sizeof(PCI_SNAPSHOT_DEVICE) );
+    if (Work.Tasks == NULL || Slices == NULL) {
+        Status = EFI_OUT_OF_RESOURCES;
+        goto Done;
+    }
+
+    Task = Work.Tasks;
+    for (UINTN i = 0; i < Snapshot->RootCount; i++) {
+        Root = &Snapshot->Roots[i];
+        for (UINTN Bus = Root->MinBus; Bus <= Root->MaxBus; Bus += Chunk, Task++) {
+            PciSnapshotInitWalk( &Task->Walk, Snapshot, i, NULL, 0, Flags );
+            Task->Walk.Stats = &Task->Stats;
+            Task->Walk.Slice = &Slices[(Task - Work.Tasks) * PARALLEL_SLICE_DEVICES];
+            Task->MinBus = (UINT16)Bus;
+            Task->MaxBus = (UINT16)MIN( Bus + Chunk - 1, Root->MaxBus );
+        }
+    }
+
+    // the BSP takes tasks too while the APs run, then waits for them
+    Status = gBS->CreateEvent( 0, TPL_CALLBACK, NULL, NULL, &Event );
+    if (!EFI_ERROR(Status)) {
+        Status = MpServices->StartupAllAPs( MpServices,
+                                            PciSnapshotWorker,
+                                            FALSE,
+                                            Event,
+                                            0,
+                                            &Work,
+                                            NULL );
+    }
+    PciSnapshotWorker( &Work );
+    if (!EFI_ERROR(Status)) {
+        gBS->WaitForEvent( 1, &Event, &Index );
+    }
+    Snapshot->Stats.Processors = Work.Workers;
+
+    // slices in task order are the serial order, so just concatenate
+    for (UINTN i = 0; i < Work.TaskCount; i++) {
+        DeviceCount += Work.Tasks[i].Walk.SliceCount;
+    }
+    Snapshot->Devices = AllocatePool( MAX( DeviceCount, 1 ) * sizeof(PCI_SNAPSHOT_DEVICE) );
+    if (Snapshot->Devices == NULL) {
+        Status = EFI_OUT_OF_RESOURCES;
+        goto Done;
+    }
+    Snapshot->DeviceMax = MAX( DeviceCount, 1 );
+
+    Status = EFI_SUCCESS;
+    for (UINTN i = 0; i < Work.TaskCount && !EFI_ERROR(Status); i++) {
+        Task = &Work.Tasks[i];
+        if (Task->Status == EFI_BUFFER_TOO_SMALL) {
+            // too many functions for the slice, scan it again here
+            PciSnapshotInitWalk( &Task->Walk, Snapshot, Task->Walk.Root, NULL, 0, Flags );
+            Status = PciSnapshotWalkRoot( &Task->Walk, Task->MinBus, Task->MaxBus );
+            continue;
+        }
+        CopyMem( &Snapshot->Devices[Snapshot->DeviceCount],
+                 Task->Walk.Slice,
+                 Task->Walk.SliceCount * sizeof(PCI_SNAPSHOT_DEVICE) );
+        Snapshot->DeviceCount += Task->Walk.SliceCount;
+        PciSnapshotAddStats( &Snapshot->Stats, &Task->Stats );
+        Status = Task->Status;
+    }
+
+Done:
+    if (Event != NULL) {
+        gBS->CloseEvent( Event );
+    }
+    if (Slices != NULL) {
+        FreePool( Slices );
+    }
+    if (Work.Tasks != NULL) {
+        FreePool( Work.Tasks );
+    }
+
+    return Status;
+}
+
+
+//
+// Enumerate every root bridge once into Snapshot. The caller frees it
+// with PciSnapshotFree(), also on failure. With PCI_SNAPSHOT_PARALLEL
+// the roots are scanned on the application processors when MP services
+// and ECAM allow it, and serially on the BSP otherwise.
+//
+EFI_STATUS
+PciSnapshotCreate( PCI_ACCESS_METHOD Method,
+                   UINTN Flags,
+                   PCI_SNAPSHOT *Snapshot )
+{
+    EFI_GUID gEfiPciEnumerationCompleteProtocolGuid = EFI_PCI_ENUMERATION_COMPLETE_GUID;
+    EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *IoDev;
+    EFI_ACPI_ADDRESS_SPACE_DESCRIPTOR *Descriptors;
+    PCI_IO_FUNCTION *Functions = NULL;
+    PCI_SNAPSHOT_WALK Walk;
+    PCI_ECAM *Ecam;
+    EFI_HANDLE *HandleBuf = NULL;
+    EFI_STATUS Status;
+    BOOLEAN IsEnd;
+    UINT16 MinBus, MaxBus;
+    UINTN HandleCount = 0;
+    UINTN FunctionCount = 0;
+    UINT64 Start;
+    VOID *Interface;
+
+    ZeroMem( Snapshot, sizeof(*Snapshot) );
+    Snapshot->Method = Method;
+    gRT->GetTime( &Snapshot->Time, NULL );
+
+    Status = gBS->LocateProtocol( &gEfiPciEnumerationCompleteProtocolGuid,
+                                  NULL,
+                                  &Interface );
+    if (EFI_ERROR(Status)) {
+        return EFI_NOT_READY;
+    }
+
+    Ecam = AllocateZeroPool( sizeof(PCI_ECAM) );
+    if (Ecam == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    Snapshot->EcamTable = Ecam;
+
+    // no MCFG table just means every read goes through the protocol
+    if (EFI_ERROR(PciEcamLocate( Ecam )) && Method == PciAccessEcam) {
+        return EFI_UNSUPPORTED;
+    }
+    if (Method == PciAccessProtocol || Method == PciAccessPciIo) {
+        Ecam->RegionCount = 0;
+    }
+    Snapshot->EcamRegions = Ecam->RegionCount;
+
+    Start = AsmReadTsc();
+
+    if (Method == PciAccessPciIo) {
+        Status = PciIoCollect( &Functions, &FunctionCount, &Snapshot->Stats );
+        if (EFI_ERROR(Status)) {
+            goto Done;
+        }
+    }
+
+    Status = gBS->LocateHandleBuffer( ByProtocol,
+                                      &gEfiPciRootBridgeIoProtocolGuid,
+                                      NULL,
+                                      &HandleCount,
+                                      &HandleBuf );
+    if (EFI_ERROR(Status)) {
+        goto Done;
+    }
+
+    for (UINTN Index = 0; Index < HandleCount; Index++) {
+        Status = PciGetProtocolAndResource( HandleBuf[Index],
+                                            &IoDev,
+                                            &Descriptors );
+        if (EFI_ERROR(Status)) {
+            goto Done;
+        }
+
+        while (TRUE) {
+            Status = PciGetNextBusRange( &Descriptors, &MinBus, &MaxBus, &IsEnd );
+            if (EFI_ERROR(Status) || IsEnd) {
+                break;
+            }
+
+            Status = PciSnapshotAddRoot( Snapshot, IoDev, MinBus, MaxBus );
+            if (EFI_ERROR(Status) || Descriptors == NULL) {
+                break;
+            }
+        }
+        if (EFI_ERROR(Status)) {
+            goto Done;
+        }
+    }
+
+    if ((Flags & PCI_SNAPSHOT_PARALLEL) != 0) {
+        Status = PciSnapshotWalkParallel( Snapshot, Flags );
+        if (Status != EFI_UNSUPPORTED) {
+            goto Done;
+        }
+    }
+
+    Snapshot->Stats.Processors = 1;
+    Status = EFI_SUCCESS;
+    for (UINTN i = 0; i < Snapshot->RootCount && !EFI_ERROR(Status); i++) {
+        PciSnapshotInitWalk( &Walk, Snapshot, i, Functions, FunctionCount, Flags );
+        Status = PciSnapshotWalkRoot( &Walk, Snapshot->Roots[i].MinBus, Snapshot->Roots[i].MaxBus );
+    }
+
+Done:
+    Snapshot->Stats.Ticks = AsmReadTsc() - Start;
+
+    if (HandleBuf != NULL) {
+        FreePool( HandleBuf );
+    }
+    if (Functions != NULL) {
+        FreePool( Functions );
+    }
+
+    return Status;
+}
+
+
+//
+// Read config space of a function in the snapshot. Offsets of 256 and
+// above are extended config space. A loaded snapshot is read from the
+// saved copy.
+//
+EFI_STATUS
+PciSnapshotReadConfig( PCI_SNAPSHOT *Snapshot,
+                       CONST PCI_SNAPSHOT_DEVICE *Device,
+                       EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_WIDTH Width,
+                       UINT32 Offset,
+                       UINTN Count,
+                       VOID *Buffer )
+{
+    UINTN Size;
+
+    if (Snapshot->Image != NULL) {
+        if (Width > EfiPciWidthUint64) {
+            return EFI_UNSUPPORTED;
+        }
+        Size = Count << (Width & 0x03);
+        if (Offset + Size > PCI_SNAPSHOT_EXTENDED_SIZE) {
+            return EFI_INVALID_PARAMETER;
+        }
+        CopyMem( Buffer, Device->Extended + Offset, Size );
+        return EFI_SUCCESS;
+    }
+
+    return PciConfigRead( &Snapshot->Stats,
+                          &Snapshot->Roots[Device->Root],
+                          Width,
+                          EFI_PCI_ADDRESS( Device->Bus, Device->Device, Device->Function, Offset ),
+                          Count,
+                          Buffer );
+}
+
+
+//
+// Read the whole 4 KB config space of a function into Device->Extended.
+// Conventional PCI functions, and root bridges that cannot reach
+// extended config space, read as all ones above 256 bytes.
+//
+EFI_STATUS
+PciSnapshotReadExtended( PCI_SNAPSHOT *Snapshot,
+                         PCI_SNAPSHOT_DEVICE *Device )
+{
+    EFI_STATUS Status;
+
+    if (Device->Extended != NULL) {
+        return EFI_SUCCESS;
+    }
+
+    Device->Extended = AllocatePool( PCI_SNAPSHOT_EXTENDED_SIZE );
+    if (Device->Extended == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    Status = PciSnapshotReadConfig( Snapshot, Device, EfiPciWidthUint32, 0,
+                                    PCI_MAX_CONFIG_OFFSET / sizeof(UINT32),
+                                    Device->Extended );
+    if (EFI_ERROR(Status)) {
+        FreePool( Device->Extended );
+        Device->Extended = NULL;
+        return Status;
+    }
+
+    Status = PciSnapshotReadConfig( Snapshot, Device, EfiPciWidthUint32, PCI_MAX_CONFIG_OFFSET,
+                                    (PCI_SNAPSHOT_EXTENDED_SIZE - PCI_MAX_CONFIG_OFFSET) / sizeof(UINT32),
+                                    Device->Extended + PCI_MAX_CONFIG_OFFSET );
+    if (EFI_ERROR(Status)) {
+        SetMem( Device->Extended + PCI_MAX_CONFIG_OFFSET,
+                PCI_SNAPSHOT_EXTENDED_SIZE - PCI_MAX_CONFIG_OFFSET, 0xff );
+    }
+
+    return EFI_SUCCESS;
+}
+
+
+//
+// Convert TSC ticks to microseconds. The TSC rate is measured once,
+// against a 10ms stall, on first use.
+//
+UINT64
+PciSnapshotTicksToMicroseconds( UINT64 Ticks )
+{
+    STATIC UINT64 TicksPerUs = 0;
+    UINT64 Start;
+
+    if (TicksPerUs == 0) {
+        Start = AsmReadTsc();
+        gBS->Stall( 10000 );
+        TicksPerUs = DivU64x32( AsmReadTsc() - Start, 10000 );
+        if (TicksPerUs == 0) {
+            TicksPerUs = 1;
+        }
+    }
+
+    return DivU64x64Remainder( Ticks, TicksPerUs, NULL );
+}
+
+
+VOID
+PciSnapshotFree( PCI_SNAPSHOT *Snapshot )
+{
+    for (UINTN i = 0; i < Snapshot->DeviceCount && Snapshot->Image == NULL; i++) {
+        if (Snapshot->Devices[i].Extended != NULL) {
+            FreePool( Snapshot->Devices[i].Extended );
+        }
+    }
+    if (Snapshot->Image != NULL) {
+        FreePool( Snapshot->Image );
+    }
+    if (Snapshot->Devices != NULL) {
+        FreePool( Snapshot->Devices );
+    }
+    if (Snapshot->Roots != NULL) {
+        FreePool( Snapshot->Roots );
+    }
+    if (Snapshot->EcamTable != NULL) {
+        FreePool( Snapshot->EcamTable );
+    }
+
+    ZeroMem( Snapshot, sizeof(*Snapshot) );
+}
@@ -0,0 +1,272 @@
+//
+//  Copyright (c) 2019   Finnbarr P. Murphy.   All rights reserved.
+//
+//  Host test and benchmark of the lodepng checksums. lodepng_crc32
+//  and lodepng_adler32 are first checked against byte at a time
+//  versions for every length up to 4K at each offset within 16 bytes,
+//  and Adler-32 also over a full screenshot in uneven pieces, then
+//  both are timed over buffers from chunk header to full screenshot
+//  size. Results are one "key value" per line.
+//
+//  Build from the ScreenShot directory:
+//
+//    gcc -O2 -I. -o ChecksumBench Host/ChecksumBench.c lodepng.c
+//
+//  Add -DLODEPNG_NO_COMPILE_SIMD to test and time the portable code.
+//
+//  Usage: ChecksumBench [-n iterations]
+//
+//  License: BSD 2 clause license applies.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lodepng.h"
+
+#define DEFAULT_ITERATIONS  5
+#define MAX_TEST_LENGTH     4096
+#define MAX_BENCH_LENGTH    (3840 * 2160 * 4)
+
+static const size_t BenchLengths[] = { 17, 4096, 1 << 20, MAX_BENCH_LENGTH };
+
+static unsigned CrcTable[256];
+
+
+static double
+NowMs( void )
+{
+    struct timespec Now;
+
+    clock_gettime( CLOCK_MONOTONIC, &Now );
+    return (double)Now.tv_sec * 1e3 + (double)Now.tv_nsec / 1e6;
+}
+
+
+static void
+MakeCrcTable( void )
+{
+    unsigned Crc;
+
+    for (unsigned n = 0; n < 256; n++) {
+        Crc = n;
+        for (int k = 0; k < 8; k++) {
+            Crc = (Crc >> 1) ^ (0xedb88320u & (0u - (Crc & 1)));
+        }
+        CrcTable[n] = Crc;
+    }
+}
+
+
+//
+// The byte at a time loop lodepng_crc32 used to be
+//
+static unsigned
+ReferenceCrc32( const unsigned char *Data,
+                size_t Length )
+{
+    unsigned Crc = 0xffffffffu;
+
+    for (size_t i = 0; i < Length; i++) {
+        Crc = CrcTable[(Crc ^ Data[i]) & 0xff] ^ (Crc >> 8);
+    }
+    return Crc ^ 0xffffffffu;
+}
+
+
+//
+// The Adler-32 loop update_adler32 used to be
+//
+static unsigned
+ReferenceAdler32( unsigned Adler,
+                  const unsigned char *Data,
+                  size_t Length )
+{
+    unsigned s1 = Adler & 0xffff;
+    unsigned s2 = Adler >> 16;
+    size_t   Amount;
+
+    while (Length > 0) {
+        Amount = Length < 5552 ? Length : 5552;
+        Length -= Amount;
+        while (Amount-- > 0) {
+            s1 += *Data++;
+            s2 += s1;
+        }
+        s1 %= 65521;
+        s2 %= 65521;
+    }
+    return (s2 << 16) | s1;
+}
+
+
+static unsigned
+Adler32( const unsigned char *Data,
+         size_t Length )
+{
+    return lodepng_adler32( 1, Data, Length );
+}
+
+
+static unsigned
+ReferenceAdler32Start( const unsigned char *Data,
+                       size_t Length )
+{
+    return ReferenceAdler32( 1, Data, Length );
+}
+
+
+static int
+TestCrc32( const unsigned char *Buffer )
+{
+    for (size_t Offset = 0; Offset < 16; Offset++) {
+        for (size_t Length = 0; Length <= MAX_TEST_LENGTH; Length++) {
+            if (lodepng_crc32( Buffer + Offset, Length ) != ReferenceCrc32( Buffer + Offset, Length )) {
+                fprintf( stderr, "ERROR: crc32 differs, length %zu offset %zu\n", Length, Offset );
+                return 1;
+            }
+        }
+    }
+    if (lodepng_crc32( (const unsigned char *)"123456789", 9 ) != 0xcbf43926u) {
+        fprintf( stderr, "ERROR: crc32 check value\n" );
+        return 1;
+    }
+
+    printf( "crc32_test ok\n" );
+    return 0;
+}
+
+
+//
+// All 0xff bytes as well, the largest sums between two modulos
+//
+static int
+TestAdler32( const unsigned char *Buffer )
+{
+    static unsigned char Ones[MAX_TEST_LENGTH * 32];
+    unsigned             Adler;
+    size_t               Done;
+    size_t               Piece;
+
+    for (size_t Offset = 0; Offset < 16; Offset++) {
+        for (size_t Length = 0; Length <= MAX_TEST_LENGTH; Length++) {
+            if (Adler32( Buffer + Offset, Length ) != ReferenceAdler32( 1, Buffer + Offset, Length )) {
+                fprintf( stderr, "ERROR: adler32 differs, length %zu offset %zu\n", Length, Offset );
+                return 1;
+            }
+        }
+    }
+
+    memset( Ones, 0xff, sizeof(Ones) );
+    for (size_t Length = 0; Length <= sizeof(Ones); Length += 61) {
+        if (Adler32( Ones, Length ) != ReferenceAdler32( 1, Ones, Length )) {
+            fprintf( stderr, "ERROR: adler32 differs on 0xff bytes, length %zu\n", Length );
+            return 1;
+        }
+    }
+
+    // a whole screenshot in pieces, continuing from the previous checksum
+    Adler = 1;
+    Piece = 1;
+    for (Done = 0; Done < MAX_BENCH_LENGTH; Done += Piece) {
+        Piece = (Piece * 7 + 1) % 100003;
+        if (Piece > MAX_BENCH_LENGTH - Done) {
+            Piece = MAX_BENCH_LENGTH - Done;
+        }
+        Adler = lodepng_adler32( Adler, Buffer + Done, Piece );
+    }
+    if (Adler != ReferenceAdler32( 1, Buffer, MAX_BENCH_LENGTH )) {
+        fprintf( stderr, "ERROR: adler32 differs in pieces\n" );
+        return 1;
+    }
+    if (Adler32( (const unsigned char *)"Wikipedia", 9 ) != 0x11e60398u) {
+        fprintf( stderr, "ERROR: adler32 check value\n" );
+        return 1;
+    }
+
+    printf( "adler32_test ok\n" );
+    return 0;
+}
+
+
+//
+// Best of Iterations, repeating short lengths up to about 1MB a run
+//
+static double
+TimeMbs( unsigned (*Checksum)( const unsigned char *, size_t ),
+         const unsigned char *Buffer,
+         size_t Length,
+         int Iterations )
+{
+    size_t            Repeat = Length < (1 << 20) ? (1 << 20) / Length : 1;
+    volatile unsigned Sink = 0;
+    double            Best = 0;
+    double            Ms;
+
+    for (int i = 0; i < Iterations; i++) {
+        Ms = NowMs();
+        for (size_t r = 0; r < Repeat; r++) {
+            Sink += Checksum( Buffer, Length );
+        }
+        Ms = NowMs() - Ms;
+        if (i == 0 || Ms < Best) {
+            Best = Ms;
+        }
+    }
+    (void)Sink;
+
+    return (double)Length * Repeat / 1e6 / (Best / 1e3);
+}
+
+
+int
+main( int argc,
+      char **argv )
+{
+    unsigned char *Buffer;
+    unsigned      Seed = 1;
+    int           Iterations = DEFAULT_ITERATIONS;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp( argv[i], "-n" ) == 0 && i + 1 < argc) {
+            Iterations = atoi( argv[++i] );
+            if (Iterations < 1) {
+                Iterations = 1;
+            }
+        }
+    }
+
+    Buffer = malloc( MAX_BENCH_LENGTH );
+    if (Buffer == NULL) {
+        fprintf( stderr, "ERROR: out of memory\n" );
+        return 1;
+    }
+    for (size_t i = 0; i < MAX_BENCH_LENGTH; i++) {
+        Seed = Seed * 1103515245 + 12345;
+        Buffer[i] = (unsigned char)(Seed >> 24);
+    }
+    MakeCrcTable();
+
+    if (TestCrc32( Buffer ) != 0 || TestAdler32( Buffer ) != 0) {
+        free( Buffer );
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(BenchLengths) / sizeof(BenchLengths[0]); i++) {
+        printf( "crc32_%zu_mb_s %.0f\n", BenchLengths[i],
+                TimeMbs( lodepng_crc32, Buffer, BenchLengths[i], Iterations ) );
+        printf( "crc32_reference_%zu_mb_s %.0f\n", BenchLengths[i],
+                TimeMbs( ReferenceCrc32, Buffer, BenchLengths[i], Iterations ) );
+    }
+    for (size_t i = 0; i < sizeof(BenchLengths) / sizeof(BenchLengths[0]); i++) {
+        printf( "adler32_%zu_mb_s %.0f\n", BenchLengths[i],
+                TimeMbs( Adler32, Buffer, BenchLengths[i], Iterations ) );
+        printf( "adler32_reference_%zu_mb_s %.0f\n", BenchLengths[i],
+                TimeMbs( ReferenceAdler32Start, Buffer, BenchLengths[i], Iterations ) );
+    }
+
+    free( Buffer );
+    return 0;
+}
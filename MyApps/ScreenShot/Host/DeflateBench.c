@@ -0,0 +1,250 @@
+//
+//  Copyright (c) 2019   Finnbarr P. Murphy.   All rights reserved.
+//
+//  Host benchmark of the lodepng compression settings used by
+//  ScreenShot and ScreenshotDriver. Each image is encoded with every
+//  setting and the deflate speed, in MB/s of filtered image data, and
+//  compression ratio are reported, one "key value" per line.
+//
+//  Build from the ScreenShot directory:
+//
+//    gcc -O2 -I. -o DeflateBench Host/DeflateBench.c lodepng.c
+//
+//  Usage: DeflateBench [image.png ...] [-n iterations]
+//
+//  Without an image a 1920x1080 desktop-like test image is used.
+//
+//  License: BSD 2 clause license applies.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lodepng.h"
+
+#define DEFAULT_ITERATIONS  3
+#define TEST_WIDTH          1920
+#define TEST_HEIGHT         1080
+
+typedef struct {
+    const char  *Name;
+    unsigned    FastMatch;
+    unsigned    WindowSize;
+} BENCH_SETTING;
+
+static const BENCH_SETTING Settings[] = {
+    { "default",   0, 2048 },
+    { "window32k", 0, 32768 },
+    { "fast",      1, 2048 },
+    { "fast32k",   1, 32768 },
+};
+
+//
+// Filled in by the custom_zlib wrapper, so deflate is timed apart
+// from filtering and the PNG chunks
+//
+typedef struct {
+    size_t      InSize;
+    size_t      OutSize;
+    double      Ms;
+} BENCH_ZLIB;
+
+
+static double
+NowMs( void )
+{
+    struct timespec Now;
+
+    clock_gettime( CLOCK_MONOTONIC, &Now );
+    return (double)Now.tv_sec * 1e3 + (double)Now.tv_nsec / 1e6;
+}
+
+
+static unsigned
+TimedZlib( unsigned char **Out,
+           size_t *OutSize,
+           const unsigned char *In,
+           size_t InSize,
+           const LodePNGCompressSettings *Settings )
+{
+    BENCH_ZLIB *Zlib = (BENCH_ZLIB *)Settings->custom_context;
+    double     Start = NowMs();
+    unsigned   Error;
+
+    Error = lodepng_zlib_compress( Out, OutSize, In, InSize, Settings );
+    Zlib->Ms += NowMs() - Start;
+    Zlib->InSize += InSize;
+    Zlib->OutSize += *OutSize;
+
+    return Error;
+}
+
+
+//
+// Title bars, text on flat backgrounds, a gradient and a photo-like
+// noisy area, roughly what a firmware or desktop screenshot holds
+//
+static unsigned char *
+TestImage( unsigned Width,
+           unsigned Height )
+{
+    unsigned char *Image = malloc( (size_t)Width * Height * 4 );
+    unsigned char *Pixel;
+    unsigned      Seed = 1;
+
+    if (Image == NULL) {
+        return NULL;
+    }
+    for (unsigned y = 0; y < Height; y++) {
+        for (unsigned x = 0; x < Width; x++) {
+            Pixel = Image + 4 * ((size_t)y * Width + x);
+            Seed = Seed * 1103515245 + 12345;
+            if (y % 270 < 24) {
+                Pixel[0] = 0x20; Pixel[1] = 0x40; Pixel[2] = 0x80;
+            } else if (x < Width / 2) {
+                // glyph-like strokes on white
+                int Ink = ((x / 3) % 3 == 0 && (y / 2) % 9 < 6 && ((x / 9 + y / 18) % 4) != 0);
+                Pixel[0] = Pixel[1] = Pixel[2] = Ink ? 0x10 : 0xff;
+            } else if (y < Height / 2) {
+                Pixel[0] = (unsigned char)(x * 255 / Width);
+                Pixel[1] = (unsigned char)(y * 255 / Height);
+                Pixel[2] = 0x60;
+            } else {
+                Pixel[0] = (unsigned char)(x + (Seed >> 28));
+                Pixel[1] = (unsigned char)(y + (Seed >> 26 & 7));
+                Pixel[2] = (unsigned char)((x ^ y) + (Seed >> 24 & 15));
+            }
+            Pixel[3] = 0xff;
+        }
+    }
+
+    return Image;
+}
+
+
+static int
+BenchImage( const char *Label,
+            const unsigned char *Image,
+            unsigned Width,
+            unsigned Height,
+            int Iterations )
+{
+    LodePNGState   State;
+    BENCH_ZLIB     Zlib;
+    BENCH_ZLIB     Best;
+    unsigned char  *Png;
+    unsigned char  *Decoded;
+    unsigned       DecodedWidth;
+    unsigned       DecodedHeight;
+    size_t         PngSize;
+    double         Start;
+    double         EncodeMs;
+    unsigned       Error;
+
+    printf( "image %s %ux%u\n", Label, Width, Height );
+
+    for (size_t s = 0; s < sizeof(Settings) / sizeof(Settings[0]); s++) {
+        EncodeMs = 0;
+        memset( &Best, 0, sizeof(Best) );
+        for (int i = 0; i < Iterations; i++) {
+            memset( &Zlib, 0, sizeof(Zlib) );
+            lodepng_state_init( &State );
+            State.info_raw.colortype = LCT_RGBA;
+            State.info_png.color.colortype = LCT_RGBA;
+            State.encoder.zlibsettings.fastmatch = Settings[s].FastMatch;
+            State.encoder.zlibsettings.windowsize = Settings[s].WindowSize;
+            State.encoder.zlibsettings.custom_zlib = TimedZlib;
+            State.encoder.zlibsettings.custom_context = &Zlib;
+
+            Png = NULL;
+            Start = NowMs();
+            Error = lodepng_encode( &Png, &PngSize, Image, Width, Height, &State );
+            Start = NowMs() - Start;
+            lodepng_state_cleanup( &State );
+            if (Error) {
+                fprintf( stderr, "ERROR: %s: encode: %s\n", Settings[s].Name, lodepng_error_text( Error ) );
+                return 1;
+            }
+
+            // every setting must give back the same pixels
+            if (i == 0) {
+                Error = lodepng_decode32( &Decoded, &DecodedWidth, &DecodedHeight, Png, PngSize );
+                if (Error || DecodedWidth != Width || DecodedHeight != Height ||
+                    memcmp( Decoded, Image, (size_t)Width * Height * 4 ) != 0) {
+                    fprintf( stderr, "ERROR: %s: image does not round trip\n", Settings[s].Name );
+                    return 1;
+                }
+                free( Decoded );
+            }
+            free( Png );
+
+            if (i == 0 || Start < EncodeMs) {
+                EncodeMs = Start;
+            }
+            if (i == 0 || Zlib.Ms < Best.Ms) {
+                Best = Zlib;
+            }
+        }
+
+        printf( "%s_encode_ms %.1f\n", Settings[s].Name, EncodeMs );
+        printf( "%s_deflate_ms %.1f\n", Settings[s].Name, Best.Ms );
+        printf( "%s_deflate_mb_s %.1f\n", Settings[s].Name,
+                (double)Best.InSize / 1e6 / (Best.Ms / 1e3) );
+        printf( "%s_zlib_bytes %zu\n", Settings[s].Name, Best.OutSize );
+        printf( "%s_ratio %.2f\n", Settings[s].Name, (double)Best.InSize / (double)Best.OutSize );
+    }
+
+    return 0;
+}
+
+
+int
+main( int argc,
+      char **argv )
+{
+    unsigned char *Image;
+    unsigned      Width;
+    unsigned      Height;
+    unsigned      Error;
+    int           Iterations = DEFAULT_ITERATIONS;
+    int           Images = 0;
+    int           Result = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp( argv[i], "-n" ) == 0 && i + 1 < argc) {
+            Iterations = atoi( argv[++i] );
+            if (Iterations < 1) {
+                Iterations = 1;
+            }
+        }
+    }
+
+    for (int i = 1; i < argc && Result == 0; i++) {
+        if (strcmp( argv[i], "-n" ) == 0) {
+            i++;
+            continue;
+        }
+        Error = lodepng_decode32_file( &Image, &Width, &Height, argv[i] );
+        if (Error) {
+            fprintf( stderr, "ERROR: %s: %s\n", argv[i], lodepng_error_text( Error ) );
+            return 1;
+        }
+        Result = BenchImage( argv[i], Image, Width, Height, Iterations );
+        free( Image );
+        Images++;
+    }
+
+    if (Images == 0) {
+        Image = TestImage( TEST_WIDTH, TEST_HEIGHT );
+        if (Image == NULL) {
+            fprintf( stderr, "ERROR: out of memory\n" );
+            return 1;
+        }
+        Result = BenchImage( "test", Image, TEST_WIDTH, TEST_HEIGHT, Iterations );
+        free( Image );
+    }
+
+    return Result;
+}
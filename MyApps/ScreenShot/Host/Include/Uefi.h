@@ -0,0 +1,62 @@
+//
+//  Copyright (c) 2019   Finnbarr P. Murphy.   All rights reserved.
+//
+//  Thin host shim so that PixelConvert.c builds as a Linux program.
+//  Only the EDK2 types, macros and BaseLib functions it uses are
+//  provided.
+//
+//  License: BSD 2 clause license applies.
+//
+
+#ifndef _HOST_UEFI_H_
+#define _HOST_UEFI_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <cpuid.h>
+
+typedef uint8_t     UINT8;
+typedef uint16_t    UINT16;
+typedef uint32_t    UINT32;
+typedef uint64_t    UINT64;
+typedef int32_t     INT32;
+typedef int64_t     INT64;
+typedef uintptr_t   UINTN;
+typedef intptr_t    INTN;
+typedef uint8_t     BOOLEAN;
+typedef void        VOID;
+
+#define CONST       const
+#define STATIC      static
+#define EFIAPI
+#define TRUE        ((BOOLEAN)1)
+#define FALSE       ((BOOLEAN)0)
+
+#define BIT1        0x00000002
+#define BIT2        0x00000004
+#define BIT5        0x00000020
+#define BIT19       0x00080000
+#define BIT27       0x08000000
+#define BIT28       0x10000000
+
+// BaseLib
+static inline UINT32
+AsmCpuidEx( UINT32 Index, UINT32 SubIndex, UINT32 *Eax, UINT32 *Ebx, UINT32 *Ecx, UINT32 *Edx )
+{
+    UINT32 Regs[4];
+
+    __cpuid_count( Index, SubIndex, Regs[0], Regs[1], Regs[2], Regs[3] );
+    if (Eax != NULL) *Eax = Regs[0];
+    if (Ebx != NULL) *Ebx = Regs[1];
+    if (Ecx != NULL) *Ecx = Regs[2];
+    if (Edx != NULL) *Edx = Regs[3];
+    return Index;
+}
+
+static inline UINT32
+AsmCpuid( UINT32 Index, UINT32 *Eax, UINT32 *Ebx, UINT32 *Ecx, UINT32 *Edx )
+{
+    return AsmCpuidEx( Index, 0, Eax, Ebx, Ecx, Edx );
+}
+
+#endif // _HOST_UEFI_H_
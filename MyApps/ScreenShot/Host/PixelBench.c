@@ -0,0 +1,269 @@
+//
+//  Copyright (c) 2019   Finnbarr P. Murphy.   All rights reserved.
+//
+//  Host test and benchmark of the PixelConvert.c kernels. Every kernel
+//  the CPU supports is first checked against the scalar code for many
+//  lengths and alignments, including that nothing is written past the
+//  end of the output, then timed on a full screen of pixels. Results
+//  are one "key value" per line. Framebuffer reads are from ordinary
+//  memory here, so they show the cost of the code, not of the uncached
+//  reads a real framebuffer has.
+//
+//  Build from the ScreenShot directory:
+//
+//    gcc -O2 -IHost/Include -I. -o PixelBench Host/PixelBench.c PixelConvert.c
+//
+//  Usage: PixelBench [-n iterations] [width height]
+//
+//  License: BSD 2 clause license applies.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <Uefi.h>
+
+#include "PixelConvert.h"
+
+#define DEFAULT_ITERATIONS  20
+#define DEFAULT_WIDTH       1920
+#define DEFAULT_HEIGHT      1080
+#define MAX_TEST_PIXELS     300
+#define GUARD_BYTES         64
+#define GUARD_VALUE         0xa5
+
+static const char *KernelNames[PixelKernelMax] = {
+    "scalar",
+    "sse2",
+    "sse41",
+    "avx2"
+};
+
+
+static double
+NowMs( void )
+{
+    struct timespec Now;
+
+    clock_gettime( CLOCK_MONOTONIC, &Now );
+    return (double)Now.tv_sec * 1e3 + (double)Now.tv_nsec / 1e6;
+}
+
+
+static void
+RandomPixels( UINT32 *Pixels,
+              size_t Count,
+              unsigned *Seed )
+{
+    for (size_t i = 0; i < Count; i++) {
+        *Seed = *Seed * 1103515245 + 12345;
+        Pixels[i] = (*Seed >> 16) | (*Seed << 16);
+    }
+}
+
+
+//
+// Each kernel at every length up to MAX_TEST_PIXELS and at each
+// 4 byte offset within a vector, against the scalar kernel
+//
+static int
+TestKernel( PIXEL_KERNEL Kernel )
+{
+    UINT32    Source[MAX_TEST_PIXELS + 8];
+    UINT32    Expect[MAX_TEST_PIXELS + 8];
+    UINT32    Actual[MAX_TEST_PIXELS + 8];
+    UINT8     ExpectBgr[MAX_TEST_PIXELS * 3 + GUARD_BYTES + 32];
+    UINT8     ActualBgr[MAX_TEST_PIXELS * 3 + GUARD_BYTES + 32];
+    UINT32    FrameBuffer[MAX_TEST_PIXELS + 16] __attribute__((aligned(64)));
+    unsigned  Seed = 1;
+
+    for (size_t Offset = 0; Offset < 8; Offset++) {
+        for (size_t Count = 0; Count <= MAX_TEST_PIXELS; Count++) {
+            RandomPixels( Source, MAX_TEST_PIXELS + 8, &Seed );
+
+            memcpy( Expect, Source, sizeof(Source) );
+            memcpy( Actual, Source, sizeof(Source) );
+            PixelBgraToRgba( PixelKernelScalar, Expect + Offset, Count );
+            PixelBgraToRgba( Kernel, Actual + Offset, Count );
+            if (memcmp( Expect, Actual, sizeof(Expect) ) != 0) {
+                fprintf( stderr, "ERROR: %s: rgba differs, count %zu offset %zu\n",
+                         KernelNames[Kernel], Count, Offset );
+                return 1;
+            }
+
+            memset( ExpectBgr, GUARD_VALUE, sizeof(ExpectBgr) );
+            memset( ActualBgr, GUARD_VALUE, sizeof(ActualBgr) );
+            PixelBgraToBgr( PixelKernelScalar, ExpectBgr + Offset, Source + Offset, Count );
+            PixelBgraToBgr( Kernel, ActualBgr + Offset, Source + Offset, Count );
+            if (memcmp( ExpectBgr, ActualBgr, sizeof(ExpectBgr) ) != 0) {
+                fprintf( stderr, "ERROR: %s: bgr differs, count %zu offset %zu\n",
+                         KernelNames[Kernel], Count, Offset );
+                return 1;
+            }
+        }
+    }
+
+    // framebuffer reads from each pixel of a cache line, in both orders
+    for (size_t Offset = 0; Offset < 16; Offset++) {
+        for (size_t Count = 0; Count <= MAX_TEST_PIXELS; Count++) {
+            for (BOOLEAN Rgb = FALSE; Rgb <= TRUE; Rgb++) {
+                RandomPixels( FrameBuffer, MAX_TEST_PIXELS + 16, &Seed );
+
+                memset( Expect, GUARD_VALUE, sizeof(Expect) );
+                memset( Actual, GUARD_VALUE, sizeof(Actual) );
+                PixelReadFrameBuffer( PixelKernelScalar, Expect, FrameBuffer + Offset, Count, Rgb );
+                PixelReadFrameBuffer( Kernel, Actual, FrameBuffer + Offset, Count, Rgb );
+                if (memcmp( Expect, Actual, sizeof(Expect) ) != 0) {
+                    fprintf( stderr, "ERROR: %s: framebuffer read differs, count %zu offset %zu rgb %u\n",
+                             KernelNames[Kernel], Count, Offset, Rgb );
+                    return 1;
+                }
+            }
+        }
+    }
+
+    // the scalar kernel itself, against the byte loops it replaced
+    if (Kernel == PixelKernelScalar) {
+        UINT8 *Byte = (UINT8 *)Source;
+
+        RandomPixels( Source, MAX_TEST_PIXELS, &Seed );
+        memcpy( Actual, Source, MAX_TEST_PIXELS * 4 );
+        PixelBgraToRgba( Kernel, Actual, MAX_TEST_PIXELS );
+        PixelBgraToBgr( Kernel, ActualBgr, Source, MAX_TEST_PIXELS );
+        PixelReadFrameBuffer( Kernel, Expect, Source, MAX_TEST_PIXELS, TRUE );
+        for (size_t i = 0; i < MAX_TEST_PIXELS; i++) {
+            UINT8 *Rgba = (UINT8 *)(Actual + i);
+
+            if (Rgba[0] != Byte[4 * i + 2] || Rgba[1] != Byte[4 * i + 1] ||
+                Rgba[2] != Byte[4 * i] || Rgba[3] != 0xff ||
+                ActualBgr[3 * i] != Byte[4 * i] || ActualBgr[3 * i + 1] != Byte[4 * i + 1] ||
+                ActualBgr[3 * i + 2] != Byte[4 * i + 2] ||
+                Expect[i] != (UINT32)(Byte[4 * i + 2] | (Byte[4 * i + 1] << 8) | (Byte[4 * i] << 16) |
+                                      (Byte[4 * i + 3] << 24))) {
+                fprintf( stderr, "ERROR: scalar: pixel %zu wrong\n", i );
+                return 1;
+            }
+        }
+    }
+
+    printf( "%s_test ok\n", KernelNames[Kernel] );
+    return 0;
+}
+
+
+//
+// Best of Iterations, in MB/s of BGRA input, over a whole screen for
+// RGBA and framebuffer reads and row by row, as PrepareBMPFile does,
+// for BGR
+//
+static int
+BenchKernel( PIXEL_KERNEL Kernel,
+             UINT32 *Pixels,
+             UINT32 *Copy,
+             UINT8 *Bgr,
+             unsigned Width,
+             unsigned Height,
+             int Iterations )
+{
+    size_t Count = (size_t)Width * Height;
+    size_t RowBytes = ((size_t)Width * 3 + 3) & ~(size_t)3;
+    double Best;
+    double Ms;
+
+    Best = 0;
+    for (int i = 0; i < Iterations; i++) {
+        Ms = NowMs();
+        PixelBgraToRgba( Kernel, Pixels, Count );
+        Ms = NowMs() - Ms;
+        if (i == 0 || Ms < Best) {
+            Best = Ms;
+        }
+    }
+    printf( "%s_rgba_ms %.3f\n", KernelNames[Kernel], Best );
+    printf( "%s_rgba_mb_s %.0f\n", KernelNames[Kernel], (double)Count * 4 / 1e6 / (Best / 1e3) );
+
+    Best = 0;
+    for (int i = 0; i < Iterations; i++) {
+        Ms = NowMs();
+        for (unsigned y = 0; y < Height; y++) {
+            PixelBgraToBgr( Kernel, Bgr + y * RowBytes, Pixels + (size_t)(Height - 1 - y) * Width, Width );
+        }
+        Ms = NowMs() - Ms;
+        if (i == 0 || Ms < Best) {
+            Best = Ms;
+        }
+    }
+    printf( "%s_bgr_ms %.3f\n", KernelNames[Kernel], Best );
+    printf( "%s_bgr_mb_s %.0f\n", KernelNames[Kernel], (double)Count * 4 / 1e6 / (Best / 1e3) );
+
+    Best = 0;
+    for (int i = 0; i < Iterations; i++) {
+        Ms = NowMs();
+        PixelReadFrameBuffer( Kernel, Copy, Pixels, Count, FALSE );
+        Ms = NowMs() - Ms;
+        if (i == 0 || Ms < Best) {
+            Best = Ms;
+        }
+    }
+    printf( "%s_read_ms %.3f\n", KernelNames[Kernel], Best );
+    printf( "%s_read_mb_s %.0f\n", KernelNames[Kernel], (double)Count * 4 / 1e6 / (Best / 1e3) );
+
+    return 0;
+}
+
+
+int
+main( int argc,
+      char **argv )
+{
+    PIXEL_KERNEL  Best = PixelBestKernel();
+    UINT32        *Pixels;
+    UINT32        *Copy;
+    UINT8         *Bgr;
+    unsigned      Width = DEFAULT_WIDTH;
+    unsigned      Height = DEFAULT_HEIGHT;
+    unsigned      Seed = 1;
+    int           Iterations = DEFAULT_ITERATIONS;
+    int           Result = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp( argv[i], "-n" ) == 0 && i + 1 < argc) {
+            Iterations = atoi( argv[++i] );
+            if (Iterations < 1) {
+                Iterations = 1;
+            }
+        } else if (i + 1 < argc) {
+            Width = (unsigned)atoi( argv[i++] );
+            Height = (unsigned)atoi( argv[i] );
+        }
+    }
+
+    printf( "best_kernel %s\n", KernelNames[Best] );
+    for (unsigned k = PixelKernelScalar; k <= (unsigned)Best && Result == 0; k++) {
+        Result = TestKernel( (PIXEL_KERNEL)k );
+    }
+    if (Result != 0) {
+        return Result;
+    }
+
+    Pixels = aligned_alloc( 64, ((size_t)Width * Height * 4 + 63) & ~(size_t)63 );
+    Copy = malloc( (size_t)Width * Height * 4 );
+    Bgr = malloc( (((size_t)Width * 3 + 3) & ~(size_t)3) * Height );
+    if (Pixels == NULL || Copy == NULL || Bgr == NULL) {
+        fprintf( stderr, "ERROR: out of memory\n" );
+        return 1;
+    }
+    RandomPixels( Pixels, (size_t)Width * Height, &Seed );
+
+    printf( "image %ux%u\n", Width, Height );
+    for (unsigned k = PixelKernelScalar; k <= (unsigned)Best; k++) {
+        BenchKernel( (PIXEL_KERNEL)k, Pixels, Copy, Bgr, Width, Height, Iterations );
+    }
+
+    free( Bgr );
+    free( Copy );
+    free( Pixels );
+    return 0;
+}
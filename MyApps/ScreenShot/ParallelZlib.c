@@ -0,0 +1,451 @@
+//
+//  Copyright (c) 2019   Finnbarr P. Murphy.   All rights reserved.
+//
+//  Zlib compression of the filtered PNG image data on all processors
+//
+//  License: BSD 2 clause license applies.
+//
+//  As in pigz, the data is cut into fixed size chunks that are deflated
+//  independently. Every chunk but the last ends with an empty stored
+//  block, so it ends on a byte boundary and the chunks can simply be
+//  concatenated. All of the data is there from the start, so each
+//  chunk is deflated with the window before it as history and nothing
+//  is lost at the chunk boundaries.
+//
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/SynchronizationLib.h>
+
+#include <Protocol/MpService.h>
+
+#include "ParallelZlib.h"
+
+//
+// An AP cannot allocate memory, so lodepng allocates from a fixed
+// arena on each processor that compresses, emptied for every chunk.
+// A chunk with 32KB of history takes about 1.4MB of it. The compressed
+// chunk is copied to a fixed slot; one that does not fit, or runs out
+// of arena, is compressed again on the BSP. The arenas and slots are
+// allocated for the first part of a stream and kept until the last,
+// and no more than 8 processors compress, so the arenas take 16MB at
+// most.
+//
+#define PARALLEL_ZLIB_ARENA_SIZE    SIZE_2MB
+#define PARALLEL_ZLIB_MAX_WORKERS   8
+#define PARALLEL_ZLIB_SLOT_SIZE     (PARALLEL_ZLIB_CHUNK_SIZE + PARALLEL_ZLIB_CHUNK_SIZE / 8 + SIZE_1KB)
+
+//
+// One chunk, compressed by whichever processor claims it
+//
+typedef struct {
+    CONST UINT8     *In;
+    UINTN           InSize;
+    UINTN           History;        // bytes before In that matches may refer to
+    UINT8           *Data;          // the chunk's slot, or pool if compressed on the BSP
+    UINTN           Size;
+    BOOLEAN         Done;
+} PARALLEL_ZLIB_TASK;
+
+typedef struct {
+    PARALLEL_ZLIB_TASK              *Tasks;
+    UINT32                          TaskCount;
+    volatile UINT32                 NextTask;
+    volatile UINT32                 Workers;        // processors that claimed an arena
+    volatile UINT32                 Busy;           // processors that compressed a chunk
+    UINT32                          TaskCapacity;   // of Tasks and Slots
+    UINT8                           *Slots;
+    UINT32                          ArenaCount;
+    LodePNGArena                    *Arenas;
+    LodePNGArena                    **ArenaOf;      // by processor number
+    UINTN                           ProcessorCount;
+    EFI_MP_SERVICES_PROTOCOL        *MpServices;
+    CONST LodePNGCompressSettings   *Settings;
+    BOOLEAN                         Last;           // the last chunk ends the deflate stream
+} PARALLEL_ZLIB_WORK;
+
+STATIC PARALLEL_ZLIB_WORK *mWork;
+
+
+//
+// lodepng_arena hook: the arena of the calling processor
+//
+STATIC
+LodePNGArena *
+ParallelZlibArena( VOID )
+{
+    UINTN Number;
+
+    if (EFI_ERROR(mWork->MpServices->WhoAmI( mWork->MpServices, &Number )) ||
+        Number >= mWork->ProcessorCount) {
+        return NULL;
+    }
+
+    return mWork->ArenaOf[Number];
+}
+
+
+//
+// Deflate one chunk, the last one with the final block if Work->Last
+//
+STATIC
+unsigned
+ParallelZlibDeflate( PARALLEL_ZLIB_WORK *Work,
+                     UINT32 Index,
+                     UINT8 **Data,
+                     UINTN *Size )
+{
+    PARALLEL_ZLIB_TASK *Task = &Work->Tasks[Index];
+
+    *Data = NULL;
+    *Size = 0;
+
+    return lodepng_deflate_part( Data, Size, Task->In - Task->History, Task->History,
+                                 Task->History + Task->InSize, Work->Settings,
+                                 Work->Last && Index == Work->TaskCount - 1 );
+}
+
+
+//
+// Runs on the BSP and on every AP. Each processor with an arena claims
+// chunks until none are left, so the BSP compresses everything alone if
+// no AP starts. Nothing here may call a boot service.
+//
+STATIC
+VOID
+EFIAPI
+ParallelZlibWorker( VOID *Buffer )
+{
+    PARALLEL_ZLIB_WORK *Work = (PARALLEL_ZLIB_WORK *)Buffer;
+    PARALLEL_ZLIB_TASK *Task;
+    LodePNGArena *Arena;
+    BOOLEAN Counted = FALSE;
+    UINT8 *Data;
+    UINTN Size;
+    UINTN Number;
+    UINT32 Slot;
+    UINT32 Index;
+
+    if (EFI_ERROR(Work->MpServices->WhoAmI( Work->MpServices, &Number )) ||
+        Number >= Work->ProcessorCount) {
+        return;
+    }
+    Slot = InterlockedIncrement( &Work->Workers ) - 1;
+    if (Slot >= Work->ArenaCount) {
+        return;
+    }
+    Arena = &Work->Arenas[Slot];
+    Work->ArenaOf[Number] = Arena;
+
+    while ((Index = InterlockedIncrement( &Work->NextTask ) - 1) < Work->TaskCount) {
+        if (!Counted) {
+            InterlockedIncrement( &Work->Busy );
+            Counted = TRUE;
+        }
+        Task = &Work->Tasks[Index];
+
+        // a chunk that ran out of arena may not report it, so check
+        Arena->used = 0;
+        Arena->full = 0;
+        if (ParallelZlibDeflate( Work, Index, &Data, &Size ) == 0 &&
+            !Arena->full && Size <= PARALLEL_ZLIB_SLOT_SIZE) {
+            CopyMem( Task->Data, Data, Size );
+            Task->Size = Size;
+            Task->Done = TRUE;
+        }
+    }
+}
+
+
+//
+// Free the arenas and slots of a stream
+//
+STATIC
+VOID
+ParallelZlibWorkFree( PARALLEL_ZLIB_WORK *Work )
+{
+    if (Work->Arenas != NULL) {
+        for (UINT32 i = 0; i < Work->ArenaCount; i++) {
+            if (Work->Arenas[i].data != NULL) {
+                FreePool( Work->Arenas[i].data );
+            }
+        }
+        FreePool( Work->Arenas );
+    }
+    if (Work->ArenaOf != NULL) {
+        FreePool( Work->ArenaOf );
+    }
+    if (Work->Tasks != NULL) {
+        FreePool( Work->Tasks );
+    }
+    if (Work->Slots != NULL) {
+        FreePool( Work->Slots );
+    }
+    FreePool( Work );
+}
+
+
+//
+// The arenas of the stream, allocated on its first part, with tasks
+// and slots for at least TaskCount chunks. Returns EFI_UNSUPPORTED
+// when the part has to be compressed serially instead, also when there
+// is not the memory for them; the serial deflate needs much less.
+//
+STATIC
+EFI_STATUS
+ParallelZlibWorkGet( PARALLEL_ZLIB_STREAM *Stream,
+                     UINT32 TaskCount,
+                     PARALLEL_ZLIB_WORK **Result )
+{
+    EFI_GUID gEfiMpServiceProtocolGuid = EFI_MP_SERVICES_PROTOCOL_GUID;
+    EFI_MP_SERVICES_PROTOCOL *MpServices;
+    PARALLEL_ZLIB_WORK *Work = Stream->Work;
+    EFI_STATUS Status;
+    UINTN ProcessorCount;
+    UINTN EnabledCount;
+
+    if (Work == NULL) {
+        Status = gBS->LocateProtocol( &gEfiMpServiceProtocolGuid,
+                                      NULL,
+                                      (VOID **)&MpServices );
+        if (EFI_ERROR(Status)) {
+            return EFI_UNSUPPORTED;
+        }
+        Status = MpServices->GetNumberOfProcessors( MpServices, &ProcessorCount, &EnabledCount );
+        if (EFI_ERROR(Status) || EnabledCount < 2) {
+            return EFI_UNSUPPORTED;
+        }
+
+        Work = AllocateZeroPool( sizeof(PARALLEL_ZLIB_WORK) );
+        if (Work == NULL) {
+            return EFI_UNSUPPORTED;
+        }
+        Work->MpServices = MpServices;
+        Work->ProcessorCount = ProcessorCount;
+        Work->ArenaCount = (UINT32)MIN( MIN( EnabledCount, PARALLEL_ZLIB_MAX_WORKERS ), TaskCount );
+        Work->Arenas = AllocateZeroPool( Work->ArenaCount * sizeof(LodePNGArena) );
+        Work->ArenaOf = AllocateZeroPool( ProcessorCount * sizeof(LodePNGArena *) );
+        if (Work->Arenas == NULL || Work->ArenaOf == NULL) {
+            ParallelZlibWorkFree( Work );
+            return EFI_UNSUPPORTED;
+        }
+        for (UINT32 i = 0; i < Work->ArenaCount; i++) {
+            Work->Arenas[i].data = AllocatePool( PARALLEL_ZLIB_ARENA_SIZE );
+            if (Work->Arenas[i].data == NULL) {
+                ParallelZlibWorkFree( Work );
+                return EFI_UNSUPPORTED;
+            }
+            Work->Arenas[i].size = PARALLEL_ZLIB_ARENA_SIZE;
+        }
+        Stream->Work = Work;
+    }
+
+    // parts are usually the same size, so this happens once
+    if (TaskCount > Work->TaskCapacity) {
+        if (Work->Tasks != NULL) {
+            FreePool( Work->Tasks );
+        }
+        if (Work->Slots != NULL) {
+            FreePool( Work->Slots );
+        }
+        Work->TaskCapacity = 0;
+        Work->Tasks = AllocatePool( TaskCount * sizeof(PARALLEL_ZLIB_TASK) );
+        Work->Slots = AllocatePool( TaskCount * PARALLEL_ZLIB_SLOT_SIZE );
+        if (Work->Tasks == NULL || Work->Slots == NULL) {
+            // give the arenas back too, for the serial deflate
+            ParallelZlibWorkFree( Work );
+            Stream->Work = NULL;
+            return EFI_UNSUPPORTED;
+        }
+        Work->TaskCapacity = TaskCount;
+    }
+
+    *Result = Work;
+    return EFI_SUCCESS;
+}
+
+
+//
+// Deflate In[Start..InSize-1] on the application processors, as
+// lodepng_deflate_part() does. The stream's Overlap, if not NULL, is
+// called on the BSP while the APs run. Returns EFI_UNSUPPORTED when
+// the data has to be compressed serially instead.
+//
+STATIC
+EFI_STATUS
+ParallelZlibRun( unsigned char **Out,
+                 size_t *OutSize,
+                 CONST unsigned char *In,
+                 size_t Start,
+                 size_t InSize,
+                 BOOLEAN Last,
+                 CONST LodePNGCompressSettings *Settings,
+                 PARALLEL_ZLIB_STREAM *Stream )
+{
+    PARALLEL_ZLIB_STATS *Stats = &Stream->Stats;
+    PARALLEL_ZLIB_WORK *Work;
+    PARALLEL_ZLIB_TASK *Task;
+    EFI_STATUS Status;
+    EFI_EVENT Event = NULL;
+    UINT8 *Buffer;
+    UINT8 *Data;
+    UINT32 TaskCount;
+    UINTN Size;
+    UINTN Index;
+    UINTN Offset;
+
+    if (InSize - Start < 2 * PARALLEL_ZLIB_CHUNK_SIZE) {
+        return EFI_UNSUPPORTED;
+    }
+
+    TaskCount = (UINT32)((InSize - Start + PARALLEL_ZLIB_CHUNK_SIZE - 1) / PARALLEL_ZLIB_CHUNK_SIZE);
+    Status = ParallelZlibWorkGet( Stream, TaskCount, &Work );
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    Work->TaskCount = TaskCount;
+    Work->NextTask = 0;
+    Work->Workers = 0;
+    Work->Busy = 0;
+    Work->Settings = Settings;
+    Work->Last = Last;
+    ZeroMem( Work->ArenaOf, Work->ProcessorCount * sizeof(LodePNGArena *) );
+    ZeroMem( Work->Tasks, TaskCount * sizeof(PARALLEL_ZLIB_TASK) );
+    for (UINT32 i = 0; i < TaskCount; i++) {
+        Task = &Work->Tasks[i];
+        Offset = Start + (UINTN)i * PARALLEL_ZLIB_CHUNK_SIZE;
+        Task->In = In + Offset;
+        Task->InSize = MIN( InSize - Offset, PARALLEL_ZLIB_CHUNK_SIZE );
+        Task->History = MIN( Offset, Settings->windowsize );
+        Task->Data = Work->Slots + (UINTN)i * PARALLEL_ZLIB_SLOT_SIZE;
+    }
+
+    // the BSP does the caller's other work, then takes chunks too while
+    // the APs run, then waits for them
+    mWork = Work;
+    lodepng_arena = ParallelZlibArena;
+    Status = gBS->CreateEvent( 0, TPL_CALLBACK, NULL, NULL, &Event );
+    if (!EFI_ERROR(Status)) {
+        Status = Work->MpServices->StartupAllAPs( Work->MpServices,
+                                                  ParallelZlibWorker,
+                                                  FALSE,
+                                                  Event,
+                                                  0,
+                                                  Work,
+                                                  NULL );
+    }
+    if (!EFI_ERROR(Status) && Stream->Overlap != NULL) {
+        Stream->Overlap( Stream->OverlapContext );
+    }
+    ParallelZlibWorker( Work );
+    if (!EFI_ERROR(Status)) {
+        gBS->WaitForEvent( 1, &Event, &Index );
+    }
+    lodepng_arena = NULL;
+    mWork = NULL;
+
+    // chunks that did not fit an arena or slot are compressed again here
+    Size = 0;
+    for (UINT32 i = 0; i < TaskCount; i++) {
+        Task = &Work->Tasks[i];
+        if (!Task->Done) {
+            if (ParallelZlibDeflate( Work, i, &Data, &Task->Size ) != 0) {
+                lodepng_free( Data );
+                Status = EFI_OUT_OF_RESOURCES;
+                goto Done;
+            }
+            Task->Data = Data;
+            Stats->Retried++;
+        }
+        Size += Task->Size;
+    }
+
+    Buffer = lodepng_malloc( Size );
+    if (Buffer == NULL) {
+        Status = EFI_OUT_OF_RESOURCES;
+        goto Done;
+    }
+
+    Size = 0;
+    for (UINT32 i = 0; i < TaskCount; i++) {
+        Task = &Work->Tasks[i];
+        CopyMem( Buffer + Size, Task->Data, Task->Size );
+        Size += Task->Size;
+    }
+
+    *Out = Buffer;
+    *OutSize = Size;
+    Stats->Processors = MAX( Stats->Processors, MAX( Work->Busy, 1 ) );
+    Stats->Chunks += TaskCount;
+    Status = EFI_SUCCESS;
+
+Done:
+    if (Event != NULL) {
+        gBS->CloseEvent( Event );
+    }
+    for (UINT32 i = 0; i < TaskCount; i++) {
+        Task = &Work->Tasks[i];
+        if (Task->Data != NULL && Task->Data != Work->Slots + (UINTN)i * PARALLEL_ZLIB_SLOT_SIZE) {
+            lodepng_free( Task->Data );
+        }
+    }
+
+    return Status;
+}
+
+
+//
+// Deflate part of a stream on all processors, or with lodepng on the
+// BSP alone when MP services are not there, there is only one
+// processor, the part is too small to be worth splitting, or the
+// arenas and slots cannot be allocated. Stats are added to, not reset.
+//
+unsigned
+ParallelZlibDeflatePart( unsigned char **Out,
+                         size_t *OutSize,
+                         CONST unsigned char *In,
+                         size_t Start,
+                         size_t InSize,
+                         CONST LodePNGCompressSettings *Settings,
+                         unsigned Last )
+{
+    PARALLEL_ZLIB_STREAM *Stream = (PARALLEL_ZLIB_STREAM *)Settings->custom_context;
+    PARALLEL_ZLIB_STREAM Ignored;
+    PARALLEL_ZLIB_STATS *Stats;
+    EFI_STATUS Status;
+
+    if (Stream == NULL) {
+        ZeroMem( &Ignored, sizeof(Ignored) );
+        Stream = &Ignored;
+    }
+    Stats = &Stream->Stats;
+
+    Status = ParallelZlibRun( Out, OutSize, In, Start, InSize, (BOOLEAN)(Last != 0), Settings, Stream );
+    if (Stream == &Ignored) {
+        ParallelZlibStreamFree( Stream );
+    }
+    if (Status == EFI_UNSUPPORTED) {
+        Stats->Processors = MAX( Stats->Processors, 1 );
+        Stats->Chunks++;
+        return lodepng_deflate_part( Out, OutSize, In, Start, InSize, Settings, Last );
+    }
+
+    return EFI_ERROR(Status) ? 83 : 0;     // 83 is lodepng's memory allocation failed
+}
+
+
+//
+// Free the arenas and slots kept in the stream
+//
+VOID
+ParallelZlibStreamFree( PARALLEL_ZLIB_STREAM *Stream )
+{
+    if (Stream->Work != NULL) {
+        ParallelZlibWorkFree( (PARALLEL_ZLIB_WORK *)Stream->Work );
+        Stream->Work = NULL;
+    }
+}
@@ -0,0 +1,65 @@
+//
+//  Copyright (c) 2019   Finnbarr P. Murphy.   All rights reserved.
+//
+//  Zlib compression of the filtered PNG image data on all processors
+//
+//  License: BSD 2 clause license applies.
+//
+
+#ifndef _PARALLELZLIB_H_
+#define _PARALLELZLIB_H_
+
+#include "lodepng.h"
+
+//
+// Filtered data is cut into chunks of this size, each deflated on its
+// own by whichever processor claims it
+//
+#define PARALLEL_ZLIB_CHUNK_SIZE    SIZE_128KB
+
+typedef struct {
+    UINTN   Processors;         // processors that compressed a chunk, 1 if serial
+    UINTN   Chunks;
+    UINTN   Retried;            // chunks compressed again on the BSP
+} PARALLEL_ZLIB_STATS;
+
+//
+// Called on the BSP once the APs have started on a part, before the
+// BSP compresses chunks too, so that other work such as reading the
+// next band of the image is done meanwhile. Boot services may be used.
+//
+typedef VOID (*PARALLEL_ZLIB_OVERLAP)( VOID *Context );
+
+typedef struct {
+    PARALLEL_ZLIB_STATS     Stats;
+    PARALLEL_ZLIB_OVERLAP   Overlap;            // may be NULL
+    VOID                    *OverlapContext;
+    VOID                    *Work;              // arenas and slots, kept from part to part
+} PARALLEL_ZLIB_STREAM;
+
+//
+// A LodePNGCompressSettings custom_deflate_part function, for the
+// streaming encoder. custom_context may point to a PARALLEL_ZLIB_STREAM;
+// its Stats are added to, so zero it before the first part, and pass it
+// to ParallelZlibStreamFree() after the last. Overlap is not called when
+// a part is compressed on the BSP alone.
+//
+// Meanwhile the stream keeps up to 16MB of arenas, and slots for the
+// compressed chunks of about 1.1 times the largest part.
+//
+unsigned
+ParallelZlibDeflatePart( unsigned char **Out,
+                         size_t *OutSize,
+                         CONST unsigned char *In,
+                         size_t Start,
+                         size_t InSize,
+                         CONST LodePNGCompressSettings *Settings,
+                         unsigned Last );
+
+//
+// Free what ParallelZlibDeflatePart() kept in the stream
+//
+VOID
+ParallelZlibStreamFree( PARALLEL_ZLIB_STREAM *Stream );
+
+#endif // _PARALLELZLIB_H_
@@ -0,0 +1,420 @@
+//
+//  Copyright (c) 2019   Finnbarr P. Murphy.   All rights reserved.
+//
+//  Conversion of captured BGRA pixels for the PNG and BMP encoders,
+//  and reading them from the linear framebuffer
+//
+//  License: BSD 2 clause license applies.
+//
+//  SSE2 is always there on X64. AVX2 is only used when CPUID reports
+//  it and the firmware has enabled the YMM state in XCR0, which many
+//  do not, so SSE4.1 is a kernel of its own for the streaming loads.
+//  Pixels left over after the last full vector are done with the
+//  scalar code.
+//
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+
+// GCC and Clang pull in stdlib.h for _mm_malloc(), which is not used
+#define _MM_MALLOC_H_INCLUDED
+#define __MM_MALLOC_H
+#include <immintrin.h>
+
+#include "PixelConvert.h"
+
+//
+// Per function, so the module needs no extra compiler flags
+//
+#if defined(__GNUC__)
+#define TARGET_SSE2     __attribute__((target("sse2")))
+#define TARGET_SSE41    __attribute__((target("sse4.1")))
+#define TARGET_AVX2     __attribute__((target("avx2")))
+#else
+#define TARGET_SSE2
+#define TARGET_SSE41
+#define TARGET_AVX2
+#endif
+
+#define CPUID_FEATURES              1
+#define CPUID_EXTENDED_FEATURES     7
+#define CPUID_ECX_SSE41             BIT19
+#define CPUID_ECX_OSXSAVE           BIT27
+#define CPUID_ECX_AVX               BIT28
+#define CPUID_EBX_AVX2              BIT5
+#define XCR0_SSE_AVX_STATE          (BIT1 | BIT2)
+
+#define ALPHA_OPAQUE                0xff000000
+
+// Streaming loads read a whole cache line at a time
+#define CACHE_LINE_SIZE             64
+
+
+STATIC
+UINT64
+ReadXcr0( VOID )
+{
+#if defined(_MSC_VER)
+    return _xgetbv( 0 );
+#else
+    UINT32 Low;
+    UINT32 High;
+
+    __asm__ __volatile__ ( "xgetbv" : "=a" (Low), "=d" (High) : "c" (0) );
+    return ((UINT64)High << 32) | Low;
+#endif
+}
+
+
+PIXEL_KERNEL
+PixelBestKernel( VOID )
+{
+    STATIC BOOLEAN      Checked = FALSE;
+    STATIC PIXEL_KERNEL Best = PixelKernelSse2;
+    UINT32 MaxLeaf;
+    UINT32 Ebx;
+    UINT32 Ecx;
+
+    if (Checked) {
+        return Best;
+    }
+    Checked = TRUE;
+
+    AsmCpuid( 0, &MaxLeaf, NULL, NULL, NULL );
+    AsmCpuid( CPUID_FEATURES, NULL, NULL, &Ecx, NULL );
+    if ((Ecx & CPUID_ECX_SSE41) != 0) {
+        Best = PixelKernelSse41;
+    }
+    if (MaxLeaf < CPUID_EXTENDED_FEATURES) {
+        return Best;
+    }
+    if ((Ecx & (CPUID_ECX_OSXSAVE | CPUID_ECX_AVX)) != (CPUID_ECX_OSXSAVE | CPUID_ECX_AVX) ||
+        (ReadXcr0() & XCR0_SSE_AVX_STATE) != XCR0_SSE_AVX_STATE) {
+        return Best;
+    }
+    AsmCpuidEx( CPUID_EXTENDED_FEATURES, 0, NULL, &Ebx, NULL, NULL );
+    if ((Ebx & CPUID_EBX_AVX2) != 0) {
+        Best = PixelKernelAvx2;
+    }
+
+    return Best;
+}
+
+
+STATIC
+VOID
+BgraToRgbaScalar( UINT32 *Pixels,
+                  UINTN Count )
+{
+    UINT32 Pixel;
+
+    for (UINTN i = 0; i < Count; i++) {
+        Pixel = Pixels[i];
+        Pixels[i] = (Pixel & 0x0000ff00) | ((Pixel >> 16) & 0xff) | ((Pixel & 0xff) << 16) | ALPHA_OPAQUE;
+    }
+}
+
+
+//
+// No byte shuffle in SSE2, so red and blue are moved with shifts
+//
+STATIC
+TARGET_SSE2
+UINTN
+BgraToRgbaSse2( UINT32 *Pixels,
+                UINTN Count )
+{
+    CONST __m128i Green = _mm_set1_epi32( 0x0000ff00 );
+    CONST __m128i Low = _mm_set1_epi32( 0x000000ff );
+    CONST __m128i Alpha = _mm_set1_epi32( (INT32)ALPHA_OPAQUE );
+    __m128i *Vector;
+    __m128i Value;
+    UINTN i;
+
+    for (i = 0; i + 4 <= Count; i += 4) {
+        Vector = (__m128i *)(Pixels + i);
+        Value = _mm_loadu_si128( Vector );
+        Value = _mm_or_si128( _mm_or_si128( _mm_and_si128( Value, Green ), Alpha ),
+                              _mm_or_si128( _mm_and_si128( _mm_srli_epi32( Value, 16 ), Low ),
+                                            _mm_slli_epi32( _mm_and_si128( Value, Low ), 16 ) ) );
+        _mm_storeu_si128( Vector, Value );
+    }
+
+    return i;
+}
+
+
+STATIC
+TARGET_AVX2
+UINTN
+BgraToRgbaAvx2( UINT32 *Pixels,
+                UINTN Count )
+{
+    CONST __m256i Shuffle = _mm256_setr_epi8( 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                              2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15 );
+    CONST __m256i Alpha = _mm256_set1_epi32( (INT32)ALPHA_OPAQUE );
+    __m256i *Vector;
+    __m256i Value0;
+    __m256i Value1;
+    UINTN i;
+
+    for (i = 0; i + 16 <= Count; i += 16) {
+        Vector = (__m256i *)(Pixels + i);
+        Value0 = _mm256_loadu_si256( Vector );
+        Value1 = _mm256_loadu_si256( Vector + 1 );
+        _mm256_storeu_si256( Vector, _mm256_or_si256( _mm256_shuffle_epi8( Value0, Shuffle ), Alpha ) );
+        _mm256_storeu_si256( Vector + 1, _mm256_or_si256( _mm256_shuffle_epi8( Value1, Shuffle ), Alpha ) );
+    }
+
+    return i;
+}
+
+
+VOID
+PixelBgraToRgba( PIXEL_KERNEL Kernel,
+                 UINT32 *Pixels,
+                 UINTN Count )
+{
+    UINTN Done = 0;
+
+    if (Kernel == PixelKernelAvx2) {
+        Done = BgraToRgbaAvx2( Pixels, Count );
+    }
+    if (Kernel >= PixelKernelSse2) {
+        Done += BgraToRgbaSse2( Pixels + Done, Count - Done );
+    }
+    BgraToRgbaScalar( Pixels + Done, Count - Done );
+}
+
+
+STATIC
+VOID
+BgraToBgrScalar( UINT8 *Bgr,
+                 CONST UINT32 *Pixels,
+                 UINTN Count )
+{
+    for (UINTN i = 0; i < Count; i++) {
+        *Bgr++ = (UINT8)Pixels[i];
+        *Bgr++ = (UINT8)(Pixels[i] >> 8);
+        *Bgr++ = (UINT8)(Pixels[i] >> 16);
+    }
+}
+
+
+//
+// Each 64 bit half packs its two pixels into 6 bytes, then the high
+// half is moved down next to the low one. A 16 byte store writes 4
+// bytes past the 12 of the 4 pixels, so only while 2 more follow.
+//
+STATIC
+TARGET_SSE2
+UINTN
+BgraToBgrSse2( UINT8 *Bgr,
+               CONST UINT32 *Pixels,
+               UINTN Count )
+{
+    CONST __m128i First = _mm_set1_epi64x( 0x0000000000ffffffULL );
+    CONST __m128i Second = _mm_set1_epi64x( 0x0000ffffff000000ULL );
+    CONST __m128i LowHalf = _mm_set_epi32( 0, 0, 0x0000ffff, (INT32)0xffffffff );
+    __m128i Value;
+    UINTN i;
+
+    for (i = 0; i + 6 <= Count; i += 4) {
+        Value = _mm_loadu_si128( (CONST __m128i *)(Pixels + i) );
+        Value = _mm_or_si128( _mm_and_si128( Value, First ),
+                              _mm_and_si128( _mm_srli_epi64( Value, 8 ), Second ) );
+        Value = _mm_or_si128( _mm_and_si128( Value, LowHalf ),
+                              _mm_andnot_si128( LowHalf, _mm_srli_si128( Value, 2 ) ) );
+        _mm_storeu_si128( (__m128i *)(Bgr + i * 3), Value );
+    }
+
+    return i;
+}
+
+
+//
+// Each 128 bit lane packs its 4 pixels into 12 bytes, and a permute
+// joins the lanes. The 32 byte store writes 8 bytes past the 24 of the
+// 8 pixels, so only while 3 more follow.
+//
+STATIC
+TARGET_AVX2
+UINTN
+BgraToBgrAvx2( UINT8 *Bgr,
+               CONST UINT32 *Pixels,
+               UINTN Count )
+{
+    CONST __m256i Shuffle = _mm256_setr_epi8( 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                              0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1 );
+    CONST __m256i Permute = _mm256_setr_epi32( 0, 1, 2, 4, 5, 6, 7, 7 );
+    __m256i Value;
+    UINTN i;
+
+    for (i = 0; i + 11 <= Count; i += 8) {
+        Value = _mm256_loadu_si256( (CONST __m256i *)(Pixels + i) );
+        Value = _mm256_permutevar8x32_epi32( _mm256_shuffle_epi8( Value, Shuffle ), Permute );
+        _mm256_storeu_si256( (__m256i *)(Bgr + i * 3), Value );
+    }
+
+    return i;
+}
+
+
+VOID
+PixelBgraToBgr( PIXEL_KERNEL Kernel,
+                UINT8 *Bgr,
+                CONST UINT32 *Pixels,
+                UINTN Count )
+{
+    UINTN Done = 0;
+
+    if (Kernel == PixelKernelAvx2) {
+        Done = BgraToBgrAvx2( Bgr, Pixels, Count );
+    }
+    if (Kernel >= PixelKernelSse2) {
+        Done += BgraToBgrSse2( Bgr + Done * 3, Pixels + Done, Count - Done );
+    }
+    BgraToBgrScalar( Bgr + Done * 3, Pixels + Done, Count - Done );
+}
+
+
+STATIC
+VOID
+ReadFrameBufferScalar( UINT32 *Pixels,
+                       CONST UINT32 *FrameBuffer,
+                       UINTN Count,
+                       BOOLEAN Rgb )
+{
+    UINT32 Pixel;
+
+    for (UINTN i = 0; i < Count; i++) {
+        Pixel = FrameBuffer[i];
+        if (Rgb) {
+            Pixel = (Pixel & 0xff00ff00) | ((Pixel >> 16) & 0xff) | ((Pixel & 0xff) << 16);
+        }
+        Pixels[i] = Pixel;
+    }
+}
+
+
+STATIC
+TARGET_SSE2
+UINTN
+ReadFrameBufferSse2( UINT32 *Pixels,
+                     CONST UINT32 *FrameBuffer,
+                     UINTN Count,
+                     BOOLEAN Rgb )
+{
+    CONST __m128i GreenReserved = _mm_set1_epi32( (INT32)0xff00ff00 );
+    CONST __m128i Low = _mm_set1_epi32( 0x000000ff );
+    __m128i Value;
+    UINTN i;
+
+    for (i = 0; i + 4 <= Count; i += 4) {
+        Value = _mm_loadu_si128( (CONST __m128i *)(FrameBuffer + i) );
+        if (Rgb) {
+            Value = _mm_or_si128( _mm_and_si128( Value, GreenReserved ),
+                                  _mm_or_si128( _mm_and_si128( _mm_srli_epi32( Value, 16 ), Low ),
+                                                _mm_slli_epi32( _mm_and_si128( Value, Low ), 16 ) ) );
+        }
+        _mm_storeu_si128( (__m128i *)(Pixels + i), Value );
+    }
+
+    return i;
+}
+
+
+//
+// A cache line at a time, FrameBuffer aligned to 16 bytes
+//
+STATIC
+TARGET_SSE41
+UINTN
+ReadFrameBufferSse41( UINT32 *Pixels,
+                      CONST UINT32 *FrameBuffer,
+                      UINTN Count,
+                      BOOLEAN Rgb )
+{
+    CONST __m128i Swap = _mm_setr_epi8( 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15 );
+    __m128i *Source;
+    __m128i *Dest;
+    __m128i Value[4];
+    UINTN i;
+
+    for (i = 0; i + 16 <= Count; i += 16) {
+        Source = (__m128i *)(FrameBuffer + i);
+        Dest = (__m128i *)(Pixels + i);
+        for (UINTN k = 0; k < 4; k++) {
+            Value[k] = _mm_stream_load_si128( Source + k );
+        }
+        for (UINTN k = 0; k < 4; k++) {
+            _mm_storeu_si128( Dest + k, Rgb ? _mm_shuffle_epi8( Value[k], Swap ) : Value[k] );
+        }
+    }
+
+    return i;
+}
+
+
+//
+// A cache line at a time, FrameBuffer aligned to 32 bytes
+//
+STATIC
+TARGET_AVX2
+UINTN
+ReadFrameBufferAvx2( UINT32 *Pixels,
+                     CONST UINT32 *FrameBuffer,
+                     UINTN Count,
+                     BOOLEAN Rgb )
+{
+    CONST __m256i Swap = _mm256_setr_epi8( 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                           2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15 );
+    CONST __m256i *Source;
+    __m256i *Dest;
+    __m256i Value0;
+    __m256i Value1;
+    UINTN i;
+
+    for (i = 0; i + 16 <= Count; i += 16) {
+        Source = (CONST __m256i *)(FrameBuffer + i);
+        Dest = (__m256i *)(Pixels + i);
+        Value0 = _mm256_stream_load_si256( (__m256i *)Source );
+        Value1 = _mm256_stream_load_si256( (__m256i *)(Source + 1) );
+        if (Rgb) {
+            Value0 = _mm256_shuffle_epi8( Value0, Swap );
+            Value1 = _mm256_shuffle_epi8( Value1, Swap );
+        }
+        _mm256_storeu_si256( Dest, Value0 );
+        _mm256_storeu_si256( Dest + 1, Value1 );
+    }
+
+    return i;
+}
+
+
+VOID
+PixelReadFrameBuffer( PIXEL_KERNEL Kernel,
+                      UINT32 *Pixels,
+                      CONST UINT32 *FrameBuffer,
+                      UINTN Count,
+                      BOOLEAN Rgb )
+{
+    UINTN Done = 0;
+
+    // streaming loads must be aligned, so read up to a cache line first
+    if (Kernel >= PixelKernelSse41 && ((UINTN)FrameBuffer & 3) == 0) {
+        Done = ((0 - (UINTN)FrameBuffer) & (CACHE_LINE_SIZE - 1)) / sizeof(UINT32);
+        if (Done > Count) {
+            Done = Count;
+        }
+        ReadFrameBufferScalar( Pixels, FrameBuffer, Done, Rgb );
+        if (Kernel == PixelKernelAvx2) {
+            Done += ReadFrameBufferAvx2( Pixels + Done, FrameBuffer + Done, Count - Done, Rgb );
+        }
+        Done += ReadFrameBufferSse41( Pixels + Done, FrameBuffer + Done, Count - Done, Rgb );
+    }
+    if (Kernel >= PixelKernelSse2) {
+        Done += ReadFrameBufferSse2( Pixels + Done, FrameBuffer + Done, Count - Done, Rgb );
+    }
+    ReadFrameBufferScalar( Pixels + Done, FrameBuffer + Done, Count - Done, Rgb );
+}
@@ -0,0 +1,58 @@
+//
+//  Copyright (c) 2019   Finnbarr P. Murphy.   All rights reserved.
+//
+//  Conversion of captured BGRA pixels for the PNG and BMP encoders,
+//  and reading them from the linear framebuffer
+//
+//  License: BSD 2 clause license applies.
+//
+
+#ifndef _PIXELCONVERT_H_
+#define _PIXELCONVERT_H_
+
+//
+// Ordered, so every kernel below the best one also runs
+//
+typedef enum {
+    PixelKernelScalar = 0,
+    PixelKernelSse2,
+    PixelKernelSse41,
+    PixelKernelAvx2,
+    PixelKernelMax
+} PIXEL_KERNEL;
+
+PIXEL_KERNEL
+PixelBestKernel( VOID );
+
+//
+// BGRA (EFI_GRAPHICS_OUTPUT_BLT_PIXEL) to RGBA with alpha 0xff, in place
+//
+VOID
+PixelBgraToRgba( PIXEL_KERNEL Kernel,
+                 UINT32 *Pixels,
+                 UINTN Count );
+
+//
+// BGRA to packed 3 byte BGR, as in a BMP row
+//
+VOID
+PixelBgraToBgr( PIXEL_KERNEL Kernel,
+                UINT8 *Bgr,
+                CONST UINT32 *Pixels,
+                UINTN Count );
+
+//
+// Copy Count pixels from the linear framebuffer to BGRA, as
+// Gop->Blt() gives them. Rgb is for PixelRedGreenBlueReserved8BitPerColor
+// modes, whose red and blue are swapped. The framebuffer is read with
+// streaming loads from SSE4.1 on, which do not fill the caches with
+// data read only once.
+//
+VOID
+PixelReadFrameBuffer( PIXEL_KERNEL Kernel,
+                      UINT32 *Pixels,
+                      CONST UINT32 *FrameBuffer,
+                      UINTN Count,
+                      BOOLEAN Rgb );
+
+#endif // _PIXELCONVERT_H_
@@ -32,10 +32,14 @@
 
 #ifdef SAVE_AS_PNG
 #include "lodepng.h"
+#include "ParallelZlib.h"
 #else
 #include <IndustryStandard/Bmp.h>
 #endif
 
+#include "PixelConvert.h"
+#include "ScreenShotUtil.h"
+
 EFI_GRAPHICS_OUTPUT_BLT_PIXEL EfiGraphicsColors[16] = {
     // B    G    R   reserved
     {0x00, 0x00, 0x00, 0x00},  // BLACK
@@ -75,13 +79,33 @@ typedef enum {
     White
 } COLOR;
 
-#define UTILITY_VERSION L"20190314"
+#define UTILITY_VERSION L"20190424"
 #undef DEBUG
 
 
 // Determines the size of status square
 #define STATUS_SQUARE_SIDE 10
 
+// The screen is read, converted and encoded in bands of about this size
+#define CAPTURE_BAND_SIZE SIZE_2MB
+
+//
+// The region of the screen being captured, read a band of rows at a
+// time straight from the linear framebuffer when the mode has one in a
+// 32 bit format, else with Gop->Blt()
+//
+typedef struct {
+    EFI_GRAPHICS_OUTPUT_PROTOCOL *Gop;
+    UINTN                        StartX;
+    UINTN                        StartY;
+    UINTN                        Width;
+    UINTN                        Height;
+    CONST UINT32                 *FrameBuffer;  // top left of the region, NULL to use Blt
+    UINTN                        Stride;        // pixels from one scan line to the next
+    BOOLEAN                      Rgb;           // red and blue swapped from the Blt pixel
+    PIXEL_KERNEL                 Kernel;
+} CAPTURE;
+
 
 BOOLEAN
 IsUnicodeDecimalDigit( CHAR16 Char )
@@ -166,38 +190,59 @@ ShowStatus( EFI_GRAPHICS_OUTPUT_PROTOCOL *Gop,
 
 
 //
-// Save image to file
+// Open image file in the current directory for writing. FullPath is
+// for messages, free it after use.
 //
-EFI_STATUS 
-SaveImage( CHAR16 *FileName,
-           UINT8  *FileData,
-           UINTN  FileDataLength )
+EFI_STATUS
+OpenImage( CHAR16            *FileName,
+           SHELL_FILE_HANDLE *FileHandle,
+           CHAR16            **FullPath )
 {
-    SHELL_FILE_HANDLE FileHandle = NULL;
     EFI_STATUS        Status = EFI_SUCCESS;
     CONST CHAR16      *CurDir = NULL;
     CONST CHAR16      *PathName = NULL;
-    CHAR16            *FullPath = NULL;
     UINTN             Length = 0;
-    
+
+    *FullPath = NULL;
     CurDir = gEfiShellProtocol->GetCurDir(NULL);
     if (CurDir == NULL) {
         Print(L"ERROR: Cannot retrieve current directory\n");
 	return EFI_NOT_FOUND;
     }
     PathName = CurDir;
-    StrnCatGrow(&FullPath, &Length, PathName, 0);
-    StrnCatGrow(&FullPath, &Length, L"\\", 0);
-    StrnCatGrow(&FullPath, &Length, FileName, 0);
+    StrnCatGrow(FullPath, &Length, PathName, 0);
+    StrnCatGrow(FullPath, &Length, L"\\", 0);
+    StrnCatGrow(FullPath, &Length, FileName, 0);
 #ifdef DEBUG
-    Print(L"FullPath: [%s]\n", FullPath);
+    Print(L"FullPath: [%s]\n", *FullPath);
 #endif
 
-    Status = gEfiShellProtocol->OpenFileByName( FullPath,
-                                                &FileHandle,
+    Status = gEfiShellProtocol->OpenFileByName( *FullPath,
+                                                FileHandle,
                                                 EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE);
     if (EFI_ERROR(Status)) {
-        Print(L"ERROR: OpenFileByName [%s] [%d]\n", FullPath, Status);
+        Print(L"ERROR: OpenFileByName [%s] [%d]\n", *FullPath, Status);
+    }
+
+    return Status;
+}
+
+
+//
+// Save image to file
+//
+EFI_STATUS 
+SaveImage( CHAR16 *FileName,
+           UINT8  *FileData,
+           UINTN  FileDataLength )
+{
+    SHELL_FILE_HANDLE FileHandle = NULL;
+    EFI_STATUS        Status = EFI_SUCCESS;
+    CHAR16            *FullPath = NULL;
+
+    Status = OpenImage( FileName, &FileHandle, &FullPath );
+    if (EFI_ERROR(Status)) {
+        SHELL_FREE_NON_NULL( FullPath );
         return Status;
     } 
 
@@ -212,67 +257,328 @@ SaveImage( CHAR16 *FileName,
     } else {
         Print(L"Successfully saved image to %s\n", FullPath);
     }
+    SHELL_FREE_NON_NULL( FullPath );
 
     return Status;
 }
 
 
-#ifdef SAVE_AS_PNG
+//
+// Set up the capture of a region, from the framebuffer if the whole
+// region is inside it
+//
+STATIC
+VOID
+CaptureInit( CAPTURE *Capture,
+             EFI_GRAPHICS_OUTPUT_PROTOCOL *Gop,
+             UINTN StartX,
+             UINTN StartY,
+             UINTN Width,
+             UINTN Height )
+{
+    EFI_GRAPHICS_OUTPUT_MODE_INFORMATION *Info = Gop->Mode->Info;
+
+    Capture->Gop = Gop;
+    Capture->StartX = StartX;
+    Capture->StartY = StartY;
+    Capture->Width = Width;
+    Capture->Height = Height;
+    Capture->FrameBuffer = NULL;
+    Capture->Stride = Info->PixelsPerScanLine;
+    Capture->Rgb = (BOOLEAN)(Info->PixelFormat == PixelRedGreenBlueReserved8BitPerColor);
+    Capture->Kernel = PixelBestKernel();
+
+    if (Gop->Mode->FrameBufferBase != 0 &&
+        (Info->PixelFormat == PixelBlueGreenRedReserved8BitPerColor ||
+         Info->PixelFormat == PixelRedGreenBlueReserved8BitPerColor) &&
+        StartX + Width <= Info->HorizontalResolution &&
+        StartY + Height <= Info->VerticalResolution &&
+        Info->PixelsPerScanLine >= Info->HorizontalResolution &&
+        (StartY + Height) * Info->PixelsPerScanLine * sizeof(UINT32) <= Gop->Mode->FrameBufferSize) {
+        Capture->FrameBuffer = (CONST UINT32 *)(UINTN)Gop->Mode->FrameBufferBase +
+                               StartY * Info->PixelsPerScanLine + StartX;
+    }
+}
 
+
+//
+// Read Rows rows of the region, starting Y rows down, into Band
+//
+STATIC
 EFI_STATUS
-PreparePNGFile( EFI_GRAPHICS_OUTPUT_BLT_PIXEL *BltBuffer,
-                UINT32 Width,
-                UINT32 Height )
+CaptureBand( CAPTURE *Capture,
+             EFI_GRAPHICS_OUTPUT_BLT_PIXEL *Band,
+             UINTN Y,
+             UINTN Rows )
 {
-    UINTN           ImageSize;
-    UINTN           i;
-    UINT8           *PngFile;
-    UINTN           PngFileSize;
-    EFI_STATUS      Status;
-    EFI_TIME          Time;
-    CHAR16            FileName[40]; 
+    EFI_STATUS Status;
 
-    Status = EFI_SUCCESS;
+    if (Capture->FrameBuffer != NULL) {
+        for (UINTN Row = 0; Row < Rows; Row++) {
+            PixelReadFrameBuffer( Capture->Kernel, (UINT32 *)(Band + Row * Capture->Width),
+                                  Capture->FrameBuffer + (Y + Row) * Capture->Stride,
+                                  Capture->Width, Capture->Rgb );
+        }
+        return EFI_SUCCESS;
+    }
 
-    ImageSize = (Width * Height);
+    Status = Capture->Gop->Blt( Capture->Gop, Band, EfiBltVideoToBltBuffer,
+                                Capture->StartX, Capture->StartY + Y, 0, 0, Capture->Width, Rows, 0 );
+    if (EFI_ERROR(Status)) {
+        Print(L"ERROR: Gop->Blt [%d]\n", Status);
+    }
+
+    return Status;
+}
 
-    // Convert BGR to RGBA with Alpha set to 0xFF
-    for (i = 0; i < ImageSize; i++) {
-        UINT8 Temp;
 
-        Temp = BltBuffer[i].Blue;
+//
+// Read the whole region once through each path the mode allows and
+// print how long each took, to compare them
+//
+STATIC
+EFI_STATUS
+TimeCapture( CAPTURE *Capture )
+{
+    EFI_GRAPHICS_OUTPUT_BLT_PIXEL *Band;
+    CONST UINT32 *FrameBuffer = Capture->FrameBuffer;
+    EFI_STATUS   Status = EFI_SUCCESS;
+    UINTN        BandRows;
+    UINTN        Rows;
+    UINT64       Start;
+    UINT64       Us;
+
+    BandRows = MIN( MAX( CAPTURE_BAND_SIZE / (Capture->Width * sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL)), 1 ),
+                    Capture->Height );
+    Band = AllocatePool( BandRows * Capture->Width * sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL) );
+    if (Band == NULL) {
+        Print(L"ERROR: Band buffer. No memory resources\n");
+        return EFI_OUT_OF_RESOURCES;
+    }
 
-        BltBuffer[i].Blue = BltBuffer[i].Red;
-        BltBuffer[i].Red = Temp;
-        BltBuffer[i].Reserved = 0xFF;
+    if (FrameBuffer == NULL) {
+        Print(L"Capture framebuffer: not usable in this mode\n");
     }
+    for (UINTN Path = (FrameBuffer != NULL) ? 0 : 1; Path < 2 && !EFI_ERROR(Status); Path++) {
+        Capture->FrameBuffer = (Path == 0) ? FrameBuffer : NULL;
+
+        Start = AsmReadTsc();
+        for (UINTN y = 0; y < Capture->Height && !EFI_ERROR(Status); y += Rows) {
+            Rows = MIN( BandRows, Capture->Height - y );
+            Status = CaptureBand( Capture, Band, y, Rows );
+        }
+        Us = ScreenShotTicksToMicroseconds( AsmReadTsc() - Start );
 
-    // Encode raw RGB image to PNG format
-    PngFile = NULL;
-    i = lodepng_encode32(&PngFile, &PngFileSize, (CONST UINT8*)BltBuffer, Width, Height);
-    if (i == 0) {
-        Status = gRT->GetTime(&Time, NULL);
         if (!EFI_ERROR(Status)) {
-            UnicodeSPrint( FileName, 62, L"screenshot-%04d%02d%02d-%02d%02d%02d.png",
-                           Time.Year, Time.Month, Time.Day, Time.Hour, Time.Minute, Time.Second );
-        } else {
-            UnicodeSPrint( FileName, 30, L"screenshot.png" );
+            Print(L"Capture %s: %ld us, %ld MB/s\n", (Path == 0) ? L"framebuffer" : L"Blt", Us,
+                  DivU64x64Remainder( Capture->Width * Capture->Height * sizeof(UINT32), MAX( Us, 1 ), NULL ));
         }
+    }
+
+    Capture->FrameBuffer = FrameBuffer;
+    FreePool( Band );
+
+    return Status;
+}
+
+
+#ifdef SAVE_AS_PNG
 
-        SaveImage( FileName, PngFile, PngFileSize );
+//
+// The band to be read and converted next, while the one before is
+// compressed if the APs are running
+//
+typedef struct {
+    CAPTURE                       *Capture;
+    PIXEL_KERNEL                  Kernel;
+    EFI_GRAPHICS_OUTPUT_BLT_PIXEL *Band;
+    UINTN                         Y;
+    UINTN                         Rows;
+    BOOLEAN                       Pending;
+    EFI_STATUS                    Status;
+} READ_AHEAD;
+
+
+//
+// Read and convert the pending band, if any. Also a ParallelZlib
+// overlap function.
+//
+STATIC
+VOID
+ReadAheadBand( VOID *Context )
+{
+    READ_AHEAD *ReadAhead = (READ_AHEAD *)Context;
+
+    if (!ReadAhead->Pending) {
+        return;
+    }
+    ReadAhead->Pending = FALSE;
+
+    ReadAhead->Status = CaptureBand( ReadAhead->Capture, ReadAhead->Band, ReadAhead->Y, ReadAhead->Rows );
+    if (!EFI_ERROR(ReadAhead->Status)) {
+        // Convert BGR to RGBA with Alpha set to 0xFF
+        PixelBgraToRgba( ReadAhead->Kernel, (UINT32 *)ReadAhead->Band, ReadAhead->Rows * ReadAhead->Capture->Width );
+    }
+}
+
+
+//
+// lodepng streaming encoder write function, Context is the open file
+//
+STATIC
+unsigned
+PngWrite( VOID *Context,
+          CONST UINT8 *Data,
+          UINTN Size )
+{
+    UINTN Written = Size;
+
+    if (EFI_ERROR(gEfiShellProtocol->WriteFile( (SHELL_FILE_HANDLE)Context, &Written, (VOID *)Data )) ||
+        Written != Size) {
+        return 1;
+    }
+
+    return 0;
+}
+
+
+//
+// The screen is read and the PNG written to the file a band of rows at
+// a time, each band read while the one before is compressed on the APs,
+// so only a few bands are in memory at once.
+//
+EFI_STATUS
+PreparePNGFile( CAPTURE *Capture,
+                BOOLEAN Fast )
+{
+    EFI_GRAPHICS_OUTPUT_BLT_PIXEL *Bands[2] = { NULL, NULL };
+    EFI_GRAPHICS_OUTPUT_BLT_PIXEL *Band;
+    SHELL_FILE_HANDLE    FileHandle = NULL;
+    CHAR16               *FullPath = NULL;
+    UINT32               Width = (UINT32)Capture->Width;
+    UINT32               Height = (UINT32)Capture->Height;
+    UINTN                BandRows;
+    UINTN                Rows;
+    UINTN                y;
+    unsigned             Error;
+    EFI_STATUS           Status;
+    EFI_TIME             Time;
+    CHAR16               FileName[40]; 
+    LodePNGState         State;
+    LodePNGStream        Stream;
+    READ_AHEAD           ReadAhead;
+    PARALLEL_ZLIB_STREAM Zlib;
+
+    BandRows = MIN( MAX( CAPTURE_BAND_SIZE / (Capture->Width * sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL)), 1 ),
+                    Capture->Height );
+    Bands[0] = AllocatePool( BandRows * Capture->Width * sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL) );
+    Bands[1] = AllocatePool( BandRows * Capture->Width * sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL) );
+    if (Bands[0] == NULL || Bands[1] == NULL) {
+        SHELL_FREE_NON_NULL( Bands[0] );
+        SHELL_FREE_NON_NULL( Bands[1] );
+        Print(L"ERROR: Band buffers. No memory resources\n");
+        return EFI_OUT_OF_RESOURCES;
     }
 
+    Status = gRT->GetTime(&Time, NULL);
+    if (!EFI_ERROR(Status)) {
+        UnicodeSPrint( FileName, 62, L"screenshot-%04d%02d%02d-%02d%02d%02d.png",
+                       Time.Year, Time.Month, Time.Day, Time.Hour, Time.Minute, Time.Second );
+    } else {
+        UnicodeSPrint( FileName, 30, L"screenshot.png" );
+    }
+
+    Status = OpenImage( FileName, &FileHandle, &FullPath );
+    if (EFI_ERROR(Status)) {
+        SHELL_FREE_NON_NULL( FullPath );
+        FreePool( Bands[0] );
+        FreePool( Bands[1] );
+        return Status;
+    }
+
+    ReadAhead.Capture = Capture;
+    ReadAhead.Kernel = PixelBestKernel();
+    ReadAhead.Band = Bands[0];
+    ReadAhead.Y = 0;
+    ReadAhead.Rows = BandRows;
+    ReadAhead.Pending = TRUE;
+    ReadAhead.Status = EFI_SUCCESS;
+
+    // Encode RGBA to an RGB PNG, the alpha is always opaque, with the
+    // image data compressed on all processors. The color type is fixed
+    // before the first band, so unlike lodepng_encode32() there is no
+    // auto_convert to a palette or grey for screens with few colors.
+    ZeroMem(&Zlib, sizeof(Zlib));
+    Zlib.Overlap = ReadAheadBand;
+    Zlib.OverlapContext = &ReadAhead;
+    lodepng_state_init(&State);
+    State.info_raw.colortype = LCT_RGBA;
+    State.info_raw.bitdepth = 8;
+    State.info_png.color.colortype = LCT_RGB;
+    State.info_png.color.bitdepth = 8;
+    if (Fast) {
+        ScreenShotFastDeflate( &State.encoder.zlibsettings );
+    }
+    State.encoder.zlibsettings.custom_deflate_part = ParallelZlibDeflatePart;
+    State.encoder.zlibsettings.custom_context = &Zlib;
+
+    Error = lodepng_stream_begin(&Stream, &State, Width, Height, PngWrite, FileHandle);
+    for (y = 0; y < Height && Error == 0; y += Rows) {
+        // read now unless it was done while the last band was compressed
+        ReadAheadBand( &ReadAhead );
+        if (EFI_ERROR(ReadAhead.Status)) {
+            break;
+        }
+        Band = ReadAhead.Band;
+        Rows = ReadAhead.Rows;
+
+        // the next band goes in the other buffer
+        ReadAhead.Band = (Band == Bands[0]) ? Bands[1] : Bands[0];
+        ReadAhead.Y = y + Rows;
+        ReadAhead.Rows = MIN( BandRows, Height - ReadAhead.Y );
+        ReadAhead.Pending = (BOOLEAN)(ReadAhead.Rows != 0);
+
+        Error = lodepng_stream_rows(&Stream, (CONST UINT8 *)Band, (unsigned)Rows);
+    }
+    Error = lodepng_stream_finish(&Stream);
+    lodepng_state_cleanup(&State);
+    ParallelZlibStreamFree( &Zlib );
+    FreePool( Bands[0] );
+    FreePool( Bands[1] );
+#ifdef DEBUG
+    Print(L"Compressed %d chunks on %d processors, %d retried\n",
+          Zlib.Stats.Chunks, Zlib.Stats.Processors, Zlib.Stats.Retried);
+#endif
+
+    if (EFI_ERROR(ReadAhead.Status)) {
+        gEfiShellProtocol->DeleteFile( FileHandle );
+        Status = ReadAhead.Status;
+    } else if (Error != 0) {
+        Print(L"ERROR: Encoding PNG [%d]\n", Error);
+        gEfiShellProtocol->DeleteFile( FileHandle );
+        Status = (Error == 83) ? EFI_OUT_OF_RESOURCES : EFI_DEVICE_ERROR;
+    } else {
+        gEfiShellProtocol->CloseFile( FileHandle );
+        Print(L"Successfully saved image to %s\n", FullPath);
+        Status = EFI_SUCCESS;
+    }
+    SHELL_FREE_NON_NULL( FullPath );
+
     return Status;
 }
 
 #else
 
+//
+// The screen is read a band of rows at a time into the bottom up BMP
+//
 EFI_STATUS
-PrepareBMPFile( EFI_GRAPHICS_OUTPUT_BLT_PIXEL *BltBuffer,
-                UINT32 Width, 
-                UINT32 Height )
+PrepareBMPFile( CAPTURE *Capture )
 {
+    EFI_GRAPHICS_OUTPUT_BLT_PIXEL *Band;
     EFI_GRAPHICS_OUTPUT_BLT_PIXEL *Pixel;
+    UINT32            Width = (UINT32)Capture->Width;
+    UINT32            Height = (UINT32)Capture->Height;
     BMP_IMAGE_HEADER  *BmpHeader;
     EFI_STATUS        Status = EFI_SUCCESS;
     EFI_TIME          Time;
@@ -282,7 +588,11 @@ PrepareBMPFile( EFI_GRAPHICS_OUTPUT_BLT_PIXEL *BltBuffer,
     UINT8             *ImagePtr;
     UINT8             *ImagePtrBase;
     UINTN             ImageLineOffset;
-    UINTN             x, y;
+    UINTN             BandRows;
+    UINTN             Rows;
+    UINTN             y;
+    UINTN             Row;
+    PIXEL_KERNEL      Kernel;
 
     ImageLineOffset = Width * 3;
     if ((ImageLineOffset % 4) != 0) {
@@ -292,8 +602,11 @@ PrepareBMPFile( EFI_GRAPHICS_OUTPUT_BLT_PIXEL *BltBuffer,
     // allocate buffer for data
     FileDataLength = sizeof(BMP_IMAGE_HEADER) + Height * ImageLineOffset;
     FileData = AllocateZeroPool( FileDataLength );
-    if (FileData == NULL) {
-        FreePool( BltBuffer );
+    BandRows = MIN( MAX( CAPTURE_BAND_SIZE / (Width * sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL)), 1 ), Height );
+    Band = AllocatePool( BandRows * Width * sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL) );
+    if (FileData == NULL || Band == NULL) {
+        SHELL_FREE_NON_NULL( FileData );
+        SHELL_FREE_NON_NULL( Band );
         Print(L"ERROR: AllocateZeroPool. No memony resources\n");
         return EFI_OUT_OF_RESOURCES;
     }
@@ -313,22 +626,27 @@ PrepareBMPFile( EFI_GRAPHICS_OUTPUT_BLT_PIXEL *BltBuffer,
     BmpHeader->XPixelsPerMeter = 0;
     BmpHeader->YPixelsPerMeter = 0;
     
-    // fill pixel buffer
+    // fill pixel buffer, the top row of the screen is the last in the file
+    Kernel = PixelBestKernel();
     ImagePtrBase = FileData + BmpHeader->ImageOffset;
-    for (y = 0; y < Height; y++) {
-        ImagePtr = ImagePtrBase;
-        ImagePtrBase += ImageLineOffset;
-        Pixel = BltBuffer + (Height - 1 - y) * Width;
-        
-        for (x = 0; x < Width; x++) {
-            *ImagePtr++ = Pixel->Blue;
-            *ImagePtr++ = Pixel->Green;
-            *ImagePtr++ = Pixel->Red;
-            Pixel++;
+    for (y = 0; y < Height; y += Rows) {
+        Rows = MIN( BandRows, Height - y );
+        Status = CaptureBand( Capture, Band, y, Rows );
+        if (EFI_ERROR(Status)) {
+            FreePool( Band );
+            FreePool( FileData );
+            return Status;
+        }
+
+        for (Row = 0; Row < Rows; Row++) {
+            ImagePtr = ImagePtrBase + (Height - 1 - y - Row) * ImageLineOffset;
+            Pixel = Band + Row * Width;
+
+            PixelBgraToBgr( Kernel, ImagePtr, (CONST UINT32 *)Pixel, Width );
         }
     }
 
-    FreePool(BltBuffer);
+    FreePool( Band );
 
     Status = gRT->GetTime(&Time, NULL);
     if (!EFI_ERROR(Status)) {
@@ -338,7 +656,7 @@ PrepareBMPFile( EFI_GRAPHICS_OUTPUT_BLT_PIXEL *BltBuffer,
         UnicodeSPrint( FileName, 30, L"screenshot.bmp" );
     }
     
-    SaveImage( FileName, FileData, FileDataLength );
+    Status = SaveImage( FileName, FileData, FileDataLength );
 
     FreePool( FileData );
 
@@ -353,33 +671,26 @@ SnapShot( EFI_GRAPHICS_OUTPUT_PROTOCOL *Gop,
           UINTN                        StartX, 
           UINTN                        StartY,
           UINTN                        Width, 
-          UINTN                        Height ) 
+          UINTN                        Height,
+          BOOLEAN                      Fast,
+          BOOLEAN                      Time ) 
 {
-    EFI_GRAPHICS_OUTPUT_BLT_PIXEL *BltBuffer = NULL;
+    CAPTURE    Capture;
     EFI_STATUS Status = EFI_SUCCESS;
-    UINTN      ImageSize;  
-
-    ImageSize = Width * Height;
-            
-    // allocate memory for snapshot
-    BltBuffer = AllocateZeroPool( sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL) * ImageSize );
-    if (BltBuffer == NULL) {
-        Print(L"ERROR: BltBuffer. No memory resources\n");
-        return EFI_OUT_OF_RESOURCES;
-    }
 
-    // take screenshot
-    Status = Gop->Blt( Gop, BltBuffer, EfiBltVideoToBltBuffer, StartX, StartY, 0, 0, Width, Height, 0 );
-    if (EFI_ERROR(Status)) {
-        Print(L"ERROR: Gop->Blt [%d]\n", Status);
-        FreePool( BltBuffer );
-        return Status;
+    // the screen is read band by band as the image is written
+    CaptureInit( &Capture, Gop, StartX, StartY, Width, Height );
+    if (Time) {
+        Status = TimeCapture( &Capture );
+        if (EFI_ERROR(Status)) {
+            return Status;
+        }
     }
-            
+
     #ifdef SAVE_AS_PNG
-    PreparePNGFile( BltBuffer, (UINT32)Width, (UINT32)Height );
+    Status = PreparePNGFile( &Capture, Fast );
     #else
-    PrepareBMPFile( BltBuffer, (UINT32)Width, (UINT32)Height );
+    Status = PrepareBMPFile( &Capture );
     #endif
 
     return Status;
@@ -393,7 +704,7 @@ Usage( BOOLEAN ErrorMsg )
         Print(L"ERROR: Unknown option(s).\n");
     }
 
-    Print(L"Usage: ScreenShot [StartX StartY WidthX HeightY]\n");
+    Print(L"Usage: ScreenShot [-f | --fast] [-t | --time] [StartX StartY WidthX HeightY]\n");
     Print(L"       ScreenShot [-i | --info]\n");
     Print(L"       ScreenShot [-V | --version]\n");
 }
@@ -409,6 +720,8 @@ ShellAppMain( UINTN Argc,
     EFI_STATUS                   Status = EFI_SUCCESS;
     EFI_HANDLE                   *Handles = NULL;
     BOOLEAN                      DisplayInfo = FALSE;
+    BOOLEAN                      Fast = FALSE;
+    BOOLEAN                      Time = FALSE;
     UINTN                        HandleCount = 0;
     UINTN                        StartX = 0, StartY = 0, Width = 0, Height = 0; 
 
@@ -417,6 +730,22 @@ ShellAppMain( UINTN Argc,
         return EFI_SUCCESS;
     }
 
+    while (Argc > 1) {
+        if (!StrCmp(Argv[1], L"--fast") ||
+            !StrCmp(Argv[1], L"-f")) {
+            // faster, slightly weaker PNG compression
+            Fast = TRUE;
+        } else if (!StrCmp(Argv[1], L"--time") ||
+            !StrCmp(Argv[1], L"-t")) {
+            // report how long reading the screen takes each way
+            Time = TRUE;
+        } else {
+            break;
+        }
+        Argc--;
+        Argv++;
+    }
+
     if (Argc == 2) {
         if (!StrCmp(Argv[1], L"--version") ||
             !StrCmp(Argv[1], L"-V")) {
@@ -491,7 +820,7 @@ ShellAppMain( UINTN Argc,
 
     Status = ShowStatus( Gop, Yellow, StartX, StartY, Width, Height ); 
     gBS->Stall(500*1000);
-    Status = SnapShot( Gop , StartX, StartY, Width, Height );
+    Status = SnapShot( Gop , StartX, StartY, Width, Height, Fast, Time );
     if (EFI_ERROR(Status)) {
         Status = ShowStatus( Gop, Red, StartX, StartY, Width, Height ); 
     } else {
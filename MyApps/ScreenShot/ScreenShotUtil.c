@@ -0,0 +1,47 @@
+//
+//  Copyright (c) 2019   Finnbarr P. Murphy.   All rights reserved.
+//
+//  Helpers shared by the ScreenShot application and ScreenshotDriver
+//
+//  License: BSD 2 clause license applies.
+//
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+
+#include "ScreenShotUtil.h"
+
+
+//
+// The TSC rate is measured once, against a 10ms stall, on first use
+//
+UINT64
+ScreenShotTicksToMicroseconds( UINT64 Ticks )
+{
+    STATIC UINT64 TicksPerUs = 0;
+    UINT64 Start;
+
+    if (TicksPerUs == 0) {
+        Start = AsmReadTsc();
+        gBS->Stall( 10000 );
+        TicksPerUs = DivU64x32( AsmReadTsc() - Start, 10000 );
+        if (TicksPerUs == 0) {
+            TicksPerUs = 1;
+        }
+    }
+
+    return DivU64x64Remainder( Ticks, TicksPerUs, NULL );
+}
+
+
+//
+// lodepng's single probe matcher over a 32K window is several times
+// faster than its default search, and about as small on screen content
+//
+VOID
+ScreenShotFastDeflate( LodePNGCompressSettings *Settings )
+{
+    Settings->fastmatch = 1;
+    Settings->windowsize = 32768;
+}
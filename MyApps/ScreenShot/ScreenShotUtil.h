@@ -0,0 +1,26 @@
+//
+//  Copyright (c) 2019   Finnbarr P. Murphy.   All rights reserved.
+//
+//  Helpers shared by the ScreenShot application and ScreenshotDriver
+//
+//  License: BSD 2 clause license applies.
+//
+
+#ifndef _SCREENSHOTUTIL_H_
+#define _SCREENSHOTUTIL_H_
+
+#include "lodepng.h"
+
+//
+// Convert TSC ticks to microseconds
+//
+UINT64
+ScreenShotTicksToMicroseconds( UINT64 Ticks );
+
+//
+// Deflate settings for a fast rather than a small PNG
+//
+VOID
+ScreenShotFastDeflate( LodePNGCompressSettings *Settings );
+
+#endif // _SCREENSHOTUTIL_H_
@@ -38,22 +38,21 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 // Floating point operations are used here, this must be defined to prevent linker error
 const int32_t _fltused = 0;
 
-// Internal C function implementations
+// Internal C function implementations. BaseMemoryLib rather than gBS,
+// so the encoder can also run on an AP.
 static inline void* memcpy(void* dst, const void* src, size_t size) {
-  gBS->CopyMem(dst, (VOID *) src, size);
-  return dst;
+  return CopyMem(dst, src, size);
 }
 
 static inline void* memset(void* dst, int c, size_t n) {
-  gBS->SetMem(dst, n, (UINT8) c);
-  return dst;
+  return SetMem(dst, n, (UINT8) c);
 }
 
 static inline int abs(int j) {
   return j < 0 ? -j : j;
 }
 
-static size_t strlen(const char* s1) {
+static inline size_t strlen(const char* s1) {
   size_t len;
   for (len=0; *s1; s1+=1, len+=1);
   return len;
@@ -65,12 +64,49 @@ static size_t strlen(const char* s1) {
   _Static_assert(sizeof(size_t) >= 4, "Unsupported size_t");
 #endif
 
+LodePNGArena* (*lodepng_arena)(void) = NULL;
+
+// The arena of the calling processor, or NULL to use pool
+static LodePNGArena* lodepng_current_arena(void) {
+  return lodepng_arena != NULL ? lodepng_arena() : NULL;
+}
+
+// Arena blocks are 8 byte aligned, including the size header
+static size_t lodepng_arena_need(size_t size) {
+  return (size + sizeof(size_t) + 7) & ~(size_t)7;
+}
+
+static int lodepng_arena_owns(LodePNGArena* arena, void* ptr) {
+  return (uint8_t*)ptr > arena->data && (uint8_t*)ptr <= arena->data + arena->size;
+}
+
+// The last block allocated can be freed or resized in place, which is
+// how the vectors of the encoder mostly grow
+static int lodepng_arena_is_top(LodePNGArena* arena, void* ptr) {
+  size_t size;
+  memcpy(&size, (uint8_t*)ptr - sizeof(size_t), sizeof(size_t));
+  return (uint8_t*)ptr - sizeof(size_t) + lodepng_arena_need(size) == arena->data + arena->used;
+}
+
 void* lodepng_malloc(size_t size) {
   if (size > LODEPNG_MAX_ALLOC) {
     return NULL;
   }
 
   void* ptr;
+  LodePNGArena* arena = lodepng_current_arena();
+  if (arena != NULL) {
+    size_t need = lodepng_arena_need(size);
+    if (need > arena->size - arena->used) {
+      arena->full = 1;
+      return NULL;
+    }
+    ptr = arena->data + arena->used;
+    arena->used += need;
+    memcpy(ptr, &size, sizeof(size_t));
+    return (uint8_t*)ptr + sizeof(size_t);
+  }
+
   EFI_STATUS Status = gBS->AllocatePool(EfiBootServicesData, size + sizeof(size_t), &ptr);
   if (EFI_ERROR (Status)) {
     DEBUG ((DEBUG_INFO, "lodepng alloc failure - %r\n", Status));
@@ -82,6 +118,13 @@ void* lodepng_malloc(size_t size) {
 }
 
 void lodepng_free(void* ptr) {
+  LodePNGArena* arena = lodepng_current_arena();
+  if (arena != NULL && lodepng_arena_owns(arena, ptr)) {
+    if (lodepng_arena_is_top(arena, ptr)) {
+      arena->used = (uint8_t*)ptr - sizeof(size_t) - arena->data;
+    }
+    return;
+  }
   if (ptr) {
     EFI_STATUS Status = gBS->FreePool((uint8_t*)ptr - sizeof(size_t));
     if (EFI_ERROR (Status)) {
@@ -100,6 +143,17 @@ void* lodepng_realloc(void* ptr, size_t new_size) {
     return NULL;
   }
 
+  LodePNGArena* arena = lodepng_current_arena();
+  if (arena != NULL && new_size <= LODEPNG_MAX_ALLOC &&
+      lodepng_arena_owns(arena, ptr) && lodepng_arena_is_top(arena, ptr)) {
+    size_t base = (uint8_t*)ptr - sizeof(size_t) - arena->data;
+    if (lodepng_arena_need(new_size) <= arena->size - base) {
+      arena->used = base + lodepng_arena_need(new_size);
+      memcpy((uint8_t*)ptr - sizeof(size_t), &new_size, sizeof(size_t));
+      return ptr;
+    }
+  }
+
   void* new_ptr = lodepng_malloc(new_size);
   if (new_ptr != NULL) {
     size_t old_size;
@@ -208,6 +262,94 @@ Example: if(!uivector_resizev(&frequencies_ll, 286, 0)) ERROR_BREAK(83);
   return;\
 }
 
+#ifdef LODEPNG_COMPILE_SIMD
+/*
+Local addition: SSE2 is always there on x86-64, the other instruction sets are
+used when lodepng_cpu_features reports them. Each kernel has its own target
+attribute, so no extra compiler flags are needed.
+*/
+#define _MM_MALLOC_H_INCLUDED /*gcc and clang: keep stdlib.h out of immintrin.h*/
+#define __MM_MALLOC_H
+#ifdef size_t /*lodepng.h makes it UINTN for EFI, but the intrinsics headers typedef it*/
+#undef size_t
+#include <immintrin.h>
+#define size_t UINTN
+#else
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define LODEPNG_TARGET_SSE2
+#define LODEPNG_TARGET_AVX2
+#define LODEPNG_TARGET_PCLMUL
+#define LODEPNG_TARGET_SSSE3
+#else
+#include <cpuid.h>
+#define LODEPNG_TARGET_SSE2 __attribute__((target("sse2")))
+#define LODEPNG_TARGET_AVX2 __attribute__((target("avx2")))
+#define LODEPNG_TARGET_PCLMUL __attribute__((target("sse2,pclmul")))
+#define LODEPNG_TARGET_SSSE3 __attribute__((target("ssse3")))
+#endif
+#endif /*LODEPNG_COMPILE_SIMD*/
+
+#if defined(LODEPNG_COMPILE_SIMD) && (defined(LODEPNG_COMPILE_PNG) || defined(LODEPNG_COMPILE_ZLIB))
+#define LODEPNG_CPU_AVX2 1u
+#define LODEPNG_CPU_PCLMUL 2u
+#define LODEPNG_CPU_SSSE3 4u
+
+static void lodepng_cpuid(unsigned leaf, unsigned regs[4]) {
+#if defined(_MSC_VER)
+  __cpuidex((int*)regs, (int)leaf, 0);
+#else
+  __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static unsigned long long lodepng_xgetbv(void) {
+#if defined(_MSC_VER)
+  return _xgetbv(0);
+#else
+  unsigned lo, hi;
+  __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  return ((unsigned long long)hi << 32) | lo;
+#endif
+}
+
+/*the LODEPNG_CPU_ flags of this processor, worked out on the first call*/
+static unsigned lodepng_cpu_features(void) {
+  static unsigned features = 0, checked = 0;
+  unsigned regs[4];
+  unsigned maxleaf;
+
+  if(checked) return features;
+
+  lodepng_cpuid(0, regs);
+  maxleaf = regs[0];
+  lodepng_cpuid(1, regs);
+  if(regs[2] & (1u << 1)) features |= LODEPNG_CPU_PCLMUL;
+  if(regs[2] & (1u << 9)) features |= LODEPNG_CPU_SSSE3;
+  /*AVX2 needs OSXSAVE and AVX in ECX, and XMM and YMM state enabled in XCR0*/
+  if(maxleaf >= 7 && (regs[2] & (1u << 27)) && (regs[2] & (1u << 28)) && (lodepng_xgetbv() & 6) == 6) {
+    lodepng_cpuid(7, regs);
+    if(regs[1] & (1u << 5)) features |= LODEPNG_CPU_AVX2;
+  }
+
+  checked = 1;
+  return features;
+}
+
+/*
+XCR0 belongs to each processor, and firmware does not always enable the AVX
+state on the APs as it does on the BSP, so code that may run on an AP checks
+on the processor it is running on before using AVX2
+*/
+static unsigned lodepng_avx_enabled_here(void) {
+  unsigned regs[4];
+  lodepng_cpuid(1, regs);
+  return (regs[2] & (1u << 27)) && (lodepng_xgetbv() & 6) == 6;
+}
+#endif /*LODEPNG_COMPILE_SIMD && (LODEPNG_COMPILE_PNG || LODEPNG_COMPILE_ZLIB)*/
+
 /*
 About uivector, ucvector and string:
 -All of them wrap dynamic arrays or text strings in a similar way.
@@ -1343,10 +1485,24 @@ typedef struct Hash {
   int* headz; /*similar to head, but for chainz*/
   unsigned short* chainz; /*those with same amount of zeros*/
   unsigned short* zeros; /*length of zeros streak, used as a second hash chain*/
+
+  int* fast; /*local addition: 4 byte hash to its last position, the only table with fastmatch*/
 } Hash;
 
-static unsigned hash_init(Hash* hash, unsigned windowsize) {
+/*local addition: the fastmatch table, small enough to stay in the cache*/
+#define FAST_HASH_BITS 15
+static const unsigned FAST_HASH_NUM_VALUES = 1u << FAST_HASH_BITS;
+
+static unsigned hash_init(Hash* hash, unsigned windowsize, unsigned fastmatch) {
   unsigned i;
+  memset(hash, 0, sizeof(*hash));
+  if(fastmatch) {
+    hash->fast = (int*)lodepng_malloc(sizeof(int) * FAST_HASH_NUM_VALUES);
+    if(!hash->fast) return 83; /*alloc fail*/
+    for(i = 0; i != FAST_HASH_NUM_VALUES; ++i) hash->fast[i] = -1;
+    return 0;
+  }
+
   hash->head = (int*)lodepng_malloc(sizeof(int) * HASH_NUM_VALUES);
   hash->val = (int*)lodepng_malloc(sizeof(int) * windowsize);
   hash->chain = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
@@ -1378,6 +1534,8 @@ static void hash_cleanup(Hash* hash) {
   lodepng_free(hash->zeros);
   lodepng_free(hash->headz);
   lodepng_free(hash->chainz);
+
+  lodepng_free(hash->fast);
 }
 
 
@@ -1580,9 +1738,100 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
   return error;
 }
 
+/*
+Local addition: LZ77 for fastmatch. Each position is hashed on its next 4 bytes into
+a table that holds only the last position with that hash, which is probed once. A
+match is taken greedily and of its positions only the last is added to the table.
+This is what zlib level 1 and the fastest libdeflate level do.
+*/
+static unsigned encodeLZ77Fast(uivector* out, Hash* hash,
+                               const unsigned char* in, size_t inpos, size_t insize,
+                               unsigned windowsize, unsigned minmatch) {
+  size_t pos = inpos;
+  unsigned error = 0;
+
+  if(windowsize == 0 || windowsize > 32768) return 60; /*error: windowsize smaller/larger than allowed*/
+  if((windowsize & (windowsize - 1)) != 0) return 90; /*error: must be power of two*/
+
+  while(pos < insize) {
+    unsigned length = 0;
+    size_t offset = 0;
+
+    if(pos + 4 <= insize) {
+      unsigned four = (unsigned)in[pos] | ((unsigned)in[pos + 1] << 8u) |
+                      ((unsigned)in[pos + 2] << 16u) | ((unsigned)in[pos + 3] << 24u);
+      unsigned hashval = (unsigned)((four * 2654435761u) >> (32u - FAST_HASH_BITS));
+      int prev = hash->fast[hashval];
+      hash->fast[hashval] = (int)pos;
+
+      if(prev >= 0 && pos - (size_t)prev <= windowsize) {
+        const unsigned char* foreptr = &in[pos];
+        const unsigned char* backptr = &in[prev];
+        const unsigned char* lastptr = &in[insize < pos + MAX_SUPPORTED_DEFLATE_LENGTH ?
+                                           insize : pos + MAX_SUPPORTED_DEFLATE_LENGTH];
+        while(foreptr != lastptr && *backptr == *foreptr) {
+          ++backptr;
+          ++foreptr;
+        }
+        length = (unsigned)(foreptr - &in[pos]);
+        offset = pos - (size_t)prev;
+      }
+    }
+
+    /*a hash collision gives a short or empty match, which is written as a literal*/
+    if(length >= 4 && length >= minmatch) {
+      if(!uivector_reserve(out, (out->size + 4) * sizeof(unsigned))) ERROR_BREAK(83 /*alloc fail*/);
+      addLengthDistance(out, length, offset);
+      pos += length;
+      if(pos + 3 <= insize) {
+        size_t last = pos - 1;
+        unsigned four = (unsigned)in[last] | ((unsigned)in[last + 1] << 8u) |
+                        ((unsigned)in[last + 2] << 16u) | ((unsigned)in[last + 3] << 24u);
+        hash->fast[(four * 2654435761u) >> (32u - FAST_HASH_BITS)] = (int)last;
+      }
+    } else {
+      if(!uivector_push_back(out, in[pos])) ERROR_BREAK(83 /*alloc fail*/);
+      ++pos;
+    }
+  }
+
+  return error;
+}
+
+/*
+Local addition: enter in[pos..end-1] into the hash as encodeLZ77 or encodeLZ77Fast would
+have, without encoding them, so the data after end can be matched against them.
+*/
+static void hash_prime(Hash* hash, const unsigned char* in, size_t pos, size_t end, size_t insize,
+                       unsigned windowsize) {
+  unsigned hashval, numzeros = 0;
+
+  if(hash->fast) {
+    for(; pos < end && pos + 4 <= insize; ++pos) {
+      unsigned four = (unsigned)in[pos] | ((unsigned)in[pos + 1] << 8u) |
+                      ((unsigned)in[pos + 2] << 16u) | ((unsigned)in[pos + 3] << 24u);
+      hash->fast[(four * 2654435761u) >> (32u - FAST_HASH_BITS)] = (int)pos;
+    }
+    return;
+  }
+
+  for(; pos < end; ++pos) {
+    hashval = getHash(in, insize, pos);
+    if(hashval == 0) {
+      if(numzeros == 0) numzeros = countZeros(in, insize, pos);
+      else if(pos + numzeros > insize || in[pos + numzeros - 1] != 0) --numzeros;
+    } else {
+      numzeros = 0;
+    }
+    updateHashChain(hash, pos & (windowsize - 1), hashval, numzeros);
+  }
+}
+
 /* /////////////////////////////////////////////////////////////////////////// */
 
-static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize) {
+/*final is 0 for a part of a longer stream (local addition): then no block is marked final*/
+static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize,
+                                     unsigned final) {
   /*non compressed deflate block data: 1 bit BFINAL,2 bits BTYPE,(5 bits): it jumps to start of next byte,
   2 bytes LEN, 2 bytes NLEN, LEN bytes literal DATA*/
 
@@ -1592,7 +1841,7 @@ static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, s
     unsigned BFINAL, BTYPE, LEN, NLEN;
     unsigned char firstbyte;
 
-    BFINAL = (i == numdeflateblocks - 1);
+    BFINAL = final && (i == numdeflateblocks - 1);
     BTYPE = 0;
 
     firstbyte = (unsigned char)(BFINAL + ((BTYPE & 1) << 1) + ((BTYPE & 2) << 1));
@@ -1704,7 +1953,11 @@ static unsigned deflateDynamic(LodePNGBitWriter* writer, Hash* hash,
   /*This while loop never loops due to a break at the end, it is here to
   allow breaking out of it to the cleanup phase on error conditions.*/
   while(!error) {
-    if(settings->use_lz77) {
+    if(settings->use_lz77 && settings->fastmatch) {
+      error = encodeLZ77Fast(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
+                             settings->minmatch);
+      if(error) break;
+    } else if(settings->use_lz77) {
       error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
                          settings->minmatch, settings->nicematch, settings->lazymatching);
       if(error) break;
@@ -1894,8 +2147,13 @@ static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
   if(settings->use_lz77) /*LZ77 encoded*/ {
     uivector lz77_encoded;
     uivector_init(&lz77_encoded);
-    error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                       settings->minmatch, settings->nicematch, settings->lazymatching);
+    if(settings->fastmatch) {
+      error = encodeLZ77Fast(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
+                             settings->minmatch);
+    } else {
+      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
+                         settings->minmatch, settings->nicematch, settings->lazymatching);
+    }
     if(!error) writeLZ77data(writer, &lz77_encoded, &tree_ll, &tree_d);
     uivector_cleanup(&lz77_encoded);
   } else /*no LZ77, but still will be Huffman compressed*/ {
@@ -1913,8 +2171,11 @@ static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
   return error;
 }
 
-static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
-                                 const LodePNGCompressSettings* settings) {
+/*in[start..insize-1] is compressed, the window before start is history for matches.
+last is 0 for a part of a longer stream: then no block is marked final and an
+empty stored block (a sync flush) is added so the output ends on a byte boundary*/
+static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t start, size_t insize,
+                                 const LodePNGCompressSettings* settings, unsigned last) {
   unsigned error = 0;
   size_t i, blocksize, numdeflateblocks;
   Hash hash;
@@ -1923,29 +2184,42 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
   LodePNGBitWriter_init(&writer, out);
 
   if(settings->btype > 2) return 61;
-  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
-  else if(settings->btype == 1) blocksize = insize;
+  else if(settings->btype == 0) return deflateNoCompression(out, in + start, insize - start, last);
+  else if(settings->btype == 1) blocksize = insize - start;
   else /*if(settings->btype == 2)*/ {
     /*on PNGs, deflate blocks of 65-262k seem to give most dense encoding*/
-    blocksize = insize / 8 + 8;
+    blocksize = (insize - start) / 8 + 8;
     if(blocksize < 65536) blocksize = 65536;
     if(blocksize > 262144) blocksize = 262144;
   }
 
-  numdeflateblocks = (insize + blocksize - 1) / blocksize;
+  numdeflateblocks = (insize - start + blocksize - 1) / blocksize;
   if(numdeflateblocks == 0) numdeflateblocks = 1;
 
-  error = hash_init(&hash, settings->windowsize);
+  error = hash_init(&hash, settings->windowsize, settings->fastmatch);
   if(error) return error;
+  if(start > 0 && settings->use_lz77) {
+    hash_prime(&hash, in, start > settings->windowsize ? start - settings->windowsize : 0, start, insize,
+               settings->windowsize);
+  }
 
   for(i = 0; i != numdeflateblocks && !error; ++i) {
-    unsigned final = (i == numdeflateblocks - 1);
-    size_t start = i * blocksize;
-    size_t end = start + blocksize;
+    unsigned final = last && (i == numdeflateblocks - 1);
+    size_t begin = start + i * blocksize;
+    size_t end = begin + blocksize;
     if(end > insize) end = insize;
 
-    if(settings->btype == 1) error = deflateFixed(&writer, &hash, in, start, end, settings, final);
-    else if(settings->btype == 2) error = deflateDynamic(&writer, &hash, in, start, end, settings, final);
+    if(settings->btype == 1) error = deflateFixed(&writer, &hash, in, begin, end, settings, final);
+    else if(settings->btype == 2) error = deflateDynamic(&writer, &hash, in, begin, end, settings, final);
+  }
+
+  if(!error && !last) {
+    /*BFINAL 0 and BTYPE 00, then LEN 0 and NLEN 0xffff from the next byte boundary*/
+    writeBits(&writer, 0, 3);
+    ucvector_push_back(out, 0);
+    ucvector_push_back(out, 0);
+    ucvector_push_back(out, 255);
+    if(!ucvector_push_back(out, 255)) error = 83; /*alloc fail*/
   }
 
   hash_cleanup(&hash);
@@ -1959,7 +2233,19 @@ unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
   unsigned error;
   ucvector v;
   ucvector_init_buffer(&v, *out, *outsize);
-  error = lodepng_deflatev(&v, in, insize, settings);
+  error = lodepng_deflatev(&v, in, 0, insize, settings, 1);
+  *out = v.data;
+  *outsize = v.size;
+  return error;
+}
+
+unsigned lodepng_deflate_part(unsigned char** out, size_t* outsize,
+                              const unsigned char* in, size_t start, size_t insize,
+                              const LodePNGCompressSettings* settings, unsigned last) {
+  unsigned error;
+  ucvector v;
+  ucvector_init_buffer(&v, *out, *outsize);
+  error = lodepng_deflatev(&v, in, start, insize, settings, last);
   *out = v.data;
   *outsize = v.size;
   return error;
@@ -1981,10 +2267,121 @@ static unsigned deflate(unsigned char** out, size_t* outsize,
 /* / Adler32                                                                  */
 /* ////////////////////////////////////////////////////////////////////////// */
 
-static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len) {
+#ifdef LODEPNG_COMPILE_SIMD
+/*
+Local addition: Adler-32 of whole blocks of 32 (SSSE3) or 64 (AVX2) bytes. Per
+block, psadbw adds the bytes to s1 and pmaddubsw weights them by their distance
+from the end of the block for s2, which also gets block size times the s1 of
+the blocks before. As in update_adler32, the modulo is only taken every 5552
+bytes at most. len must be a multiple of the block size.
+*/
+static LODEPNG_TARGET_SSSE3 unsigned adler32SSSE3(unsigned adler, const unsigned char* data, size_t len) {
+  const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
   unsigned s1 = adler & 0xffff;
   unsigned s2 = (adler >> 16) & 0xffff;
+  size_t blocks = len / 32;
+  __m128i v_s1, v_s2, v_ps, x1, x2;
+  unsigned n;
+
+  while(blocks > 0) {
+    n = blocks > 5552 / 32 ? 5552 / 32 : (unsigned)blocks;
+    blocks -= n;
+    v_ps = _mm_cvtsi32_si128((int)(s1 * n)); /*the s1 of the blocks before, once per block*/
+    v_s2 = _mm_cvtsi32_si128((int)s2);
+    v_s1 = zero;
+    do {
+      x1 = _mm_loadu_si128((const __m128i*)data);
+      x2 = _mm_loadu_si128((const __m128i*)(data + 16));
+      v_ps = _mm_add_epi32(v_ps, v_s1);
+      v_s1 = _mm_add_epi32(v_s1, _mm_add_epi32(_mm_sad_epu8(x1, zero), _mm_sad_epu8(x2, zero)));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(x1, tap1), ones));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(x2, tap2), ones));
+      data += 32;
+    } while(--n);
+    v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+    v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+    s1 = (s1 + (unsigned)_mm_cvtsi128_si32(v_s1)) % 65521;
+    s2 = (unsigned)_mm_cvtsi128_si32(v_s2) % 65521;
+  }
 
+  return (s2 << 16) | s1;
+}
+
+static LODEPNG_TARGET_AVX2 unsigned adler32AVX2(unsigned adler, const unsigned char* data, size_t len) {
+  const __m256i tap1 = _mm256_setr_epi8(64, 63, 62, 61, 60, 59, 58, 57, 56, 55, 54, 53, 52, 51, 50, 49,
+                                        48, 47, 46, 45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33);
+  const __m256i tap2 = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                        16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+  unsigned s1 = adler & 0xffff;
+  unsigned s2 = (adler >> 16) & 0xffff;
+  size_t blocks = len / 64;
+  __m256i v_s1, v_s2, v_ps, x1, x2;
+  __m128i h_s1, h_s2;
+  unsigned n;
+
+  while(blocks > 0) {
+    n = blocks > 5552 / 64 ? 5552 / 64 : (unsigned)blocks;
+    blocks -= n;
+    v_ps = _mm256_setr_epi32((int)(s1 * n), 0, 0, 0, 0, 0, 0, 0);
+    v_s2 = _mm256_setr_epi32((int)s2, 0, 0, 0, 0, 0, 0, 0);
+    v_s1 = zero;
+    do {
+      x1 = _mm256_loadu_si256((const __m256i*)data);
+      x2 = _mm256_loadu_si256((const __m256i*)(data + 32));
+      v_ps = _mm256_add_epi32(v_ps, v_s1);
+      v_s1 = _mm256_add_epi32(v_s1, _mm256_add_epi32(_mm256_sad_epu8(x1, zero), _mm256_sad_epu8(x2, zero)));
+      v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(x1, tap1), ones));
+      v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(x2, tap2), ones));
+      data += 64;
+    } while(--n);
+    v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 6));
+
+    h_s1 = _mm_add_epi32(_mm256_castsi256_si128(v_s1), _mm256_extracti128_si256(v_s1, 1));
+    h_s2 = _mm_add_epi32(_mm256_castsi256_si128(v_s2), _mm256_extracti128_si256(v_s2, 1));
+    h_s1 = _mm_add_epi32(h_s1, _mm_shuffle_epi32(h_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+    h_s2 = _mm_add_epi32(h_s2, _mm_shuffle_epi32(h_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+    h_s2 = _mm_add_epi32(h_s2, _mm_shuffle_epi32(h_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+    s1 = (s1 + (unsigned)_mm_cvtsi128_si32(h_s1)) % 65521;
+    s2 = (unsigned)_mm_cvtsi128_si32(h_s2) % 65521;
+  }
+
+  return (s2 << 16) | s1;
+}
+#endif /*LODEPNG_COMPILE_SIMD*/
+
+static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len) {
+  unsigned s1;
+  unsigned s2;
+
+#ifdef LODEPNG_COMPILE_SIMD
+  if(len >= 64) {
+    unsigned features = lodepng_cpu_features();
+    unsigned blocks = len;
+    /*checking this processor costs a cpuid, which may trap to a hypervisor*/
+    if((features & LODEPNG_CPU_AVX2) && len >= 65536 && lodepng_avx_enabled_here()) {
+      blocks &= ~63u;
+      adler = adler32AVX2(adler, data, blocks);
+    } else if(features & LODEPNG_CPU_SSSE3) {
+      blocks &= ~31u;
+      adler = adler32SSSE3(adler, data, blocks);
+    } else {
+      blocks = 0;
+    }
+    data += blocks;
+    len -= blocks;
+  }
+#endif
+
+  s1 = adler & 0xffff;
+  s2 = (adler >> 16) & 0xffff;
   while(len > 0) {
     /*at least 5552 sums can be done before the sums overflow, saving a lot of module divisions*/
     unsigned amount = len > 5552 ? 5552 : len;
@@ -2006,6 +2403,17 @@ static unsigned adler32(const unsigned char* data, unsigned len) {
   return update_adler32(1L, data, len);
 }
 
+unsigned lodepng_adler32(unsigned adler, const unsigned char* data, size_t len) {
+  /*update_adler32 takes an unsigned length*/
+  while(len > 0) {
+    unsigned amount = len > 0x40000000u ? 0x40000000u : (unsigned)len;
+    adler = update_adler32(adler, data, amount);
+    data += amount;
+    len -= amount;
+  }
+  return adler;
+}
+
 /* ////////////////////////////////////////////////////////////////////////// */
 /* / Zlib                                                                   / */
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -2052,6 +2460,9 @@ unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const uns
   return 0; /*no error*/
 }
 
+/*local change: only the PNG decoder and the C++ wrapper use this, so zlib-only builds
+such as ShowPCIx's do not warn about an unused static function*/
+#if defined(LODEPNG_COMPILE_PNG) || defined(LODEPNG_COMPILE_CPP)
 static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
                                 size_t insize, const LodePNGDecompressSettings* settings) {
   if(settings->custom_zlib) {
@@ -2060,6 +2471,7 @@ static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsi
     return lodepng_zlib_decompress(out, outsize, in, insize, settings);
   }
 }
+#endif /*LODEPNG_COMPILE_PNG || LODEPNG_COMPILE_CPP*/
 
 #endif /*LODEPNG_COMPILE_DECODER*/
 
@@ -2104,6 +2516,7 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
   return error;
 }
 
+#if defined(LODEPNG_COMPILE_PNG) || defined(LODEPNG_COMPILE_CPP)
 /* compress using the default or custom zlib function */
 static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
                               size_t insize, const LodePNGCompressSettings* settings) {
@@ -2113,6 +2526,7 @@ static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsign
     return lodepng_zlib_compress(out, outsize, in, insize, settings);
   }
 }
+#endif /*LODEPNG_COMPILE_PNG || LODEPNG_COMPILE_CPP*/
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
@@ -2150,13 +2564,15 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings) {
   settings->minmatch = 3;
   settings->nicematch = 128;
   settings->lazymatching = 1;
+  settings->fastmatch = 0;
 
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
+  settings->custom_deflate_part = 0;
   settings->custom_context = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0, 0, 0};
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -2226,14 +2642,114 @@ static unsigned lodepng_crc32_table[256] = {
   3009837614u, 3294710456u, 1567103746u,  711928724u, 3020668471u, 3272380065u, 1510334235u,  755167117u
 };
 
+/*
+Local addition: slicing by 8, eight bytes per step through eight tables made
+from lodepng_crc32_table on first use, and where the processor has PCLMULQDQ,
+folding of 64 bytes per step with carry-less multiplies. Both go on from the
+running value r, which is not inverted.
+*/
+static unsigned lodepng_crc32_slices[8][256];
+static unsigned lodepng_crc32_slices_made = 0;
+
+static void lodepng_crc32_make_slices(void) {
+  unsigned i, j, r;
+  for(i = 0; i != 256; ++i) {
+    r = lodepng_crc32_table[i];
+    lodepng_crc32_slices[0][i] = r;
+    for(j = 1; j != 8; ++j) {
+      r = lodepng_crc32_table[r & 0xff] ^ (r >> 8);
+      lodepng_crc32_slices[j][i] = r;
+    }
+  }
+  lodepng_crc32_slices_made = 1;
+}
+
+static unsigned lodepng_crc32_slice8(unsigned r, const unsigned char* data, size_t length) {
+  const unsigned (*t)[256] = lodepng_crc32_slices;
+  unsigned a, b;
+
+  if(!lodepng_crc32_slices_made) lodepng_crc32_make_slices();
+  for(; length >= 8; data += 8, length -= 8) {
+    a = r ^ (data[0] | ((unsigned)data[1] << 8) | ((unsigned)data[2] << 16) | ((unsigned)data[3] << 24));
+    b = data[4] | ((unsigned)data[5] << 8) | ((unsigned)data[6] << 16) | ((unsigned)data[7] << 24);
+    r = t[7][a & 0xff] ^ t[6][(a >> 8) & 0xff] ^ t[5][(a >> 16) & 0xff] ^ t[4][a >> 24]
+      ^ t[3][b & 0xff] ^ t[2][(b >> 8) & 0xff] ^ t[1][(b >> 16) & 0xff] ^ t[0][b >> 24];
+  }
+  for(; length != 0; ++data, --length) {
+    r = lodepng_crc32_table[(r ^ *data) & 0xff] ^ (r >> 8);
+  }
+  return r;
+}
+
+#ifdef LODEPNG_COMPILE_SIMD
+/*
+"Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction",
+Intel, 2009: four 128 bit lanes are folded 64 bytes on, then into one lane,
+which is reduced to 32 bits. length must be a multiple of 16, at least 64.
+*/
+static LODEPNG_TARGET_PCLMUL unsigned lodepng_crc32_pclmul(unsigned r, const unsigned char* data, size_t length) {
+  const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL); /*fold by 4*/
+  const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL); /*fold by 1*/
+  const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124LL); /*64 to 32 bits*/
+  const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL); /*Barrett: P' and mu*/
+  const __m128i low32 = _mm_setr_epi32(-1, 0, -1, 0);
+  __m128i x1, x2, x3, x4, y1, y2, y3, y4;
+
+  x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)data), _mm_cvtsi32_si128((int)r));
+  x2 = _mm_loadu_si128((const __m128i*)(data + 16));
+  x3 = _mm_loadu_si128((const __m128i*)(data + 32));
+  x4 = _mm_loadu_si128((const __m128i*)(data + 48));
+  data += 64;
+  length -= 64;
+
+  for(; length >= 64; data += 64, length -= 64) {
+    y1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    y2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    y3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    y4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k1k2, 0x11), y1);
+    x2 = _mm_xor_si128(_mm_clmulepi64_si128(x2, k1k2, 0x11), y2);
+    x3 = _mm_xor_si128(_mm_clmulepi64_si128(x3, k1k2, 0x11), y3);
+    x4 = _mm_xor_si128(_mm_clmulepi64_si128(x4, k1k2, 0x11), y4);
+    x1 = _mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)data));
+    x2 = _mm_xor_si128(x2, _mm_loadu_si128((const __m128i*)(data + 16)));
+    x3 = _mm_xor_si128(x3, _mm_loadu_si128((const __m128i*)(data + 32)));
+    x4 = _mm_xor_si128(x4, _mm_loadu_si128((const __m128i*)(data + 48)));
+  }
+
+  /*the four lanes into one, then the remaining 16 byte blocks*/
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), _mm_clmulepi64_si128(x1, k3k4, 0x00)), x2);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), _mm_clmulepi64_si128(x1, k3k4, 0x00)), x3);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), _mm_clmulepi64_si128(x1, k3k4, 0x00)), x4);
+  for(; length >= 16; data += 16, length -= 16) {
+    x2 = _mm_loadu_si128((const __m128i*)data);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), _mm_clmulepi64_si128(x1, k3k4, 0x00)), x2);
+  }
+
+  /*128 to 64 bits, 64 to 32 bits*/
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), _mm_clmulepi64_si128(x1, k3k4, 0x10));
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 4), _mm_clmulepi64_si128(_mm_and_si128(x1, low32), k5, 0x00));
+
+  /*Barrett reduction*/
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, low32), poly, 0x10);
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, low32), poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+#endif /*LODEPNG_COMPILE_SIMD*/
+
 /*Return the CRC of the bytes buf[0..len-1].*/
 unsigned lodepng_crc32(const unsigned char* data, size_t length) {
   unsigned r = 0xffffffffu;
-  size_t i;
-  for(i = 0; i < length; ++i) {
-    r = lodepng_crc32_table[(r ^ data[i]) & 0xff] ^ (r >> 8);
+#ifdef LODEPNG_COMPILE_SIMD
+  if(length >= 64 && (lodepng_cpu_features() & LODEPNG_CPU_PCLMUL)) {
+    size_t blocks = length & ~(size_t)15;
+    r = lodepng_crc32_pclmul(r, data, blocks);
+    data += blocks;
+    length -= blocks;
   }
-  return r ^ 0xffffffffu;
+#endif
+  return lodepng_crc32_slice8(r, data, length) ^ 0xffffffffu;
 }
 #else /* !LODEPNG_NO_COMPILE_CRC */
 unsigned lodepng_crc32(const unsigned char* data, size_t length);
@@ -3670,6 +4186,25 @@ static unsigned char paethPredictor(short a, short b, short c) {
   else return (unsigned char)a;
 }
 
+#ifdef LODEPNG_COMPILE_SIMD
+/*local addition: the Paeth predictor of 16 bit lanes, with the same tie breaking as paethPredictor*/
+static LODEPNG_TARGET_SSE2 __m128i paethPredictorSSE2(__m128i a, __m128i b, __m128i c) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i pa = _mm_sub_epi16(b, c);
+  __m128i pb = _mm_sub_epi16(a, c);
+  __m128i pc = _mm_add_epi16(pa, pb);
+  __m128i usec, useb;
+
+  pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+  pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+  pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+  usec = _mm_and_si128(_mm_cmplt_epi16(pc, pa), _mm_cmplt_epi16(pc, pb));
+  useb = _mm_andnot_si128(usec, _mm_cmplt_epi16(pb, pa));
+  return _mm_or_si128(_mm_or_si128(_mm_and_si128(usec, c), _mm_and_si128(useb, b)),
+                      _mm_andnot_si128(_mm_or_si128(usec, useb), a));
+}
+#endif /*LODEPNG_COMPILE_SIMD*/
+
 /*shared values used by multiple Adam7 related functions*/
 
 static const unsigned ADAM7_IX[7] = { 0, 4, 0, 2, 0, 1, 0 }; /*x start values*/
@@ -3786,6 +4321,109 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h, LodePNGState* state,
   return state->error;
 }
 
+#ifdef LODEPNG_COMPILE_SIMD
+/*
+Local addition: unfilterScanline for 3 and 4 byte pixels with SSE2. None, Sub
+and Up go 12 or 16 bytes at a time, Sub as a prefix sum. Average and Paeth
+need the pixel just decoded, so they go one pixel per step, but without the
+branches of paethPredictor. Every store only covers bytes already loaded, so
+recon may still be the same memory as scanline.
+*/
+static unsigned lodepng_load_pixel(const unsigned char* p, size_t bytewidth) {
+  return p[0] | ((unsigned)p[1] << 8) | ((unsigned)p[2] << 16) | (bytewidth == 4 ? (unsigned)p[3] << 24 : 0u);
+}
+
+static void lodepng_store_pixel(unsigned char* p, unsigned v, size_t bytewidth) {
+  p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v >> 8);
+  p[2] = (unsigned char)(v >> 16);
+  if(bytewidth == 4) p[3] = (unsigned char)(v >> 24);
+}
+
+/*returns 1 if the scanline was unfiltered, 0 to leave it to the portable code*/
+static LODEPNG_TARGET_SSE2 unsigned unfilterScanlineSSE2(unsigned char* recon, const unsigned char* scanline,
+                                                         const unsigned char* precon, size_t bytewidth,
+                                                         unsigned char filterType, size_t length) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i a, b, c, d, x;
+  size_t i = 0;
+
+  if(bytewidth != 3 && bytewidth != 4) return 0;
+  if(filterType == 4 && !precon) filterType = 1; /*paethPredictor(a, 0, 0) is always a*/
+
+  switch(filterType) {
+    case 0:
+      for(; i + 16 <= length; i += 16) {
+        _mm_storeu_si128((__m128i*)&recon[i], _mm_loadu_si128((const __m128i*)&scanline[i]));
+      }
+      for(; i != length; ++i) recon[i] = scanline[i];
+      break;
+    case 1:
+      a = zero; /*the last pixel decoded, in the low bytes*/
+      if(bytewidth == 4) {
+        for(; i + 16 <= length; i += 16) {
+          x = _mm_add_epi8(_mm_loadu_si128((const __m128i*)&scanline[i]), a);
+          x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+          x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+          _mm_storeu_si128((__m128i*)&recon[i], x);
+          a = _mm_srli_si128(x, 12);
+        }
+      } else {
+        /*4 pixels in 12 bytes, stored as 8 + 4 so nothing past them is written*/
+        __m128i mask = _mm_cvtsi32_si128(0xffffff);
+        for(; i + 16 <= length; i += 12) {
+          x = _mm_add_epi8(_mm_loadu_si128((const __m128i*)&scanline[i]), a);
+          x = _mm_add_epi8(x, _mm_slli_si128(x, 3));
+          x = _mm_add_epi8(x, _mm_slli_si128(x, 6));
+          _mm_storel_epi64((__m128i*)&recon[i], x);
+          lodepng_store_pixel(&recon[i + 8], (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(x, 8)), 4);
+          a = _mm_and_si128(_mm_srli_si128(x, 9), mask);
+        }
+      }
+      for(; i != length; i += bytewidth) {
+        a = _mm_add_epi8(a, _mm_cvtsi32_si128((int)lodepng_load_pixel(&scanline[i], bytewidth)));
+        lodepng_store_pixel(&recon[i], (unsigned)_mm_cvtsi128_si32(a), bytewidth);
+      }
+      break;
+    case 2:
+      if(!precon) return 0;
+      for(; i + 16 <= length; i += 16) {
+        x = _mm_add_epi8(_mm_loadu_si128((const __m128i*)&scanline[i]), _mm_loadu_si128((const __m128i*)&precon[i]));
+        _mm_storeu_si128((__m128i*)&recon[i], x);
+      }
+      for(; i != length; ++i) recon[i] = scanline[i] + precon[i];
+      break;
+    case 3:
+      a = zero;
+      b = zero;
+      for(; i != length; i += bytewidth) {
+        if(precon) b = _mm_cvtsi32_si128((int)lodepng_load_pixel(&precon[i], bytewidth));
+        d = _mm_cvtsi32_si128((int)lodepng_load_pixel(&scanline[i], bytewidth));
+        /*(a + b) >> 1 per byte: the rounded up average, less the bit it rounded*/
+        x = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+        a = _mm_add_epi8(d, x);
+        lodepng_store_pixel(&recon[i], (unsigned)_mm_cvtsi128_si32(a), bytewidth);
+      }
+      break;
+    case 4:
+      /*a and c start as 0, which makes the first pixel's predictor precon*/
+      a = zero;
+      c = zero;
+      for(; i != length; i += bytewidth) {
+        b = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)lodepng_load_pixel(&precon[i], bytewidth)), zero);
+        d = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)lodepng_load_pixel(&scanline[i], bytewidth)), zero);
+        x = _mm_add_epi8(_mm_packus_epi16(paethPredictorSSE2(a, b, c), zero), _mm_packus_epi16(d, zero));
+        lodepng_store_pixel(&recon[i], (unsigned)_mm_cvtsi128_si32(x), bytewidth);
+        a = _mm_unpacklo_epi8(x, zero);
+        c = b;
+      }
+      break;
+    default: return 0;
+  }
+  return 1;
+}
+#endif /*LODEPNG_COMPILE_SIMD*/
+
 static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
                                  size_t bytewidth, unsigned char filterType, size_t length) {
   /*
@@ -3798,6 +4436,9 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
   */
 
   size_t i;
+#ifdef LODEPNG_COMPILE_SIMD
+  if(unfilterScanlineSSE2(recon, scanline, precon, bytewidth, filterType, length)) return 0;
+#endif
   switch(filterType) {
     case 0:
       for(i = 0; i != length; ++i) recon[i] = scanline[i];
@@ -5038,44 +5679,211 @@ static unsigned addChunk_iCCP(ucvector* out, const LodePNGInfo* info, LodePNGCom
 
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
+#ifdef LODEPNG_COMPILE_SIMD
+/*
+Local addition: the body of filterScanline with SSE2, or AVX2 where the
+processor has it. An output byte only depends on input bytes, so any bytewidth
+goes 16 or 32 bytes at a time. They start at byte i, past the first pixel, and
+return where they stopped for the portable code to finish the scanline.
+*/
+static LODEPNG_TARGET_SSE2 size_t filterScanlineSSE2(unsigned char* out, const unsigned char* scanline,
+                                                     const unsigned char* prevline, size_t length,
+                                                     size_t bytewidth, unsigned char filterType, size_t i) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i a, b, c, x;
+
+  if(filterType == 2 && !prevline) filterType = 0;
+  if(filterType == 4 && !prevline) filterType = 1;
+
+  switch(filterType) {
+    case 0:
+      for(; i + 16 <= length; i += 16) {
+        _mm_storeu_si128((__m128i*)&out[i], _mm_loadu_si128((const __m128i*)&scanline[i]));
+      }
+      break;
+    case 1:
+      for(; i + 16 <= length; i += 16) {
+        x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+        a = _mm_loadu_si128((const __m128i*)&scanline[i - bytewidth]);
+        _mm_storeu_si128((__m128i*)&out[i], _mm_sub_epi8(x, a));
+      }
+      break;
+    case 2:
+      for(; i + 16 <= length; i += 16) {
+        x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+        b = _mm_loadu_si128((const __m128i*)&prevline[i]);
+        _mm_storeu_si128((__m128i*)&out[i], _mm_sub_epi8(x, b));
+      }
+      break;
+    case 3:
+      for(; i + 16 <= length; i += 16) {
+        x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+        a = _mm_loadu_si128((const __m128i*)&scanline[i - bytewidth]);
+        if(prevline) {
+          /*(a + b) >> 1 per byte: the rounded up average, less the bit it rounded*/
+          b = _mm_loadu_si128((const __m128i*)&prevline[i]);
+          a = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+        } else {
+          a = _mm_and_si128(_mm_srli_epi16(a, 1), _mm_set1_epi8(0x7f));
+        }
+        _mm_storeu_si128((__m128i*)&out[i], _mm_sub_epi8(x, a));
+      }
+      break;
+    case 4:
+      for(; i + 16 <= length; i += 16) {
+        x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+        a = _mm_loadu_si128((const __m128i*)&scanline[i - bytewidth]);
+        b = _mm_loadu_si128((const __m128i*)&prevline[i]);
+        c = _mm_loadu_si128((const __m128i*)&prevline[i - bytewidth]);
+        a = _mm_packus_epi16(paethPredictorSSE2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero),
+                                                _mm_unpacklo_epi8(c, zero)),
+                             paethPredictorSSE2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero),
+                                                _mm_unpackhi_epi8(c, zero)));
+        _mm_storeu_si128((__m128i*)&out[i], _mm_sub_epi8(x, a));
+      }
+      break;
+    default: break;
+  }
+  return i;
+}
+
+static LODEPNG_TARGET_AVX2 __m256i paethPredictorAVX2(__m256i a, __m256i b, __m256i c) {
+  __m256i pa = _mm256_abs_epi16(_mm256_sub_epi16(b, c));
+  __m256i pb = _mm256_abs_epi16(_mm256_sub_epi16(a, c));
+  __m256i pc = _mm256_abs_epi16(_mm256_sub_epi16(_mm256_add_epi16(a, b), _mm256_add_epi16(c, c)));
+  __m256i usec = _mm256_and_si256(_mm256_cmpgt_epi16(pa, pc), _mm256_cmpgt_epi16(pb, pc));
+  __m256i useb = _mm256_cmpgt_epi16(pa, pb);
+  return _mm256_blendv_epi8(_mm256_blendv_epi8(a, b, useb), c, usec);
+}
+
+static LODEPNG_TARGET_AVX2 size_t filterScanlineAVX2(unsigned char* out, const unsigned char* scanline,
+                                                     const unsigned char* prevline, size_t length,
+                                                     size_t bytewidth, unsigned char filterType, size_t i) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i a, b, c, x;
+
+  if(filterType == 2 && !prevline) filterType = 0;
+  if(filterType == 4 && !prevline) filterType = 1;
+
+  switch(filterType) {
+    case 0:
+      for(; i + 32 <= length; i += 32) {
+        _mm256_storeu_si256((__m256i*)&out[i], _mm256_loadu_si256((const __m256i*)&scanline[i]));
+      }
+      break;
+    case 1:
+      for(; i + 32 <= length; i += 32) {
+        x = _mm256_loadu_si256((const __m256i*)&scanline[i]);
+        a = _mm256_loadu_si256((const __m256i*)&scanline[i - bytewidth]);
+        _mm256_storeu_si256((__m256i*)&out[i], _mm256_sub_epi8(x, a));
+      }
+      break;
+    case 2:
+      for(; i + 32 <= length; i += 32) {
+        x = _mm256_loadu_si256((const __m256i*)&scanline[i]);
+        b = _mm256_loadu_si256((const __m256i*)&prevline[i]);
+        _mm256_storeu_si256((__m256i*)&out[i], _mm256_sub_epi8(x, b));
+      }
+      break;
+    case 3:
+      for(; i + 32 <= length; i += 32) {
+        x = _mm256_loadu_si256((const __m256i*)&scanline[i]);
+        a = _mm256_loadu_si256((const __m256i*)&scanline[i - bytewidth]);
+        if(prevline) {
+          b = _mm256_loadu_si256((const __m256i*)&prevline[i]);
+          a = _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), _mm256_set1_epi8(1)));
+        } else {
+          a = _mm256_and_si256(_mm256_srli_epi16(a, 1), _mm256_set1_epi8(0x7f));
+        }
+        _mm256_storeu_si256((__m256i*)&out[i], _mm256_sub_epi8(x, a));
+      }
+      break;
+    case 4:
+      /*unpack and pack both work within 128 bit lanes, so the bytes end up in order*/
+      for(; i + 32 <= length; i += 32) {
+        x = _mm256_loadu_si256((const __m256i*)&scanline[i]);
+        a = _mm256_loadu_si256((const __m256i*)&scanline[i - bytewidth]);
+        b = _mm256_loadu_si256((const __m256i*)&prevline[i]);
+        c = _mm256_loadu_si256((const __m256i*)&prevline[i - bytewidth]);
+        a = _mm256_packus_epi16(paethPredictorAVX2(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero),
+                                                   _mm256_unpacklo_epi8(c, zero)),
+                                paethPredictorAVX2(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero),
+                                                   _mm256_unpackhi_epi8(c, zero)));
+        _mm256_storeu_si256((__m256i*)&out[i], _mm256_sub_epi8(x, a));
+      }
+      break;
+    default: break;
+  }
+  return i;
+}
+
+/*the sum filter() ranks the filtered scanlines by, with the difference bytes taken as signed*/
+static LODEPNG_TARGET_SSE2 size_t filterSumSSE2(const unsigned char* line, size_t length, unsigned isdelta) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i ones = _mm_set1_epi8(-1);
+  __m128i sum = zero;
+  __m128i x;
+  size_t i = 0, result;
+
+  for(; i + 16 <= length; i += 16) {
+    x = _mm_loadu_si128((const __m128i*)&line[i]);
+    if(isdelta) x = _mm_min_epu8(x, _mm_xor_si128(x, ones)); /*s < 128 ? s : 255 - s*/
+    sum = _mm_add_epi64(sum, _mm_sad_epu8(x, zero));
+  }
+  result = (size_t)_mm_cvtsi128_si64(sum) + (size_t)_mm_cvtsi128_si64(_mm_srli_si128(sum, 8));
+  for(; i != length; ++i) result += isdelta ? (line[i] < 128 ? line[i] : 255U - line[i]) : line[i];
+  return result;
+}
+#endif /*LODEPNG_COMPILE_SIMD*/
+
 static void filterScanline(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
                            size_t length, size_t bytewidth, unsigned char filterType) {
   size_t i;
+  size_t start = bytewidth; /*local addition: the bytes after the first pixel the SIMD code left*/
+#ifdef LODEPNG_COMPILE_SIMD
+  if(lodepng_cpu_features() & LODEPNG_CPU_AVX2) {
+    start = filterScanlineAVX2(out, scanline, prevline, length, bytewidth, filterType, start);
+  }
+  start = filterScanlineSSE2(out, scanline, prevline, length, bytewidth, filterType, start);
+#endif
   switch(filterType) {
     case 0: /*None*/
-      for(i = 0; i != length; ++i) out[i] = scanline[i];
+      for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
+      for(i = start; i < length; ++i) out[i] = scanline[i];
       break;
     case 1: /*Sub*/
       for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
-      for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - scanline[i - bytewidth];
+      for(i = start; i < length; ++i) out[i] = scanline[i] - scanline[i - bytewidth];
       break;
     case 2: /*Up*/
       if(prevline) {
-        for(i = 0; i != length; ++i) out[i] = scanline[i] - prevline[i];
+        for(i = 0; i != bytewidth; ++i) out[i] = scanline[i] - prevline[i];
+        for(i = start; i < length; ++i) out[i] = scanline[i] - prevline[i];
       } else {
-        for(i = 0; i != length; ++i) out[i] = scanline[i];
+        for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
+        for(i = start; i < length; ++i) out[i] = scanline[i];
       }
       break;
     case 3: /*Average*/
       if(prevline) {
         for(i = 0; i != bytewidth; ++i) out[i] = scanline[i] - (prevline[i] >> 1);
-        for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) >> 1);
+        for(i = start; i < length; ++i) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) >> 1);
       } else {
         for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
-        for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - (scanline[i - bytewidth] >> 1);
+        for(i = start; i < length; ++i) out[i] = scanline[i] - (scanline[i - bytewidth] >> 1);
       }
       break;
     case 4: /*Paeth*/
       if(prevline) {
         /*paethPredictor(0, prevline[i], 0) is always prevline[i]*/
         for(i = 0; i != bytewidth; ++i) out[i] = (scanline[i] - prevline[i]);
-        for(i = bytewidth; i < length; ++i) {
+        for(i = start; i < length; ++i) {
           out[i] = (scanline[i] - paethPredictor(scanline[i - bytewidth], prevline[i], prevline[i - bytewidth]));
         }
       } else {
         for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
         /*paethPredictor(scanline[i - bytewidth], 0, 0) is always scanline[i - bytewidth]*/
-        for(i = bytewidth; i < length; ++i) out[i] = (scanline[i] - scanline[i - bytewidth]);
+        for(i = start; i < length; ++i) out[i] = (scanline[i] - scanline[i - bytewidth]);
       }
       break;
     default: return; /*unexisting filter type given*/
@@ -5090,12 +5898,14 @@ static float flog2(float f) {
   return result + 1.442695f * (f * f * f / 3 - 3 * f * f / 2 + 3 * f - 1.83333f);
 }
 
-static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+static unsigned filter(unsigned char* out, const unsigned char* in, const unsigned char* prevline,
+                       unsigned w, unsigned h,
                        const LodePNGColorMode* info, const LodePNGEncoderSettings* settings) {
   /*
   For PNG filter method 0
   out must be a buffer with as size: h + (w * h * bpp + 7) / 8, because there are
   the scanlines with 1 extra byte per scanline
+  prevline is the scanline above in, or null for the first scanline of the image (local addition)
   */
 
   unsigned bpp = lodepng_get_bpp(info);
@@ -5103,7 +5913,6 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
   size_t linebytes = (w * bpp + 7) / 8;
   /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
   size_t bytewidth = (bpp + 7) / 8;
-  const unsigned char* prevline = 0;
   unsigned x, y;
   unsigned error = 0;
   LodePNGFilterStrategy strategy = settings->filter_strategy;
@@ -5153,6 +5962,9 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
           filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
 
           /*calculate the sum of the result*/
+#ifdef LODEPNG_COMPILE_SIMD
+          sum[type] = filterSumSSE2(attempt[type], linebytes, type != 0);
+#else
           sum[type] = 0;
           if(type == 0) {
             for(x = 0; x != linebytes; ++x) sum[type] += (unsigned char)(attempt[type][x]);
@@ -5165,6 +5977,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
               sum[type] += s < 128 ? s : (255U - s);
             }
           }
+#endif
 
           /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
           if(type == 0 || sum[type] < smallest) {
@@ -5250,6 +6063,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     images only, so disable it*/
     zlibsettings.custom_zlib = 0;
     zlibsettings.custom_deflate = 0;
+    zlibsettings.custom_deflate_part = 0;
     for(type = 0; type != 5; ++type) {
       attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
       if(!attempt[type]) return 83; /*alloc fail*/
@@ -5375,12 +6189,12 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
         if(!padded) error = 83; /*alloc fail*/
         if(!error) {
           addPaddingBits(padded, in, ((w * bpp + 7) / 8) * 8, w * bpp, h);
-          error = filter(*out, padded, w, h, &info_png->color, settings);
+          error = filter(*out, padded, 0, w, h, &info_png->color, settings);
         }
         lodepng_free(padded);
       } else {
         /*we can immediately filter into the out buffer, no other steps needed*/
-        error = filter(*out, in, w, h, &info_png->color, settings);
+        error = filter(*out, in, 0, w, h, &info_png->color, settings);
       }
     }
   } else /*interlace_method is 1 (Adam7)*/ {
@@ -5407,11 +6221,11 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
           if(!padded) ERROR_BREAK(83); /*alloc fail*/
           addPaddingBits(padded, &adam7[passstart[i]],
                          ((passw[i] * bpp + 7) / 8) * 8, passw[i] * bpp, passh[i]);
-          error = filter(&(*out)[filter_passstart[i]], padded,
+          error = filter(&(*out)[filter_passstart[i]], padded, 0,
                          passw[i], passh[i], &info_png->color, settings);
           lodepng_free(padded);
         } else {
-          error = filter(&(*out)[filter_passstart[i]], &adam7[padded_passstart[i]],
+          error = filter(&(*out)[filter_passstart[i]], &adam7[padded_passstart[i]], 0,
                          passw[i], passh[i], &info_png->color, settings);
         }
 
@@ -5708,6 +6522,183 @@ cleanup:
   return state->error;
 }
 
+/*local addition: the streaming encoder*/
+
+/*IDAT chunk data size of the streaming encoder*/
+#define STREAM_IDAT_SIZE 65536
+
+static unsigned streamWrite(LodePNGStream* stream, const unsigned char* data, size_t size) {
+  if(stream->write(stream->context, data, size)) return 120; /*error: the write function failed*/
+  return 0;
+}
+
+/*write out the IDAT chunk being filled*/
+static unsigned streamFlush(LodePNGStream* stream) {
+  unsigned char* chunk = stream->idat;
+  lodepng_set32bitInt(chunk, (unsigned)stream->idatused);
+  lodepng_chunk_generate_crc(chunk);
+  stream->idatused = 0;
+  return streamWrite(stream, chunk, lodepng_chunk_length(chunk) + 12);
+}
+
+/*add zlib data to the IDAT chunk being filled, writing out every chunk that fills up*/
+static unsigned streamAppend(LodePNGStream* stream, const unsigned char* data, size_t size) {
+  while(size > 0) {
+    size_t amount = STREAM_IDAT_SIZE - stream->idatused;
+    if(amount > size) amount = size;
+    memcpy(stream->idat + 8 + stream->idatused, data, amount);
+    stream->idatused += amount;
+    data += amount;
+    size -= amount;
+    if(stream->idatused == STREAM_IDAT_SIZE) CERROR_TRY_RETURN(streamFlush(stream));
+  }
+  return 0;
+}
+
+unsigned lodepng_stream_begin(LodePNGStream* stream, LodePNGState* state, unsigned w, unsigned h,
+                              LodePNGStreamWrite write, void* context) {
+  const LodePNGColorMode* color = &state->info_png.color;
+  ucvector outv;
+  /*zlib header as in lodepng_zlib_compress: 32K window, no dictionary*/
+  static const unsigned char zlibheader[2] = {0x78, 0x01};
+
+  memset(stream, 0, sizeof(*stream));
+  stream->state = state;
+  stream->write = write;
+  stream->context = context;
+  stream->w = w;
+  stream->h = h;
+  stream->adler = 1;
+  state->error = 0;
+
+  /*check input values validity*/
+  if(state->encoder.zlibsettings.btype > 2) CERROR_RETURN_ERROR(state->error, 61);
+  if(w == 0 || h == 0) CERROR_RETURN_ERROR(state->error, 93);
+  state->error = checkColorValidity(color->colortype, color->bitdepth);
+  if(state->error) return state->error;
+  state->error = checkColorValidity(state->info_raw.colortype, state->info_raw.bitdepth);
+  if(state->error) return state->error;
+  if(state->info_png.interlace_method != 0 || color->colortype == LCT_PALETTE || color->bitdepth < 8) {
+    CERROR_RETURN_ERROR(state->error, 121);
+  }
+
+  stream->linebytes = (size_t)w * lodepng_get_bpp(color) / 8;
+  stream->prevline = (unsigned char*)lodepng_malloc(stream->linebytes);
+  stream->window = (unsigned char*)lodepng_malloc(state->encoder.zlibsettings.windowsize);
+  stream->idat = (unsigned char*)lodepng_malloc(STREAM_IDAT_SIZE + 12);
+  if(!stream->prevline || !stream->window || !stream->idat) CERROR_RETURN_ERROR(state->error, 83);
+  memcpy(stream->idat + 4, "IDAT", 4);
+
+  ucvector_init(&outv);
+  writeSignature(&outv);
+  state->error = addChunk_IHDR(&outv, w, h, color->colortype, color->bitdepth, 0);
+  if(!state->error && (color->colortype == LCT_GREY || color->colortype == LCT_RGB) && color->key_defined) {
+    state->error = addChunk_tRNS(&outv, color);
+  }
+  if(!state->error) state->error = streamWrite(stream, outv.data, outv.size);
+  ucvector_cleanup(&outv);
+  if(!state->error) state->error = streamAppend(stream, zlibheader, 2);
+
+  return state->error;
+}
+
+unsigned lodepng_stream_rows(LodePNGStream* stream, const unsigned char* rows, unsigned numrows) {
+  LodePNGState* state = stream->state;
+  const LodePNGCompressSettings* zlibsettings = &state->encoder.zlibsettings;
+  LodePNGEncoderSettings settings = state->encoder;
+  size_t history = stream->windowused;
+  size_t filtersize = (size_t)numrows * (stream->linebytes + 1);
+  size_t keep;
+  unsigned char* data;
+  unsigned char* converted = 0;
+  unsigned char* deflated = 0;
+  size_t deflatedsize = 0;
+  unsigned last;
+
+  if(state->error) return state->error;
+  if(numrows > stream->h - stream->y) CERROR_RETURN_ERROR(state->error, 122);
+  if(numrows == 0) return 0;
+  last = stream->y + numrows == stream->h;
+
+  if(!lodepng_color_mode_equal(&state->info_raw, &state->info_png.color)) {
+    converted = (unsigned char*)lodepng_malloc((size_t)numrows * stream->linebytes);
+    if(!converted) CERROR_RETURN_ERROR(state->error, 83);
+    state->error = lodepng_convert(converted, rows, &state->info_png.color, &state->info_raw, stream->w, numrows);
+    if(state->error) {
+      lodepng_free(converted);
+      return state->error;
+    }
+    rows = converted;
+  }
+
+  /*the filtered band goes after the end of the previous one, which deflate may refer back to*/
+  data = (unsigned char*)lodepng_malloc(history + filtersize);
+  if(!data) {
+    lodepng_free(converted);
+    CERROR_RETURN_ERROR(state->error, 83);
+  }
+  if(history) memcpy(data, stream->window, history);
+
+  if(settings.predefined_filters) settings.predefined_filters += stream->y;
+  state->error = filter(data + history, rows, stream->y ? stream->prevline : 0, stream->w, numrows,
+                        &state->info_png.color, &settings);
+  if(!state->error) {
+    /*the whole band at once here rather than per part in custom_deflate_part: with
+    SIMD this is cheap next to deflate, and needs no combining of checksums*/
+    stream->adler = lodepng_adler32(stream->adler, data + history, filtersize);
+    if(zlibsettings->custom_deflate_part) {
+      state->error = zlibsettings->custom_deflate_part(&deflated, &deflatedsize, data, history,
+                                                       history + filtersize, zlibsettings, last);
+    } else {
+      state->error = lodepng_deflate_part(&deflated, &deflatedsize, data, history,
+                                          history + filtersize, zlibsettings, last);
+    }
+  }
+  if(!state->error) state->error = streamAppend(stream, deflated, deflatedsize);
+  lodepng_free(deflated);
+
+  if(!state->error) {
+    keep = history + filtersize;
+    if(keep > zlibsettings->windowsize) keep = zlibsettings->windowsize;
+    memcpy(stream->window, data + history + filtersize - keep, keep);
+    stream->windowused = keep;
+    memcpy(stream->prevline, rows + (size_t)(numrows - 1) * stream->linebytes, stream->linebytes);
+    stream->y += numrows;
+  }
+  lodepng_free(data);
+  lodepng_free(converted);
+
+  return state->error;
+}
+
+unsigned lodepng_stream_finish(LodePNGStream* stream) {
+  LodePNGState* state = stream->state;
+  unsigned char trailer[4];
+  ucvector outv;
+
+  if(!state->error && stream->y != stream->h) state->error = 122;
+  if(!state->error) {
+    lodepng_set32bitInt(trailer, stream->adler);
+    state->error = streamAppend(stream, trailer, 4);
+  }
+  if(!state->error && stream->idatused) state->error = streamFlush(stream);
+  if(!state->error) {
+    ucvector_init(&outv);
+    state->error = addChunk_IEND(&outv);
+    if(!state->error) state->error = streamWrite(stream, outv.data, outv.size);
+    ucvector_cleanup(&outv);
+  }
+
+  lodepng_free(stream->prevline);
+  lodepng_free(stream->window);
+  lodepng_free(stream->idat);
+  stream->prevline = 0;
+  stream->window = 0;
+  stream->idat = 0;
+
+  return state->error;
+}
+
 unsigned lodepng_encode_memory(unsigned char** out, size_t* outsize, const unsigned char* image,
                                unsigned w, unsigned h, LodePNGColorType colortype, unsigned bitdepth) {
   unsigned error;
@@ -5879,6 +6870,10 @@ const char* lodepng_error_text(unsigned code) {
     case 102: return "not allowed to set grayscale ICC profile with colored pixels by PNG specification";
     case 103: return "invalid palette index in bKGD chunk. Maybe it came before PLTE chunk?";
     case 104: return "invalid bKGD color while encoding (e.g. palette index out of range)";
+    /*local additions, the streaming encoder*/
+    case 120: return "the streaming encoder's write function failed";
+    case 121: return "the streaming encoder needs a non-interlaced PNG of 8 bit or more per channel, no palette";
+    case 122: return "the streaming encoder was not given exactly the image height of scanlines";
   }
   return "unknown error code";
 }
@@ -33,6 +33,7 @@ freely, subject to the following restrictions:
 #ifdef EFIAPI
 #include <Uefi.h>
 #include <Library/UefiBootServicesTableLib.h>
+#include <Library/BaseMemoryLib.h>
 #include <Library/DebugLib.h>
 
 #define LODEPNG_NO_COMPILE_CPP
@@ -57,6 +58,23 @@ typedef INT8   int8_t;
 void* lodepng_malloc(size_t size);
 void* lodepng_realloc(void* ptr, size_t new_size);
 void lodepng_free(void* ptr);
+
+/*
+Local addition: code running on an AP must not call boot services, so while
+lodepng_arena is set, allocations on a processor it returns an arena for are
+taken from that arena instead of pool. Only the last block allocated is really
+freed or resized in place; the owner empties the arena by resetting used. Not
+every allocation failure is reported by the encoder, so output produced after
+full was set is not valid.
+*/
+typedef struct LodePNGArena {
+  unsigned char* data;
+  size_t size;
+  size_t used;
+  unsigned full; /*set when an allocation did not fit*/
+} LodePNGArena;
+
+extern LodePNGArena* (*lodepng_arena)(void);
 #else
 #include <string.h> /*for size_t*/
 #endif
@@ -115,6 +133,12 @@ source files with custom allocators.*/
 #define LODEPNG_COMPILE_ALLOCATORS
 #endif
 
+/*local addition: SSE2 and, where the processor has them, AVX2 kernels for the
+PNG filters on x86-64. The portable code is always compiled as the fallback.*/
+#if !defined(LODEPNG_NO_COMPILE_SIMD) && (defined(__x86_64__) || defined(_M_X64))
+#define LODEPNG_COMPILE_SIMD
+#endif
+
 /*compile the C++ version (you can disable the C++ wrapper here even when compiling for C++)*/
 #ifdef __cplusplus
 #ifndef LODEPNG_NO_COMPILE_CPP
@@ -329,6 +353,10 @@ struct LodePNGCompressSettings /*deflate = compress*/ {
   unsigned minmatch; /*mininum lz77 length. 3 is normally best, 6 can be better for some PNGs. Default: 0*/
   unsigned nicematch; /*stop searching if >= this length found. Set to 258 for best compression. Default: 128*/
   unsigned lazymatching; /*use lazy matching: better compression but a bit slower. Default: true*/
+  /*local addition: find matches with one probe of a 4 byte hash table and take them
+  greedily, like zlib level 1. Several times faster, output a little larger. nicematch
+  and lazymatching are then not used. Default: false*/
+  unsigned fastmatch;
 
   /*use custom zlib encoder instead of built in one (default: null)*/
   unsigned (*custom_zlib)(unsigned char**, size_t*,
@@ -340,6 +368,11 @@ struct LodePNGCompressSettings /*deflate = compress*/ {
   unsigned (*custom_deflate)(unsigned char**, size_t*,
                              const unsigned char*, size_t,
                              const LodePNGCompressSettings*);
+  /*local addition: use custom function instead of lodepng_deflate_part in the
+  streaming encoder (default: null)*/
+  unsigned (*custom_deflate_part)(unsigned char**, size_t*,
+                                  const unsigned char*, size_t, size_t,
+                                  const LodePNGCompressSettings*, unsigned);
 
   const void* custom_context; /*optional custom settings for custom functions*/
 };
@@ -827,6 +860,48 @@ unsigned lodepng_inspect_chunk(LodePNGState* state, size_t pos,
 unsigned lodepng_encode(unsigned char** out, size_t* outsize,
                         const unsigned char* image, unsigned w, unsigned h,
                         LodePNGState* state);
+
+/*
+Local addition: streaming encoder, for images too large to hold several copies of.
+Scanlines are given in bands from the top. Each band is filtered and deflated when
+it is given, the deflate window carrying over from the band before, and the zlib
+data is passed to the write function in IDAT chunks of 64K as each fills up.
+Memory used is about three times the band in the PNG color (converted, filtered
+and deflated), plus the deflate window, one IDAT chunk and about 1.4MB of deflate
+working memory: some 6.5MB for a 2MB RGBA band encoded to RGB. A custom_deflate_part
+adds its own; ScreenShot's ParallelZlib keeps up to 16MB of per-processor arenas and
+slots of about 1.1 times the band, some 22MB in all.
+The image is converted from info_raw to info_png.color as with auto_convert off,
+which must be non-interlaced, 8 or more bits per channel and without palette.
+Only the IHDR, tRNS, IDAT and IEND chunks are written.
+
+lodepng_stream_begin writes the PNG header, lodepng_stream_rows takes the next
+numrows scanlines and lodepng_stream_finish writes the end of the PNG. Call
+lodepng_stream_finish after lodepng_stream_begin also to give up after an error, it
+frees the stream. Each returns the first error, also kept in state->error. The
+state must stay valid until lodepng_stream_finish.
+*/
+typedef unsigned (*LodePNGStreamWrite)(void* context, const unsigned char* data, size_t size);
+
+typedef struct LodePNGStream {
+  LodePNGState* state;
+  LodePNGStreamWrite write; /*returns nonzero if writing failed*/
+  void* context;
+  unsigned w, h;
+  unsigned y; /*scanlines given so far*/
+  size_t linebytes; /*of a scanline in the PNG color, without filter type*/
+  unsigned char* prevline; /*last scanline of the band before, for filtering*/
+  unsigned char* window; /*end of the filtered band before, for deflate to refer back to*/
+  size_t windowused;
+  unsigned char* idat; /*IDAT chunk being filled*/
+  size_t idatused;
+  unsigned adler;
+} LodePNGStream;
+
+unsigned lodepng_stream_begin(LodePNGStream* stream, LodePNGState* state, unsigned w, unsigned h,
+                              LodePNGStreamWrite write, void* context);
+unsigned lodepng_stream_rows(LodePNGStream* stream, const unsigned char* rows, unsigned numrows);
+unsigned lodepng_stream_finish(LodePNGStream* stream);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 /*
@@ -932,6 +1007,12 @@ buffer. It cannot be used to create gzip files however, and it only supports the
 part of zlib that is required for PNG, it does not support dictionaries.
 */
 
+/*
+Local addition: update the Adler-32 checksum adler (1 to start) with the bytes
+data[0..len-1], as used in the zlib trailer. SSSE3 or AVX2 when available.
+*/
+unsigned lodepng_adler32(unsigned adler, const unsigned char* data, size_t len);
+
 #ifdef LODEPNG_COMPILE_DECODER
 /*Inflate a buffer. Inflate is the decompression step of deflate. Out buffer must be freed after use.*/
 unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
@@ -973,6 +1054,18 @@ unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGCompressSettings* settings);
 
+/*
+Local addition: compress in[start..insize-1] as one part of a longer deflate stream.
+Matches may refer back to the bytes before start, up to the window size, which
+must be the data of the parts before. Unless last, no block is marked final and
+the output ends on a byte boundary, after an empty stored block (a zlib sync
+flush) if needed, so parts compressed independently can simply be concatenated.
+start must not be larger than insize.
+*/
+unsigned lodepng_deflate_part(unsigned char** out, size_t* outsize,
+                              const unsigned char* in, size_t start, size_t insize,
+                              const LodePNGCompressSettings* settings, unsigned last);
+
 #endif /*LODEPNG_COMPILE_ENCODER*/
 #endif /*LODEPNG_COMPILE_ZLIB*/
 
@@ -1782,6 +1875,7 @@ state.encoder.zlibsettings.windowsize: tweak LZ77 windowsize
 state.encoder.zlibsettings.minmatch: tweak min LZ77 length to match
 state.encoder.zlibsettings.nicematch: tweak LZ77 match where to stop searching
 state.encoder.zlibsettings.lazymatching: try one more LZ77 matching
+state.encoder.zlibsettings.fastmatch: single probe greedy LZ77, for speed
 state.encoder.zlibsettings.custom_...: use custom deflate function
 state.encoder.auto_convert: choose optimal PNG color type, if 0 uses info_png
 state.encoder.filter_palette_zero: PNG filter strategy for palette
@@ -42,6 +42,9 @@
 #include <IndustryStandard/Bmp.h>
 #endif
 
+#include "../ScreenShot/PixelConvert.h"
+#include "../ScreenShot/ScreenShotUtil.h"
+
 STATIC EFI_LOADED_IMAGE                 *gModuleSelfLoadedImage     = NULL;
 STATIC EFI_FILE_HANDLE                  gModuleSelfRootDir          = NULL;
 STATIC EFI_DEVICE_PATH_PROTOCOL         *gDevicePath                = NULL;
@@ -85,7 +88,7 @@ typedef enum {
     White
 } COLOR;
 
-#define UTILITY_VERSION L"20190314"
+#define UTILITY_VERSION L"20190424"
 
 // determines the size of status square
 #define STATUS_SQUARE_SIDE 10
@@ -102,6 +105,7 @@ EFI_DRIVER_BINDING_PROTOCOL gScreenshotDriverBinding = {
 };
 
 EFI_HANDLE SimpleTextInExHandle;
+EFI_HANDLE SimpleTextInExFastHandle;
 
 GLOBAL_REMOVE_IF_UNREFERENCED
 EFI_COMPONENT_NAME2_PROTOCOL gScreenshotDriverComponentName2 = {
@@ -365,7 +369,8 @@ SaveImage( CHAR16 *FileName,
 EFI_STATUS
 PreparePNGFile( EFI_GRAPHICS_OUTPUT_BLT_PIXEL *BltBuffer,
                 UINT32 Width,
-                UINT32 Height )
+                UINT32 Height,
+                BOOLEAN Fast )
 {
     UINTN           ImageSize;
     UINTN           i;
@@ -374,25 +379,28 @@ PreparePNGFile( EFI_GRAPHICS_OUTPUT_BLT_PIXEL *BltBuffer,
     EFI_STATUS      Status;
     EFI_TIME          Time;
     CHAR16            FileName[40]; 
+    LodePNGState      State;
 
     Status = EFI_SUCCESS;
 
     ImageSize = (Width * Height);
 
     // Convert BGR to RGBA with Alpha set to 0xFF
-    for (i = 0; i < ImageSize; i++) {
-        UINT8 Temp;
-
-        Temp = BltBuffer[i].Blue;
-
-        BltBuffer[i].Blue = BltBuffer[i].Red;
-        BltBuffer[i].Red = Temp;
-        BltBuffer[i].Reserved = 0xFF;
+    PixelBgraToRgba( PixelBestKernel(), (UINT32 *)BltBuffer, ImageSize );
+
+    // Encode raw RGBA image to PNG format as lodepng_encode32() does
+    lodepng_state_init(&State);
+    State.info_raw.colortype = LCT_RGBA;
+    State.info_raw.bitdepth = 8;
+    State.info_png.color.colortype = LCT_RGBA;
+    State.info_png.color.bitdepth = 8;
+    if (Fast) {
+        ScreenShotFastDeflate( &State.encoder.zlibsettings );
     }
 
-    // Encode raw RGB image to PNG format
     PngFile = NULL;
-    i = lodepng_encode32(&PngFile, &PngFileSize, (CONST UINT8*)BltBuffer, Width, Height);
+    i = lodepng_encode(&PngFile, &PngFileSize, (CONST UINT8*)BltBuffer, Width, Height, &State);
+    lodepng_state_cleanup(&State);
     if (i == 0) {
         Status = gRT->GetTime(&Time, NULL);
         if (!EFI_ERROR(Status)) {
@@ -425,7 +433,8 @@ PrepareBMPFile( EFI_GRAPHICS_OUTPUT_BLT_PIXEL *BltBuffer,
     UINT8            *ImagePtr;
     UINT8            *ImagePtrBase;
     UINTN            ImageLineOffset;
-    UINTN            x, y;
+    UINTN            y;
+    PIXEL_KERNEL     Kernel;
 
     ImageLineOffset = Width * 3;
     if ((ImageLineOffset % 4) != 0) {
@@ -457,18 +466,14 @@ PrepareBMPFile( EFI_GRAPHICS_OUTPUT_BLT_PIXEL *BltBuffer,
     BmpHeader->YPixelsPerMeter = 0;
     
     // fill pixel buffer
+    Kernel = PixelBestKernel();
     ImagePtrBase = FileData + BmpHeader->ImageOffset;
     for (y = 0; y < Height; y++) {
         ImagePtr = ImagePtrBase;
         ImagePtrBase += ImageLineOffset;
         Pixel = BltBuffer + (Height - 1 - y) * Width;
-        
-        for (x = 0; x < Width; x++) {
-            *ImagePtr++ = Pixel->Blue;
-            *ImagePtr++ = Pixel->Green;
-            *ImagePtr++ = Pixel->Red;
-            Pixel++;
-        }
+
+        PixelBgraToBgr( Kernel, ImagePtr, (CONST UINT32 *)Pixel, Width );
     }
 
     FreePool(BltBuffer);
@@ -491,16 +496,55 @@ PrepareBMPFile( EFI_GRAPHICS_OUTPUT_BLT_PIXEL *BltBuffer,
 #endif
 
 
+//
+// The top left of the region in the linear framebuffer, or NULL when
+// the mode has none in a 32 bit format or the region is not all inside
+// it and Blt has to be used
+//
+STATIC
+CONST UINT32 *
+FrameBufferRegion( EFI_GRAPHICS_OUTPUT_PROTOCOL *Gop,
+                   UINTN StartX,
+                   UINTN StartY,
+                   UINTN Width,
+                   UINTN Height )
+{
+    EFI_GRAPHICS_OUTPUT_MODE_INFORMATION *Info = Gop->Mode->Info;
+
+    if (Gop->Mode->FrameBufferBase == 0 ||
+        (Info->PixelFormat != PixelBlueGreenRedReserved8BitPerColor &&
+         Info->PixelFormat != PixelRedGreenBlueReserved8BitPerColor) ||
+        StartX + Width > Info->HorizontalResolution ||
+        StartY + Height > Info->VerticalResolution ||
+        Info->PixelsPerScanLine < Info->HorizontalResolution ||
+        (StartY + Height) * Info->PixelsPerScanLine * sizeof(UINT32) > Gop->Mode->FrameBufferSize) {
+        return NULL;
+    }
+
+    return (CONST UINT32 *)(UINTN)Gop->Mode->FrameBufferBase + StartY * Info->PixelsPerScanLine + StartX;
+}
+
+
+//
+// The region is read straight from the framebuffer when possible,
+// which skips the firmware's Blt and its copy. The path and time
+// taken are logged at DEBUG_INFO.
+//
 EFI_STATUS
 SnapShot( EFI_GRAPHICS_OUTPUT_PROTOCOL *Gop, 
           UINTN StartX, 
           UINTN StartY,
           UINTN Width, 
-          UINTN Height ) 
+          UINTN Height,
+          BOOLEAN Fast ) 
 {
     EFI_GRAPHICS_OUTPUT_BLT_PIXEL *BltBuffer = NULL;
     EFI_STATUS Status = EFI_SUCCESS;
     UINTN      ImageSize;  
+    CONST UINT32 *FrameBuffer;
+    PIXEL_KERNEL Kernel;
+    BOOLEAN    Rgb;
+    UINT64     Start;
 
     ImageSize = Width * Height;
             
@@ -512,15 +556,31 @@ SnapShot( EFI_GRAPHICS_OUTPUT_PROTOCOL *Gop,
     }
 
     // take screenshot
-    Status = Gop->Blt( Gop, BltBuffer, EfiBltVideoToBltBuffer, StartX, StartY, 0, 0, Width, Height, 0 );
-    if (EFI_ERROR(Status)) {
-        DEBUG((DEBUG_ERROR, "Gop->Blt [%d]\n", Status));
-        FreePool( BltBuffer );
-        return Status;
+    Start = AsmReadTsc();
+    FrameBuffer = FrameBufferRegion( Gop, StartX, StartY, Width, Height );
+    if (FrameBuffer != NULL) {
+        Kernel = PixelBestKernel();
+        Rgb = (BOOLEAN)(Gop->Mode->Info->PixelFormat == PixelRedGreenBlueReserved8BitPerColor);
+        for (UINTN y = 0; y < Height; y++) {
+            PixelReadFrameBuffer( Kernel, (UINT32 *)(BltBuffer + y * Width),
+                                  FrameBuffer + y * Gop->Mode->Info->PixelsPerScanLine, Width, Rgb );
+        }
+    } else {
+        Status = Gop->Blt( Gop, BltBuffer, EfiBltVideoToBltBuffer, StartX, StartY, 0, 0, Width, Height, 0 );
+        if (EFI_ERROR(Status)) {
+            DEBUG((DEBUG_ERROR, "Gop->Blt [%d]\n", Status));
+            FreePool( BltBuffer );
+            return Status;
+        }
+    }
+    if (DebugPrintLevelEnabled( DEBUG_INFO )) {
+        DEBUG((DEBUG_INFO, "Captured %dx%d with %a in %ld us\n", Width, Height,
+               (FrameBuffer != NULL) ? "framebuffer" : "Blt",
+               ScreenShotTicksToMicroseconds( AsmReadTsc() - Start )));
     }
 
     #ifdef SAVE_AS_PNG
-    PreparePNGFile( BltBuffer, (UINT32)Width, (UINT32)Height );
+    PreparePNGFile( BltBuffer, (UINT32)Width, (UINT32)Height, Fast );
     #else
     PrepareBMPFile( BltBuffer, (UINT32)Width, (UINT32)Height );
     #endif
@@ -538,6 +598,10 @@ TakeScreenShot( EFI_KEY_DATA *KeyData )
     EFI_HANDLE                   *Handles = NULL;
     UINTN                        HandleCount = 0;
     UINTN StartX = 0, StartY = 0, Width = 0, Height = 0; 
+    BOOLEAN                      Fast;
+
+    // the F11 hotkey asks for the faster PNG compression
+    Fast = (KeyData->Key.ScanCode == SCAN_F11);
 
     // try locating GOP by handle
     Status = gBS->LocateHandleBuffer( ByProtocol,
@@ -577,7 +641,7 @@ TakeScreenShot( EFI_KEY_DATA *KeyData )
 
     Status = ShowStatus( Gop, Yellow, StartX, StartY, Width, Height ); 
     gBS->Stall(500*1000);
-    Status = SnapShot( Gop , StartX, StartY, Width, Height );
+    Status = SnapShot( Gop , StartX, StartY, Width, Height, Fast );
     if (EFI_ERROR(Status)) {
         Status = ShowStatus( Gop, Red, StartX, StartY, Width, Height ); 
     } else {
@@ -755,6 +819,18 @@ ScreenshotDriverEntryPoint( EFI_HANDLE ImageHandle,
         return Status;
     }
 
+    // LEFTCTRL+LEFTALT+F11 takes the screenshot with faster compression
+    SimpleTextInExKeyStroke.Key.ScanCode = SCAN_F11;
+    Status = SimpleTextInEx->RegisterKeyNotify( SimpleTextInEx,
+                                                &SimpleTextInExKeyStroke,
+                                                TakeScreenShot,
+                                                &SimpleTextInExFastHandle );
+    if (EFI_ERROR (Status)) {
+        DEBUG((DEBUG_ERROR, "SimpleTextInEx->RegisterKeyNotify returned %d\n", Status));
+        SimpleTextInEx->UnregisterKeyNotify( SimpleTextInEx, SimpleTextInExHandle );
+        return Status;
+    }
+
     return EFI_SUCCESS;
 }
 
@@ -778,13 +854,19 @@ ScreenshotDriverUnload( EFI_HANDLE ImageHandle )
         return Status;
     }
 
-    // unregister key notification function
+    // unregister key notification functions
     Status = SimpleTextInEx->UnregisterKeyNotify( SimpleTextInEx,
                                                   SimpleTextInExHandle );
     if (EFI_ERROR (Status)) {
         DEBUG((DEBUG_ERROR, "SimpleTextInEx->UnregisterKeyNotify returned %d\n", Status));
         return Status;
     }
+    Status = SimpleTextInEx->UnregisterKeyNotify( SimpleTextInEx,
+                                                  SimpleTextInExFastHandle );
+    if (EFI_ERROR (Status)) {
+        DEBUG((DEBUG_ERROR, "SimpleTextInEx->UnregisterKeyNotify returned %d\n", Status));
+        return Status;
+    }
 
     // get list of all the handles in the handle database.
     Status = gBS->LocateHandleBuffer( AllHandles,
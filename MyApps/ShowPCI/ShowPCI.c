@@ -16,98 +16,15 @@
 #include <Library/MemoryAllocationLib.h>
 #include <Library/UefiBootServicesTableLib.h>
 #include <Library/PrintLib.h>
-
-#include <Protocol/LoadedImage.h>
-#include <Protocol/PciEnumerationComplete.h>
-#include <Protocol/PciRootBridgeIo.h>
+#include <Library/PciSnapshotLib.h>
 
 #include <IndustryStandard/Pci.h>
- 
-#define CALC_EFI_PCI_ADDRESS(Bus, Dev, Func, Reg) \
-    ((UINT64) ((((UINTN) Bus) << 24) + (((UINTN) Dev) << 16) + (((UINTN) Func) << 8) + ((UINTN) Reg)))
-
 
-#pragma pack(1)
-typedef union {
-   PCI_DEVICE_HEADER_TYPE_REGION  Device;
-   PCI_CARDBUS_CONTROL_REGISTER   CardBus;
-} NON_COMMON_UNION;
 
-typedef struct {
-   PCI_DEVICE_INDEPENDENT_REGION  Common;
-   NON_COMMON_UNION               NonCommon;
-   UINT32                         Data[48];
-} PCI_CONFIG_SPACE;
-#pragma pack()
-
-#define UTILITY_VERSION L"20190329"
+#define UTILITY_VERSION L"20190412"
 #undef DEBUG
 
 
-//
-// Copyed from UDK2015 Source. UDK2015 license applies.
-//
-EFI_STATUS
-PciGetNextBusRange( EFI_ACPI_ADDRESS_SPACE_DESCRIPTOR  **Descriptors,
-                    UINT16 *MinBus,
-                    UINT16 *MaxBus,
-                    BOOLEAN *IsEnd )
-{
-    *IsEnd = FALSE;
-
-    if ((*Descriptors) == NULL) {
-        *MinBus = 0;
-        *MaxBus = PCI_MAX_BUS;
-        return EFI_SUCCESS;
-    }
-
-    while ((*Descriptors)->Desc != ACPI_END_TAG_DESCRIPTOR) {
-        if ((*Descriptors)->ResType == ACPI_ADDRESS_SPACE_TYPE_BUS) {
-            *MinBus = (UINT16) (*Descriptors)->AddrRangeMin;
-            *MaxBus = (UINT16) (*Descriptors)->AddrRangeMax;
-            (*Descriptors)++;
-            return (EFI_SUCCESS);
-        }
-
-        (*Descriptors)++;
-    }
-
-    if ((*Descriptors)->Desc == ACPI_END_TAG_DESCRIPTOR) {
-        *IsEnd = TRUE;
-    }
-
-    return EFI_SUCCESS;
-}
-
-
-//
-// Copyed from UDK2015 Source. UDK2015 license applies.
-//
-EFI_STATUS
-PciGetProtocolAndResource( EFI_HANDLE Handle,
-                           EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL **IoDev,
-                           EFI_ACPI_ADDRESS_SPACE_DESCRIPTOR **Descriptors )
-{
-    EFI_STATUS Status;
-
-    // Get inferface from protocol
-    Status = gBS->HandleProtocol( Handle,
-                                  &gEfiPciRootBridgeIoProtocolGuid,
-                                  (VOID**)IoDev );
-    if (EFI_ERROR (Status)) {
-        return Status;
-    }
-
-    Status = (*IoDev)->Configuration( *IoDev, (VOID**)Descriptors );
-    if (Status == EFI_UNSUPPORTED) {
-        *Descriptors = NULL;
-        return EFI_SUCCESS;
-    }
-
-    return Status;
-}
-
-
 VOID
 Usage( CHAR16 *Str, 
        BOOLEAN ErrorMsg )
@@ -115,7 +32,9 @@ Usage( CHAR16 *Str,
     if ( ErrorMsg ) {
         Print(L"ERROR: Unknown option.\n");
     }
-    Print(L"Usage: %s [-V | --version]\n", Str);
+    Print(L"Usage: %s [-s | --stats] [-m | --method auto | ecam | protocol]\n", Str);
+    Print(L"       %s [--format json | csv] [-o | --output <file>]\n", Str);
+    Print(L"       %s [-V | --version]\n", Str);
 }
 
 
@@ -124,29 +43,53 @@ EFIAPI
 ShellAppMain( UINTN Argc, 
               CHAR16 **Argv )
 {
-    EFI_GUID gEfiPciEnumerationCompleteProtocolGuid = EFI_PCI_ENUMERATION_COMPLETE_GUID;  
-    EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *IoDev;
-    EFI_ACPI_ADDRESS_SPACE_DESCRIPTOR *Descriptors;
-    PCI_DEVICE_INDEPENDENT_REGION PciHeader;
-    PCI_CONFIG_SPACE ConfigSpace;
-    PCI_DEVICE_HEADER_TYPE_REGION *DeviceHeader;
+    PCI_SNAPSHOT Snapshot;
+    PCI_SNAPSHOT_EXPORT Export;
+    PCI_SNAPSHOT_DEVICE *Device;
+    PCI_EXPORT_FORMAT ExportFormat = PciExportJson;
+    PCI_ACCESS_METHOD Method = PciAccessAuto;
     EFI_STATUS Status = EFI_SUCCESS;
-    EFI_HANDLE *HandleBuf;
-    UINTN HandleBufSize;
-    UINTN HandleCount;
-    UINT64 Address;
-    UINT16 MinBus;
-    UINT16 MaxBus;
-    BOOLEAN IsEnd; 
-    VOID *Interface;
+    BOOLEAN ShowStats = FALSE;
+    BOOLEAN Exporting = FALSE;
+    CHAR16 *OutputFileName = (CHAR16 *)NULL;
 
-    if (Argc == 2) {
-        if (!StrCmp(Argv[1], L"--version") ||
-            !StrCmp(Argv[1], L"-V")) {
+    for (UINTN i = 1; i < Argc; i++) {
+        if (!StrCmp(Argv[i], L"--version") ||
+            !StrCmp(Argv[i], L"-V")) {
             Print(L"Version: %s\n", UTILITY_VERSION);
             return Status;
-        } else if (!StrCmp(Argv[1], L"--help") ||
-            !StrCmp(Argv[1], L"-h")) {
+        } else if (!StrCmp(Argv[i], L"--stats") ||
+            !StrCmp(Argv[i], L"-s")) {
+            ShowStats = TRUE;
+        } else if ((!StrCmp(Argv[i], L"--method") ||
+            !StrCmp(Argv[i], L"-m")) && i + 1 < Argc) {
+            i++;
+            if (!StrCmp(Argv[i], L"auto")) {
+                Method = PciAccessAuto;
+            } else if (!StrCmp(Argv[i], L"ecam")) {
+                Method = PciAccessEcam;
+            } else if (!StrCmp(Argv[i], L"protocol")) {
+                Method = PciAccessProtocol;
+            } else {
+                Usage(Argv[0], TRUE);
+                return Status;
+            }
+        } else if (!StrCmp(Argv[i], L"--format") && i + 1 < Argc) {
+            i++;
+            Exporting = TRUE;
+            if (!StrCmp(Argv[i], L"json")) {
+                ExportFormat = PciExportJson;
+            } else if (!StrCmp(Argv[i], L"csv")) {
+                ExportFormat = PciExportCsv;
+            } else {
+                Usage(Argv[0], TRUE);
+                return Status;
+            }
+        } else if ((!StrCmp(Argv[i], L"--output") ||
+            !StrCmp(Argv[i], L"-o")) && i + 1 < Argc) {
+            OutputFileName = Argv[++i];
+        } else if (!StrCmp(Argv[i], L"--help") ||
+            !StrCmp(Argv[i], L"-h")) {
             Usage(Argv[0], FALSE);
             return Status;
         } else {
@@ -154,134 +97,67 @@ ShellAppMain( UINTN Argc,
             return Status;
         }
     }
-    if (Argc > 2) {
-        Usage(Argv[0], TRUE);
-        return Status;
-    }
- 
 
-    Status = gBS->LocateProtocol( &gEfiPciEnumerationCompleteProtocolGuid,
-                                  NULL,
-                                  &Interface );
-    if (EFI_ERROR(Status)) {
+    // every bus in each root bridge's range, not just those behind a bridge
+    Status = PciSnapshotCreate( Method, PCI_SNAPSHOT_ALL_BUSES, &Snapshot );
+    if (Status == EFI_NOT_READY) {
         Print(L"ERROR: Could not find PCI enumeration protocol\n");
-        return Status;
-    }
-
-    HandleBufSize = sizeof(EFI_HANDLE);
-    HandleBuf = (EFI_HANDLE *) AllocateZeroPool( HandleBufSize);
-    if (HandleBuf == NULL) {
-        Print(L"ERROR: Out of memory resources\n");
-        return EFI_OUT_OF_RESOURCES;
-    }
-
-    Status = gBS->LocateHandle( ByProtocol,
-                                &gEfiPciRootBridgeIoProtocolGuid,
-                                NULL,
-                                &HandleBufSize,
-                                HandleBuf);
-
-    if (Status == EFI_BUFFER_TOO_SMALL) {
-        HandleBuf = ReallocatePool (sizeof (EFI_HANDLE), HandleBufSize, HandleBuf);
-        if (HandleBuf == NULL) {
-            Print(L"ERROR: Out of memory resources\n");
-            Status = EFI_OUT_OF_RESOURCES;
-            goto Done;
-        }
-
-        Status = gBS->LocateHandle( ByProtocol,
-                                    &gEfiPciRootBridgeIoProtocolGuid,
-                                    NULL,
-                                    &HandleBufSize,
-                                    HandleBuf);
-    }
-
-    if (EFI_ERROR (Status)) {
-        Print(L"ERROR: Failed to find any PCI handles\n");
+        goto Done;
+    } else if (Status == EFI_UNSUPPORTED && Method == PciAccessEcam) {
+        Print(L"ERROR: No ACPI MCFG table entry for every root bridge, ECAM access not available\n");
+        goto Done;
+    } else if (EFI_ERROR(Status)) {
+        Print(L"ERROR: Could not enumerate PCI devices [%d]\n", Status);
         goto Done;
     }
 
-    HandleCount = HandleBufSize / sizeof (EFI_HANDLE);
-
-    for (UINT16 Index = 0; Index < HandleCount; Index++) {
-        Status = PciGetProtocolAndResource( HandleBuf[Index],
-                                            &IoDev,
-                                            &Descriptors);
+    if (Exporting) {
+        // no name tables here, names are left null
+        Status = PciSnapshotExportOpen( OutputFileName, ExportFormat, &Export );
+        if (!EFI_ERROR(Status)) {
+            for (UINTN i = 0; i < Snapshot.DeviceCount; i++) {
+                PciSnapshotExportDevice( &Export, &Snapshot.Devices[i], NULL, NULL, NULL );
+            }
+            Status = PciSnapshotExportClose( &Export );
+        }
         if (EFI_ERROR(Status)) {
-            Print(L"ERROR: PciGetProtocolAndResource [%d]\n, Status");
-            goto Done;
+            Print(L"ERROR: Could not write %s [%d]\n",
+                  OutputFileName != NULL ? OutputFileName : L"output", Status);
         }
-  
-        while(TRUE) {
-            Status = PciGetNextBusRange( &Descriptors, &MinBus, &MaxBus, &IsEnd);
-            if (EFI_ERROR(Status)) {
-                Print(L"ERROR: Retrieving PCI bus range [%d]\n", Status);
-                goto Done;
-            }
-
-            if (IsEnd) {
-                break;
-            }
-
-            Print(L"\n");
-            Print(L"  Bus     Vendor    Device   Subvendor SubvendorDevice\n");
-            Print(L"  ----------------------------------------------------\n");
-
-            for (UINT16 Bus = MinBus; Bus <= MaxBus; Bus++) {
-                for (UINT16 Device = 0; Device <= PCI_MAX_DEVICE; Device++) {
-                    for (UINT16 Func = 0; Func <= PCI_MAX_FUNC; Func++) {
-                         Address = CALC_EFI_PCI_ADDRESS (Bus, Device, Func, 0);
-
-                         Status = IoDev->Pci.Read( IoDev,
-                                                   EfiPciWidthUint8,
-                                                   Address,
-                                                   sizeof(ConfigSpace),
-                                                   &ConfigSpace);
-
-                         DeviceHeader = (PCI_DEVICE_HEADER_TYPE_REGION *) &(ConfigSpace.NonCommon.Device);
-
-                         IoDev->Pci.Read( IoDev,
-                                          EfiPciWidthUint16,
-                                          Address,
-                                          1,
-                                          &PciHeader.VendorId );
-
-                         if (PciHeader.VendorId == 0xffff && Func == 0) {
-                             break;
-                         }
-
-                         if (PciHeader.VendorId != 0xffff) {
-                             IoDev->Pci.Read( IoDev,
-                                              EfiPciWidthUint32,
-                                              Address,
-                                              sizeof (PciHeader) / sizeof (UINT32),
-                                              &PciHeader );
-
-                             Print(L"   %02d      %04x      %04x       %04x       %04x\n", 
-                                   Bus, PciHeader.VendorId, PciHeader.DeviceId, 
-                                   DeviceHeader->SubsystemVendorID, DeviceHeader->SubsystemID);
+        goto Done;
+    }
 
-                             if (Func == 0 && 
-                                ((PciHeader.HeaderType & HEADER_TYPE_MULTI_FUNCTION) == 0x00)) {
-                                break;
-                             }
-                         }
-                     }
-                 }
-             }
+    for (UINTN Root = 0; Root < Snapshot.RootCount; Root++) {
+        Print(L"\n");
+        Print(L"  Bus     Vendor    Device   Subvendor SubvendorDevice\n");
+        Print(L"  ----------------------------------------------------\n");
 
-            if (Descriptors == NULL) {
-                break;
+        for (UINTN i = 0; i < Snapshot.DeviceCount; i++) {
+            Device = &Snapshot.Devices[i];
+            if (Device->Root != Root) {
+                continue;
             }
+            Print(L"   %02d      %04x      %04x       %04x       %04x\n", 
+                  Device->Bus, Device->Header.Hdr.VendorId, Device->Header.Hdr.DeviceId, 
+                  Device->Header.Device.SubsystemVendorID, Device->Header.Device.SubsystemID);
         }
     }
 
     Print(L"\n");
 
-Done:
-    if (HandleBuf != NULL) {
-        FreePool( HandleBuf );
+    if (ShowStats) {
+        // a full 256 byte-wide read of every probed function cost 257 accesses,
+        // plus 4 more for each function present
+        Print(L"Functions probed: %d, present: %d\n", Snapshot.Stats.Functions, Snapshot.Stats.Present);
+        Print(L"Config accesses: %d (full config space scan: %d)\n",
+              Snapshot.Stats.Accesses, Snapshot.Stats.Functions * 257 + Snapshot.Stats.Present * 4);
+        Print(L"ECAM accesses: %d, enumeration time: %ld us\n",
+              Snapshot.Stats.EcamAccesses,
+              PciSnapshotTicksToMicroseconds( Snapshot.Stats.Ticks ));
     }
 
+Done:
+    PciSnapshotFree( &Snapshot );
+
     return Status;
 }
@@ -0,0 +1,322 @@
+//
+//  Copyright (c) 2019   Finnbarr P. Murphy.   All rights reserved.
+//
+//  Host (Linux) implementations of the EDK2 library functions used by
+//  PciIds.c and PciIdsSearch.c. Shell files map onto stdio, and pool
+//  allocations are counted so the benchmark can report memory use.
+//
+//  License: BSD 2 clause license applies.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <Uefi.h>
+
+typedef struct {
+    FILE   *File;
+    char   Path[4096];
+} HOST_FILE;
+
+//
+// Every pool block is preceded by its size so FreePool can account for it
+//
+typedef union {
+    UINTN  Size;
+    UINT64 Align;
+} HOST_POOL_HEADER;
+
+STATIC UINTN PoolCurrent;
+STATIC UINTN PoolPeak;
+
+STATIC UINT32 CrcTable[256];
+
+STATIC SORT_COMPARE SortCompare;
+
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostCalculateCrc32( VOID *Data,
+                    UINTN DataSize,
+                    UINT32 *Crc32 )
+{
+    CONST UINT8 *Bytes = Data;
+    UINT32 Crc = 0xffffffff;
+
+    if (CrcTable[1] == 0) {
+        for (UINT32 i = 0; i < 256; i++) {
+            UINT32 Value = i;
+            for (int j = 0; j < 8; j++) {
+                Value = (Value & 1) ? (Value >> 1) ^ 0xedb88320 : Value >> 1;
+            }
+            CrcTable[i] = Value;
+        }
+    }
+
+    for (UINTN i = 0; i < DataSize; i++) {
+        Crc = CrcTable[(Crc ^ Bytes[i]) & 0xff] ^ (Crc >> 8);
+    }
+    *Crc32 = Crc ^ 0xffffffff;
+
+    return EFI_SUCCESS;
+}
+
+STATIC EFI_BOOT_SERVICES HostBootServices = { HostCalculateCrc32 };
+EFI_BOOT_SERVICES *gBS = &HostBootServices;
+
+
+UINTN
+StrLen( CONST CHAR16 *String )
+{
+    UINTN Length = 0;
+
+    while (String[Length] != 0) {
+        Length++;
+    }
+    return Length;
+}
+
+UINTN
+AsciiStrLen( CONST CHAR8 *String )
+{
+    return strlen( String );
+}
+
+INTN
+AsciiStrCmp( CONST CHAR8 *FirstString,
+             CONST CHAR8 *SecondString )
+{
+    return strcmp( FirstString, SecondString );
+}
+
+INTN
+AsciiStrnCmp( CONST CHAR8 *FirstString,
+              CONST CHAR8 *SecondString,
+              UINTN Length )
+{
+    return strncmp( FirstString, SecondString, Length );
+}
+
+CHAR8 *
+AsciiStrStr( CONST CHAR8 *String,
+             CONST CHAR8 *SearchString )
+{
+    return strstr( String, SearchString );
+}
+
+
+VOID *
+CopyMem( VOID *Destination,
+         CONST VOID *Source,
+         UINTN Length )
+{
+    // EDK2 CopyMem allows overlap
+    return memmove( Destination, Source, Length );
+}
+
+VOID *
+ZeroMem( VOID *Buffer,
+         UINTN Length )
+{
+    return memset( Buffer, 0, Length );
+}
+
+VOID *
+SetMem32( VOID *Buffer,
+          UINTN Length,
+          UINT32 Value )
+{
+    UINT32 *Ptr = Buffer;
+
+    for (UINTN i = 0; i < Length / sizeof(UINT32); i++) {
+        Ptr[i] = Value;
+    }
+    return Buffer;
+}
+
+
+VOID *
+AllocatePool( UINTN AllocationSize )
+{
+    HOST_POOL_HEADER *Header;
+
+    Header = malloc( sizeof(HOST_POOL_HEADER) + AllocationSize );
+    if (Header == NULL) {
+        return NULL;
+    }
+    Header->Size = AllocationSize;
+    PoolCurrent += AllocationSize;
+    PoolPeak = MAX( PoolPeak, PoolCurrent );
+
+    return Header + 1;
+}
+
+VOID *
+AllocateZeroPool( UINTN AllocationSize )
+{
+    VOID *Buffer = AllocatePool( AllocationSize );
+
+    if (Buffer != NULL) {
+        memset( Buffer, 0, AllocationSize );
+    }
+    return Buffer;
+}
+
+VOID
+FreePool( VOID *Buffer )
+{
+    HOST_POOL_HEADER *Header = (HOST_POOL_HEADER *)Buffer - 1;
+
+    PoolCurrent -= Header->Size;
+    free( Header );
+}
+
+UINTN
+HostPoolCurrent( VOID )
+{
+    return PoolCurrent;
+}
+
+UINTN
+HostPoolPeak( VOID )
+{
+    return PoolPeak;
+}
+
+VOID
+HostPoolResetPeak( VOID )
+{
+    PoolPeak = PoolCurrent;
+}
+
+
+STATIC
+int
+HostSortCompare( const void *Left,
+                 const void *Right )
+{
+    INTN Result = SortCompare( Left, Right );
+
+    return (Result < 0) ? -1 : (Result > 0);
+}
+
+VOID
+PerformQuickSort( VOID *BufferToSort,
+                  UINTN Count,
+                  UINTN ElementSize,
+                  SORT_COMPARE CompareFunction )
+{
+    SortCompare = CompareFunction;
+    qsort( BufferToSort, Count, ElementSize, HostSortCompare );
+}
+
+
+//
+// Shell paths use backslashes, host paths use forward slashes
+//
+EFI_STATUS
+ShellOpenFileByName( CONST CHAR16 *FileName,
+                     SHELL_FILE_HANDLE *FileHandle,
+                     UINT64 OpenMode,
+                     UINT64 Attributes )
+{
+    HOST_FILE *Host;
+    UINTN     i;
+
+    // file attributes do not matter on the host
+    (VOID)Attributes;
+
+    Host = calloc( 1, sizeof(HOST_FILE) );
+    if (Host == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    for (i = 0; FileName[i] != 0 && i < sizeof(Host->Path) - 1; i++) {
+        Host->Path[i] = (FileName[i] == L'\\') ? '/' : (char)FileName[i];
+    }
+    Host->Path[i] = '\0';
+
+    if ((OpenMode & EFI_FILE_MODE_WRITE) == 0) {
+        Host->File = fopen( Host->Path, "rb" );
+    } else {
+        // like EFI_FILE_PROTOCOL.Open, an existing file is not truncated
+        Host->File = fopen( Host->Path, "r+b" );
+        if (Host->File == NULL && (OpenMode & EFI_FILE_MODE_CREATE) != 0) {
+            Host->File = fopen( Host->Path, "w+b" );
+        }
+    }
+    if (Host->File == NULL) {
+        free( Host );
+        return EFI_NOT_FOUND;
+    }
+
+    *FileHandle = Host;
+    return EFI_SUCCESS;
+}
+
+EFI_STATUS
+ShellCloseFile( SHELL_FILE_HANDLE *FileHandle )
+{
+    HOST_FILE *Host = *FileHandle;
+
+    fclose( Host->File );
+    free( Host );
+    *FileHandle = NULL;
+
+    return EFI_SUCCESS;
+}
+
+EFI_STATUS
+ShellDeleteFile( SHELL_FILE_HANDLE *FileHandle )
+{
+    HOST_FILE *Host = *FileHandle;
+    int       Result;
+
+    fclose( Host->File );
+    Result = remove( Host->Path );
+    free( Host );
+    *FileHandle = NULL;
+
+    return (Result == 0) ? EFI_SUCCESS : EFI_UNSUPPORTED;
+}
+
+EFI_STATUS
+ShellReadFile( SHELL_FILE_HANDLE FileHandle,
+               UINTN *ReadSize,
+               VOID *Buffer )
+{
+    HOST_FILE *Host = FileHandle;
+
+    *ReadSize = fread( Buffer, 1, *ReadSize, Host->File );
+
+    return ferror( Host->File ) ? EFI_VOLUME_CORRUPTED : EFI_SUCCESS;
+}
+
+EFI_STATUS
+ShellWriteFile( SHELL_FILE_HANDLE FileHandle,
+                UINTN *BufferSize,
+                VOID *Buffer )
+{
+    HOST_FILE *Host = FileHandle;
+
+    *BufferSize = fwrite( Buffer, 1, *BufferSize, Host->File );
+
+    return ferror( Host->File ) ? EFI_VOLUME_CORRUPTED : EFI_SUCCESS;
+}
+
+EFI_STATUS
+ShellGetFileSize( SHELL_FILE_HANDLE FileHandle,
+                  UINT64 *Size )
+{
+    HOST_FILE   *Host = FileHandle;
+    struct stat Info;
+
+    if (fstat( fileno( Host->File ), &Info ) != 0) {
+        return EFI_UNSUPPORTED;
+    }
+    *Size = (UINT64)Info.st_size;
+
+    return EFI_SUCCESS;
+}
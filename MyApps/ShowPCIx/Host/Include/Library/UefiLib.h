@@ -0,0 +1,4 @@
+//
+// Host build: everything is declared in the Uefi.h shim
+//
+#include <Uefi.h>
@@ -0,0 +1,106 @@
+//
+//  Copyright (c) 2019   Finnbarr P. Murphy.   All rights reserved.
+//
+//  Thin host shim so that the ShowPCIx database code (PciIds.c and
+//  PciIdsSearch.c) builds as a Linux program. Only the EDK2 types,
+//  macros and library functions that code uses are provided; the
+//  functions are in HostShim.c.
+//
+//  License: BSD 2 clause license applies.
+//
+
+#ifndef _HOST_UEFI_H_
+#define _HOST_UEFI_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint8_t     UINT8;
+typedef uint16_t    UINT16;
+typedef uint32_t    UINT32;
+typedef uint64_t    UINT64;
+typedef int32_t     INT32;
+typedef int64_t     INT64;
+typedef uintptr_t   UINTN;
+typedef intptr_t    INTN;
+typedef char        CHAR8;
+typedef uint16_t    CHAR16;         // build with -fshort-wchar for L"" literals
+typedef uint8_t     BOOLEAN;
+typedef void        VOID;
+typedef UINTN       EFI_STATUS;
+typedef VOID        *SHELL_FILE_HANDLE;
+
+#define CONST       const
+#define STATIC      static
+#define EFIAPI
+#define TRUE        ((BOOLEAN)1)
+#define FALSE       ((BOOLEAN)0)
+
+#define MAX_UINT16  ((UINT16)0xffff)
+#define MAX_UINT32  ((UINT32)0xffffffff)
+#define MAX_UINTN   ((UINTN)-1)
+
+#define MIN(a, b)           (((a) < (b)) ? (a) : (b))
+#define MAX(a, b)           (((a) > (b)) ? (a) : (b))
+#define ARRAY_SIZE(Array)   (sizeof(Array) / sizeof((Array)[0]))
+
+#define SIGNATURE_16(A, B)              ((A) | ((B) << 8))
+#define SIGNATURE_32(A, B, C, D)        (SIGNATURE_16(A, B) | (SIGNATURE_16(C, D) << 16))
+
+#define ENCODE_ERROR(Code)          ((EFI_STATUS)(((UINTN)1 << (sizeof(UINTN) * 8 - 1)) | (Code)))
+#define EFI_ERROR(Status)           (((INTN)(EFI_STATUS)(Status)) < 0)
+
+#define EFI_SUCCESS                 0
+#define EFI_INVALID_PARAMETER       ENCODE_ERROR(2)
+#define EFI_UNSUPPORTED             ENCODE_ERROR(3)
+#define EFI_OUT_OF_RESOURCES        ENCODE_ERROR(9)
+#define EFI_VOLUME_CORRUPTED        ENCODE_ERROR(10)
+#define EFI_NOT_FOUND               ENCODE_ERROR(14)
+
+#define EFI_FILE_MODE_READ          0x0000000000000001ULL
+#define EFI_FILE_MODE_WRITE         0x0000000000000002ULL
+#define EFI_FILE_MODE_CREATE        0x8000000000000000ULL
+
+//
+// gBS is only used for CalculateCrc32
+//
+typedef struct {
+    EFI_STATUS (EFIAPI *CalculateCrc32)( VOID *Data, UINTN DataSize, UINT32 *Crc32 );
+} EFI_BOOT_SERVICES;
+
+extern EFI_BOOT_SERVICES *gBS;
+
+typedef INTN (EFIAPI *SORT_COMPARE)( CONST VOID *Buffer1, CONST VOID *Buffer2 );
+
+// BaseLib
+UINTN   StrLen( CONST CHAR16 *String );
+UINTN   AsciiStrLen( CONST CHAR8 *String );
+INTN    AsciiStrCmp( CONST CHAR8 *FirstString, CONST CHAR8 *SecondString );
+INTN    AsciiStrnCmp( CONST CHAR8 *FirstString, CONST CHAR8 *SecondString, UINTN Length );
+CHAR8   *AsciiStrStr( CONST CHAR8 *String, CONST CHAR8 *SearchString );
+
+// BaseMemoryLib
+VOID    *CopyMem( VOID *Destination, CONST VOID *Source, UINTN Length );
+VOID    *ZeroMem( VOID *Buffer, UINTN Length );
+VOID    *SetMem32( VOID *Buffer, UINTN Length, UINT32 Value );
+
+// MemoryAllocationLib, with the bytes allocated tracked for the benchmark
+VOID    *AllocatePool( UINTN AllocationSize );
+VOID    *AllocateZeroPool( UINTN AllocationSize );
+VOID    FreePool( VOID *Buffer );
+UINTN   HostPoolCurrent( VOID );
+UINTN   HostPoolPeak( VOID );
+VOID    HostPoolResetPeak( VOID );
+
+// SortLib
+VOID    PerformQuickSort( VOID *BufferToSort, UINTN Count, UINTN ElementSize, SORT_COMPARE CompareFunction );
+
+// ShellLib, on stdio
+EFI_STATUS ShellOpenFileByName( CONST CHAR16 *FileName, SHELL_FILE_HANDLE *FileHandle, UINT64 OpenMode, UINT64 Attributes );
+EFI_STATUS ShellCloseFile( SHELL_FILE_HANDLE *FileHandle );
+EFI_STATUS ShellDeleteFile( SHELL_FILE_HANDLE *FileHandle );
+EFI_STATUS ShellReadFile( SHELL_FILE_HANDLE FileHandle, UINTN *ReadSize, VOID *Buffer );
+EFI_STATUS ShellWriteFile( SHELL_FILE_HANDLE FileHandle, UINTN *BufferSize, VOID *Buffer );
+EFI_STATUS ShellGetFileSize( SHELL_FILE_HANDLE FileHandle, UINT64 *Size );
+
+#endif // _HOST_UEFI_H_
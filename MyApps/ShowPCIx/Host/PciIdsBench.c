@@ -0,0 +1,435 @@
+//
+//  Copyright (c) 2019   Finnbarr P. Murphy.   All rights reserved.
+//
+//  Host benchmark of the ShowPCIx pci.ids engine. Replays a recorded
+//  list of (vendor, device, subvendor, subdevice) tuples against a
+//  pci.ids file and reports parse time, index build and load time,
+//  memory footprint and per-lookup latency, one "key value" per line
+//  so results are easy to track in CI.
+//
+//  Build from the ShowPCIx directory:
+//
+//    gcc -O2 -fshort-wchar -IHost/Include -I. -o PciIdsBench
+//        Host/PciIdsBench.c Host/HostShim.c PciIds.c PciIdsSearch.c
+//
+//  Usage: PciIdsBench pci.ids tuples [iterations [workdir]]
+//
+//  Tuples are four hex IDs per line, or the output of
+//  ShowPCIx --format csv. The pci.idx and pci.trg indexes are
+//  written to workdir, /tmp by default, not beside pci.ids.
+//
+//  License: BSD 2 clause license applies.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <Uefi.h>
+
+#include "PciIds.h"
+
+#define DEFAULT_ITERATIONS  1000
+#define DEFAULT_WORKDIR     "/tmp"
+
+// column of vendor_id in ShowPCIx --format csv output
+#define CSV_VENDOR_COLUMN   5
+
+typedef struct {
+    UINT16  VendorId;
+    UINT16  DeviceId;
+    UINT16  SubVendorId;
+    UINT16  SubDeviceId;
+    BOOLEAN HasSubsystem;
+} BENCH_TUPLE;
+
+typedef struct {
+    UINTN   Vendors;
+    UINTN   Devices;
+    UINTN   Subsystems;
+} BENCH_HITS;
+
+
+STATIC
+UINT64
+NowNs( VOID )
+{
+    struct timespec Now;
+
+    clock_gettime( CLOCK_MONOTONIC, &Now );
+    return (UINT64)Now.tv_sec * 1000000000ULL + (UINT64)Now.tv_nsec;
+}
+
+
+STATIC
+double
+ElapsedMs( UINT64 Start )
+{
+    return (double)(NowNs() - Start) / 1e6;
+}
+
+
+//
+// Host path to a shell style path, with backslashes
+//
+STATIC
+CHAR16 *
+ShellPath( CONST char *Dir,
+           CONST char *Name )
+{
+    size_t Length = strlen( Dir ) + 1 + strlen( Name );
+    CHAR16 *Path;
+    size_t i = 0;
+
+    Path = calloc( Length + 1, sizeof(CHAR16) );
+    if (Path == NULL) {
+        return NULL;
+    }
+    for (CONST char *Src = Dir; *Src != '\0'; Src++) {
+        Path[i++] = (*Src == '/') ? L'\\' : (CHAR16)*Src;
+    }
+    if (*Name != '\0') {
+        Path[i++] = L'\\';
+        for (CONST char *Src = Name; *Src != '\0'; Src++) {
+            Path[i++] = (*Src == '/') ? L'\\' : (CHAR16)*Src;
+        }
+    }
+    Path[i] = 0;
+
+    return Path;
+}
+
+
+//
+// Split Line into at most MaxFields fields at commas or blanks. A CSV
+// line has empty fields where an ID is missing, so commas are not merged.
+//
+STATIC
+UINTN
+SplitFields( char *Line,
+             char **Fields,
+             UINTN MaxFields )
+{
+    BOOLEAN Csv = (strchr( Line, ',' ) != NULL);
+    UINTN   Count = 0;
+    char    *Ptr = Line;
+
+    while (Count < MaxFields) {
+        if (!Csv) {
+            Ptr += strspn( Ptr, " \t\r\n" );
+            if (*Ptr == '\0') {
+                break;
+            }
+        }
+        Fields[Count++] = Ptr;
+        Ptr += strcspn( Ptr, Csv ? ",\r\n" : " \t\r\n" );
+        if (*Ptr == '\0') {
+            break;
+        }
+        if (Csv && *Ptr != ',') {
+            *Ptr = '\0';
+            break;
+        }
+        *Ptr++ = '\0';
+    }
+
+    return Count;
+}
+
+
+STATIC
+BOOLEAN
+ParseId( CONST char *Field,
+         UINT16 *Id )
+{
+    char          *End;
+    unsigned long Value;
+
+    Value = strtoul( Field, &End, 16 );
+    if (End == Field || *End != '\0' || Value > MAX_UINT16) {
+        return FALSE;
+    }
+    *Id = (UINT16)Value;
+
+    return TRUE;
+}
+
+
+STATIC
+BENCH_TUPLE *
+LoadTuples( CONST char *FileName,
+            UINTN *Count )
+{
+    BENCH_TUPLE *Tuples = NULL;
+    BENCH_TUPLE *Tuple;
+    UINTN       Allocated = 0;
+    UINTN       First = 0;
+    UINTN       FieldCount;
+    char        Line[1024];
+    char        *Fields[CSV_VENDOR_COLUMN + 4];
+    FILE        *File;
+
+    *Count = 0;
+
+    File = fopen( FileName, "r" );
+    if (File == NULL) {
+        return NULL;
+    }
+
+    while (fgets( Line, sizeof(Line), File ) != NULL) {
+        if (Line[0] == '#') {
+            continue;
+        }
+        // the --format csv header names the columns
+        if (strncmp( Line, "segment,", 8 ) == 0) {
+            First = CSV_VENDOR_COLUMN;
+            continue;
+        }
+        FieldCount = SplitFields( Line, Fields, ARRAY_SIZE(Fields) );
+        if (FieldCount < First + 2) {
+            continue;
+        }
+
+        if (*Count == Allocated) {
+            Allocated = Allocated ? Allocated * 2 : 256;
+            Tuples = realloc( Tuples, Allocated * sizeof(BENCH_TUPLE) );
+            if (Tuples == NULL) {
+                break;
+            }
+        }
+        Tuple = &Tuples[*Count];
+        if (!ParseId( Fields[First], &Tuple->VendorId ) ||
+            !ParseId( Fields[First + 1], &Tuple->DeviceId )) {
+            continue;
+        }
+        // bridges have no subsystem IDs, an empty CSV field
+        Tuple->HasSubsystem = FieldCount >= First + 4 &&
+                              ParseId( Fields[First + 2], &Tuple->SubVendorId ) &&
+                              ParseId( Fields[First + 3], &Tuple->SubDeviceId );
+        (*Count)++;
+    }
+    fclose( File );
+
+    return Tuples;
+}
+
+
+//
+// One pass over all tuples, as ShowPCIx looks each function up
+//
+STATIC
+VOID
+LookupTuples( CONST PCI_IDS_DATABASE *Db,
+              CONST BENCH_TUPLE *Tuples,
+              UINTN Count,
+              BENCH_HITS *Hits )
+{
+    CONST PCI_IDS_VENDOR *Vendor;
+    CONST PCI_IDS_DEVICE *Device;
+
+    for (UINTN i = 0; i < Count; i++) {
+        Vendor = PciIdsFindVendor( Db, Tuples[i].VendorId );
+        if (Vendor == NULL) {
+            continue;
+        }
+        Hits->Vendors++;
+        Device = PciIdsFindDevice( Vendor, Tuples[i].DeviceId );
+        if (Device == NULL) {
+            continue;
+        }
+        Hits->Devices++;
+        if (Tuples[i].HasSubsystem &&
+            PciIdsFindSubsystem( Device, Tuples[i].SubVendorId, Tuples[i].SubDeviceId ) != NULL) {
+            Hits->Subsystems++;
+        }
+    }
+}
+
+
+//
+// Mean and best per-lookup latency over Iterations passes
+//
+STATIC
+VOID
+TimeLookups( CONST char *Prefix,
+             CONST PCI_IDS_DATABASE *Db,
+             CONST BENCH_TUPLE *Tuples,
+             UINTN Count,
+             UINTN Iterations )
+{
+    BENCH_HITS Hits;
+    UINT64     Start;
+    UINT64     Elapsed;
+    UINT64     Total = 0;
+    UINT64     Best = ~0ULL;
+
+    for (UINTN i = 0; i < Iterations; i++) {
+        ZeroMem( &Hits, sizeof(Hits) );
+        Start = NowNs();
+        LookupTuples( Db, Tuples, Count, &Hits );
+        Elapsed = NowNs() - Start;
+        Total += Elapsed;
+        Best = MIN( Best, Elapsed );
+    }
+
+    printf( "%s_lookup_ns_mean %.1f\n", Prefix, (double)Total / (double)(Iterations * Count) );
+    printf( "%s_lookup_ns_best %.1f\n", Prefix, (double)Best / (double)Count );
+    printf( "%s_hits_vendor %lu\n", Prefix, (unsigned long)Hits.Vendors );
+    printf( "%s_hits_device %lu\n", Prefix, (unsigned long)Hits.Devices );
+    printf( "%s_hits_subsystem %lu\n", Prefix, (unsigned long)Hits.Subsystems );
+}
+
+
+int
+main( int argc,
+      char **argv )
+{
+    PCI_IDS_DATABASE Db;
+    PCI_IDS_DATABASE IndexDb;
+    PCI_IDS_SEARCH   Search;
+    BENCH_TUPLE      *Tuples;
+    SHELL_FILE_HANDLE FileHandle;
+    EFI_STATUS       Status;
+    CONST char       *WorkDir = DEFAULT_WORKDIR;
+    CHAR16           *IdsFileName;
+    CHAR16           *IndexFileName;
+    CHAR16           *SearchBase;
+    CHAR16           *SearchFileName;
+    UINTN            TupleCount;
+    UINTN            Iterations = DEFAULT_ITERATIONS;
+    UINTN            Base;
+    UINT64           Start;
+    int              Result = 1;
+
+    if (argc < 3 || argc > 5) {
+        fprintf( stderr, "Usage: %s pci.ids tuples [iterations [workdir]]\n", argv[0] );
+        return 2;
+    }
+    if (argc > 3) {
+        Iterations = strtoul( argv[3], NULL, 10 );
+        if (Iterations == 0) {
+            Iterations = 1;
+        }
+    }
+    if (argc > 4) {
+        WorkDir = argv[4];
+    }
+
+    Tuples = LoadTuples( argv[2], &TupleCount );
+    if (TupleCount == 0) {
+        fprintf( stderr, "ERROR: No tuples in %s\n", argv[2] );
+        free( Tuples );
+        return 1;
+    }
+
+    // the search index goes beside its "database", so name one in WorkDir
+    IdsFileName = ShellPath( argv[1], "" );
+    IndexFileName = ShellPath( WorkDir, "pci.idx" );
+    SearchBase = ShellPath( WorkDir, "pci.ids" );
+    SearchFileName = ShellPath( WorkDir, "pci.trg" );
+    if (IdsFileName == NULL || IndexFileName == NULL || SearchBase == NULL || SearchFileName == NULL) {
+        fprintf( stderr, "ERROR: Out of memory\n" );
+        goto Done;
+    }
+
+    printf( "tuples %lu\n", (unsigned long)TupleCount );
+    printf( "iterations %lu\n", (unsigned long)Iterations );
+
+    Base = HostPoolCurrent();
+    HostPoolResetPeak();
+    Start = NowNs();
+    Status = PciIdsLoad( IdsFileName, &Db );
+    if (EFI_ERROR(Status)) {
+        fprintf( stderr, "ERROR: Cannot load %s\n", argv[1] );
+        goto Done;
+    }
+    printf( "parse_ms %.3f\n", ElapsedMs( Start ) );
+    printf( "parse_peak_bytes %lu\n", (unsigned long)(HostPoolPeak() - Base) );
+    printf( "parse_resident_bytes %lu\n", (unsigned long)(HostPoolCurrent() - Base) );
+    printf( "source_bytes %lu\n", (unsigned long)Db.BufferSize );
+    printf( "vendors %lu\n", (unsigned long)Db.VendorCount );
+    printf( "devices %lu\n", (unsigned long)Db.DeviceCount );
+    printf( "subsystems %lu\n", (unsigned long)Db.SubsystemCount );
+    printf( "classes %lu\n", (unsigned long)Db.ClassCount );
+
+    TimeLookups( "parsed", &Db, Tuples, TupleCount, Iterations );
+
+    Base = HostPoolCurrent();
+    HostPoolResetPeak();
+    Start = NowNs();
+    Status = PciIdsSaveIndex( IndexFileName, &Db );
+    if (EFI_ERROR(Status)) {
+        fprintf( stderr, "ERROR: Cannot write index in %s\n", WorkDir );
+        goto FreeDb;
+    }
+    printf( "index_build_ms %.3f\n", ElapsedMs( Start ) );
+    printf( "index_build_peak_bytes %lu\n", (unsigned long)(HostPoolPeak() - Base) );
+
+    Base = HostPoolCurrent();
+    HostPoolResetPeak();
+    Start = NowNs();
+    Status = PciIdsLoadIndex( IndexFileName, Db.Version, Db.SourceSize, &IndexDb );
+    if (EFI_ERROR(Status)) {
+        fprintf( stderr, "ERROR: Cannot load index from %s\n", WorkDir );
+        goto FreeDb;
+    }
+    printf( "index_load_ms %.3f\n", ElapsedMs( Start ) );
+    printf( "index_peak_bytes %lu\n", (unsigned long)(HostPoolPeak() - Base) );
+    printf( "index_resident_bytes %lu\n", (unsigned long)(HostPoolCurrent() - Base) );
+
+    TimeLookups( "index", &IndexDb, Tuples, TupleCount, Iterations );
+    PciIdsFree( &IndexDb );
+
+    // remove any earlier search index so the first open builds it
+    Status = ShellOpenFileByName( SearchFileName,
+                                  &FileHandle,
+                                  EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE,
+                                  0 );
+    if (!EFI_ERROR(Status)) {
+        ShellDeleteFile( &FileHandle );
+    }
+
+    Base = HostPoolCurrent();
+    HostPoolResetPeak();
+    Start = NowNs();
+    Status = PciIdsOpenSearch( SearchBase, L"pci.trg", &Db, &Search );
+    if (EFI_ERROR(Status)) {
+        fprintf( stderr, "ERROR: Cannot build search index in %s\n", WorkDir );
+        goto FreeDb;
+    }
+    printf( "search_build_ms %.3f\n", ElapsedMs( Start ) );
+    printf( "search_build_peak_bytes %lu\n", (unsigned long)(HostPoolPeak() - Base) );
+    PciIdsFreeSearch( &Search );
+
+    Base = HostPoolCurrent();
+    HostPoolResetPeak();
+    Start = NowNs();
+    Status = PciIdsOpenSearch( SearchBase, L"pci.trg", &Db, &Search );
+    if (EFI_ERROR(Status)) {
+        fprintf( stderr, "ERROR: Cannot load search index from %s\n", WorkDir );
+        goto FreeDb;
+    }
+    printf( "search_load_ms %.3f\n", ElapsedMs( Start ) );
+    printf( "search_resident_bytes %lu\n", (unsigned long)(HostPoolCurrent() - Base) );
+    PciIdsFreeSearch( &Search );
+
+    Result = 0;
+
+FreeDb:
+    PciIdsFree( &Db );
+    if (HostPoolCurrent() != 0) {
+        // everything the engine allocates should be freed by now
+        printf( "leaked_bytes %lu\n", (unsigned long)HostPoolCurrent() );
+        Result = 1;
+    }
+
+Done:
+    free( IdsFileName );
+    free( IndexFileName );
+    free( SearchBase );
+    free( SearchFileName );
+    free( Tuples );
+
+    return Result;
+}
@@ -0,0 +1,1075 @@
+//
+//  Copyright (c) 2019   Finnbarr P. Murphy.   All rights reserved.
+//
+//  In-memory index of the PCI.IDS text-based database
+//
+//  License: BSD 2 clause license applies.
+//
+//  The database file is read into memory with a single read and parsed
+//  once into a sorted vendor table, each vendor owning a sorted slice of
+//  the device table, each device a sorted slice of the subsystem table.
+//  The device class list at the end of the file goes into its own table
+//  keyed by class, subclass and programming interface.
+//  Names are not copied, they point into the file buffer which is
+//  NUL-terminated line by line during the parse.
+//
+//  The parsed tables are saved as a compact image (pci.idx) beside
+//  pci.ids.  Later runs read that image with a single read and turn its
+//  indexes and offsets back into pointers, without touching the text
+//  database.
+//
+
+#include <Uefi.h>
+#include <Library/UefiLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/ShellLib.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/SortLib.h>
+
+#include "PciIds.h"
+
+#define PCI_IDS_LINE_OTHER      0
+#define PCI_IDS_LINE_VENDOR     1
+#define PCI_IDS_LINE_DEVICE     2
+#define PCI_IDS_LINE_SUBSYSTEM  3
+#define PCI_IDS_LINE_CLASS      4
+#define PCI_IDS_LINE_SUBCLASS   5
+#define PCI_IDS_LINE_PROGIF     6
+
+
+STATIC
+BOOLEAN
+IsBlank( CHAR8 Chr )
+{
+    return (BOOLEAN)(Chr == ' ' || Chr == '\t');
+}
+
+
+STATIC
+BOOLEAN
+ParseHex( CONST CHAR8 *Str,
+          UINTN Digits,
+          UINT16 *Value )
+{
+    UINT16 Result = 0;
+
+    for (UINTN i = 0; i < Digits; i++) {
+        Result <<= 4;
+        if (Str[i] >= '0' && Str[i] <= '9') {
+            Result |= (UINT16)(Str[i] - '0');
+        } else if (Str[i] >= 'a' && Str[i] <= 'f') {
+            Result |= (UINT16)(Str[i] - 'a' + 10);
+        } else if (Str[i] >= 'A' && Str[i] <= 'F') {
+            Result |= (UINT16)(Str[i] - 'A' + 10);
+        } else {
+            return FALSE;
+        }
+    }
+
+    *Value = Result;
+
+    return TRUE;
+}
+
+
+//
+// Return start of next line. If Terminate is set, the line is
+// NUL-terminated in place with any trailing blanks removed.
+//
+STATIC
+CHAR8 *
+NextLine( CHAR8 **Pos,
+          CHAR8 *End,
+          BOOLEAN Terminate )
+{
+    CHAR8 *Line = *Pos;
+    CHAR8 *Eol = Line;
+
+    if (Line >= End) {
+        return NULL;
+    }
+
+    while (Eol < End && *Eol != '\n') {
+        Eol++;
+    }
+    *Pos = Eol + 1;
+
+    if (Terminate) {
+        while (Eol > Line && (Eol[-1] == '\r' || IsBlank(Eol[-1]))) {
+            Eol--;
+        }
+        *Eol = '\0';
+    }
+
+    return Line;
+}
+
+
+//
+// Id[0] receives the vendor, device, subvendor, class, subclass or
+// programming interface ID, Id[1] the subdevice ID. Indented lines
+// after the first class line belong to the class list.
+//
+STATIC
+UINTN
+ClassifyLine( CONST CHAR8 *Line,
+              BOOLEAN InClasses,
+              UINT16 *Id )
+{
+    if (Line[0] == 'C' && Line[1] == ' ') {
+        if (ParseHex( &Line[2], 2, &Id[0] ) && IsBlank(Line[4])) {
+            return PCI_IDS_LINE_CLASS;
+        }
+    } else if (InClasses) {
+        if (Line[0] == '\t' && Line[1] == '\t') {
+            if (ParseHex( &Line[2], 2, &Id[0] ) && IsBlank(Line[4])) {
+                return PCI_IDS_LINE_PROGIF;
+            }
+        } else if (Line[0] == '\t') {
+            if (ParseHex( &Line[1], 2, &Id[0] ) && IsBlank(Line[3])) {
+                return PCI_IDS_LINE_SUBCLASS;
+            }
+        }
+    } else if (Line[0] == '\t') {
+        if (Line[1] == '\t') {
+            if (ParseHex( &Line[2], 4, &Id[0] ) && Line[6] == ' ' &&
+                ParseHex( &Line[7], 4, &Id[1] ) && IsBlank(Line[11])) {
+                return PCI_IDS_LINE_SUBSYSTEM;
+            }
+        } else if (ParseHex( &Line[1], 4, &Id[0] ) && IsBlank(Line[5])) {
+            return PCI_IDS_LINE_DEVICE;
+        }
+    } else if (ParseHex( Line, 4, &Id[0] ) && IsBlank(Line[4])) {
+        return PCI_IDS_LINE_VENDOR;
+    }
+
+    return PCI_IDS_LINE_OTHER;
+}
+
+
+STATIC
+CHAR8 *
+GetName( CHAR8 *Str )
+{
+    while (IsBlank(*Str)) {
+        Str++;
+    }
+
+    return Str;
+}
+
+
+STATIC
+INTN
+EFIAPI
+CompareVendor( CONST VOID *Left,
+               CONST VOID *Right )
+{
+    return (INTN)((CONST PCI_IDS_VENDOR *)Left)->VendorId -
+           (INTN)((CONST PCI_IDS_VENDOR *)Right)->VendorId;
+}
+
+
+STATIC
+INTN
+EFIAPI
+CompareDevice( CONST VOID *Left,
+               CONST VOID *Right )
+{
+    return (INTN)((CONST PCI_IDS_DEVICE *)Left)->DeviceId -
+           (INTN)((CONST PCI_IDS_DEVICE *)Right)->DeviceId;
+}
+
+
+STATIC
+UINT32
+SubsystemKey( CONST PCI_IDS_SUBSYSTEM *Subsystem )
+{
+    return ((UINT32)Subsystem->SubVendorId << 16) | Subsystem->SubDeviceId;
+}
+
+
+STATIC
+INTN
+EFIAPI
+CompareSubsystem( CONST VOID *Left,
+                  CONST VOID *Right )
+{
+    UINT32 LeftKey = SubsystemKey( (CONST PCI_IDS_SUBSYSTEM *)Left );
+    UINT32 RightKey = SubsystemKey( (CONST PCI_IDS_SUBSYSTEM *)Right );
+
+    return (LeftKey > RightKey) - (LeftKey < RightKey);
+}
+
+
+STATIC
+INTN
+EFIAPI
+CompareClass( CONST VOID *Left,
+              CONST VOID *Right )
+{
+    UINT32 LeftKey = ((CONST PCI_IDS_CLASS *)Left)->Key;
+    UINT32 RightKey = ((CONST PCI_IDS_CLASS *)Right)->Key;
+
+    return (LeftKey > RightKey) - (LeftKey < RightKey);
+}
+
+
+//
+// pci.ids is kept sorted upstream, so only sort what is out of order.
+// UefiSortLib quicksort degrades badly on already sorted input.
+//
+STATIC
+VOID
+SortTables( PCI_IDS_DATABASE *Db )
+{
+    PCI_IDS_VENDOR *Vendor;
+    PCI_IDS_DEVICE *Device;
+    UINTN i, j;
+
+    for (i = 1; i < Db->VendorCount; i++) {
+        if (Db->Vendors[i - 1].VendorId > Db->Vendors[i].VendorId) {
+            PerformQuickSort( Db->Vendors, Db->VendorCount, sizeof(PCI_IDS_VENDOR), CompareVendor );
+            break;
+        }
+    }
+
+    for (i = 0; i < Db->VendorCount; i++) {
+        Vendor = &Db->Vendors[i];
+        for (j = 1; j < Vendor->DeviceCount; j++) {
+            if (Vendor->Devices[j - 1].DeviceId > Vendor->Devices[j].DeviceId) {
+                PerformQuickSort( Vendor->Devices, Vendor->DeviceCount, sizeof(PCI_IDS_DEVICE), CompareDevice );
+                break;
+            }
+        }
+    }
+
+    for (i = 0; i < Db->DeviceCount; i++) {
+        Device = &Db->Devices[i];
+        for (j = 1; j < Device->SubsystemCount; j++) {
+            if (SubsystemKey( &Device->Subsystems[j - 1] ) > SubsystemKey( &Device->Subsystems[j] )) {
+                PerformQuickSort( Device->Subsystems, Device->SubsystemCount, sizeof(PCI_IDS_SUBSYSTEM), CompareSubsystem );
+                break;
+            }
+        }
+    }
+
+    for (i = 1; i < Db->ClassCount; i++) {
+        if (Db->Classes[i - 1].Key > Db->Classes[i].Key) {
+            PerformQuickSort( Db->Classes, Db->ClassCount, sizeof(PCI_IDS_CLASS), CompareClass );
+            break;
+        }
+    }
+}
+
+
+//
+// Build vendor, device, subsystem and class tables from Db->Buffer
+//
+EFI_STATUS
+PciIdsParse( PCI_IDS_DATABASE *Db )
+{
+    PCI_IDS_VENDOR    *Vendor = NULL;
+    PCI_IDS_DEVICE    *Device = NULL;
+    PCI_IDS_SUBSYSTEM *Subsystem;
+    PCI_IDS_CLASS     *Class;
+    CHAR8   *Pos, *End, *Line, *Sptr;
+    BOOLEAN InClasses = FALSE;
+    UINTN   MaxVendors = 0;
+    UINTN   MaxDevices = 0;
+    UINTN   MaxSubsystems = 0;
+    UINTN   MaxClasses = 0;
+    UINTN   Type, i;
+    UINT16  Id[2];
+    UINT16  ClassId = 0;
+    UINT16  SubclassId = 0;
+    UINTN   Depth = 0;
+
+    End = Db->Buffer + Db->BufferSize;
+
+    // first pass sizes the tables
+    for (Pos = Db->Buffer; (Line = NextLine( &Pos, End, FALSE )) != NULL; ) {
+        Type = ClassifyLine( Line, InClasses, Id );
+        if (Type == PCI_IDS_LINE_VENDOR) {
+            MaxVendors++;
+        } else if (Type == PCI_IDS_LINE_DEVICE) {
+            MaxDevices++;
+        } else if (Type == PCI_IDS_LINE_SUBSYSTEM) {
+            MaxSubsystems++;
+        } else if (Type != PCI_IDS_LINE_OTHER) {
+            InClasses = TRUE;
+            MaxClasses++;
+        }
+    }
+
+    Db->Vendors = AllocateZeroPool( (MaxVendors + 1) * sizeof(PCI_IDS_VENDOR) );
+    Db->Devices = AllocateZeroPool( (MaxDevices + 1) * sizeof(PCI_IDS_DEVICE) );
+    Db->Subsystems = AllocateZeroPool( (MaxSubsystems + 1) * sizeof(PCI_IDS_SUBSYSTEM) );
+    Db->Classes = AllocateZeroPool( (MaxClasses + 1) * sizeof(PCI_IDS_CLASS) );
+    if (Db->Vendors == NULL || Db->Devices == NULL ||
+        Db->Subsystems == NULL || Db->Classes == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    // second pass fills them
+    InClasses = FALSE;
+    for (Pos = Db->Buffer; (Line = NextLine( &Pos, End, TRUE )) != NULL; ) {
+        Type = ClassifyLine( Line, InClasses, Id );
+
+        if (Type == PCI_IDS_LINE_CLASS) {
+            InClasses = TRUE;
+            ClassId = Id[0];
+            Depth = 1;
+        } else if (Type == PCI_IDS_LINE_SUBCLASS && Depth >= 1) {
+            SubclassId = Id[0];
+            Depth = 2;
+        } else if (Type == PCI_IDS_LINE_PROGIF && Depth >= 2) {
+            Depth = 3;
+        } else if (Type == PCI_IDS_LINE_SUBCLASS || Type == PCI_IDS_LINE_PROGIF) {
+            continue;           // no parent entry
+        }
+
+        if (InClasses) {
+            if (Type != PCI_IDS_LINE_OTHER && Db->ClassCount < MaxClasses) {
+                Class = &Db->Classes[Db->ClassCount++];
+                Class->Key = PCI_IDS_CLASS_KEY( ClassId,
+                                                Depth >= 2 ? SubclassId : 0,
+                                                Depth == 3 ? Id[0] : 0,
+                                                Depth );
+                Class->Name = GetName( &Line[Depth == 2 ? 3 : 4] );
+            }
+        } else if (Type == PCI_IDS_LINE_VENDOR && Db->VendorCount < MaxVendors) {
+            Vendor = &Db->Vendors[Db->VendorCount++];
+            Vendor->VendorId = Id[0];
+            Vendor->Devices = &Db->Devices[Db->DeviceCount];
+            Vendor->Name = GetName( &Line[4] );
+            Device = NULL;
+        } else if (Type == PCI_IDS_LINE_DEVICE && Vendor != NULL && Db->DeviceCount < MaxDevices) {
+            Device = &Db->Devices[Db->DeviceCount++];
+            Device->DeviceId = Id[0];
+            Device->Subsystems = &Db->Subsystems[Db->SubsystemCount];
+            Device->Name = GetName( &Line[5] );
+            Vendor->DeviceCount++;
+        } else if (Type == PCI_IDS_LINE_SUBSYSTEM && Device != NULL && Db->SubsystemCount < MaxSubsystems) {
+            Subsystem = &Db->Subsystems[Db->SubsystemCount++];
+            Subsystem->SubVendorId = Id[0];
+            Subsystem->SubDeviceId = Id[1];
+            Subsystem->Name = GetName( &Line[11] );
+            Device->SubsystemCount++;
+        } else if (Line[0] == '#' && Db->Version[0] == '\0') {
+            if ((Sptr = AsciiStrStr( Line, "Version: " )) != NULL) {
+                Sptr += 9;
+                for (i = 0; Sptr[i] != '\0' && i < sizeof(Db->Version) - 1; i++) {
+                    Db->Version[i] = Sptr[i];
+                }
+                Db->Version[i] = '\0';
+            }
+        }
+    }
+
+    SortTables( Db );
+
+    return EFI_SUCCESS;
+}
+
+
+//
+// Read the whole database with one read and index it
+//
+EFI_STATUS
+PciIdsLoad( CHAR16 *FullFileName,
+            PCI_IDS_DATABASE *Db )
+{
+    SHELL_FILE_HANDLE FileHandle = (SHELL_FILE_HANDLE)NULL;
+    EFI_STATUS Status;
+    UINT64     FileSize;
+    UINTN      Size = 0;
+
+    ZeroMem( Db, sizeof(PCI_IDS_DATABASE) );
+
+    Status = ShellOpenFileByName( FullFileName,
+                                  &FileHandle,
+                                  EFI_FILE_MODE_READ,
+                                  0 );
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    Status = ShellGetFileSize( FileHandle, &FileSize );
+    if (!EFI_ERROR(Status)) {
+        Size = (UINTN)FileSize;
+        Db->Buffer = AllocatePool( Size + 1 );
+        if (Db->Buffer == NULL) {
+            Status = EFI_OUT_OF_RESOURCES;
+        } else {
+            Status = ShellReadFile( FileHandle, &Size, Db->Buffer );
+        }
+    }
+    ShellCloseFile( &FileHandle );
+
+    if (!EFI_ERROR(Status)) {
+        Db->Buffer[Size] = '\0';
+        Db->BufferSize = Size;
+        Db->SourceSize = Size;
+        gBS->CalculateCrc32( Db->Buffer, Size, &Db->SourceCrc );
+        Status = PciIdsParse( Db );
+    }
+
+    if (EFI_ERROR(Status)) {
+        PciIdsFree( Db );
+    }
+
+    return Status;
+}
+
+
+//
+// Read the version string from the head of pci.ids, and its size
+//
+EFI_STATUS
+PciIdsReadVersion( CHAR16 *FullFileName,
+                   CHAR8 *Version,
+                   UINTN VersionSize,
+                   UINT64 *FileSize )
+{
+    SHELL_FILE_HANDLE FileHandle = (SHELL_FILE_HANDLE)NULL;
+    EFI_STATUS Status;
+    CHAR8      Head[1024];
+    CHAR8      *Sptr;
+    UINTN      Size = sizeof(Head) - 1;
+    UINTN      i;
+
+    Version[0] = '\0';
+
+    Status = ShellOpenFileByName( FullFileName,
+                                  &FileHandle,
+                                  EFI_FILE_MODE_READ,
+                                  0 );
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    Status = ShellGetFileSize( FileHandle, FileSize );
+    if (!EFI_ERROR(Status)) {
+        Status = ShellReadFile( FileHandle, &Size, Head );
+    }
+    ShellCloseFile( &FileHandle );
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    Head[Size] = '\0';
+    if ((Sptr = AsciiStrStr( Head, "Version: " )) == NULL) {
+        return EFI_NOT_FOUND;
+    }
+
+    Sptr += 9;
+    for (i = 0; i < VersionSize - 1; i++) {
+        if (Sptr[i] == '\0' || Sptr[i] == '\n' || Sptr[i] == '\r') {
+            break;
+        }
+        Version[i] = Sptr[i];
+    }
+    Version[i] = '\0';
+
+    return EFI_SUCCESS;
+}
+
+
+//
+// Index file lives in the same directory as the database
+//
+CHAR16 *
+BuildIndexFileName( CONST CHAR16 *FullFileName,
+                    CONST CHAR16 *IndexName )
+{
+    CHAR16 *IndexFileName;
+    UINTN  DirLength = 0;
+    UINTN  NameLength;
+
+    for (UINTN i = 0; FullFileName[i] != L'\0'; i++) {
+        if (FullFileName[i] == L'\\' || FullFileName[i] == L':') {
+            DirLength = i + 1;
+        }
+    }
+    NameLength = StrLen( IndexName );
+
+    IndexFileName = AllocatePool( (DirLength + NameLength + 1) * sizeof(CHAR16) );
+    if (IndexFileName != NULL) {
+        CopyMem( IndexFileName, FullFileName, DirLength * sizeof(CHAR16) );
+        CopyMem( &IndexFileName[DirLength], IndexName, (NameLength + 1) * sizeof(CHAR16) );
+    }
+
+    return IndexFileName;
+}
+
+
+//
+// Deduplicating string pool used while building the index. Many
+// subsystem and device names repeat, so each distinct name is stored once.
+//
+typedef struct {
+    CHAR8  *Pool;
+    UINT32 Used;
+    UINT32 *Slots;          // pool offset + 1, zero when free
+    UINTN  SlotMask;
+} PCI_IDX_STRINGS;
+
+
+STATIC
+UINT32
+AddString( PCI_IDX_STRINGS *Strings,
+           CONST CHAR8 *Str )
+{
+    UINT32 Hash = 2166136261U;     // FNV-1a
+    UINT32 Offset;
+    UINTN  Length;
+    UINTN  Slot;
+
+    for (Length = 0; Str[Length] != '\0'; Length++) {
+        Hash = (Hash ^ (UINT8)Str[Length]) * 16777619U;
+    }
+    Length++;
+
+    for (Slot = Hash & Strings->SlotMask; Strings->Slots[Slot] != 0; Slot = (Slot + 1) & Strings->SlotMask) {
+        Offset = Strings->Slots[Slot] - 1;
+        if (AsciiStrCmp( Strings->Pool + Offset, Str ) == 0) {
+            return Offset;
+        }
+    }
+
+    Offset = Strings->Used;
+    CopyMem( Strings->Pool + Offset, Str, Length );
+    Strings->Used += (UINT32)Length;
+    Strings->Slots[Slot] = Offset + 1;
+
+    return Offset;
+}
+
+
+//
+// Write the parsed tables as a compact image. Table entries refer to
+// each other by index and to names by offset into the string pool.
+//
+EFI_STATUS
+PciIdsSaveIndex( CHAR16 *IndexFileName,
+                 CONST PCI_IDS_DATABASE *Db )
+{
+    SHELL_FILE_HANDLE FileHandle = (SHELL_FILE_HANDLE)NULL;
+    PCI_IDX_HEADER    *Header;
+    PCI_IDX_VENDOR    *Vendor;
+    PCI_IDX_DEVICE    *Device;
+    PCI_IDX_SUBSYSTEM *Subsystem;
+    PCI_IDX_CLASS     *Class;
+    PCI_IDX_STRINGS   Strings;
+    EFI_STATUS Status;
+    CHAR8      *Image;
+    UINTN      StringSize = 0;
+    UINTN      TableSize;
+    UINTN      ImageSize;
+    UINTN      NameCount;
+    UINTN      Size;
+    UINTN      i;
+
+    for (i = 0; i < Db->VendorCount; i++) {
+        if (Db->Vendors[i].DeviceCount > MAX_UINT16) {
+            return EFI_UNSUPPORTED;
+        }
+        StringSize += AsciiStrLen( Db->Vendors[i].Name ) + 1;
+    }
+    for (i = 0; i < Db->DeviceCount; i++) {
+        if (Db->Devices[i].SubsystemCount > MAX_UINT16) {
+            return EFI_UNSUPPORTED;
+        }
+        StringSize += AsciiStrLen( Db->Devices[i].Name ) + 1;
+    }
+    for (i = 0; i < Db->SubsystemCount; i++) {
+        StringSize += AsciiStrLen( Db->Subsystems[i].Name ) + 1;
+    }
+    for (i = 0; i < Db->ClassCount; i++) {
+        StringSize += AsciiStrLen( Db->Classes[i].Name ) + 1;
+    }
+
+    TableSize = Db->VendorCount * sizeof(PCI_IDX_VENDOR) +
+                Db->DeviceCount * sizeof(PCI_IDX_DEVICE) +
+                Db->SubsystemCount * sizeof(PCI_IDX_SUBSYSTEM) +
+                Db->ClassCount * sizeof(PCI_IDX_CLASS);
+    if (sizeof(PCI_IDX_HEADER) + TableSize + StringSize > MAX_UINT32) {
+        return EFI_UNSUPPORTED;
+    }
+
+    // keep the hash table at most half full
+    NameCount = Db->VendorCount + Db->DeviceCount + Db->SubsystemCount + Db->ClassCount;
+    for (Strings.SlotMask = 255; Strings.SlotMask < NameCount * 2; ) {
+        Strings.SlotMask = Strings.SlotMask * 2 + 1;
+    }
+    Strings.Slots = AllocateZeroPool( (Strings.SlotMask + 1) * sizeof(UINT32) );
+    if (Strings.Slots == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    // string pool size is an upper bound until names are deduplicated
+    Image = AllocateZeroPool( sizeof(PCI_IDX_HEADER) + TableSize + StringSize );
+    if (Image == NULL) {
+        FreePool( Strings.Slots );
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    Header = (PCI_IDX_HEADER *)Image;
+    Header->Signature = PCI_IDX_SIGNATURE;
+    Header->Revision = PCI_IDX_REVISION;
+    Header->HeaderSize = sizeof(PCI_IDX_HEADER);
+    Header->SourceSize = Db->SourceSize;
+    Header->SourceCrc = Db->SourceCrc;
+    CopyMem( Header->Version, Db->Version, sizeof(Header->Version) );
+    Header->VendorCount = (UINT32)Db->VendorCount;
+    Header->DeviceCount = (UINT32)Db->DeviceCount;
+    Header->SubsystemCount = (UINT32)Db->SubsystemCount;
+    Header->ClassCount = (UINT32)Db->ClassCount;
+    Header->VendorOffset = sizeof(PCI_IDX_HEADER);
+    Header->DeviceOffset = Header->VendorOffset + (UINT32)(Db->VendorCount * sizeof(PCI_IDX_VENDOR));
+    Header->SubsystemOffset = Header->DeviceOffset + (UINT32)(Db->DeviceCount * sizeof(PCI_IDX_DEVICE));
+    Header->ClassOffset = Header->SubsystemOffset + (UINT32)(Db->SubsystemCount * sizeof(PCI_IDX_SUBSYSTEM));
+    Header->StringOffset = Header->ClassOffset + (UINT32)(Db->ClassCount * sizeof(PCI_IDX_CLASS));
+
+    Strings.Pool = Image + Header->StringOffset;
+    Strings.Used = 0;
+
+    Vendor = (PCI_IDX_VENDOR *)(Image + Header->VendorOffset);
+    for (i = 0; i < Db->VendorCount; i++, Vendor++) {
+        Vendor->VendorId = Db->Vendors[i].VendorId;
+        Vendor->DeviceCount = (UINT16)Db->Vendors[i].DeviceCount;
+        Vendor->FirstDevice = (UINT32)(Db->Vendors[i].Devices - Db->Devices);
+        Vendor->Name = AddString( &Strings, Db->Vendors[i].Name );
+    }
+
+    Device = (PCI_IDX_DEVICE *)(Image + Header->DeviceOffset);
+    for (i = 0; i < Db->DeviceCount; i++, Device++) {
+        Device->DeviceId = Db->Devices[i].DeviceId;
+        Device->SubsystemCount = (UINT16)Db->Devices[i].SubsystemCount;
+        Device->FirstSubsystem = (UINT32)(Db->Devices[i].Subsystems - Db->Subsystems);
+        Device->Name = AddString( &Strings, Db->Devices[i].Name );
+    }
+
+    Subsystem = (PCI_IDX_SUBSYSTEM *)(Image + Header->SubsystemOffset);
+    for (i = 0; i < Db->SubsystemCount; i++, Subsystem++) {
+        Subsystem->SubVendorId = Db->Subsystems[i].SubVendorId;
+        Subsystem->SubDeviceId = Db->Subsystems[i].SubDeviceId;
+        Subsystem->Name = AddString( &Strings, Db->Subsystems[i].Name );
+    }
+
+    Class = (PCI_IDX_CLASS *)(Image + Header->ClassOffset);
+    for (i = 0; i < Db->ClassCount; i++, Class++) {
+        Class->Key = Db->Classes[i].Key;
+        Class->Name = AddString( &Strings, Db->Classes[i].Name );
+    }
+
+    FreePool( Strings.Slots );
+
+    Header->StringSize = Strings.Used;
+    ImageSize = Header->StringOffset + Strings.Used;
+    Header->ImageSize = (UINT32)ImageSize;
+    gBS->CalculateCrc32( Image + sizeof(PCI_IDX_HEADER),
+                         ImageSize - sizeof(PCI_IDX_HEADER),
+                         &Header->ImageCrc );
+
+    // EFI_FILE_MODE_CREATE does not truncate, so remove any stale index first
+    Status = ShellOpenFileByName( IndexFileName,
+                                  &FileHandle,
+                                  EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE,
+                                  0 );
+    if (!EFI_ERROR(Status)) {
+        ShellDeleteFile( &FileHandle );
+    }
+
+    Status = ShellOpenFileByName( IndexFileName,
+                                  &FileHandle,
+                                  EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE,
+                                  0 );
+    if (!EFI_ERROR(Status)) {
+        Size = ImageSize;
+        Status = ShellWriteFile( FileHandle, &Size, Image );
+        ShellCloseFile( &FileHandle );
+    }
+
+    FreePool( Image );
+
+    return Status;
+}
+
+
+//
+// Load a binary index. Fails if it is damaged or was built from
+// a different pci.ids version or size.
+//
+EFI_STATUS
+PciIdsLoadIndex( CHAR16 *IndexFileName,
+                 CONST CHAR8 *Version,
+                 UINT64 SourceSize,
+                 PCI_IDS_DATABASE *Db )
+{
+    SHELL_FILE_HANDLE FileHandle = (SHELL_FILE_HANDLE)NULL;
+    PCI_IDX_HEADER    *Header;
+    PCI_IDX_VENDOR    *IdxVendor;
+    PCI_IDX_DEVICE    *IdxDevice;
+    PCI_IDX_SUBSYSTEM *IdxSubsystem;
+    PCI_IDX_CLASS     *IdxClass;
+    EFI_STATUS Status;
+    CHAR8      *Image = NULL;
+    CHAR8      *Pool;
+    UINT8      *Tables;
+    UINT64     FileSize;
+    UINT32     Crc;
+    UINTN      Size = 0;
+    UINTN      i;
+
+    ZeroMem( Db, sizeof(PCI_IDS_DATABASE) );
+
+    Status = ShellOpenFileByName( IndexFileName,
+                                  &FileHandle,
+                                  EFI_FILE_MODE_READ,
+                                  0 );
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    Status = ShellGetFileSize( FileHandle, &FileSize );
+    if (!EFI_ERROR(Status)) {
+        if (FileSize < sizeof(PCI_IDX_HEADER) || FileSize > MAX_UINT32) {
+            Status = EFI_VOLUME_CORRUPTED;
+        } else {
+            Size = (UINTN)FileSize;
+            Image = AllocatePool( Size );
+            if (Image == NULL) {
+                Status = EFI_OUT_OF_RESOURCES;
+            } else {
+                Status = ShellReadFile( FileHandle, &Size, Image );
+            }
+        }
+    }
+    ShellCloseFile( &FileHandle );
+    if (EFI_ERROR(Status)) {
+        goto Error;
+    }
+
+    Header = (PCI_IDX_HEADER *)Image;
+    if (Size != FileSize ||
+        Header->Signature != PCI_IDX_SIGNATURE ||
+        Header->Revision != PCI_IDX_REVISION ||
+        Header->HeaderSize != sizeof(PCI_IDX_HEADER) ||
+        Header->ImageSize != Size) {
+        Status = EFI_VOLUME_CORRUPTED;
+        goto Error;
+    }
+
+    // stale if pci.ids has been replaced
+    if (Header->SourceSize != SourceSize ||
+        AsciiStrnCmp( Header->Version, Version, sizeof(Header->Version) ) != 0) {
+        Status = EFI_NOT_FOUND;
+        goto Error;
+    }
+
+    gBS->CalculateCrc32( Image + sizeof(PCI_IDX_HEADER), Size - sizeof(PCI_IDX_HEADER), &Crc );
+    if (Crc != Header->ImageCrc ||
+        Header->VendorCount == 0 ||
+        Header->VendorOffset + (UINT64)Header->VendorCount * sizeof(PCI_IDX_VENDOR) > Size ||
+        Header->DeviceOffset + (UINT64)Header->DeviceCount * sizeof(PCI_IDX_DEVICE) > Size ||
+        Header->SubsystemOffset + (UINT64)Header->SubsystemCount * sizeof(PCI_IDX_SUBSYSTEM) > Size ||
+        Header->ClassOffset + (UINT64)Header->ClassCount * sizeof(PCI_IDX_CLASS) > Size ||
+        (UINT64)Header->StringOffset + Header->StringSize > Size ||
+        Header->StringSize == 0 ||
+        Image[Header->StringOffset + Header->StringSize - 1] != '\0') {
+        Status = EFI_VOLUME_CORRUPTED;
+        goto Error;
+    }
+
+    // one allocation holds all the in-memory tables
+    Tables = AllocatePool( Header->VendorCount * sizeof(PCI_IDS_VENDOR) +
+                           Header->DeviceCount * sizeof(PCI_IDS_DEVICE) +
+                           Header->SubsystemCount * sizeof(PCI_IDS_SUBSYSTEM) +
+                           Header->ClassCount * sizeof(PCI_IDS_CLASS) );
+    if (Tables == NULL) {
+        Status = EFI_OUT_OF_RESOURCES;
+        goto Error;
+    }
+
+    Db->Buffer = Image;
+    Db->BufferSize = Size;
+    Db->FromIndex = TRUE;
+    Db->Vendors = (PCI_IDS_VENDOR *)Tables;
+    Db->VendorCount = Header->VendorCount;
+    Db->Devices = (PCI_IDS_DEVICE *)(Db->Vendors + Db->VendorCount);
+    Db->DeviceCount = Header->DeviceCount;
+    Db->Subsystems = (PCI_IDS_SUBSYSTEM *)(Db->Devices + Db->DeviceCount);
+    Db->SubsystemCount = Header->SubsystemCount;
+    Db->Classes = (PCI_IDS_CLASS *)(Db->Subsystems + Db->SubsystemCount);
+    Db->ClassCount = Header->ClassCount;
+    Db->SourceSize = Header->SourceSize;
+    Db->SourceCrc = Header->SourceCrc;
+    CopyMem( Db->Version, Header->Version, sizeof(Db->Version) );
+    Db->Version[sizeof(Db->Version) - 1] = '\0';
+
+    Pool = Image + Header->StringOffset;
+
+    IdxVendor = (PCI_IDX_VENDOR *)(Image + Header->VendorOffset);
+    for (i = 0; i < Db->VendorCount; i++, IdxVendor++) {
+        if ((UINT64)IdxVendor->FirstDevice + IdxVendor->DeviceCount > Db->DeviceCount ||
+            IdxVendor->Name >= Header->StringSize) {
+            goto Corrupted;
+        }
+        Db->Vendors[i].VendorId = IdxVendor->VendorId;
+        Db->Vendors[i].DeviceCount = IdxVendor->DeviceCount;
+        Db->Vendors[i].Devices = Db->Devices + IdxVendor->FirstDevice;
+        Db->Vendors[i].Name = Pool + IdxVendor->Name;
+    }
+
+    IdxDevice = (PCI_IDX_DEVICE *)(Image + Header->DeviceOffset);
+    for (i = 0; i < Db->DeviceCount; i++, IdxDevice++) {
+        if ((UINT64)IdxDevice->FirstSubsystem + IdxDevice->SubsystemCount > Db->SubsystemCount ||
+            IdxDevice->Name >= Header->StringSize) {
+            goto Corrupted;
+        }
+        Db->Devices[i].DeviceId = IdxDevice->DeviceId;
+        Db->Devices[i].SubsystemCount = IdxDevice->SubsystemCount;
+        Db->Devices[i].Subsystems = Db->Subsystems + IdxDevice->FirstSubsystem;
+        Db->Devices[i].Name = Pool + IdxDevice->Name;
+    }
+
+    IdxSubsystem = (PCI_IDX_SUBSYSTEM *)(Image + Header->SubsystemOffset);
+    for (i = 0; i < Db->SubsystemCount; i++, IdxSubsystem++) {
+        if (IdxSubsystem->Name >= Header->StringSize) {
+            goto Corrupted;
+        }
+        Db->Subsystems[i].SubVendorId = IdxSubsystem->SubVendorId;
+        Db->Subsystems[i].SubDeviceId = IdxSubsystem->SubDeviceId;
+        Db->Subsystems[i].Name = Pool + IdxSubsystem->Name;
+    }
+
+    IdxClass = (PCI_IDX_CLASS *)(Image + Header->ClassOffset);
+    for (i = 0; i < Db->ClassCount; i++, IdxClass++) {
+        if (IdxClass->Name >= Header->StringSize) {
+            goto Corrupted;
+        }
+        Db->Classes[i].Key = IdxClass->Key;
+        Db->Classes[i].Name = Pool + IdxClass->Name;
+    }
+
+    return EFI_SUCCESS;
+
+Corrupted:
+    Status = EFI_VOLUME_CORRUPTED;
+    FreePool( Tables );
+    ZeroMem( Db, sizeof(PCI_IDS_DATABASE) );
+Error:
+    if (Image != NULL) {
+        FreePool( Image );
+    }
+
+    return Status;
+}
+
+
+//
+// Load the binary index if it matches pci.ids, otherwise parse
+// pci.ids and (re)build the index for next time
+//
+EFI_STATUS
+PciIdsOpen( CHAR16 *FullFileName,
+            CONST CHAR16 *IndexName,
+            PCI_IDS_DATABASE *Db )
+{
+    EFI_STATUS Status;
+    CHAR16     *IndexFileName;
+    CHAR8      Version[16];
+    UINT64     FileSize = 0;
+
+    Status = PciIdsReadVersion( FullFileName, Version, sizeof(Version), &FileSize );
+    if (EFI_ERROR(Status) && Status != EFI_NOT_FOUND) {
+        return Status;
+    }
+
+    IndexFileName = BuildIndexFileName( FullFileName, IndexName );
+    if (IndexFileName != NULL) {
+        Status = PciIdsLoadIndex( IndexFileName, Version, FileSize, Db );
+        if (!EFI_ERROR(Status)) {
+            FreePool( IndexFileName );
+            return Status;
+        }
+    }
+
+    Status = PciIdsLoad( FullFileName, Db );
+    if (!EFI_ERROR(Status) && IndexFileName != NULL) {
+        // best effort, the volume may be read-only
+        PciIdsSaveIndex( IndexFileName, Db );
+    }
+
+    if (IndexFileName != NULL) {
+        FreePool( IndexFileName );
+    }
+
+    return Status;
+}
+
+
+CONST PCI_IDS_VENDOR *
+PciIdsFindVendor( CONST PCI_IDS_DATABASE *Db,
+                  UINT16 VendorId )
+{
+    UINTN Low = 0;
+    UINTN High = Db->VendorCount;
+    UINTN Mid;
+
+    while (Low < High) {
+        Mid = (Low + High) / 2;
+        if (Db->Vendors[Mid].VendorId < VendorId) {
+            Low = Mid + 1;
+        } else {
+            High = Mid;
+        }
+    }
+
+    if (Low < Db->VendorCount && Db->Vendors[Low].VendorId == VendorId) {
+        return &Db->Vendors[Low];
+    }
+
+    return NULL;
+}
+
+
+CONST PCI_IDS_DEVICE *
+PciIdsFindDevice( CONST PCI_IDS_VENDOR *Vendor,
+                  UINT16 DeviceId )
+{
+    UINTN Low = 0;
+    UINTN High = Vendor->DeviceCount;
+    UINTN Mid;
+
+    while (Low < High) {
+        Mid = (Low + High) / 2;
+        if (Vendor->Devices[Mid].DeviceId < DeviceId) {
+            Low = Mid + 1;
+        } else {
+            High = Mid;
+        }
+    }
+
+    if (Low < Vendor->DeviceCount && Vendor->Devices[Low].DeviceId == DeviceId) {
+        return &Vendor->Devices[Low];
+    }
+
+    return NULL;
+}
+
+
+CONST PCI_IDS_SUBSYSTEM *
+PciIdsFindSubsystem( CONST PCI_IDS_DEVICE *Device,
+                     UINT16 SubVendorId,
+                     UINT16 SubDeviceId )
+{
+    UINT32 Key = ((UINT32)SubVendorId << 16) | SubDeviceId;
+    UINTN  Low = 0;
+    UINTN  High = Device->SubsystemCount;
+    UINTN  Mid;
+
+    while (Low < High) {
+        Mid = (Low + High) / 2;
+        if (SubsystemKey( &Device->Subsystems[Mid] ) < Key) {
+            Low = Mid + 1;
+        } else {
+            High = Mid;
+        }
+    }
+
+    if (Low < Device->SubsystemCount && SubsystemKey( &Device->Subsystems[Low] ) == Key) {
+        return &Device->Subsystems[Low];
+    }
+
+    return NULL;
+}
+
+
+STATIC
+CONST CHAR8 *
+FindClassName( CONST PCI_IDS_DATABASE *Db,
+               UINT32 Key )
+{
+    UINTN Low = 0;
+    UINTN High = Db->ClassCount;
+    UINTN Mid;
+
+    while (Low < High) {
+        Mid = (Low + High) / 2;
+        if (Db->Classes[Mid].Key < Key) {
+            Low = Mid + 1;
+        } else {
+            High = Mid;
+        }
+    }
+
+    if (Low < Db->ClassCount && Db->Classes[Low].Key == Key) {
+        return Db->Classes[Low].Name;
+    }
+
+    return NULL;
+}
+
+
+//
+// Names[0..2] receive the class, subclass and programming interface
+// names, or NULL. Returns how many leading names were found.
+//
+UINTN
+PciIdsFindClass( CONST PCI_IDS_DATABASE *Db,
+                 UINT8 Class,
+                 UINT8 Subclass,
+                 UINT8 ProgIf,
+                 CONST CHAR8 **Names )
+{
+    UINTN Count = 0;
+
+    Names[0] = FindClassName( Db, PCI_IDS_CLASS_KEY( Class, 0, 0, 1 ) );
+    Names[1] = NULL;
+    Names[2] = NULL;
+
+    if (Names[0] != NULL) {
+        Count++;
+        Names[1] = FindClassName( Db, PCI_IDS_CLASS_KEY( Class, Subclass, 0, 2 ) );
+        if (Names[1] != NULL) {
+            Count++;
+            Names[2] = FindClassName( Db, PCI_IDS_CLASS_KEY( Class, Subclass, ProgIf, 3 ) );
+            if (Names[2] != NULL) {
+                Count++;
+            }
+        }
+    }
+
+    return Count;
+}
+
+
+VOID
+PciIdsFree( PCI_IDS_DATABASE *Db )
+{
+    // tables loaded from an index share a single allocation
+    if (!Db->FromIndex) {
+        if (Db->Classes != NULL) {
+            FreePool( Db->Classes );
+        }
+        if (Db->Subsystems != NULL) {
+            FreePool( Db->Subsystems );
+        }
+        if (Db->Devices != NULL) {
+            FreePool( Db->Devices );
+        }
+    }
+    if (Db->Vendors != NULL) {
+        FreePool( Db->Vendors );
+    }
+    if (Db->Buffer != NULL) {
+        FreePool( Db->Buffer );
+    }
+
+    ZeroMem( Db, sizeof(PCI_IDS_DATABASE) );
+}
@@ -0,0 +1,252 @@
+//
+//  Copyright (c) 2019   Finnbarr P. Murphy.   All rights reserved.
+//
+//  In-memory index of the PCI.IDS text-based database
+//
+//  License: BSD 2 clause license applies.
+//
+
+#ifndef _PCIIDS_H_
+#define _PCIIDS_H_
+
+typedef struct {
+    UINT16          SubVendorId;
+    UINT16          SubDeviceId;
+    CHAR8           *Name;
+} PCI_IDS_SUBSYSTEM;
+
+typedef struct {
+    UINT16            DeviceId;
+    UINT32            SubsystemCount;
+    PCI_IDS_SUBSYSTEM *Subsystems;    // sorted slice of PCI_IDS_DATABASE.Subsystems
+    CHAR8             *Name;
+} PCI_IDS_DEVICE;
+
+typedef struct {
+    UINT16          VendorId;
+    UINT32          DeviceCount;
+    PCI_IDS_DEVICE  *Devices;         // sorted slice of PCI_IDS_DATABASE.Devices
+    CHAR8           *Name;
+} PCI_IDS_VENDOR;
+
+//
+// Class, subclass and programming interface names share one table,
+// sorted by key. Depth is 1 for a class, 2 for a subclass, 3 for a
+// programming interface.
+//
+#define PCI_IDS_CLASS_KEY(Class, Subclass, ProgIf, Depth) \
+    (((UINT32)(Class) << 24) | ((UINT32)(Subclass) << 16) | ((UINT32)(ProgIf) << 8) | (Depth))
+
+typedef struct {
+    UINT32          Key;
+    CHAR8           *Name;
+} PCI_IDS_CLASS;
+
+typedef struct {
+    CHAR8             *Buffer;        // database text or index image
+    UINTN             BufferSize;
+    BOOLEAN           FromIndex;      // loaded from the binary index
+    PCI_IDS_VENDOR    *Vendors;       // sorted by VendorId
+    UINTN             VendorCount;
+    PCI_IDS_DEVICE    *Devices;
+    UINTN             DeviceCount;
+    PCI_IDS_SUBSYSTEM *Subsystems;
+    UINTN             SubsystemCount;
+    PCI_IDS_CLASS     *Classes;       // sorted by Key
+    UINTN             ClassCount;
+    UINT64            SourceSize;
+    UINT32            SourceCrc;
+    CHAR8             Version[16];
+} PCI_IDS_DATABASE;
+
+//
+// Binary index file (pci.idx) kept beside pci.ids. Table entries refer
+// to each other by index and to names by offset into the string pool.
+//
+#define PCI_IDX_SIGNATURE  SIGNATURE_32('P', 'I', 'D', 'X')
+#define PCI_IDX_REVISION   2
+
+#pragma pack(1)
+typedef struct {
+    UINT16  VendorId;
+    UINT16  DeviceCount;
+    UINT32  FirstDevice;
+    UINT32  Name;
+} PCI_IDX_VENDOR;
+
+typedef struct {
+    UINT16  DeviceId;
+    UINT16  SubsystemCount;
+    UINT32  FirstSubsystem;
+    UINT32  Name;
+} PCI_IDX_DEVICE;
+
+typedef struct {
+    UINT16  SubVendorId;
+    UINT16  SubDeviceId;
+    UINT32  Name;
+} PCI_IDX_SUBSYSTEM;
+
+typedef struct {
+    UINT32  Key;
+    UINT32  Name;
+} PCI_IDX_CLASS;
+
+typedef struct {
+    UINT32  Signature;
+    UINT32  Revision;
+    UINT32  HeaderSize;
+    UINT32  ImageSize;          // header, tables and string pool
+    UINT64  SourceSize;         // size of pci.ids the index was built from
+    UINT32  SourceCrc;          // CRC32 of that pci.ids
+    UINT32  ImageCrc;           // CRC32 of everything after the header
+    CHAR8   Version[16];        // pci.ids version string
+    UINT32  VendorCount;
+    UINT32  DeviceCount;
+    UINT32  SubsystemCount;
+    UINT32  ClassCount;
+    UINT32  StringSize;         // deduplicated, NUL-terminated names
+    UINT32  VendorOffset;       // image offsets of the tables
+    UINT32  DeviceOffset;
+    UINT32  SubsystemOffset;
+    UINT32  ClassOffset;
+    UINT32  StringOffset;
+} PCI_IDX_HEADER;
+#pragma pack()
+
+//
+// Name search index file (pci.trg) kept beside pci.ids. Names are
+// folded to 37 symbols, letters without case, digits and one symbol for
+// everything else, and every trigram of symbols has a sorted posting
+// list of the entries whose vendor or device name contains it.
+//
+#define PCI_TRG_SIGNATURE  SIGNATURE_32('P', 'T', 'R', 'G')
+#define PCI_TRG_REVISION   1
+#define PCI_TRG_SYMBOLS    37
+#define PCI_TRG_TRIGRAMS   (PCI_TRG_SYMBOLS * PCI_TRG_SYMBOLS * PCI_TRG_SYMBOLS)
+
+//
+// An entry is a vendor index in the upper 16 bits and, for a device,
+// its index within the vendor plus one in the lower 16 bits
+//
+#define PCI_TRG_ENTRY(Vendor, Device)   (((UINT32)(Vendor) << 16) | (UINT32)(Device))
+#define PCI_TRG_VENDOR(Entry)           ((Entry) >> 16)
+#define PCI_TRG_DEVICE(Entry)           ((Entry) & 0xffff)
+
+#pragma pack(1)
+typedef struct {
+    UINT32  Signature;
+    UINT32  Revision;
+    UINT32  HeaderSize;
+    UINT32  ImageSize;          // header, offsets and postings
+    UINT64  SourceSize;         // size of pci.ids the index was built from
+    UINT32  SourceCrc;          // CRC32 of that pci.ids
+    UINT32  ImageCrc;           // CRC32 of everything after the header
+    UINT32  VendorCount;
+    UINT32  DeviceCount;
+    UINT32  PostingCount;
+} PCI_TRG_HEADER;
+#pragma pack()
+
+//
+// Offsets[t] to Offsets[t + 1] is the posting list of trigram t
+//
+typedef struct {
+    VOID        *Image;
+    UINT32      *Offsets;           // PCI_TRG_TRIGRAMS + 1
+    UINT32      *Postings;
+    UINTN       PostingCount;
+} PCI_IDS_SEARCH;
+
+
+EFI_STATUS
+PciIdsReadVersion( CHAR16 *FullFileName,
+                   CHAR8 *Version,
+                   UINTN VersionSize,
+                   UINT64 *FileSize );
+
+EFI_STATUS
+PciIdsLoad( CHAR16 *FullFileName,
+            PCI_IDS_DATABASE *Db );
+
+EFI_STATUS
+PciIdsParse( PCI_IDS_DATABASE *Db );
+
+EFI_STATUS
+PciIdsLoadIndex( CHAR16 *IndexFileName,
+                 CONST CHAR8 *Version,
+                 UINT64 SourceSize,
+                 PCI_IDS_DATABASE *Db );
+
+EFI_STATUS
+PciIdsSaveIndex( CHAR16 *IndexFileName,
+                 CONST PCI_IDS_DATABASE *Db );
+
+EFI_STATUS
+PciIdsOpen( CHAR16 *FullFileName,
+            CONST CHAR16 *IndexName,
+            PCI_IDS_DATABASE *Db );
+
+CONST PCI_IDS_VENDOR *
+PciIdsFindVendor( CONST PCI_IDS_DATABASE *Db,
+                  UINT16 VendorId );
+
+CONST PCI_IDS_DEVICE *
+PciIdsFindDevice( CONST PCI_IDS_VENDOR *Vendor,
+                  UINT16 DeviceId );
+
+CONST PCI_IDS_SUBSYSTEM *
+PciIdsFindSubsystem( CONST PCI_IDS_DEVICE *Device,
+                     UINT16 SubVendorId,
+                     UINT16 SubDeviceId );
+
+UINTN
+PciIdsFindClass( CONST PCI_IDS_DATABASE *Db,
+                 UINT8 Class,
+                 UINT8 Subclass,
+                 UINT8 ProgIf,
+                 CONST CHAR8 **Names );
+
+VOID
+PciIdsFree( PCI_IDS_DATABASE *Db );
+
+CHAR16 *
+BuildIndexFileName( CONST CHAR16 *FullFileName,
+                    CONST CHAR16 *IndexName );
+
+//
+// Name search (PciIdsSearch.c)
+//
+EFI_STATUS
+PciIdsOpenSearch( CHAR16 *FullFileName,
+                  CONST CHAR16 *IndexName,
+                  CONST PCI_IDS_DATABASE *Db,
+                  PCI_IDS_SEARCH *Search );
+
+EFI_STATUS
+PciIdsFind( CONST PCI_IDS_SEARCH *Search,
+            CONST PCI_IDS_DATABASE *Db,
+            CONST CHAR8 *Text,
+            UINT32 **Matches,
+            UINTN *MatchCount );
+
+VOID
+PciIdsFreeSearch( PCI_IDS_SEARCH *Search );
+
+//
+// Built-in fallback tables (PciIdsBuiltin.c)
+//
+CONST CHAR8 *
+PciIdsBuiltinVendor( UINT16 VendorId );
+
+CONST CHAR8 *
+PciIdsBuiltinDevice( UINT16 VendorId,
+                     UINT16 DeviceId );
+
+CONST CHAR8 *
+PciIdsBuiltinVersion( VOID );
+
+VOID
+PciIdsBuiltinFree( VOID );
+
+#endif // _PCIIDS_H_
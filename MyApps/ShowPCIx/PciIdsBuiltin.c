@@ -0,0 +1,163 @@
+//
+//  Copyright (c) 2019   Finnbarr P. Murphy.   All rights reserved.
+//
+//  Built-in copy of the PCI.IDS vendor and device names
+//
+//  License: BSD 2 clause license applies.
+//
+//  Used when pci.ids cannot be found.  The tables in PciIdsData.h are
+//  minimal perfect hash tables generated by build_pci_ids_data.py, so a
+//  lookup is at most two hashes and one compare with no file I/O.
+//
+//  Names are kept in zlib-compressed blocks of 64 vendors each.  A block
+//  is inflated, using the lodepng zlib decoder, the first time one of its
+//  names is needed and kept until PciIdsBuiltinFree() is called.
+//
+//  Regenerate PciIdsData.h whenever pci.ids is updated:
+//
+//      python3 build_pci_ids_data.py pci.ids PciIdsData.h
+//
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+
+#include "PciIds.h"
+#include "../ScreenShot/lodepng.h"
+
+typedef struct {
+    UINT16  VendorId;
+    UINT16  DeviceId;
+    UINT32  Name;           // (block << PCI_IDS_DATA_BLOCK_SHIFT) | block offset
+} PCI_IDS_DATA_ENTRY;
+
+typedef struct {
+    UINT32  Offset;         // into PciIdsBlockData
+    UINT32  CompressedSize;
+    UINT32  Size;
+} PCI_IDS_DATA_BLOCK;
+
+#include "PciIdsData.h"
+
+STATIC CHAR8 *mBlocks[PCI_IDS_DATA_BLOCK_COUNT];
+
+
+//
+// Must match fmix32() and slot_hash() in build_pci_ids_data.py
+//
+STATIC
+UINT32
+Fmix32( UINT32 Hash )
+{
+    Hash ^= Hash >> 16;
+    Hash *= 0x85ebca6b;
+    Hash ^= Hash >> 13;
+    Hash *= 0xc2b2ae35;
+    Hash ^= Hash >> 16;
+
+    return Hash;
+}
+
+
+//
+// Return a name, inflating its block if this is the first use
+//
+STATIC
+CONST CHAR8 *
+GetName( UINT32 Name )
+{
+    CONST PCI_IDS_DATA_BLOCK *Block;
+    UINT32 Index = Name >> PCI_IDS_DATA_BLOCK_SHIFT;
+    UINT32 Offset = Name & ((1 << PCI_IDS_DATA_BLOCK_SHIFT) - 1);
+    UINT8  *Out = NULL;
+    size_t OutSize = 0;
+
+    if (Index >= PCI_IDS_DATA_BLOCK_COUNT) {
+        return NULL;
+    }
+    Block = &PciIdsBlocks[Index];
+
+    if (mBlocks[Index] == NULL) {
+        if (lodepng_zlib_decompress( &Out,
+                                     &OutSize,
+                                     &PciIdsBlockData[Block->Offset],
+                                     Block->CompressedSize,
+                                     &lodepng_default_decompress_settings ) != 0 ||
+            OutSize != Block->Size || Out[OutSize - 1] != '\0') {
+            lodepng_free( Out );
+            return NULL;
+        }
+        mBlocks[Index] = (CHAR8 *)Out;
+    }
+
+    if (Offset >= Block->Size) {
+        return NULL;
+    }
+
+    return mBlocks[Index] + Offset;
+}
+
+
+STATIC
+CONST CHAR8 *
+LookupName( CONST PCI_IDS_DATA_ENTRY *Table,
+            UINT32 Count,
+            CONST UINT16 *Seeds,
+            UINT32 Buckets,
+            UINT16 VendorId,
+            UINT16 DeviceId )
+{
+    UINT32 Key = ((UINT32)VendorId << 16) | DeviceId;
+    UINT32 Seed;
+    UINT32 Slot;
+
+    Seed = Seeds[Fmix32( Key ) % Buckets];
+    if (Seed & PCI_IDS_DATA_DIRECT_SLOT) {
+        Slot = Seed & ~PCI_IDS_DATA_DIRECT_SLOT;
+    } else {
+        Slot = Fmix32( Key ^ (Seed * 0x9e3779b9) ) % Count;
+    }
+
+    if (Table[Slot].VendorId != VendorId || Table[Slot].DeviceId != DeviceId) {
+        return NULL;
+    }
+
+    return GetName( Table[Slot].Name );
+}
+
+
+CONST CHAR8 *
+PciIdsBuiltinVendor( UINT16 VendorId )
+{
+    return LookupName( PciIdsVendorTable, PCI_IDS_DATA_VENDOR_COUNT,
+                       PciIdsVendorSeeds, PCI_IDS_DATA_VENDOR_BUCKETS,
+                       VendorId, 0 );
+}
+
+
+CONST CHAR8 *
+PciIdsBuiltinDevice( UINT16 VendorId,
+                     UINT16 DeviceId )
+{
+    return LookupName( PciIdsDeviceTable, PCI_IDS_DATA_DEVICE_COUNT,
+                       PciIdsDeviceSeeds, PCI_IDS_DATA_DEVICE_BUCKETS,
+                       VendorId, DeviceId );
+}
+
+
+CONST CHAR8 *
+PciIdsBuiltinVersion( VOID )
+{
+    return PCI_IDS_DATA_VERSION;
+}
+
+
+VOID
+PciIdsBuiltinFree( VOID )
+{
+    for (UINTN i = 0; i < PCI_IDS_DATA_BLOCK_COUNT; i++) {
+        if (mBlocks[i] != NULL) {
+            lodepng_free( mBlocks[i] );
+            mBlocks[i] = NULL;
+        }
+    }
+}
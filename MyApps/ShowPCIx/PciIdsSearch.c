@@ -0,0 +1,463 @@
+//
+//  Copyright (c) 2019   Finnbarr P. Murphy.   All rights reserved.
+//
+//  Trigram index for substring search over PCI.IDS vendor and device
+//  names
+//
+//  License: BSD 2 clause license applies.
+//
+//  The index (pci.trg) is built once from the loaded database, in two
+//  linear passes of a counting sort so the posting lists come out sorted,
+//  and saved beside pci.ids.  A query looks up the posting list of each
+//  of its trigrams and only checks the names in the shortest one.
+//
+
+#include <Uefi.h>
+#include <Library/UefiLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/ShellLib.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+
+#include "PciIds.h"
+
+
+STATIC
+UINT32
+FoldSymbol( CHAR8 Chr )
+{
+    if (Chr >= 'a' && Chr <= 'z') {
+        return Chr - 'a';
+    }
+    if (Chr >= 'A' && Chr <= 'Z') {
+        return Chr - 'A';
+    }
+    if (Chr >= '0' && Chr <= '9') {
+        return 26 + Chr - '0';
+    }
+    return PCI_TRG_SYMBOLS - 1;
+}
+
+
+STATIC
+CHAR8
+FoldCase( CHAR8 Chr )
+{
+    return (Chr >= 'A' && Chr <= 'Z') ? Chr - 'A' + 'a' : Chr;
+}
+
+
+//
+// Case-insensitive substring match
+//
+STATIC
+BOOLEAN
+NameContains( CONST CHAR8 *Name,
+              CONST CHAR8 *Text )
+{
+    UINTN i;
+
+    for (; *Name != '\0'; Name++) {
+        for (i = 0; Text[i] != '\0' && FoldCase( Name[i] ) == FoldCase( Text[i] ); i++);
+        if (Text[i] == '\0') {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+
+STATIC
+CONST CHAR8 *
+EntryName( CONST PCI_IDS_DATABASE *Db,
+           UINT32 Entry )
+{
+    CONST PCI_IDS_VENDOR *Vendor = &Db->Vendors[PCI_TRG_VENDOR(Entry)];
+
+    if (PCI_TRG_DEVICE(Entry) == 0) {
+        return Vendor->Name;
+    }
+
+    return Vendor->Devices[PCI_TRG_DEVICE(Entry) - 1].Name;
+}
+
+
+//
+// Add the distinct trigrams of one name. With Postings NULL only count
+// them; Last holds the entry each trigram was last seen in.
+//
+STATIC
+UINTN
+IndexName( UINT32 *Cursor,
+           UINT32 *Last,
+           UINT32 *Postings,
+           UINT32 Entry,
+           CONST CHAR8 *Name )
+{
+    UINTN  Added = 0;
+    UINT32 Trigram;
+
+    if (Name[0] == '\0' || Name[1] == '\0') {
+        return 0;
+    }
+
+    Trigram = FoldSymbol( Name[0] ) * PCI_TRG_SYMBOLS + FoldSymbol( Name[1] );
+    for (Name += 2; *Name != '\0'; Name++) {
+        Trigram = (Trigram % (PCI_TRG_SYMBOLS * PCI_TRG_SYMBOLS)) * PCI_TRG_SYMBOLS + FoldSymbol( *Name );
+        if (Last[Trigram] == Entry) {
+            continue;
+        }
+        Last[Trigram] = Entry;
+        if (Postings == NULL) {
+            Cursor[Trigram + 1]++;
+        } else {
+            Postings[Cursor[Trigram]++] = Entry;
+        }
+        Added++;
+    }
+
+    return Added;
+}
+
+
+STATIC
+UINTN
+IndexDatabase( CONST PCI_IDS_DATABASE *Db,
+               UINT32 *Cursor,
+               UINT32 *Last,
+               UINT32 *Postings )
+{
+    CONST PCI_IDS_VENDOR *Vendor;
+    UINTN Added = 0;
+
+    SetMem32( Last, PCI_TRG_TRIGRAMS * sizeof(UINT32), MAX_UINT32 );
+
+    // entries in increasing order, so every posting list is sorted
+    for (UINTN v = 0; v < Db->VendorCount; v++) {
+        Vendor = &Db->Vendors[v];
+        Added += IndexName( Cursor, Last, Postings, PCI_TRG_ENTRY(v, 0), Vendor->Name );
+        for (UINTN d = 0; d < Vendor->DeviceCount; d++) {
+            Added += IndexName( Cursor, Last, Postings, PCI_TRG_ENTRY(v, d + 1), Vendor->Devices[d].Name );
+        }
+    }
+
+    return Added;
+}
+
+
+//
+// Build the index image from the database tables and save it
+//
+STATIC
+EFI_STATUS
+BuildSearch( CHAR16 *IndexFileName,
+             CONST PCI_IDS_DATABASE *Db,
+             PCI_IDS_SEARCH *Search )
+{
+    SHELL_FILE_HANDLE FileHandle = (SHELL_FILE_HANDLE)NULL;
+    PCI_TRG_HEADER *Header;
+    EFI_STATUS Status;
+    UINT32     *Last;
+    UINT32     *Cursor;
+    UINT8      *Image;
+    UINTN      PostingCount;
+    UINTN      ImageSize;
+    UINTN      Size;
+
+    // entries must fit PCI_TRG_ENTRY
+    if (Db->VendorCount > MAX_UINT16) {
+        return EFI_UNSUPPORTED;
+    }
+    for (UINTN v = 0; v < Db->VendorCount; v++) {
+        if (Db->Vendors[v].DeviceCount >= MAX_UINT16) {
+            return EFI_UNSUPPORTED;
+        }
+    }
+
+    Last = AllocatePool( PCI_TRG_TRIGRAMS * sizeof(UINT32) );
+    Cursor = AllocateZeroPool( (PCI_TRG_TRIGRAMS + 1) * sizeof(UINT32) );
+    if (Last == NULL || Cursor == NULL) {
+        Status = EFI_OUT_OF_RESOURCES;
+        goto Done;
+    }
+
+    // count the postings of each trigram, then turn the counts into offsets
+    PostingCount = IndexDatabase( Db, Cursor, Last, NULL );
+    for (UINTN t = 1; t <= PCI_TRG_TRIGRAMS; t++) {
+        Cursor[t] += Cursor[t - 1];
+    }
+
+    ImageSize = sizeof(PCI_TRG_HEADER) + (PCI_TRG_TRIGRAMS + 1 + PostingCount) * sizeof(UINT32);
+    Image = AllocateZeroPool( ImageSize );
+    if (Image == NULL) {
+        Status = EFI_OUT_OF_RESOURCES;
+        goto Done;
+    }
+
+    Header = (PCI_TRG_HEADER *)Image;
+    Header->Signature = PCI_TRG_SIGNATURE;
+    Header->Revision = PCI_TRG_REVISION;
+    Header->HeaderSize = sizeof(PCI_TRG_HEADER);
+    Header->ImageSize = (UINT32)ImageSize;
+    Header->SourceSize = Db->SourceSize;
+    Header->SourceCrc = Db->SourceCrc;
+    Header->VendorCount = (UINT32)Db->VendorCount;
+    Header->DeviceCount = (UINT32)Db->DeviceCount;
+    Header->PostingCount = (UINT32)PostingCount;
+
+    Search->Image = Image;
+    Search->Offsets = (UINT32 *)(Image + sizeof(PCI_TRG_HEADER));
+    Search->Postings = Search->Offsets + PCI_TRG_TRIGRAMS + 1;
+    Search->PostingCount = PostingCount;
+    CopyMem( Search->Offsets, Cursor, (PCI_TRG_TRIGRAMS + 1) * sizeof(UINT32) );
+
+    // second pass fills each list, advancing its start offset as it goes
+    IndexDatabase( Db, Cursor, Last, Search->Postings );
+
+    gBS->CalculateCrc32( Image + sizeof(PCI_TRG_HEADER),
+                         ImageSize - sizeof(PCI_TRG_HEADER),
+                         &Header->ImageCrc );
+
+    // EFI_FILE_MODE_CREATE does not truncate, so remove any stale index first
+    Status = ShellOpenFileByName( IndexFileName,
+                                  &FileHandle,
+                                  EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE,
+                                  0 );
+    if (!EFI_ERROR(Status)) {
+        ShellDeleteFile( &FileHandle );
+    }
+
+    // best effort, the volume may be read-only
+    Status = ShellOpenFileByName( IndexFileName,
+                                  &FileHandle,
+                                  EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE,
+                                  0 );
+    if (!EFI_ERROR(Status)) {
+        Size = ImageSize;
+        ShellWriteFile( FileHandle, &Size, Image );
+        ShellCloseFile( &FileHandle );
+    }
+    Status = EFI_SUCCESS;
+
+Done:
+    if (Last != NULL) {
+        FreePool( Last );
+    }
+    if (Cursor != NULL) {
+        FreePool( Cursor );
+    }
+
+    return Status;
+}
+
+
+//
+// Load a saved index. Fails if it is damaged or was built from a
+// different pci.ids.
+//
+STATIC
+EFI_STATUS
+LoadSearch( CHAR16 *IndexFileName,
+            CONST PCI_IDS_DATABASE *Db,
+            PCI_IDS_SEARCH *Search )
+{
+    SHELL_FILE_HANDLE FileHandle = (SHELL_FILE_HANDLE)NULL;
+    PCI_TRG_HEADER *Header;
+    EFI_STATUS Status;
+    UINT8      *Image = NULL;
+    UINT32     *Offsets;
+    UINT64     FileSize;
+    UINT32     Crc;
+    UINTN      Size = 0;
+
+    Status = ShellOpenFileByName( IndexFileName,
+                                  &FileHandle,
+                                  EFI_FILE_MODE_READ,
+                                  0 );
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    Status = ShellGetFileSize( FileHandle, &FileSize );
+    if (!EFI_ERROR(Status)) {
+        if (FileSize < sizeof(PCI_TRG_HEADER) + (PCI_TRG_TRIGRAMS + 1) * sizeof(UINT32) ||
+            FileSize > MAX_UINT32) {
+            Status = EFI_VOLUME_CORRUPTED;
+        } else {
+            Size = (UINTN)FileSize;
+            Image = AllocatePool( Size );
+            if (Image == NULL) {
+                Status = EFI_OUT_OF_RESOURCES;
+            } else {
+                Status = ShellReadFile( FileHandle, &Size, Image );
+            }
+        }
+    }
+    ShellCloseFile( &FileHandle );
+    if (EFI_ERROR(Status)) {
+        goto Error;
+    }
+
+    Header = (PCI_TRG_HEADER *)Image;
+    if (Size != FileSize ||
+        Header->Signature != PCI_TRG_SIGNATURE ||
+        Header->Revision != PCI_TRG_REVISION ||
+        Header->HeaderSize != sizeof(PCI_TRG_HEADER) ||
+        Header->ImageSize != Size ||
+        Size != sizeof(PCI_TRG_HEADER) + (PCI_TRG_TRIGRAMS + 1 + (UINT64)Header->PostingCount) * sizeof(UINT32)) {
+        Status = EFI_VOLUME_CORRUPTED;
+        goto Error;
+    }
+
+    // stale if pci.ids has been replaced
+    if (Header->SourceSize != Db->SourceSize ||
+        Header->SourceCrc != Db->SourceCrc ||
+        Header->VendorCount != Db->VendorCount ||
+        Header->DeviceCount != Db->DeviceCount) {
+        Status = EFI_NOT_FOUND;
+        goto Error;
+    }
+
+    gBS->CalculateCrc32( Image + sizeof(PCI_TRG_HEADER), Size - sizeof(PCI_TRG_HEADER), &Crc );
+    Offsets = (UINT32 *)(Image + sizeof(PCI_TRG_HEADER));
+    if (Crc != Header->ImageCrc ||
+        Offsets[0] != 0 ||
+        Offsets[PCI_TRG_TRIGRAMS] != Header->PostingCount) {
+        Status = EFI_VOLUME_CORRUPTED;
+        goto Error;
+    }
+    for (UINTN t = 0; t < PCI_TRG_TRIGRAMS; t++) {
+        if (Offsets[t] > Offsets[t + 1]) {
+            Status = EFI_VOLUME_CORRUPTED;
+            goto Error;
+        }
+    }
+
+    Search->Image = Image;
+    Search->Offsets = Offsets;
+    Search->Postings = Offsets + PCI_TRG_TRIGRAMS + 1;
+    Search->PostingCount = Header->PostingCount;
+
+    return EFI_SUCCESS;
+
+Error:
+    if (Image != NULL) {
+        FreePool( Image );
+    }
+
+    return Status;
+}
+
+
+//
+// Load the search index if it matches the database, otherwise build it
+//
+EFI_STATUS
+PciIdsOpenSearch( CHAR16 *FullFileName,
+                  CONST CHAR16 *IndexName,
+                  CONST PCI_IDS_DATABASE *Db,
+                  PCI_IDS_SEARCH *Search )
+{
+    EFI_STATUS Status;
+    CHAR16     *IndexFileName;
+
+    ZeroMem( Search, sizeof(PCI_IDS_SEARCH) );
+
+    IndexFileName = BuildIndexFileName( FullFileName, IndexName );
+    if (IndexFileName == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    Status = LoadSearch( IndexFileName, Db, Search );
+    if (EFI_ERROR(Status)) {
+        Status = BuildSearch( IndexFileName, Db, Search );
+    }
+
+    FreePool( IndexFileName );
+
+    return Status;
+}
+
+
+//
+// Find every vendor and device whose name contains Text, ignoring case.
+// Matches are entries in increasing order, in a buffer the caller frees.
+//
+EFI_STATUS
+PciIdsFind( CONST PCI_IDS_SEARCH *Search,
+            CONST PCI_IDS_DATABASE *Db,
+            CONST CHAR8 *Text,
+            UINT32 **Matches,
+            UINTN *MatchCount )
+{
+    CONST UINT32 *Candidates = NULL;
+    UINT32 Trigram;
+    UINT32 Entry;
+    UINTN  CandidateCount = 0;
+    UINTN  Length;
+
+    *Matches = NULL;
+    *MatchCount = 0;
+
+    Length = AsciiStrLen( Text );
+    if (Length == 0) {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    // the rarest trigram of the text bounds the names to check
+    if (Length >= 3) {
+        Trigram = FoldSymbol( Text[0] ) * PCI_TRG_SYMBOLS + FoldSymbol( Text[1] );
+        for (UINTN i = 2; i < Length; i++) {
+            Trigram = (Trigram % (PCI_TRG_SYMBOLS * PCI_TRG_SYMBOLS)) * PCI_TRG_SYMBOLS + FoldSymbol( Text[i] );
+            if (Candidates == NULL ||
+                Search->Offsets[Trigram + 1] - Search->Offsets[Trigram] < CandidateCount) {
+                Candidates = Search->Postings + Search->Offsets[Trigram];
+                CandidateCount = Search->Offsets[Trigram + 1] - Search->Offsets[Trigram];
+            }
+        }
+        if (CandidateCount == 0) {
+            return EFI_SUCCESS;
+        }
+    } else {
+        // too short for a trigram, check every name
+        CandidateCount = Db->VendorCount + Db->DeviceCount;
+    }
+
+    *Matches = AllocatePool( CandidateCount * sizeof(UINT32) );
+    if (*Matches == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    if (Candidates != NULL) {
+        for (UINTN i = 0; i < CandidateCount; i++) {
+            if (NameContains( EntryName( Db, Candidates[i] ), Text )) {
+                (*Matches)[(*MatchCount)++] = Candidates[i];
+            }
+        }
+        return EFI_SUCCESS;
+    }
+
+    for (UINTN v = 0; v < Db->VendorCount; v++) {
+        for (UINTN d = 0; d <= Db->Vendors[v].DeviceCount; d++) {
+            Entry = PCI_TRG_ENTRY(v, d);
+            if (NameContains( EntryName( Db, Entry ), Text )) {
+                (*Matches)[(*MatchCount)++] = Entry;
+            }
+        }
+    }
+
+    return EFI_SUCCESS;
+}
+
+
+VOID
+PciIdsFreeSearch( PCI_IDS_SEARCH *Search )
+{
+    if (Search->Image != NULL) {
+        FreePool( Search->Image );
+    }
+
+    ZeroMem( Search, sizeof(PCI_IDS_SEARCH) );
+}
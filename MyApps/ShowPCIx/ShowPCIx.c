@@ -6,7 +6,8 @@
 //  License: UDK2015 license applies to code from UDK2015 source, 
 //           BSD 2 clause license applies to all other code.
 //
-//  Requires pci.ids database from https://pci-ids.ucw.cz/ for full functionality 
+//  Uses pci.ids database from https://pci-ids.ucw.cz/ if found, otherwise
+//  a built-in copy of the vendor and device names
 //
 
 
@@ -20,284 +21,731 @@
 #include <Library/MemoryAllocationLib.h>
 #include <Library/UefiBootServicesTableLib.h>
 #include <Library/PrintLib.h>
-
-#include <Protocol/PciEnumerationComplete.h>
-#include <Protocol/PciRootBridgeIo.h>
+#include <Library/SortLib.h>
+#include <Library/PciSnapshotLib.h>
 
 #include <IndustryStandard/Pci.h>
 
-#define CALC_EFI_PCI_ADDRESS(Bus, Dev, Func, Reg) \
-    ((UINT64) ((((UINTN) Bus) << 24) + (((UINTN) Dev) << 16) + (((UINTN) Func) << 8) + ((UINTN) Reg)))
-
-// all typedefs from EDKII sources
-#pragma pack(1)
-typedef union {
-   PCI_DEVICE_HEADER_TYPE_REGION  Device;
-   PCI_CARDBUS_CONTROL_REGISTER   CardBus;
-} NON_COMMON_UNION;
+#include "PciIds.h"
 
-typedef struct {
-   PCI_DEVICE_INDEPENDENT_REGION  Common;
-   NON_COMMON_UNION               NonCommon;
-   UINT32                         Data[48];
-} PCI_CONFIG_SPACE;
-#pragma pack()
-
-#define UTILITY_VERSION L"20190403"
+#define UTILITY_VERSION L"20190415"
 #undef DEBUG
-#define LINE_MAX 1024
 #define PCIDATABASE L"pci.ids"
+#define PCIDATABASE_INDEX L"pci.idx"
+#define PCIDATABASE_SEARCH L"pci.trg"
+#define DETAIL_INDENT 43
+
 
-#define EFI_PCI_EMUMERATION_COMPLETE_GUID \
-    { 0x30cfe3e7, 0x3de1, 0x4586, {0xbe, 0x20, 0xde, 0xab, 0xa1, 0xb3, 0xb7, 0x93}}
+//
+// Snapshot diff index entry, sorted by segment, bus, device, function
+//
+typedef struct {
+    UINT64              Key;
+    PCI_SNAPSHOT_DEVICE *Device;
+} PCI_DIFF_ENTRY;
 
 
-CHAR16 *
-GetDeviceDesc( CHAR16 *Line )
+//
+// Look up vendor and device names in the in-memory database, or in
+// the built-in tables if no database was loaded. Unknown names are NULL.
+//
+VOID
+LookupPciNames( CONST PCI_IDS_DATABASE *Db,
+                UINT16 VendorId,
+                UINT16 DeviceId,
+                CONST CHAR8 **VendorName,
+                CONST CHAR8 **DeviceName )
 {
-    static CHAR16 DeviceDesc[LINE_MAX];
-    CHAR16 *s = Line;
-    CHAR16 *d = DeviceDesc;
+    CONST PCI_IDS_VENDOR *Vendor;
+    CONST PCI_IDS_DEVICE *Device;
+
+    *DeviceName = NULL;
 
-    s++;
-    while (*s++) {
-        if (*s == L' ' || *s == L'\t')
-           break;
+    if (Db->VendorCount == 0) {
+        *VendorName = PciIdsBuiltinVendor( VendorId );
+        if (*VendorName != NULL) {
+            *DeviceName = PciIdsBuiltinDevice( VendorId, DeviceId );
+        }
+    } else {
+        Vendor = PciIdsFindVendor( Db, VendorId );
+        *VendorName = (Vendor == NULL) ? NULL : Vendor->Name;
+        if (Vendor != NULL) {
+            Device = PciIdsFindDevice( Vendor, DeviceId );
+            *DeviceName = (Device == NULL) ? NULL : Device->Name;
+        }
     }
+}
+
+
+//
+// Print vendor and device names
+//
+BOOLEAN
+PrintPciNames( CONST PCI_IDS_DATABASE *Db,
+               UINT16 VendorId,
+               UINT16 DeviceId )
+{
+    CONST CHAR8 *VendorName;
+    CONST CHAR8 *DeviceName;
+
+    LookupPciNames( Db, VendorId, DeviceId, &VendorName, &DeviceName );
 
-    while (*s++) {
-        if (*s != L' ' && *s != L'\t')
-           break;
+    if (VendorName == NULL) {
+        return FALSE;
     }
+    Print(L"     %a", VendorName);
 
-    while (*s) {
-        *(d++) = *(s++);
+    if (DeviceName == NULL) {
+        return FALSE;
     }
-    *d = 0;
+    Print(L", %a", DeviceName);
 
-    return DeviceDesc;
+    return TRUE;
 }
 
 
-CHAR16 *
-GetVendorDesc( CHAR16 *Line )
+//
+// Print subsystem and class names on continuation lines. Only known
+// with a pci.ids database, the built-in tables do not carry them.
+//
+VOID
+PrintPciDetails( CONST PCI_IDS_DATABASE *Db,
+                 CONST PCI_TYPE00 *PciHeader )
 {
-    static CHAR16 VendorDesc[LINE_MAX];
-    CHAR16 *s = Line;
-    CHAR16 *d = VendorDesc;
+    CONST PCI_IDS_VENDOR *Vendor;
+    CONST PCI_IDS_VENDOR *SubVendor;
+    CONST PCI_IDS_DEVICE *Device;
+    CONST PCI_IDS_SUBSYSTEM *Subsystem = NULL;
+    CONST CHAR8 *ClassNames[3];
+    UINTN Count;
+
+    if (Db->VendorCount == 0) {
+        return;
+    }
 
-    while (*s++) {
-        if (*s == L' ' || *s == L'\t')
-            break;
+    // subsystem IDs are only in type 0 headers
+    if ((PciHeader->Hdr.HeaderType & HEADER_LAYOUT_CODE) == HEADER_TYPE_DEVICE &&
+        PciHeader->Device.SubsystemVendorID != 0 && PciHeader->Device.SubsystemVendorID != 0xffff) {
+        Vendor = PciIdsFindVendor( Db, PciHeader->Hdr.VendorId );
+        if (Vendor != NULL) {
+            Device = PciIdsFindDevice( Vendor, PciHeader->Hdr.DeviceId );
+            if (Device != NULL) {
+                Subsystem = PciIdsFindSubsystem( Device,
+                                                 PciHeader->Device.SubsystemVendorID,
+                                                 PciHeader->Device.SubsystemID );
+            }
+        }
+        if (Subsystem != NULL) {
+            Print(L"%*a Subsystem: %a\n", (UINTN)DETAIL_INDENT, "", Subsystem->Name);
+        } else if ((SubVendor = PciIdsFindVendor( Db, PciHeader->Device.SubsystemVendorID )) != NULL) {
+            Print(L"%*a Subsystem: %a\n", (UINTN)DETAIL_INDENT, "", SubVendor->Name);
+        }
     }
 
-    while (*s++) {
-        if (*s != L' ' && *s != L'\t')
-            break;
+    Count = PciIdsFindClass( Db,
+                             PciHeader->Hdr.ClassCode[2],
+                             PciHeader->Hdr.ClassCode[1],
+                             PciHeader->Hdr.ClassCode[0],
+                             ClassNames );
+    if (Count > 0) {
+        Print(L"%*a Class: %a", (UINTN)DETAIL_INDENT, "", ClassNames[0]);
+        for (UINTN i = 1; i < Count; i++) {
+            Print(L", %a", ClassNames[i]);
+        }
+        Print(L"\n");
     }
+}
 
-    while (*s) {
-        *(d++) = *(s++);
+
+
+//
+// Print one function, as a table row or as a tree node
+//
+VOID
+PrintPciFunction( CONST PCI_IDS_DATABASE *Db,
+                  BOOLEAN Tree,
+                  CONST PCI_SNAPSHOT_DEVICE *Device )
+{
+    CONST PCI_TYPE00 *PciHeader = &Device->Header;
+
+    if (Tree) {
+        Print(L"%*s%02x:%02x.%x  %04x:%04x", (UINTN)(Device->Depth * 2 + 1), L"",
+              Device->Bus, Device->Device, Device->Function,
+              PciHeader->Hdr.VendorId, PciHeader->Hdr.DeviceId);
+        if (Db != NULL) {
+            PrintPciNames( Db, PciHeader->Hdr.VendorId, PciHeader->Hdr.DeviceId );
+        }
+        Print(L"\n");
+        return;
+    }
+
+    Print(L" %02d     %04x     %04x     %04x     %04x", 
+          Device->Bus, PciHeader->Hdr.VendorId, PciHeader->Hdr.DeviceId, 
+          PciHeader->Device.SubsystemVendorID, PciHeader->Device.SubsystemID);
+
+    if (Db != NULL) {
+        PrintPciNames( Db, PciHeader->Hdr.VendorId, PciHeader->Hdr.DeviceId );
     }
-    *d = 0;
 
-    return VendorDesc;
+    Print(L"\n");
+
+    if (Db != NULL) {
+        PrintPciDetails( Db, PciHeader );
+    }
+}
+
+
+STATIC
+INTN
+EFIAPI
+CompareDiffEntry( CONST VOID *Left,
+                  CONST VOID *Right )
+{
+    UINT64 LeftKey = ((CONST PCI_DIFF_ENTRY *)Left)->Key;
+    UINT64 RightKey = ((CONST PCI_DIFF_ENTRY *)Right)->Key;
+
+    return (LeftKey > RightKey) - (LeftKey < RightKey);
 }
 
 
 //
-// Copyed from UDK2015 Source.
+// Index a snapshot by location. Walk order is bus order on most systems,
+// so only sort when needed; UefiSortLib quicksort degrades on sorted input.
 //
 EFI_STATUS
-PciGetNextBusRange( EFI_ACPI_ADDRESS_SPACE_DESCRIPTOR **Descriptors,
-                    UINT16 *MinBus,
-                    UINT16 *MaxBus,
-                    BOOLEAN *IsEnd )
+BuildDiffIndex( PCI_SNAPSHOT *Snapshot,
+                PCI_DIFF_ENTRY **Index )
 {
-    *IsEnd = FALSE;
+    PCI_SNAPSHOT_DEVICE *Device;
+    PCI_DIFF_ENTRY *Entries;
 
-    if ((*Descriptors) == NULL) {
-        *MinBus = 0;
-        *MaxBus = PCI_MAX_BUS;
-        return EFI_SUCCESS;
+    Entries = AllocatePool( MAX( Snapshot->DeviceCount, 1 ) * sizeof(PCI_DIFF_ENTRY) );
+    if (Entries == NULL) {
+        return EFI_OUT_OF_RESOURCES;
     }
 
-    while ((*Descriptors)->Desc != ACPI_END_TAG_DESCRIPTOR) {
-        if ((*Descriptors)->ResType == ACPI_ADDRESS_SPACE_TYPE_BUS) {
-            *MinBus = (UINT16) (*Descriptors)->AddrRangeMin;
-            *MaxBus = (UINT16) (*Descriptors)->AddrRangeMax;
-            (*Descriptors)++;
-            return (EFI_SUCCESS);
-        }
-
-        (*Descriptors)++;
+    for (UINTN i = 0; i < Snapshot->DeviceCount; i++) {
+        Device = &Snapshot->Devices[i];
+        Entries[i].Key = LShiftU64( Device->Segment, 24 ) |
+                         (Device->Bus << 16) | (Device->Device << 8) | Device->Function;
+        Entries[i].Device = Device;
     }
 
-    if ((*Descriptors)->Desc == ACPI_END_TAG_DESCRIPTOR) {
-        *IsEnd = TRUE;
+    for (UINTN i = 1; i < Snapshot->DeviceCount; i++) {
+        if (Entries[i - 1].Key > Entries[i].Key) {
+            PerformQuickSort( Entries, Snapshot->DeviceCount, sizeof(PCI_DIFF_ENTRY), CompareDiffEntry );
+            break;
+        }
     }
 
+    *Index = Entries;
+
     return EFI_SUCCESS;
 }
 
 
 //
-// Copyed from UDK2015 Source. 
+// Print one added or removed function of a diff
+//
+VOID
+PrintDiffFunction( CONST PCI_IDS_DATABASE *Db,
+                   CHAR16 Change,
+                   CONST PCI_SNAPSHOT_DEVICE *Device )
+{
+    Print(L"%c %04x:%02x:%02x.%x  %04x:%04x", Change,
+          Device->Segment, Device->Bus, Device->Device, Device->Function,
+          Device->Header.Hdr.VendorId, Device->Header.Hdr.DeviceId);
+    if (Db != NULL) {
+        PrintPciNames( Db, Device->Header.Hdr.VendorId, Device->Header.Hdr.DeviceId );
+    }
+    Print(L"\n");
+}
+
+
+//
+// Compare two snapshots with one merge pass over their sorted indexes,
+// printing added and removed functions and every changed config dword
 //
 EFI_STATUS
-PciGetProtocolAndResource( EFI_HANDLE Handle,
-                           EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL **IoDev,
-                           EFI_ACPI_ADDRESS_SPACE_DESCRIPTOR **Descriptors )
+DiffSnapshots( CONST PCI_IDS_DATABASE *Db,
+               PCI_SNAPSHOT *Old,
+               PCI_SNAPSHOT *New,
+               UINTN *Differences )
 {
+    PCI_DIFF_ENTRY *OldIndex = NULL;
+    PCI_DIFF_ENTRY *NewIndex = NULL;
+    PCI_SNAPSHOT_DEVICE *OldDevice;
+    PCI_SNAPSHOT_DEVICE *NewDevice;
+    CONST UINT32 *OldConfig;
+    CONST UINT32 *NewConfig;
     EFI_STATUS Status;
+    BOOLEAN    Changed;
+    UINTN      o = 0;
+    UINTN      n = 0;
 
-    Status = gBS->HandleProtocol( Handle,
-                                  &gEfiPciRootBridgeIoProtocolGuid,
-                                  (VOID**)IoDev );
-    if (EFI_ERROR (Status)) {
-        return Status;
+    *Differences = 0;
+
+    Status = BuildDiffIndex( Old, &OldIndex );
+    if (!EFI_ERROR(Status)) {
+        Status = BuildDiffIndex( New, &NewIndex );
+    }
+    if (EFI_ERROR(Status)) {
+        goto Done;
     }
 
-    Status = (*IoDev)->Configuration ( *IoDev,
-                                       (VOID**)Descriptors );
-    if (Status == EFI_UNSUPPORTED) {
-        *Descriptors = NULL;
-        return EFI_SUCCESS;
+    while (o < Old->DeviceCount || n < New->DeviceCount) {
+        if (n == New->DeviceCount ||
+            (o < Old->DeviceCount && OldIndex[o].Key < NewIndex[n].Key)) {
+            PrintDiffFunction( Db, L'-', OldIndex[o++].Device );
+            (*Differences)++;
+            continue;
+        }
+        if (o == Old->DeviceCount || NewIndex[n].Key < OldIndex[o].Key) {
+            PrintDiffFunction( Db, L'+', NewIndex[n++].Device );
+            (*Differences)++;
+            continue;
+        }
+
+        OldDevice = OldIndex[o++].Device;
+        NewDevice = NewIndex[n++].Device;
+        Status = PciSnapshotReadExtended( Old, OldDevice );
+        if (!EFI_ERROR(Status)) {
+            Status = PciSnapshotReadExtended( New, NewDevice );
+        }
+        if (EFI_ERROR(Status)) {
+            goto Done;
+        }
+
+        OldConfig = (CONST UINT32 *)OldDevice->Extended;
+        NewConfig = (CONST UINT32 *)NewDevice->Extended;
+        Changed = FALSE;
+        for (UINTN i = 0; i < PCI_SNAPSHOT_EXTENDED_SIZE / sizeof(UINT32); i++) {
+            if (OldConfig[i] == NewConfig[i]) {
+                continue;
+            }
+            if (Changed == FALSE) {
+                PrintDiffFunction( Db, L'*', NewDevice );
+                (*Differences)++;
+                Changed = TRUE;
+            }
+            Print(L"    0x%03x: %08x -> %08x\n", i * sizeof(UINT32), OldConfig[i], NewConfig[i]);
+        }
+    }
+
+Done:
+    if (OldIndex != NULL) {
+        FreePool( OldIndex );
+    }
+    if (NewIndex != NULL) {
+        FreePool( NewIndex );
     }
 
     return Status;
 }
 
 
-VOID
-LowerCaseStr( CHAR16 *Str )
+//
+// Link speed in GT/s from the Link Capabilities encoding
+//
+CONST CHAR16 *
+LinkSpeedString( UINT8 Speed )
+{
+    CONST CHAR16 *Speeds[] = { L"?", L"2.5", L"5", L"8", L"16", L"32", L"64" };
+
+    return (Speed < ARRAY_SIZE(Speeds)) ? Speeds[Speed] : Speeds[0];
+}
+
+
+CONST CHAR16 *
+AspmString( UINT8 Aspm )
+{
+    CONST CHAR16 *States[] = { L"off", L"L0s", L"L1", L"L0s L1" };
+
+    return States[Aspm & (PCI_EXPRESS_ASPM_L0S | PCI_EXPRESS_ASPM_L1)];
+}
+
+
+CONST CHAR16 *
+PortTypeString( UINT8 PortType )
+{
+    switch (PortType) {
+        case PCI_EXPRESS_PORT_ENDPOINT:           return L"Endpoint";
+        case PCI_EXPRESS_PORT_LEGACY_ENDPOINT:    return L"Legacy";
+        case PCI_EXPRESS_PORT_ROOT:               return L"Root Port";
+        case PCI_EXPRESS_PORT_UPSTREAM:           return L"Upstream";
+        case PCI_EXPRESS_PORT_DOWNSTREAM:         return L"Downstream";
+        case PCI_EXPRESS_PORT_PCIE_TO_PCI:        return L"PCIe-PCI";
+        case PCI_EXPRESS_PORT_PCI_TO_PCIE:        return L"PCI-PCIe";
+        case PCI_EXPRESS_PORT_RC_ENDPOINT:        return L"RC Endpoint";
+        case PCI_EXPRESS_PORT_RC_EVENT_COLLECTOR: return L"RC Event";
+        default:                                  return L"?";
+    }
+}
+
+
+//
+// Compare a function with the downstream port at the other end of its
+// link. Returns the number of mismatches printed.
+//
+UINTN
+CheckUpstreamLink( UINTN Fields,
+                   CONST PCI_SNAPSHOT_EXPRESS *Express,
+                   CONST PCI_SNAPSHOT_EXPRESS *Port )
 {
-    for (int i = 0; Str[i] != L'\0'; i++) {
-        if (Str[i] >= L'A' && Str[i] <= L'Z') {
-            Str[i] -= (CHAR16)(L'A' - L'a');
+    UINTN Mismatches = 0;
+    UINT8 Speed;
+    UINT8 Width;
+
+    if ((Fields & PCI_EXPRESS_LINK) != 0) {
+        // the link trains to the best both ends support
+        Speed = MIN( Express->MaxLinkSpeed, Port->MaxLinkSpeed );
+        Width = MIN( Express->MaxLinkWidth, Port->MaxLinkWidth );
+        if (Express->LinkSpeed < Speed) {
+            Print(L"%*a ! link at %s GT/s, both ends support %s GT/s\n", (UINTN)12, "",
+                  LinkSpeedString( Express->LinkSpeed ), LinkSpeedString( Speed ));
+            Mismatches++;
         }
+        if (Express->LinkWidth < Width) {
+            Print(L"%*a ! link is x%d, both ends support x%d\n", (UINTN)12, "",
+                  Express->LinkWidth, Width);
+            Mismatches++;
+        }
+    }
+
+    if ((Fields & PCI_EXPRESS_PAYLOAD) != 0 && Express->MaxPayload != Port->MaxPayload) {
+        Print(L"%*a ! MPS %d, upstream port MPS %d\n", (UINTN)12, "",
+              Express->MaxPayload, Port->MaxPayload);
+        Mismatches++;
+    }
+
+    if ((Fields & PCI_EXPRESS_ASPM) != 0 && Express->AspmEnabled != Port->AspmEnabled) {
+        Print(L"%*a ! ASPM %s%s%s, upstream port ASPM %s%s%s\n", (UINTN)12, "",
+              AspmString( Express->AspmEnabled ),
+              (Express->AspmEnabled & PCI_EXPRESS_ASPM_L1_1) ? L" L1.1" : L"",
+              (Express->AspmEnabled & PCI_EXPRESS_ASPM_L1_2) ? L" L1.2" : L"",
+              AspmString( Port->AspmEnabled ),
+              (Port->AspmEnabled & PCI_EXPRESS_ASPM_L1_1) ? L" L1.1" : L"",
+              (Port->AspmEnabled & PCI_EXPRESS_ASPM_L1_2) ? L" L1.2" : L"");
+        Mismatches++;
     }
+
+    return Mismatches;
 }
 
 
-BOOLEAN
-SearchPciData( SHELL_FILE_HANDLE FileHandle,
-               CHAR16 *ReadLine,
-               UINTN VendorID, 
-               UINTN DeviceID )
+//
+// List the PCI Express settings of every function, flagging any that
+// differ from the port upstream of it
+//
+VOID
+PrintPciExpress( PCI_SNAPSHOT *Snapshot,
+                 UINTN Fields )
 {
-    EFI_STATUS Status = EFI_SUCCESS;
-    BOOLEAN Found = FALSE;
-    BOOLEAN VendorFound = FALSE;
-    BOOLEAN Ascii = TRUE;
-    UINTN   Size = LINE_MAX;
-    CHAR16  Vendor[5];
-    CHAR16  Device[5];
-
-    UnicodeSPrint(Vendor, sizeof(Vendor), L"%04x", VendorID);
-    LowerCaseStr(Vendor);
-    UnicodeSPrint(Device, sizeof(Device), L"%04x", DeviceID);
-    LowerCaseStr(Device);
-
-    ShellSetFilePosition(FileHandle, 0);
-
-    // Read file line by line
-    for (;!ShellFileHandleEof(FileHandle); Size = LINE_MAX) {
-        Status = ShellFileHandleReadLine( FileHandle, ReadLine, &Size, TRUE, &Ascii );
-        if (Status == EFI_BUFFER_TOO_SMALL) {
-            Status = EFI_SUCCESS;
-        } else if (EFI_ERROR(Status)) {
-            break;
+    PCI_SNAPSHOT_EXPRESS Express;
+    PCI_SNAPSHOT_EXPRESS Port;
+    PCI_SNAPSHOT_DEVICE *Device;
+    PCI_SNAPSHOT_DEVICE *Bridge;
+    UINTN Mismatches = 0;
+    UINTN Count = 0;
+
+    Print(L"Location      Port         ");
+    if ((Fields & PCI_EXPRESS_LINK) != 0) {
+        Print(L"Link (GT/s)  Max (GT/s)   ");
+    }
+    if ((Fields & PCI_EXPRESS_PAYLOAD) != 0) {
+        Print(L"MPS  Max   MRRS  RO   ");
+    }
+    if ((Fields & PCI_EXPRESS_ASPM) != 0) {
+        Print(L"ASPM (supported)");
+    }
+    Print(L"\n\n");
+
+    for (UINTN i = 0; i < Snapshot->DeviceCount; i++) {
+        Device = &Snapshot->Devices[i];
+        if (EFI_ERROR(PciSnapshotReadExpress( Snapshot, Device, Fields, &Express ))) {
+            continue;
+        }
+        Count++;
+
+        Print(L"%04x:%02x:%02x.%x  %-11s  ", Device->Segment, Device->Bus,
+              Device->Device, Device->Function, PortTypeString( Express.PortType ));
+        if ((Fields & PCI_EXPRESS_LINK) != 0) {
+            if (Express.HasLink) {
+                Print(L"%4s x%-2d     %4s x%-2d     ",
+                      LinkSpeedString( Express.LinkSpeed ), Express.LinkWidth,
+                      LinkSpeedString( Express.MaxLinkSpeed ), Express.MaxLinkWidth);
+            } else {
+                Print(L"%-26s", L"-");
+            }
         }
+        if ((Fields & PCI_EXPRESS_PAYLOAD) != 0) {
+            Print(L"%4d %4d  %4d  %-3s  ", Express.MaxPayload, Express.MaxPayloadSupported,
+                  Express.MaxReadRequest, Express.RelaxedOrdering ? L"on" : L"off");
+        }
+        if ((Fields & PCI_EXPRESS_ASPM) != 0 && Express.HasLink) {
+            Print(L"%s%s%s (%s%s%s)", AspmString( Express.AspmEnabled ),
+                  (Express.AspmEnabled & PCI_EXPRESS_ASPM_L1_1) ? L" L1.1" : L"",
+                  (Express.AspmEnabled & PCI_EXPRESS_ASPM_L1_2) ? L" L1.2" : L"",
+                  AspmString( Express.AspmSupported ),
+                  (Express.AspmSupported & PCI_EXPRESS_ASPM_L1_1) ? L" L1.1" : L"",
+                  (Express.AspmSupported & PCI_EXPRESS_ASPM_L1_2) ? L" L1.2" : L"");
+        }
+        Print(L"\n");
 
-        // Skip comment and empty lines
-        if (ReadLine[0] == L'#' || ReadLine[0] == L' ' || 
-            ReadLine[0] == L'\n' || ReadLine[0] == L'\r') {
+        // only the upstream end of a link is compared, against its port
+        if (Express.PortType != PCI_EXPRESS_PORT_ENDPOINT &&
+            Express.PortType != PCI_EXPRESS_PORT_LEGACY_ENDPOINT &&
+            Express.PortType != PCI_EXPRESS_PORT_UPSTREAM &&
+            Express.PortType != PCI_EXPRESS_PORT_PCIE_TO_PCI) {
             continue;
         }
- 
-        if (StrnCmp(ReadLine, Vendor, 4) == 0) {
-            Print(L"     %s", GetVendorDesc(ReadLine));
-            VendorFound = TRUE;
-        } else if (VendorFound && StrnCmp(&ReadLine[1], Device, 4) == 0) {
-            Print(L", %s", GetDeviceDesc(ReadLine));
-            Found = TRUE;
-            break;
-        } else if (VendorFound && (StrnCmp(ReadLine, L"\t", 1) != 0) && 
-                  (StrnCmp(ReadLine, L"\t\t", 2) != 0)) {
-            break;
+        Bridge = PciSnapshotFindUpstreamBridge( Snapshot, Device );
+        if (Bridge == NULL ||
+            EFI_ERROR(PciSnapshotReadExpress( Snapshot, Bridge, Fields, &Port )) ||
+            (Port.PortType != PCI_EXPRESS_PORT_ROOT && Port.PortType != PCI_EXPRESS_PORT_DOWNSTREAM)) {
+            continue;
         }
+        Mismatches += CheckUpstreamLink( Fields, &Express, &Port );
     }
 
-    return Found;
-} 
+    Print(L"\n%d PCI Express functions, %d mismatches with upstream ports\n", Count, Mismatches);
+}
 
 
 //
-// Print PCI.ID database version string
+// Parse a comma separated list of PCI Express field groups
 //
-VOID
-PrintPciDatabaseVersion( VOID )
+UINTN
+ParseExpressFields( CONST CHAR16 *List )
 {
-    SHELL_FILE_HANDLE InFileHandle = (SHELL_FILE_HANDLE)NULL;
-    EFI_STATUS Status = EFI_SUCCESS;
-    BOOLEAN Ascii = TRUE;
-    CHAR16 *FullFileName = (CHAR16 *)NULL;
-    CHAR16 FileName[] = PCIDATABASE;
-    CHAR16 *ReadLine = (CHAR16 *)NULL;
-    CHAR16 *Sptr, *Vptr;
-    CHAR16 Version[12];
-    UINTN Size = LINE_MAX;
+    CONST CHAR16 *Names[] = { L"link", L"payload", L"aspm" };
+    CONST UINTN Groups[] = { PCI_EXPRESS_LINK, PCI_EXPRESS_PAYLOAD, PCI_EXPRESS_ASPM };
+    UINTN Fields = 0;
+    UINTN Length;
+    UINTN i;
+
+    while (*List != L'\0') {
+        for (Length = 0; List[Length] != L'\0' && List[Length] != L','; Length++);
+        for (i = 0; i < ARRAY_SIZE(Names); i++) {
+            if (StrLen( Names[i] ) == Length && StrnCmp( List, Names[i], Length ) == 0) {
+                Fields |= Groups[i];
+                break;
+            }
+        }
+        if (i == ARRAY_SIZE(Names)) {
+            return 0;
+        }
+        List += Length;
+        if (*List == L',') {
+            List++;
+        }
+    }
 
-    FullFileName = ShellFindFilePath( FileName );
-    if (FullFileName == NULL) {
-        return;
+    return Fields;
+}
+
+STATIC
+INTN
+EFIAPI
+ComparePciId( CONST VOID *Left,
+              CONST VOID *Right )
+{
+    UINT32 LeftId = *(CONST UINT32 *)Left;
+    UINT32 RightId = *(CONST UINT32 *)Right;
+
+    return (LeftId > RightId) - (LeftId < RightId);
+}
+
+
+//
+// First of the sorted vendor and device IDs not below Id
+//
+UINTN
+FindPciId( CONST UINT32 *Ids,
+           UINTN Count,
+           UINT32 Id )
+{
+    UINTN Low = 0;
+    UINTN High = Count;
+    UINTN Mid;
+
+    while (Low < High) {
+        Mid = (Low + High) / 2;
+        if (Ids[Mid] < Id) {
+            Low = Mid + 1;
+        } else {
+            High = Mid;
+        }
+    }
+
+    return Low;
+}
+
+
+//
+// Print the vendors and devices whose names contain Text, marking those
+// present on this system. A matching vendor is followed by those of its
+// devices that are present.
+//
+EFI_STATUS
+FindPciNames( CHAR16 *FullFileName,
+              CONST PCI_IDS_DATABASE *Db,
+              CONST PCI_SNAPSHOT *Snapshot,
+              CONST CHAR16 *Text )
+{
+    CONST PCI_IDS_VENDOR *Vendor;
+    CONST PCI_IDS_DEVICE *Device;
+    PCI_IDS_SEARCH Search;
+    EFI_STATUS Status;
+    CHAR8      AsciiText[64];
+    UINT32     *Matches = NULL;
+    UINT32     *Present;
+    UINTN      MatchCount = 0;
+    UINTN      First;
+    UINT64     Start;
+    UINT64     IndexTicks;
+    UINT64     FindTicks;
+
+    if (StrLen( Text ) >= sizeof(AsciiText)) {
+        return EFI_INVALID_PARAMETER;
     }
+    UnicodeStrToAsciiStrS( Text, AsciiText, sizeof(AsciiText) );
 
-    // open database file
-    Status = ShellOpenFileByName( FullFileName, 
-                                  &InFileHandle,
-                                  EFI_FILE_MODE_READ,
-                                  0 );
+    // vendor and device IDs present, sorted for binary search
+    Present = AllocatePool( MAX( Snapshot->DeviceCount, 1 ) * sizeof(UINT32) );
+    if (Present == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    for (UINTN i = 0; i < Snapshot->DeviceCount; i++) {
+        Present[i] = ((UINT32)Snapshot->Devices[i].Header.Hdr.VendorId << 16) |
+                     Snapshot->Devices[i].Header.Hdr.DeviceId;
+    }
+    PerformQuickSort( Present, Snapshot->DeviceCount, sizeof(UINT32), ComparePciId );
+
+    Start = AsmReadTsc();
+    Status = PciIdsOpenSearch( FullFileName, PCIDATABASE_SEARCH, Db, &Search );
+    IndexTicks = AsmReadTsc() - Start;
     if (EFI_ERROR(Status)) {
-        return;
+        FreePool( Present );
+        return Status;
     }
 
-    // allocate a buffer to read lines into
-    ReadLine = AllocateZeroPool( Size );
-    if (ReadLine == NULL) {
-        return;
+    Start = AsmReadTsc();
+    Status = PciIdsFind( &Search, Db, AsciiText, &Matches, &MatchCount );
+    FindTicks = AsmReadTsc() - Start;
+    if (EFI_ERROR(Status)) {
+        goto Done;
     }
 
-    // look for database version string 
-    for (;!ShellFileHandleEof(InFileHandle); Size = LINE_MAX) {
-        Status = ShellFileHandleReadLine( InFileHandle, ReadLine, &Size, TRUE, &Ascii );
-        if (Status == EFI_BUFFER_TOO_SMALL) {
-            Status = EFI_SUCCESS;
-        } else if (EFI_ERROR(Status)) {
-            break;
+    Print(L"Vendor  Device     Name\n\n");
+    for (UINTN i = 0; i < MatchCount; i++) {
+        Vendor = &Db->Vendors[PCI_TRG_VENDOR(Matches[i])];
+        First = FindPciId( Present, Snapshot->DeviceCount, (UINT32)Vendor->VendorId << 16 );
+
+        if (PCI_TRG_DEVICE(Matches[i]) != 0) {
+            Device = &Vendor->Devices[PCI_TRG_DEVICE(Matches[i]) - 1];
+            First = FindPciId( Present, Snapshot->DeviceCount,
+                               ((UINT32)Vendor->VendorId << 16) | Device->DeviceId );
+            Print(L" %04x    %04x    %c  %a, %a\n", Vendor->VendorId, Device->DeviceId,
+                  (First < Snapshot->DeviceCount &&
+                   Present[First] == (((UINT32)Vendor->VendorId << 16) | Device->DeviceId)) ? L'*' : L' ',
+                  Vendor->Name, Device->Name);
+            continue;
         }
 
-        if (ReadLine[0] == L'#' ) {
-            if ((Sptr = StrStr( ReadLine, L"Version: ")) != NULL) {
-                Sptr += 9;
-                Vptr = &Version[0];  
-                while (*Sptr  && *Sptr != L'\n' && *Sptr != L'\r') {
-                    *Vptr++ = *Sptr++;
-                }
-                *Vptr = L'\0';
-                Print(L"Database Version: %s\n", Version);
-                break;
+        Print(L" %04x            %c  %a (%d devices)\n", Vendor->VendorId,
+              (First < Snapshot->DeviceCount && (Present[First] >> 16) == Vendor->VendorId) ? L'*' : L' ',
+              Vendor->Name, Vendor->DeviceCount);
+        for (; First < Snapshot->DeviceCount && (Present[First] >> 16) == Vendor->VendorId; First++) {
+            if (First > 0 && Present[First] == Present[First - 1]) {
+                continue;
             }
+            Device = PciIdsFindDevice( Vendor, (UINT16)Present[First] );
+            Print(L" %04x    %04x    *    %a\n", Vendor->VendorId, Present[First] & 0xffff,
+                  (Device != NULL) ? Device->Name : "");
         }
+    }
 
-        if (ReadLine[0] == L' ' || ReadLine[0] == L'\n' || ReadLine[0] == L'\r') {
-            break;
+    Print(L"\n%d matches (* present), index %ld us, search %ld us\n", MatchCount,
+          PciSnapshotTicksToMicroseconds( IndexTicks ),
+          PciSnapshotTicksToMicroseconds( FindTicks ));
+
+Done:
+    if (Matches != NULL) {
+        FreePool( Matches );
+    }
+    PciIdsFreeSearch( &Search );
+    FreePool( Present );
+
+    return Status;
+}
+
+//
+// Write one record per function, with names resolved when a database
+// or the built-in tables are available
+//
+EFI_STATUS
+ExportPciFunctions( CONST PCI_IDS_DATABASE *Db,
+                    PCI_SNAPSHOT *Snapshot,
+                    PCI_EXPORT_FORMAT Format,
+                    CONST CHAR16 *OutputFileName )
+{
+    PCI_SNAPSHOT_EXPORT Export;
+    PCI_SNAPSHOT_DEVICE *Device;
+    CONST CHAR8 *VendorName = NULL;
+    CONST CHAR8 *DeviceName = NULL;
+    CONST CHAR8 *ClassNames[3];
+    UINTN ClassCount;
+    EFI_STATUS Status;
+
+    Status = PciSnapshotExportOpen( OutputFileName, Format, &Export );
+    if (EFI_ERROR(Status)) {
+        return Status;
+    }
+
+    for (UINTN i = 0; i < Snapshot->DeviceCount && !EFI_ERROR(Status); i++) {
+        Device = &Snapshot->Devices[i];
+        ClassCount = 0;
+        if (Db != NULL) {
+            LookupPciNames( Db, Device->Header.Hdr.VendorId, Device->Header.Hdr.DeviceId,
+                            &VendorName, &DeviceName );
+            ClassCount = PciIdsFindClass( Db,
+                                          Device->Header.Hdr.ClassCode[2],
+                                          Device->Header.Hdr.ClassCode[1],
+                                          Device->Header.Hdr.ClassCode[0],
+                                          ClassNames );
         }
+        // the subclass name if known, it is the more specific
+        Status = PciSnapshotExportDevice( &Export, Device, VendorName, DeviceName,
+                                          (ClassCount == 0) ? NULL : ClassNames[MIN( ClassCount, 2 ) - 1] );
+    }
+
+    // reports the first write error, if any
+    return PciSnapshotExportClose( &Export );
+}
+
+//
+// Print PCI.ID database version string
+//
+VOID
+PrintPciDatabaseVersion( VOID )
+{
+    CHAR16 *FullFileName = (CHAR16 *)NULL;
+    CHAR16 FileName[] = PCIDATABASE;
+    CHAR8  Version[16];
+    UINT64 FileSize;
+
+    FullFileName = ShellFindFilePath( FileName );
+    if (FullFileName == NULL) {
+        Print(L"Database Version: %a (built-in)\n", PciIdsBuiltinVersion());
+        return;
     }
- 
-    ShellCloseFile( &InFileHandle );
-    FreePool( ReadLine );
+
+    if (!EFI_ERROR(PciIdsReadVersion( FullFileName, Version, sizeof(Version), &FileSize ))) {
+        Print(L"Database Version: %a\n", Version);
+    }
+
+    FreePool( FullFileName );
 
     return;
 }
@@ -310,48 +758,131 @@ Usage( BOOLEAN ErrorMsg )
         Print(L"ERROR: Unknown option(s).\n");
     }
 
-    Print(L"Usage: ShowPCIx [ -n | --nodatabase ]\n");
+    Print(L"Usage: ShowPCIx [ -n | --nodatabase ] [ -t | --tree ] [ -s | --stats ]\n");
+    Print(L"                [ -m | --method auto | ecam | protocol | pciio ] [ -p | --parallel ]\n");
+    Print(L"       ShowPCIx [ -n | --nodatabase ] [ --format json | csv ] [ -o | --output <file> ]\n");
+    Print(L"       ShowPCIx [ -c | --compare ]\n");
+    Print(L"       ShowPCIx [ -f | --find <text> ]\n");
+    Print(L"       ShowPCIx [ -x | --express [ link,payload,aspm ] ]\n");
+    Print(L"       ShowPCIx [ -w | --save <file> ]\n");
+    Print(L"       ShowPCIx [ -n | --nodatabase ] [ -d | --diff <file> [ <file> ] ]\n");
     Print(L"       ShowPCIx [ -V | --version ]\n");
 }
 
 
+
 INTN
 EFIAPI
 ShellAppMain( UINTN Argc, 
               CHAR16 **Argv )
 {
-    EFI_GUID gEfiPciEnumerationCompleteProtocolGuid = EFI_PCI_EMUMERATION_COMPLETE_GUID;  
-    EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL *IoDev;
-    EFI_ACPI_ADDRESS_SPACE_DESCRIPTOR *Descriptors;
-    SHELL_FILE_HANDLE InFileHandle = (SHELL_FILE_HANDLE)NULL;
-    PCI_DEVICE_HEADER_TYPE_REGION *DeviceHeader;
-    PCI_DEVICE_INDEPENDENT_REGION PciHeader;
-    PCI_CONFIG_SPACE ConfigSpace;
+    CONST PCI_ACCESS_METHOD CompareMethods[] = { PciAccessProtocol, PciAccessEcam, PciAccessEcam, PciAccessPciIo };
+    CONST UINTN CompareFlags[] = { 0, 0, PCI_SNAPSHOT_PARALLEL, 0 };
+    CONST CHAR16 *MethodNames[] = { L"protocol", L"ecam", L"ecam-mp", L"pciio" };
+    PCI_SNAPSHOT_STATS CompareStats[ARRAY_SIZE(CompareMethods)];
+    PCI_ACCESS_METHOD Method = PciAccessAuto;
+    PCI_SNAPSHOT Snapshot;
+    PCI_SNAPSHOT OldSnapshot;
+    PCI_IDS_DATABASE Database;
+    PCI_SNAPSHOT_STATS *Stats = &Snapshot.Stats;
     EFI_STATUS Status = EFI_SUCCESS;
-    EFI_HANDLE *HandleBuf;
-    BOOLEAN IsEnd; 
     BOOLEAN NoDatabase = FALSE;
+    BOOLEAN ShowStats = FALSE;
+    BOOLEAN Compare = FALSE;
+    BOOLEAN Tree = FALSE;
+    UINTN  Flags = 0;
     CHAR16 *FullFileName = (CHAR16 *)NULL;
     CHAR16 FileName[] = PCIDATABASE;
-    CHAR16 *ReadLine = (CHAR16 *)NULL;
-    UINT64 Address;
-    UINT16 MinBus, MaxBus;
-    UINTN HandleBufSize;
-    UINTN HandleCount;
-    UINTN Size = LINE_MAX;
-    VOID *Interface;
+    CHAR16 *SaveFileName = (CHAR16 *)NULL;
+    CHAR16 *FindText = (CHAR16 *)NULL;
+    CHAR16 *OutputFileName = (CHAR16 *)NULL;
+    BOOLEAN Export = FALSE;
+    PCI_EXPORT_FORMAT ExportFormat = PciExportJson;
+    CHAR16 *DiffFileNames[2] = { NULL, NULL };
+    UINTN  Differences;
+    UINTN  ExpressFields = 0;
+    UINT64 Speedup;
+
+    ZeroMem( &Database, sizeof(Database) );
+    ZeroMem( &Snapshot, sizeof(Snapshot) );
+    ZeroMem( &OldSnapshot, sizeof(OldSnapshot) );
+    ZeroMem( CompareStats, sizeof(CompareStats) );
   
-    if (Argc == 2) {
-        if (!StrCmp(Argv[1], L"--version") ||
-            !StrCmp(Argv[1], L"-V")) {
+    for (UINTN i = 1; i < Argc; i++) {
+        if (!StrCmp(Argv[i], L"--version") ||
+            !StrCmp(Argv[i], L"-V")) {
             Print(L"Version: %s\n", UTILITY_VERSION);
             PrintPciDatabaseVersion();
             return Status;
-        } else if (!StrCmp(Argv[1], L"--nodatabase") ||
-            !StrCmp(Argv[1], L"-n")) {
+        } else if (!StrCmp(Argv[i], L"--nodatabase") ||
+            !StrCmp(Argv[i], L"-n")) {
             NoDatabase = TRUE;
-        } else if (!StrCmp(Argv[1], L"--help") ||
-            !StrCmp(Argv[1], L"-h")) {
+        } else if (!StrCmp(Argv[i], L"--stats") ||
+            !StrCmp(Argv[i], L"-s")) {
+            ShowStats = TRUE;
+        } else if (!StrCmp(Argv[i], L"--tree") ||
+            !StrCmp(Argv[i], L"-t")) {
+            Tree = TRUE;
+        } else if (!StrCmp(Argv[i], L"--compare") ||
+            !StrCmp(Argv[i], L"-c")) {
+            Compare = TRUE;
+        } else if (!StrCmp(Argv[i], L"--parallel") ||
+            !StrCmp(Argv[i], L"-p")) {
+            Flags |= PCI_SNAPSHOT_PARALLEL;
+        } else if (!StrCmp(Argv[i], L"--express") ||
+            !StrCmp(Argv[i], L"-x")) {
+            ExpressFields = PCI_EXPRESS_ALL;
+            if (i + 1 < Argc && Argv[i + 1][0] != L'-') {
+                ExpressFields = ParseExpressFields( Argv[++i] );
+                if (ExpressFields == 0) {
+                    Usage(TRUE);
+                    return Status;
+                }
+            }
+        } else if (!StrCmp(Argv[i], L"--format") && i + 1 < Argc) {
+            i++;
+            Export = TRUE;
+            if (!StrCmp(Argv[i], L"json")) {
+                ExportFormat = PciExportJson;
+            } else if (!StrCmp(Argv[i], L"csv")) {
+                ExportFormat = PciExportCsv;
+            } else {
+                Usage(TRUE);
+                return Status;
+            }
+        } else if ((!StrCmp(Argv[i], L"--output") ||
+            !StrCmp(Argv[i], L"-o")) && i + 1 < Argc) {
+            OutputFileName = Argv[++i];
+        } else if ((!StrCmp(Argv[i], L"--find") ||
+            !StrCmp(Argv[i], L"-f")) && i + 1 < Argc) {
+            FindText = Argv[++i];
+        } else if ((!StrCmp(Argv[i], L"--save") ||
+            !StrCmp(Argv[i], L"-w")) && i + 1 < Argc) {
+            SaveFileName = Argv[++i];
+        } else if ((!StrCmp(Argv[i], L"--diff") ||
+            !StrCmp(Argv[i], L"-d")) && i + 1 < Argc) {
+            DiffFileNames[0] = Argv[++i];
+            // optional second snapshot, otherwise compare with this system
+            if (i + 1 < Argc && Argv[i + 1][0] != L'-') {
+                DiffFileNames[1] = Argv[++i];
+            }
+        } else if ((!StrCmp(Argv[i], L"--method") ||
+            !StrCmp(Argv[i], L"-m")) && i + 1 < Argc) {
+            i++;
+            if (!StrCmp(Argv[i], L"auto")) {
+                Method = PciAccessAuto;
+            } else if (!StrCmp(Argv[i], L"ecam")) {
+                Method = PciAccessEcam;
+            } else if (!StrCmp(Argv[i], L"protocol")) {
+                Method = PciAccessProtocol;
+            } else if (!StrCmp(Argv[i], L"pciio")) {
+                Method = PciAccessPciIo;
+            } else {
+                Usage(TRUE);
+                return Status;
+            }
+        } else if (!StrCmp(Argv[i], L"--help") ||
+            !StrCmp(Argv[i], L"-h")) {
             Usage(FALSE);
             return Status;
         } else {
@@ -359,180 +890,178 @@ ShellAppMain( UINTN Argc,
             return Status;
         }
     }
-    if (Argc > 2) {
-        Usage(TRUE);
-        return Status;
-    }
 
-    Status = gBS->LocateProtocol( &gEfiPciEnumerationCompleteProtocolGuid,
-                                  NULL,
-                                  &Interface );
-    if (EFI_ERROR(Status)) {
-        Print(L"ERROR: Could not find PCI enumeration protocol\n");
-        return Status;
-    }
+    if (Compare) {
+        // enumerate once each way without printing
+        for (UINTN i = 0; i < ARRAY_SIZE(CompareMethods); i++) {
+            Status = PciSnapshotCreate( CompareMethods[i], CompareFlags[i], &Snapshot );
+            CompareStats[i] = Snapshot.Stats;
+            PciSnapshotFree( &Snapshot );
+            if (Status == EFI_UNSUPPORTED && CompareMethods[i] == PciAccessEcam) {
+                Print(L"%-9s  not available, no ACPI MCFG entry for every root bridge\n", MethodNames[i]);
+                continue;
+            }
+            if (EFI_ERROR(Status)) {
+                Print(L"ERROR: Could not enumerate PCI devices [%d]\n", Status);
+                goto Done;
+            }
+            if (i == 0) {
+                Print(L"Method      Time (us)  Accesses  Found  CPUs  Speedup\n");
+            }
 
-    HandleBufSize = sizeof(EFI_HANDLE);
-    HandleBuf = (EFI_HANDLE *) AllocateZeroPool( HandleBufSize );
-    if (HandleBuf == NULL) {
-        Print(L"ERROR: Out of memory resources\n");
-        goto Done;
+            // speedup against the root bridge protocol, to one decimal place
+            Speedup = DivU64x64Remainder( MultU64x32( CompareStats[0].Ticks, 10 ),
+                                          MAX( CompareStats[i].Ticks, 1 ), NULL );
+            Print(L"%-9s  %10ld  %8d  %5d  %4d  %3ld.%ldx\n",
+                  MethodNames[i],
+                  PciSnapshotTicksToMicroseconds( CompareStats[i].Ticks ),
+                  CompareStats[i].Accesses,
+                  CompareStats[i].Present,
+                  CompareStats[i].Processors,
+                  Speedup / 10, Speedup % 10);
+            if (CompareStats[i].Present != CompareStats[0].Present) {
+                Print(L"WARNING: %s found %d functions, protocol found %d\n",
+                      MethodNames[i], CompareStats[i].Present, CompareStats[0].Present);
+            }
+        }
+        return EFI_SUCCESS;
     }
 
-    Status = gBS->LocateHandle( ByProtocol,
-                                &gEfiPciRootBridgeIoProtocolGuid,
-                                NULL,
-                                &HandleBufSize,
-                                HandleBuf );
+    if (DiffFileNames[0] != NULL) {
+        Status = PciSnapshotLoad( DiffFileNames[0], &OldSnapshot );
+        if (EFI_ERROR(Status)) {
+            Print(L"ERROR: Could not load snapshot %s [%d]\n", DiffFileNames[0], Status);
+            goto Done;
+        }
+    }
 
-    if (Status == EFI_BUFFER_TOO_SMALL) {
-        HandleBuf = ReallocatePool( sizeof (EFI_HANDLE), 
-                                    HandleBufSize, 
-                                    HandleBuf );
-        if (HandleBuf == NULL) {
-            Print(L"ERROR: Out of memory resources\n");
+    if (DiffFileNames[1] != NULL) {
+        Status = PciSnapshotLoad( DiffFileNames[1], &Snapshot );
+        if (EFI_ERROR(Status)) {
+            Print(L"ERROR: Could not load snapshot %s [%d]\n", DiffFileNames[1], Status);
             goto Done;
         }
+    } else {
+        Status = PciSnapshotCreate( Method, Flags, &Snapshot );
+    }
+    if (Status == EFI_NOT_READY) {
+        Print(L"ERROR: Could not find PCI enumeration protocol\n");
+        goto Done;
+    } else if (Status == EFI_UNSUPPORTED && Method == PciAccessEcam) {
+        Print(L"ERROR: No ACPI MCFG table entry for every root bridge, ECAM access not available\n");
+        goto Done;
+    } else if (EFI_ERROR(Status)) {
+        Print(L"ERROR: Could not enumerate PCI devices [%d]\n", Status);
+        goto Done;
+    }
 
-        Status = gBS->LocateHandle( ByProtocol,
-                                    &gEfiPciRootBridgeIoProtocolGuid,
-                                    NULL,
-                                    &HandleBufSize,
-                                    HandleBuf );
+    if (SaveFileName != NULL) {
+        Status = PciSnapshotSave( &Snapshot, SaveFileName );
+        if (EFI_ERROR(Status)) {
+            Print(L"ERROR: Could not save snapshot %s [%d]\n", SaveFileName, Status);
+        } else {
+            Print(L"Saved %d functions to %s\n", Snapshot.DeviceCount, SaveFileName);
+        }
+        goto Done;
     }
 
-    if (EFI_ERROR (Status)) {
-        Print(L"ERROR: Failed to find any PCI handles\n");
+    if (ExpressFields != 0) {
+        PrintPciExpress( &Snapshot, ExpressFields );
         goto Done;
     }
 
     if (NoDatabase == FALSE) {
+        // without pci.ids names come from the built-in tables
         FullFileName = ShellFindFilePath( FileName );
-        if (FullFileName == NULL) {
-            Print(L"ERROR: Could not find %s\n", FileName);
-            Status = EFI_NOT_FOUND;
-            goto Done;
+        if (FullFileName != NULL) {
+            // load the binary index, rebuilding it from the database if stale
+            Status = PciIdsOpen( FullFileName, PCIDATABASE_INDEX, &Database );
+            if (EFI_ERROR(Status)) {
+                Print(L"ERROR: Could not load %s [%d]\n", FileName, Status);
+                goto Done;
+            }
         }
+    }
 
-        // open the file
-        Status = ShellOpenFileByName( FullFileName, 
-                                      &InFileHandle,
-                                      EFI_FILE_MODE_READ,
-                                      0 );
+    if (Export) {
+        Status = ExportPciFunctions( NoDatabase ? NULL : &Database, &Snapshot, ExportFormat, OutputFileName );
         if (EFI_ERROR(Status)) {
-            Print(L"ERROR: Could not open %s\n", FileName);
-            goto Done;
+            Print(L"ERROR: Could not write %s [%d]\n",
+                  OutputFileName != NULL ? OutputFileName : L"output", Status);
         }
+        goto Done;
+    }
 
-        // allocate a buffer to read lines into
-        ReadLine = AllocateZeroPool( Size );
-        if (ReadLine == NULL) {
-            Print(L"ERROR: Could not allocate memory\n");
-            Status = EFI_OUT_OF_RESOURCES;
+    if (FindText != NULL) {
+        if (FullFileName == NULL) {
+            Print(L"ERROR: Name search needs %s\n", FileName);
             goto Done;
         }
+        Status = FindPciNames( FullFileName, &Database, &Snapshot, FindText );
+        if (EFI_ERROR(Status)) {
+            Print(L"ERROR: Could not search %s [%d]\n", FileName, Status);
+        }
+        goto Done;
     }
 
-    HandleCount = HandleBufSize / sizeof (EFI_HANDLE);
-
-    for (UINT16 Index = 0; Index < HandleCount; Index++) {
-        Status = PciGetProtocolAndResource( HandleBuf[Index],
-                                            &IoDev,
-                                            &Descriptors );
+    if (DiffFileNames[0] != NULL) {
+        Print(L"--- %s  %04d-%02d-%02d %02d:%02d:%02d\n", DiffFileNames[0],
+              OldSnapshot.Time.Year, OldSnapshot.Time.Month, OldSnapshot.Time.Day,
+              OldSnapshot.Time.Hour, OldSnapshot.Time.Minute, OldSnapshot.Time.Second);
+        Print(L"+++ %s  %04d-%02d-%02d %02d:%02d:%02d\n",
+              DiffFileNames[1] != NULL ? DiffFileNames[1] : L"(this system)",
+              Snapshot.Time.Year, Snapshot.Time.Month, Snapshot.Time.Day,
+              Snapshot.Time.Hour, Snapshot.Time.Minute, Snapshot.Time.Second);
+        Status = DiffSnapshots( NoDatabase ? NULL : &Database, &OldSnapshot, &Snapshot, &Differences );
         if (EFI_ERROR(Status)) {
-            Print(L"ERROR: PciGetProtocolAndResource [%d]\n, Status");
-            goto Done;
+            Print(L"ERROR: Could not compare snapshots [%d]\n", Status);
+        } else {
+            Print(L"%d functions differ\n", Differences);
         }
-  
-        while(1) {
-            Status = PciGetNextBusRange( &Descriptors, &MinBus, &MaxBus, &IsEnd );
-            if (EFI_ERROR(Status)) {
-                Print(L"ERROR: Retrieving PCI bus range [%d]\n", Status);
-                goto Done;
-            }
-
-            if ( IsEnd ) {
-                break;
-            }
+        goto Done;
+    }
 
-            Print(L"\n");
+    for (UINTN Root = 0; Root < Snapshot.RootCount; Root++) {
+        Print(L"\n");
+        if ( Tree == FALSE ) {
             Print(L"Bus    Vendor   Device  Subvendor SVDevice\n");
             Print(L"\n");
+        }
 
-            for ( UINT16 Bus = MinBus; Bus <= MaxBus; Bus++ ) {
-                for ( UINT16 Device = 0; Device <= PCI_MAX_DEVICE; Device++ ) {
-                    for ( UINT16 Func = 0; Func <= PCI_MAX_FUNC; Func++ ) {
-                        Address = CALC_EFI_PCI_ADDRESS( Bus, Device, Func, 0 );
-
-                        Status = IoDev->Pci.Read( IoDev,
-                                                  EfiPciWidthUint8,
-                                                  Address,
-                                                  sizeof(ConfigSpace),
-                                                  &ConfigSpace );
-
-                        DeviceHeader = (PCI_DEVICE_HEADER_TYPE_REGION *) &(ConfigSpace.NonCommon.Device);
-
-                        Status = IoDev->Pci.Read( IoDev,
-                                                  EfiPciWidthUint16,
-                                                  Address,
-                                                  1,
-                                                  &PciHeader.VendorId );
-
-                        if ( PciHeader.VendorId == 0xffff && Func == 0 ) {
-                            break;
-                        }
-
-                        if ( PciHeader.VendorId != 0xffff ) {
-                           Status = IoDev->Pci.Read( IoDev,
-                                                     EfiPciWidthUint32,
-                                                     Address,
-                                                     sizeof(PciHeader)/sizeof(UINT32),
-                                                     &PciHeader );
-
-                            Print(L" %02d     %04x     %04x     %04x     %04x", 
-                                  Bus, PciHeader.VendorId, PciHeader.DeviceId, 
-                                  DeviceHeader->SubsystemVendorID, DeviceHeader->SubsystemID);
-
-                            if (NoDatabase == FALSE) {
-                                SearchPciData( InFileHandle, 
-                                               ReadLine, 
-                                               PciHeader.VendorId, 
-                                               PciHeader.DeviceId );
-                            }
-
-                            Print(L"\n");
-
-                            if ( Func == 0 && 
-                                 ((PciHeader.HeaderType & HEADER_TYPE_MULTI_FUNCTION) == 0x00) ) {
-                               break;
-                            }
-                        }
-                    }
-                }
-            }
-
-            if ( Descriptors == NULL ) {
-                break;
+        for (UINTN i = 0; i < Snapshot.DeviceCount; i++) {
+            if (Snapshot.Devices[i].Root == Root) {
+                PrintPciFunction( NoDatabase ? NULL : &Database, Tree, &Snapshot.Devices[i] );
             }
         }
     }
 
     Print(L"\n");
 
-Done:
-    if ( HandleBuf != NULL ) {
-        FreePool( HandleBuf );
+    if (ShowStats) {
+        // a byte-wide read of all 256 bytes cost 257 accesses per function
+        // probed, plus 4 per function present, on every bus in the range
+        Print(L"Buses scanned: %d of %d\n", Stats->Buses, Stats->BusRange);
+        Print(L"Functions probed: %d, present: %d\n", Stats->Functions, Stats->Present);
+        Print(L"Config accesses: %d (full scan of every bus: %d)\n",
+              Stats->Accesses,
+              (Stats->Functions + (Stats->BusRange - Stats->Buses) * (PCI_MAX_DEVICE + 1)) * 257 +
+              Stats->Present * 4);
+        Print(L"ECAM accesses: %d, enumeration time: %ld us on %d processor%s\n",
+              Stats->EcamAccesses,
+              PciSnapshotTicksToMicroseconds( Stats->Ticks ),
+              Stats->Processors,
+              (Stats->Processors == 1) ? L"" : L"s");
     }
+
+Done:
+    PciSnapshotFree( &Snapshot );
+    PciSnapshotFree( &OldSnapshot );
     if ( NoDatabase == FALSE ) {
-        if ( ReadLine != NULL ) {
-            FreePool( ReadLine );
-        }
         if ( FullFileName != NULL ) {
             FreePool( FullFileName );
         }
-        if ( InFileHandle != NULL ) {
-            ShellCloseFile( &InFileHandle );
-        }
+        PciIdsFree( &Database );
+        PciIdsBuiltinFree();
     }
 
     return Status;
@@ -0,0 +1,240 @@
+#!/usr/bin/env python3
+#
+#  Copyright (c) 2019   Finnbarr P. Murphy.   All rights reserved.
+#
+#  Generate PciIdsData.h, the built-in fallback copy of the vendor and
+#  device names in pci.ids used by ShowPCIx when no database is found.
+#
+#  Usage: build_pci_ids_data.py pci.ids PciIdsData.h
+#
+#  Vendors and (vendor, device) pairs are each placed in a minimal
+#  perfect hash table using hash-and-displace: keys are split into
+#  buckets by one hash, then every bucket with several keys gets a seed
+#  for a second hash that sends its keys to free slots.  Single-key
+#  buckets take the remaining slots directly, stored as DIRECT_SLOT | slot.
+#  Lookup is at most two hashes and one compare.
+#
+#  Names are stored in zlib-compressed blocks, one per VENDORS_PER_BLOCK
+#  vendors in vendor ID order, holding the names of those vendors and
+#  their devices with duplicates removed.  Each block can be inflated on
+#  its own, so only blocks for vendors actually present are expanded.
+#  An entry's name is (block << BLOCK_SHIFT) | offset within the block.
+#
+#  Any change here must be matched in PciIdsBuiltin.c.
+#
+#  License: BSD 2 clause license applies.
+#
+
+import io
+import re
+import sys
+import zlib
+
+KEYS_PER_BUCKET = 4
+DIRECT_SLOT = 0x8000
+MAX_SEED = DIRECT_SLOT - 1
+ENTRY_SIZE = 8              # sizeof(PCI_IDS_DATA_ENTRY)
+BLOCK_ENTRY_SIZE = 12       # sizeof(PCI_IDS_DATA_BLOCK)
+VENDORS_PER_BLOCK = 64
+BLOCK_SHIFT = 20
+
+
+def fmix32(h):
+    h ^= h >> 16
+    h = (h * 0x85ebca6b) & 0xffffffff
+    h ^= h >> 13
+    h = (h * 0xc2b2ae35) & 0xffffffff
+    h ^= h >> 16
+    return h
+
+
+def slot_hash(key, seed):
+    return fmix32(key ^ ((seed * 0x9e3779b9) & 0xffffffff))
+
+
+def parse(filename):
+    version = ''
+    vendors = {}
+    devices = {}
+    vendor = None
+
+    with open(filename, 'rb') as f:
+        for raw in f:
+            line = raw.decode('utf-8', 'replace').rstrip('\r\n')
+            if line.startswith('#'):
+                m = re.match(r'#\s*Version:\s*(\S+)', line)
+                if m and not version:
+                    version = m.group(1)
+                continue
+            if line.startswith('C '):
+                break                       # device class list follows
+            m = re.match(r'^([0-9a-fA-F]{4})\s+(.*\S)', line)
+            if m:
+                vendor = int(m.group(1), 16)
+                vendors[vendor] = m.group(2)
+                continue
+            m = re.match(r'^\t([0-9a-fA-F]{4})\s+(.*\S)', line)
+            if m and vendor is not None:
+                devices[(vendor << 16) | int(m.group(1), 16)] = m.group(2)
+
+    return version, vendors, devices
+
+
+def build_hash(keys):
+    count = len(keys)
+    nbuckets = max(1, (count + KEYS_PER_BUCKET - 1) // KEYS_PER_BUCKET)
+    buckets = [[] for _ in range(nbuckets)]
+    for key in keys:
+        buckets[fmix32(key) % nbuckets].append(key)
+
+    if count > DIRECT_SLOT:
+        sys.exit('ERROR: too many keys (%d)' % count)
+
+    seeds = [0] * nbuckets
+    slots = [None] * count
+    order = sorted(range(nbuckets), key=lambda b: -len(buckets[b]))
+    for b in order:
+        if len(buckets[b]) < 2:
+            break
+        for seed in range(MAX_SEED + 1):
+            taken = set()
+            for key in buckets[b]:
+                slot = slot_hash(key, seed) % count
+                if slots[slot] is not None or slot in taken:
+                    break
+                taken.add(slot)
+            else:
+                for key in buckets[b]:
+                    slots[slot_hash(key, seed) % count] = key
+                seeds[b] = seed
+                break
+        else:
+            sys.exit('ERROR: no seed found for bucket %d, lower KEYS_PER_BUCKET' % b)
+
+    free = [slot for slot in range(count) if slots[slot] is None]
+    for b in order:
+        if len(buckets[b]) == 1:
+            slot = free.pop()
+            slots[slot] = buckets[b][0]
+            seeds[b] = DIRECT_SLOT | slot
+
+    return seeds, slots
+
+
+class NameBlocks:
+    def __init__(self, vendors, devices):
+        self.names = {}
+        self.blocks = []
+        owned = dict((vendor, []) for vendor in vendors)
+        for key in sorted(devices):
+            owned[key >> 16].append(key)
+        order = sorted(vendors)
+        for first in range(0, len(order), VENDORS_PER_BLOCK):
+            block = len(self.blocks)
+            data = bytearray()
+            offsets = {}
+            for vendor in order[first:first + VENDORS_PER_BLOCK]:
+                names = [((vendor << 16, True), vendors[vendor])]
+                names += [((key, False), devices[key]) for key in owned[vendor]]
+                for ref, name in names:
+                    raw = name.encode('utf-8') + b'\0'
+                    if raw not in offsets:
+                        offsets[raw] = len(data)
+                        data += raw
+                    self.names[ref] = (block << BLOCK_SHIFT) | offsets[raw]
+            if len(data) >= 1 << BLOCK_SHIFT:
+                sys.exit('ERROR: block %d too large, lower VENDORS_PER_BLOCK' % block)
+            self.blocks.append(bytes(data))
+
+    def name(self, key, is_vendor):
+        return self.names[(key, is_vendor)]
+
+
+def write_bytes(out, name, data):
+    out.write('static CONST UINT8 %s[] = {\n' % name)
+    for i in range(0, len(data), 16):
+        out.write('\t' + ', '.join('0x%02x' % c for c in data[i:i + 16]) + ',\n')
+    out.write('};\n\n')
+
+
+def write_entries(out, name, slots, blocks, is_vendor):
+    out.write('static CONST PCI_IDS_DATA_ENTRY %s[] = {\n' % name)
+    for key in slots:
+        out.write('\t{ 0x%04x, 0x%04x, 0x%08x },\n' %
+                  (key >> 16, key & 0xffff, blocks.name(key, is_vendor)))
+    out.write('};\n\n')
+
+
+def write_seeds(out, name, seeds):
+    out.write('static CONST UINT16 %s[] = {\n' % name)
+    for i in range(0, len(seeds), 12):
+        out.write('\t' + ', '.join('%d' % s for s in seeds[i:i + 12]) + ',\n')
+    out.write('};\n\n')
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit('Usage: %s pci.ids PciIdsData.h' % sys.argv[0])
+
+    version, vendors, devices = parse(sys.argv[1])
+
+    # vendor keys use the same (vendor << 16 | device) layout as devices
+    vendor_names = dict(((v << 16), n) for v, n in vendors.items())
+    vendor_seeds, vendor_slots = build_hash(sorted(vendor_names))
+    device_seeds, device_slots = build_hash(sorted(devices))
+
+    blocks = NameBlocks(vendors, devices)
+    compressed = [zlib.compress(block, 9) for block in blocks.blocks]
+
+    body = io.StringIO()
+    write_seeds(body, 'PciIdsVendorSeeds', vendor_seeds)
+    write_entries(body, 'PciIdsVendorTable', vendor_slots, blocks, True)
+    write_seeds(body, 'PciIdsDeviceSeeds', device_seeds)
+    write_entries(body, 'PciIdsDeviceTable', device_slots, blocks, False)
+
+    body.write('static CONST PCI_IDS_DATA_BLOCK PciIdsBlocks[] = {\n')
+    offset = 0
+    for raw, packed in zip(blocks.blocks, compressed):
+        body.write('\t{ %d, %d, %d },\n' % (offset, len(packed), len(raw)))
+        offset += len(packed)
+    body.write('};\n\n')
+    write_bytes(body, 'PciIdsBlockData', b''.join(compressed))
+
+    plain = sum(len(block) for block in blocks.blocks)
+    sizes = [
+        ('vendor table', len(vendor_slots) * ENTRY_SIZE + len(vendor_seeds) * 2),
+        ('device table', len(device_slots) * ENTRY_SIZE + len(device_seeds) * 2),
+        ('block table', len(blocks.blocks) * BLOCK_ENTRY_SIZE),
+        ('name blocks', offset),
+    ]
+    total = sum(size for _, size in sizes)
+
+    with open(sys.argv[2], 'w') as out:
+        out.write('/*\n')
+        out.write(' * Automatically generated by build_pci_ids_data.py.  Do not edit\n')
+        out.write(' *\n')
+        out.write(' * pci.ids version %s: %d vendors, %d devices\n' %
+                  (version, len(vendors), len(devices)))
+        for label, size in sizes:
+            out.write(' * %-13s %8d bytes\n' % (label + ':', size))
+        out.write(' * %-13s %8d bytes (names %d bytes uncompressed)\n' %
+                  ('total:', total, plain))
+        out.write(' */\n\n')
+        out.write('#define PCI_IDS_DATA_VERSION        "%s"\n' % version)
+        out.write('#define PCI_IDS_DATA_VENDOR_COUNT   %d\n' % len(vendor_slots))
+        out.write('#define PCI_IDS_DATA_VENDOR_BUCKETS %d\n' % len(vendor_seeds))
+        out.write('#define PCI_IDS_DATA_DEVICE_COUNT   %d\n' % len(device_slots))
+        out.write('#define PCI_IDS_DATA_DEVICE_BUCKETS %d\n' % len(device_seeds))
+        out.write('#define PCI_IDS_DATA_DIRECT_SLOT    0x%04x\n' % DIRECT_SLOT)
+        out.write('#define PCI_IDS_DATA_BLOCK_COUNT    %d\n' % len(blocks.blocks))
+        out.write('#define PCI_IDS_DATA_BLOCK_SHIFT    %d\n\n' % BLOCK_SHIFT)
+        out.write(body.getvalue())
+
+    print('pci.ids version %s: %d vendors, %d devices' % (version, len(vendors), len(devices)))
+    for label, size in sizes:
+        print('  %-13s %8d bytes' % (label + ':', size))
+    print('  %-13s %8d bytes' % ('total:', total))
+
+
+if __name__ == '__main__':
+    main()